@@ -0,0 +1,106 @@
+/* BloomFilter - фильтр Блума: множество ключей, которое может ошибочно
+ * сказать "есть" про отсутствующий ключ, но никогда не ошибается, говоря "нет"
+ *  Не зависит ни от кэшей, ни от баз данных: его используют и TinyLFU
+ * (frequency_sketch.h), и NegativeCacheDB (database.h) */
+
+#ifndef _BLOOM_FILTER_H_
+#define _BLOOM_FILTER_H_
+
+#include "mix_hash.h"
+#include <vector>
+#include <functional>
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <cassert>
+
+namespace Common {
+
+/*  nkeys - ожидаемое число ключей. На каждый ключ отводится 8 бит и
+ * используется 3 хэш-функции, что дает около 3% ложных срабатываний */
+template <class Key, class Hash = std::hash<Key>>
+class BloomFilter {
+public:
+	explicit BloomFilter(size_t nkeys);
+
+	bool contains(const Key& key) const;
+
+	/* Возвращает true, если ключ (вероятно) уже был в фильтре */
+	bool insert(const Key& key);
+
+	void clear() { std::fill(m_bits.begin(), m_bits.end(), 0); }
+
+	size_t nbits() const { return m_bits.size() * 64; }
+
+	/*  Сохранение в снимок и чтение из него, out и in - как у Serializer
+	 * (см. snapshot.h). load() возвращает false и не меняет фильтр, если
+	 * сохраненный фильтр другого размера */
+	template <class Out>
+	void save(Out& out) const { out.write(m_bits); }
+	template <class In>
+	bool load(In& in);
+
+private:
+	static constexpr int NHASHES = 3;
+
+	std::vector<uint64_t> m_bits;
+	size_t m_bit_mask;
+	Hash m_hash;
+
+	size_t bit_index(uint64_t h, int i) const
+		{ return ((h & 0xFFFFFFFF) + i * ((h >> 32) | 1)) & m_bit_mask; }
+};
+
+template <class Key, class Hash>
+constexpr int BloomFilter<Key, Hash>::NHASHES;
+
+template <class Key, class Hash>
+BloomFilter<Key, Hash>::BloomFilter(size_t nkeys)
+{
+	size_t nbits = 64;
+	while (nbits < 8 * nkeys)
+		nbits <<= 1;
+	m_bits.assign(nbits / 64, 0);
+	m_bit_mask = nbits - 1;
+}
+
+template <class Key, class Hash>
+bool BloomFilter<Key, Hash>::contains(const Key& key) const
+{
+	uint64_t h = mix_hash(m_hash(key));
+	for (int i = 0; i < NHASHES; ++i) {
+		size_t bit = bit_index(h, i);
+		if (!(m_bits[bit / 64] & (1ULL << (bit % 64))))
+			return false;
+	}
+	return true;
+}
+
+template <class Key, class Hash>
+bool BloomFilter<Key, Hash>::insert(const Key& key)
+{
+	uint64_t h = mix_hash(m_hash(key));
+	bool present = true;
+	for (int i = 0; i < NHASHES; ++i) {
+		size_t bit = bit_index(h, i);
+		uint64_t mask = 1ULL << (bit % 64);
+		present = present && (m_bits[bit / 64] & mask);
+		m_bits[bit / 64] |= mask;
+	}
+	return present;
+}
+
+template <class Key, class Hash>
+template <class In>
+bool BloomFilter<Key, Hash>::load(In& in)
+{
+	std::vector<uint64_t> bits = in.template read<std::vector<uint64_t>>();
+	if (bits.size() != m_bits.size())
+		return false;
+	m_bits.swap(bits);
+	return true;
+}
+
+} // Common namespace end
+
+#endif // _BLOOM_FILTER_H_
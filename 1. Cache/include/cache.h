@@ -3,7 +3,35 @@
  * DummyCache - Хэш с 100% вероятностью промаха. Каждый раз обращается к базе данных
  * RandomCache - Выбрасывает случайную страницу
  * LRUCache - Least Recently Used algorithm
+ * FlatLRUCache - LRU без выделений памяти после конструирования: страницы в
+ 				заранее выделенном массиве, индекс - открытая адресация
+ * TWOQCache - 2Q algorithm: FIFO для новых страниц, LRU для повторно
+ 				запрошенных и очередь ключей недавно вытесненных из FIFO
+ * ARCCache - Adaptive Replacement Cache, сам подбирает соотношение между
+ 				недавно и часто запрашиваемыми страницами
+ * SLRUCache - Segmented LRU: испытательный и защищенный LRU сегменты
+ * WTinyLFUCache - W-TinyLFU: маленькое LRU окно и основной кэш любой политики,
+ 				в который страница допускается, только если она запрашивается
+ 				чаще вытесняемой (оценка частоты по FrequencySketch)
+ * LFUCache - Least Frequently Used algorithm, O(1) на запрос, с необязательным
+ 				старением частот
+ * ShardedLRUCache - потокобезопасный LRU, ключи распределены по независимо
+ 				блокируемым шардам
+ * ClockCache - потокобезопасный CLOCK: попадание не берет блокировок и не
+ 				меняет структуру кэша, а только выставляет атомарный бит обращения
+ * PrefetchingCache - декоратор над любым кэшем, в фоновом потоке заранее
+ 				загружает страницы, которые, судя по истории запросов, будут
+ 				запрошены следующими
+ * WriteBackCache - декоратор над любым кэшем, добавляющий запись страниц
+ 				(write-back с пакетной записью в базу данных или write-through)
+ * TieredCache - двухуровневый кэш: любой кэш в памяти (L1) и DiskStore на
+ 				локальном диске (L2), куда попадают вытесненные из L1 страницы
+ * BasicCache - кэш со статическим выбором политики вытеснения (LRUPolicy,
+ 				TWOQPolicy, ClockPolicy, RandomPolicy) без виртуальных вызовов
+ * PolicyCache - адаптер BasicCache к AbstractCache
  * BeladyCache - Belady algorithm
+ * BeladySimulator - Belady algorithm для заранее известной последовательности
+ 				запросов, O(log cache_sz) на запрос
  */
 
 #ifndef _CACHE_H_
@@ -15,29 +43,212 @@
 // #define CACHE_VERBOSE
 
 #include "database.h"
+#include "hashing.h"
+#include "frequency_sketch.h"
+#include "weigher.h"
+#include "snapshot.h"
+#include "disk_store.h"
 #include <unordered_map>
+#include <unordered_set>
 #include <list>
+#include <vector>
+#include <memory>
+#include <mutex>
+#include <shared_mutex>
+#include <atomic>
+#include <future>
+#include <thread>
+#include <condition_variable>
+#include <chrono>
+#include <deque>
+#include <optional>
+#include <type_traits>
+#include <functional>
+#include <cstdint>
 #include <cassert>
 
 namespace Cache {
 
+/*  Снимок счетчиков кэша (см. CacheAnalitics::metrics()). Все счетчики
+ * только растут, поэтому разность двух снимков - статистика за интервал
+ * между ними */
+struct CacheMetrics {
+	uint64_t nhits = 0;
+	uint64_t nmisses = 0;
+	uint64_t nevictions = 0;
+	uint64_t ninserted_bytes = 0; // размер страниц, загруженных при промахах (page_bytes())
+	uint64_t nfetches = 0; // обращения к базе данных
+	uint64_t nfetch_samples = 0; // из них с замером времени
+	uint64_t fetch_ns = 0; // суммарное время замеренных обращений
+	uint64_t nage_samples = 0; // вытеснения, для которых известен возраст страницы
+	uint64_t eviction_age_ns = 0; // суммарное время от загрузки до вытеснения
+
+	uint64_t nlookups() const { return nhits + nmisses; }
+	double hit_ratio() const
+		{ return (nlookups()) ? static_cast<double>(nhits) / nlookups() : 0.0; }
+	double avg_fetch_us() const
+		{ return (nfetch_samples) ? fetch_ns / 1e3 / nfetch_samples : 0.0; }
+	double avg_eviction_age_ms() const
+		{ return (nage_samples) ? eviction_age_ns / 1e6 / nage_samples : 0.0; }
+
+	CacheMetrics operator -(const CacheMetrics& earlier) const;
+	CacheMetrics& operator +=(const CacheMetrics& other);
+};
+
+/*  64-битный счетчик, который увеличивает один поток за раз (например, под
+ * мьютексом кэша), а читать можно из любого потока без блокировок.
+ * Увеличение - обычные чтение и запись, без дорогой атомарной операции
+ * чтения-модификации-записи, поэтому на пути попадания ничего не стоит */
+class RelaxedCounter {
+public:
+	RelaxedCounter() : m_value(0) {}
+
+	void add(uint64_t n)
+		{ m_value.store(m_value.load(std::memory_order_relaxed) + n, std::memory_order_relaxed); }
+	void set(uint64_t value) { m_value.store(value, std::memory_order_relaxed); }
+	uint64_t get() const { return m_value.load(std::memory_order_relaxed); }
+
+private:
+	std::atomic<uint64_t> m_value;
+};
+
+/*  Буферы get_temp_page() потокобезопасных кэшей, которые не могут
+ * отдать ссылку на страницу внутри себя: у каждого потока свой буфер в
+ * каждом кэше. Буфер потока создается при его первом запросе к кэшу и
+ * живет, пока жив кэш. Номер кэша запоминается в потоке вместе с его
+ * буфером, чтобы повторные запросы того же потока обходились без мьютекса;
+ * номера не повторяются, поэтому буфер уничтоженного кэша не используется */
+template <class Page>
+class ThreadPageBuffers {
+public:
+	ThreadPageBuffers() : m_id(next_id()) {}
+
+	ThreadPageBuffers(const ThreadPageBuffers& other) = delete;
+	ThreadPageBuffers& operator =(const ThreadPageBuffers& other) = delete;
+
+	Page& get() const
+	{
+		thread_local uint64_t last_id = 0;
+		thread_local Page *last_buf = nullptr;
+		if (last_id != m_id) {
+			std::lock_guard<std::mutex> lock(m_mutex);
+			last_buf = &m_buffers[std::this_thread::get_id()];
+			last_id = m_id;
+		}
+		return *last_buf;
+	}
+
+private:
+	const uint64_t m_id;
+	mutable std::mutex m_mutex;
+	mutable std::unordered_map<std::thread::id, Page> m_buffers;
+
+	static uint64_t next_id()
+	{
+		static std::atomic<uint64_t> last_id(0);
+		return last_id.fetch_add(1, std::memory_order_relaxed) + 1;
+	}
+};
+
 class CacheAnalitics {
 public:
 	CacheAnalitics() :
-		m_nhits(0), m_nlookups(0) {}
-	~CacheAnalitics() = default;
+		m_bytes_cached(0),
+		m_nevictions(0), m_ninserted_bytes(0), m_nfetches(0), m_nfetch_samples(0), m_fetch_ns(0),
+		m_nage_samples(0), m_eviction_age_ns(0) {}
+	virtual ~CacheAnalitics() = default;
 
-	int nhits() const { return m_nhits; }
-	int nlookups() const { return m_nlookups; }
+	/*  Виртуальные, т.к. многопоточные кэши считают статистику по шардам:
+	 * через ссылку на AbstractCache или CacheAnalitics видна их сумма */
+	virtual uint64_t nhits() const { return m_nhits.get(); }
+	virtual uint64_t nlookups() const { return m_nhits.get() + m_nmisses.get(); }
 	double hit_ratio() const
-		{ return (m_nlookups) ? (static_cast<double>(m_nhits) / m_nlookups) : 0.0; }
+	{
+		uint64_t lookups = nlookups();
+		return (lookups) ? (static_cast<double>(nhits()) / lookups) : 0.0;
+	}
+
+	/*  Суммарный вес страниц в кэше (см. weigher.h), для PageSizeWeigher -
+	 * байты. Ведется только кэшами с параметром Weigher */
+	size_t bytes_cached() const { return m_bytes_cached; }
+
+	/*  Текущие значения всех счетчиков. Можно вызывать из любого потока
+	 * одновременно с запросами: счетчики читаются без блокировок, но по
+	 * отдельности, поэтому снимок может учесть промах и не учесть
+	 * вызванное им вытеснение. Для периодического опроса - MetricsScraper
+	 *  Виртуальная по той же причине, что и nhits() */
+	virtual CacheMetrics metrics() const;
+
+	static constexpr unsigned FETCH_SAMPLING = 16;
 
 protected:
-	void hit() const { ++m_nhits, ++m_nlookups; }
-	void miss() const { ++m_nlookups; }
+	/*  hit(), miss() и restore_counters() вызывает один поток за раз,
+	 * остальные - любые потоки одновременно */
+	void hit() const { m_nhits.add(1); }
+	void miss() const { m_nmisses.add(1); }
+	void add_bytes(size_t nbytes) const { m_bytes_cached += nbytes; }
+	void remove_bytes(size_t nbytes) const
+		{ assert(m_bytes_cached >= nbytes); m_bytes_cached -= nbytes; }
+	/* Для загрузки снимка кэша */
+	void restore_counters(uint64_t nhits, uint64_t nlookups) const
+	{
+		assert(nhits <= nlookups);
+		m_nhits.set(nhits), m_nmisses.set(nlookups - nhits);
+	}
+
+	void count_eviction() const { m_nevictions.fetch_add(1, std::memory_order_relaxed); }
+	void count_eviction_age(uint64_t age_ns) const
+	{
+		m_nage_samples.fetch_add(1, std::memory_order_relaxed);
+		m_eviction_age_ns.fetch_add(age_ns, std::memory_order_relaxed);
+	}
+	/*  Учитывает обращение к базе данных. Время меряется у каждого
+	 * FETCH_SAMPLING-го: пара вызовов steady_clock стоит десятки нс, что
+	 * сравнимо с промахом по быстрой базе данных. Возвращает true, если
+	 * время этого обращения нужно замерить и передать в count_fetch_time() */
+	bool count_fetch() const
+		{ return m_nfetches.fetch_add(1, std::memory_order_relaxed) % FETCH_SAMPLING == 0; }
+	void count_fetch_time(uint64_t fetch_ns) const
+	{
+		m_nfetch_samples.fetch_add(1, std::memory_order_relaxed);
+		m_fetch_ns.fetch_add(fetch_ns, std::memory_order_relaxed);
+	}
+	void count_inserted_bytes(size_t nbytes) const
+		{ m_ninserted_bytes.fetch_add(nbytes, std::memory_order_relaxed); }
+
+private:
+	mutable RelaxedCounter m_nhits, m_nmisses;
+	mutable size_t m_bytes_cached;
+	mutable std::atomic<uint64_t> m_nevictions, m_ninserted_bytes;
+	mutable std::atomic<uint64_t> m_nfetches, m_nfetch_samples, m_fetch_ns;
+	mutable std::atomic<uint64_t> m_nage_samples, m_eviction_age_ns;
+};
+
+/*  Опрашивает metrics() кэша и возвращает разность с предыдущим опросом,
+ * например, для экспорта в систему мониторинга. Опрос не блокирует
+ * запросы к кэшу. Cache - любой кэш с методом metrics(), в том числе
+ * ShardedLRUCache и ClockCache, собирающие его по шардам */
+template <class Cache>
+class MetricsScraper {
+public:
+	explicit MetricsScraper(const Cache& cache) :
+		m_cache(cache), m_last(cache.metrics()) {}
+
+	/* Статистика с предыдущего вызова poll() (или с создания) */
+	CacheMetrics poll()
+	{
+		CacheMetrics now = m_cache.metrics();
+		CacheMetrics delta = now - m_last;
+		m_last = now;
+		return delta;
+	}
+
+	/* Значения счетчиков на момент последнего опроса */
+	const CacheMetrics& total() const { return m_last; }
 
 private:
-	mutable int m_nhits, m_nlookups;
+	const Cache& m_cache;
+	CacheMetrics m_last;
 };
 
 
@@ -54,7 +265,8 @@ public:
 	using database_t = DataBase;
 
 	AbstractCache(const DataBase& db, size_t cache_sz) :
-		m_db(db), m_cache_sz(cache_sz) {}
+		m_db(db), m_cache_sz(cache_sz), m_batch_owner(std::thread::id()), m_batch(nullptr),
+		m_own_load_ns(false) {}
 	virtual ~AbstractCache() = default;
 
 	AbstractCache(const AbstractCache& other) = delete;
@@ -76,9 +288,157 @@ public:
 	size_t cache_sz() const { return m_cache_sz; }
 	const DataBase& db() const { return m_db; }
 
+	/*  Записывает в out копии страниц для всех ключей из [first, last)
+	 * (см. get_pages(keys)) */
+	template <class InputIt, class OutputIt>
+	OutputIt get_pages(InputIt first, InputIt last, OutputIt out) const;
+
+	/*  Страницы для всех ключей keys, i-я соответствует keys[i]. Все
+	 * отсутствующие в кэше страницы загружаются из базы данных одним
+	 * вызовом DB::AbstractIDB::get_pages(), после чего запросы выполняются
+	 * по порядку, как последовательные get_page(). Страница, вытесненная
+	 * самой пачкой до очередного запроса своего ключа, заново не загружается
+	 *  Потокобезопасные кэши переопределяют его и возвращают шаблонный
+	 * get_pages() через using */
+	std::vector<page_t> get_pages(const std::vector<key_t>& keys) const override;
+
+	/*  Функция, вызываемая для каждой вытесняемой страницы до ее удаления.
+	 * Потокобезопасные кэши могут вызывать ее из разных потоков */
+	using eviction_listener_t = std::function<void(const key_t&, const page_t&)>;
+	void set_eviction_listener(eviction_listener_t listener)
+		{ m_eviction_listener = std::move(listener); }
+
+	/*  Передает кэшу уже загруженную из базы данных страницу. Следующий
+	 * промах по key возьмет ее, не обращаясь к базе данных. Нужно, чтобы
+	 * загружать страницы вне кэша (без блокировок, пачками, заранее)
+	 *  Если страница уже в кэше, ничего не делает. Незабранных страниц
+	 * хранится не больше MAX_PRELOADED: при переполнении забывается самая
+	 * старая, и промах по ее ключу обратится к базе данных */
+	void preload_page(const key_t& key, page_t page) const;
+
 protected:
 	const DataBase& m_db;
 	size_t m_cache_sz;
+
+	/*  Общее начало снимка: политика, размер кэша и статистика.
+	 * read_snapshot_header() проверяет, что снимок сделан той же политикой
+	 * с тем же размером кэша, и возвращает сохраненные nhits, nlookups -
+	 * их нужно восстановить через restore_counters(), когда весь снимок
+	 * успешно прочитан */
+	template <class Out>
+	void write_snapshot_header(Out& out, const char *policy) const;
+	std::pair<uint64_t, uint64_t> read_snapshot_header(BufferReader& in, const char *policy) const;
+
+	/*  Учитывает вытеснение в статистике и вызывает eviction_listener */
+	void evicted(const key_t& key, const page_t& page) const;
+	/*  То же для кэшей, которые сами хранят время загрузки страниц (см.
+	 * keep_load_ns()): load_ns - значение sampled_load_ns() при загрузке */
+	void evicted(const key_t& key, const page_t& page, uint64_t load_ns) const;
+
+	/*  Время загрузки страниц выборки хранит сам кэш, в своих заранее
+	 * выделенных элементах: inserted() его не запоминает, и промахи не
+	 * трогают общую хэш-таблицу m_load_ns. Вызывается в конструкторе */
+	void keep_load_ns() { m_own_load_ns = true; }
+	/*  Время загрузки для ключа из выборки, 0 - ключ не в выборке */
+	static uint64_t sampled_load_ns(const key_t& key)
+		{ return (age_sampled(key)) ? now_ns() : 0; }
+	/*  Только вызывает eviction_listener. Для кэшей, которые передают
+	 * наружу вытеснения из вложенных кэшей, уже учтенные ими */
+	void notify_evicted(const key_t& key, const page_t& page) const
+	{
+		if (m_batch_owner.load(std::memory_order_relaxed) == std::this_thread::get_id())
+			m_batch->evicted(key, page);
+		if (m_eviction_listener)
+			m_eviction_listener(key, page);
+	}
+
+	/*  Обращения к базе данных с замером времени для metrics().
+	 * Можно вызывать из разных потоков одновременно */
+	page_t fetch_page(const key_t& key) const;
+	std::vector<page_t> fetch_pages(const std::vector<key_t>& keys) const;
+
+	/*  Учитывает страницу, загруженную при промахе: ее размер и, для
+	 * выборки ключей, время загрузки, чтобы при вытеснении узнать ее
+	 * возраст. load_page() вызывает ее сама */
+	void inserted(const key_t& key, const page_t& page) const;
+
+	/*  Ключи, которых нет в кэше, без повторов, в порядке запросов */
+	std::vector<key_t> uncached_keys(const std::vector<key_t>& keys) const
+	{
+		std::vector<key_t> uncached;
+		std::unordered_set<key_t> seen;
+		for (auto& key : keys)
+			if (!is_cached(key) && seen.insert(key).second)
+				uncached.push_back(key);
+		return uncached;
+	}
+
+	/*  Страницы пачки keys: загруженные для нее одним обращением к базе
+	 * данных (loaded_keys[i] -> pages[i]) и вытесненные этим же потоком до
+	 * очередного запроса их ключа в пачке. Каждая хранится, пока не пройдут
+	 * все запросы ее ключа, поэтому ни одна страница пачки не загружается
+	 * из базы данных повторно. Пока объект существует, вытеснения из cache
+	 * в этом потоке передаются ему (одна пачка на кэш одновременно) */
+	class BatchPages {
+	public:
+		BatchPages(const AbstractCache& cache, const std::vector<key_t>& keys,
+			const std::vector<key_t>& loaded_keys, std::vector<page_t> pages);
+		~BatchPages();
+
+		BatchPages(const BatchPages& other) = delete;
+		BatchPages& operator =(const BatchPages& other) = delete;
+
+		/*  Учитывает очередной запрос key. Если страница есть и нужна кэшу
+		 * (needed), возвращает ее: копию, если ключ еще встретится в пачке,
+		 * иначе саму страницу */
+		std::optional<page_t> take(const key_t& key, bool needed);
+		void evicted(const key_t& key, const page_t& page);
+
+	private:
+		struct Pending {
+			std::optional<page_t> page;
+			size_t nrequests_left;
+		};
+		const AbstractCache& m_cache;
+		std::unordered_map<key_t, Pending> m_pages;
+		bool m_registered;
+	};
+
+	/*  Все промахи загружают страницы через эту функцию */
+	page_t load_page(const key_t& key) const;
+	/*  Забывает предзагруженную страницу key, если она есть */
+	void discard_preloaded(const key_t& key) const;
+
+private:
+	/*  Предзагруженную страницу обычно сразу забирает промах, остальные
+	 * ждут в порядке предзагрузки */
+	static constexpr size_t MAX_PRELOADED = 64;
+	using PreloadOrder = std::list<key_t>;
+	struct Preloaded {
+		page_t page;
+		typename PreloadOrder::iterator order;
+	};
+	mutable std::unordered_map<key_t, Preloaded> m_preloaded;
+	mutable PreloadOrder m_preload_order; // от старых к новым
+	eviction_listener_t m_eviction_listener;
+	/*  Пачка get_pages() и ее поток. m_batch читает только этот поток */
+	mutable std::atomic<std::thread::id> m_batch_owner;
+	mutable BatchPages *m_batch;
+
+	/*  Возраст вытесняемых страниц известен только для ключей из выборки
+	 * (примерно 1 из AGE_SAMPLING): для них запоминается время загрузки */
+	static constexpr size_t AGE_SAMPLING = 64;
+	mutable std::mutex m_age_mutex;
+	mutable std::unordered_map<key_t, uint64_t> m_load_ns; // ключ выборки -> время загрузки
+	bool m_own_load_ns; // время загрузки хранит кэш-наследник, m_load_ns не используется
+
+	static bool age_sampled(const key_t& key)
+		{ return mix_hash(std::hash<key_t>()(key)) % AGE_SAMPLING == 0; }
+	static uint64_t now_ns()
+	{
+		return std::chrono::duration_cast<std::chrono::nanoseconds>(
+			std::chrono::steady_clock::now().time_since_epoch()).count();
+	}
 };
 
 
@@ -94,7 +454,7 @@ public:
 	const page_t& get_temp_page(const key_t& key) const override
 	{
 		this->miss();
-		return page_buf = this->m_db.get_page(key);
+		return page_buf = this->load_page(key);
 	}
 
 	bool is_cached(const key_t& key) const override { return false; }
@@ -104,96 +464,1262 @@ private:
 };
 
 
-template <class DataBase>
+/*  Вытесняет случайную страницу. Страницы хранятся в плотном массиве,
+ * хэш-таблица отображает ключ в индекс массива, поэтому и поиск, и выбор
+ * случайной страницы, и ее удаление (перестановкой с последней) - O(1)
+ *  Weigher и max_page_fraction - как в LRUCache. Вытесняемые страницы
+ * зависят только от seed и запросов: кэши с одним seed на одних и тех же
+ * запросах вытесняют одно и то же */
+template <class DataBase, class Weigher = UnitWeigher>
 class RandomCache : public AbstractCache<DataBase> {
 public:
 	using key_t = typename DataBase::key_t;
 	using page_t = typename DataBase::page_t;
 
-	RandomCache(const DataBase& db, size_t cache_sz) :
-		AbstractCache<DataBase>(db, cache_sz),
-		m_hashtbl()
-		{ assert(cache_sz > 0); m_hashtbl.reserve(cache_sz); }
+	RandomCache(const DataBase& db, size_t cache_sz,
+		double max_page_fraction = 1.0, const Weigher& weigher = Weigher(), uint64_t seed = 0);
 
 	const page_t& get_temp_page(const key_t& key) const override;
 	bool is_cached(const key_t& key) const override { return m_hashtbl.count(key); }
 
 private:
-	using Hashtable = std::unordered_map<key_t, page_t>;
-	mutable Hashtable m_hashtbl;
+	struct Entry {
+		key_t key;
+		page_t page;
+	};
+	mutable std::vector<Entry> m_entries;
+	mutable std::unordered_map<key_t, size_t> m_hashtbl; // ключ -> индекс в m_entries
+	mutable page_t m_rejected_page; // страница, не допущенная в кэш из-за веса
+	Weigher m_weigher;
+	size_t m_max_page_weight;
+	mutable uint64_t m_random_state; // не должно быть 0
 
-	typename Hashtable::iterator
-		get_random_it(Hashtable& hashtbl) const;
+	void evict_random() const;
+	size_t random_index(size_t n) const;
 };
 
 
-template <class DataBase>
+/*  Weigher задает вес страницы (см. weigher.h), cache_sz - бюджет в
+ * единицах веса. При промахе вытесняются LRU страницы, пока новая страница
+ * не поместится. Страница тяжелее max_page_fraction * cache_sz в кэш не
+ * попадает вовсе, чтобы одна огромная страница не вытеснила все остальные
+ *  По умолчанию (UnitWeigher) cache_sz - число страниц */
+template <class DataBase, class Weigher = UnitWeigher>
 class LRUCache : public AbstractCache<DataBase> {
 public:
 	using key_t = typename DataBase::key_t;
 	using page_t = typename DataBase::page_t;
 
-	LRUCache(const DataBase& db, size_t cache_sz) :
-		AbstractCache<DataBase>(db, cache_sz)
-		{ assert(cache_sz > 0); m_hashtbl.reserve(cache_sz); }
+	LRUCache(const DataBase& db, size_t cache_sz,
+		double max_page_fraction = 1.0, const Weigher& weigher = Weigher());
 
-	const page_t& get_temp_page(const key_t& key) const override;
+	const page_t& get_temp_page(const key_t& key) const override
+		{ return lookup(key); }
 	bool is_cached(const key_t& key) const override
 		{ return m_hashtbl.count(key); }
 
+	/*  Для строковых ключей - поиск по std::string_view или const char *:
+	 * попадание не создает временный key_t, ключ копируется только при
+	 * вставке страницы в кэш */
+	template <class K, class = std::enable_if_t<is_lookup_key_v<key_t, K>>>
+	const page_t& get_temp_page(const K& key) const
+		{ return lookup(key); }
+	template <class K, class = std::enable_if_t<is_lookup_key_v<key_t, K>>>
+	bool is_cached(const K& key) const
+		{ return m_hashtbl.count(key_view_t<key_t>(key)); }
+
+	/*  Ключ страницы, которая будет вытеснена при следующем промахе,
+	 * или nullptr, если в кэше есть свободное место */
+	const key_t *victim() const
+		{ return (this->bytes_cached() < this->m_cache_sz) ? nullptr : &m_lst.back().key; }
+
+	/*  Сохраняет в файл path страницы в порядке от MRU к LRU и статистику.
+	 * После load_snapshot() кэш того же размера вытесняет страницы в том же
+	 * порядке, что и сохранивший снимок. Иначе - SnapshotError, содержимое
+	 * кэша при этом не меняется
+	 *  key_t и page_t должны поддерживаться Serializer (см. snapshot.h) */
+	void save_snapshot(const std::string& path) const;
+	void load_snapshot(const std::string& path);
+	/*  То же в уже открытом снимке: для кэшей, которые хранят снимок этого
+	 * кэша внутри своего (см. write_nested()). read_snapshot() читает in до
+	 * конца */
+	template <class Out>
+	void write_snapshot(Out& out) const;
+	void read_snapshot(BufferReader& in);
+
+	/*  Запись страницы в кэш без обращения к базе данных. Старая страница
+	 * key заменяется (с пересчетом веса) и возвращается, новая добавляется
+	 * с вытеснением, как при промахе. Страница становится MRU и получает
+	 * отметку dirty. В статистике запросов не учитывается
+	 *  Страница тяжелее max_page_fraction * cache_sz не кэшируется, а
+	 * старая страница key при этом вытесняется */
+	std::optional<page_t> put_page(const key_t& key, page_t page, bool dirty) const;
+
+	/*  Грязные страницы - записанные put_page(..., true) после последнего
+	 * mark_clean(). Eviction listener вызывается до удаления страницы,
+	 * поэтому is_dirty() вытесняемой страницы в нем еще верен. Страницы из
+	 * снимка (load_snapshot()) чистые */
+	bool is_dirty(const key_t& key) const;
+	size_t ndirty() const { return m_ndirty; }
+	/* Копии всех грязных страниц */
+	std::vector<std::pair<key_t, page_t>> dirty_pages() const;
+	void mark_clean() const;
+
 private:
 	using KeyAndPage = std::pair<key_t, page_t>;
 	struct ListEntry {
 		key_t key;
 		page_t page;
+		bool dirty = false;
 	};
 	using List = std::list<ListEntry>;
-	using Hashtable = std::unordered_map<key_t, typename List::iterator>;
+	/*  Ключи хэш-таблицы - представления ключей из узлов списка (см.
+	 * key_view_t), узлы не перемещаются, пока страница в кэше */
+	using Hashtable = std::unordered_map<key_view_t<key_t>, typename List::iterator,
+		TransparentHash<key_t>, TransparentEqual<key_t>>;
 
 	mutable List m_lst;
 	mutable Hashtable m_hashtbl;
+	mutable page_t m_rejected_page; // страница, не допущенная в кэш из-за веса
+	mutable size_t m_ndirty;
+	Weigher m_weigher;
+	size_t m_max_page_weight;
+
+	const page_t& lookup(key_view_t<key_t> key) const;
+	void evict_lru() const;
 };
 
-template <class DataBase>
+/*  LRU кэш, который после конструирования не выделяет память ни при
+ * попадании, ни при промахе
+ *  Страницы хранятся в заранее выделенном массиве из cache_sz элементов,
+ * связанных в двусвязный список 32-битными индексами prev/next
+ *  Индекс ключей - хэш-таблица с открытой адресацией в стиле Swiss table:
+ * на каждую ячейку приходится управляющий байт (пусто / удалено / 7 бит хэша),
+ * байты просматриваются группами по 16 (SSE2, если доступно)
+ *  Weigher и max_page_fraction - как в LRUCache. max_pages - размер массива
+ * страниц, 0 - cache_sz (страница весит не меньше 1, поэтому столько
+ * страниц всегда хватит). Для бюджета в байтах лучше задать его явно:
+ * при заполненном массиве вытесняется LRU страница, даже если бюджет
+ * еще не исчерпан
+ *  key_t и page_t должны иметь конструктор по умолчанию */
+template <class DataBase, class Weigher = UnitWeigher>
+class FlatLRUCache : public AbstractCache<DataBase> {
+public:
+	using key_t = typename DataBase::key_t;
+	using page_t = typename DataBase::page_t;
+
+	FlatLRUCache(const DataBase& db, size_t cache_sz, double max_page_fraction = 1.0,
+		const Weigher& weigher = Weigher(), size_t max_pages = 0);
+
+	const page_t& get_temp_page(const key_t& key) const override
+		{ return lookup(key); }
+	bool is_cached(const key_t& key) const override
+		{ return find_slot(key, hash(key)) != NIL; }
+
+	/* Аналогично LRUCache */
+	template <class K, class = std::enable_if_t<is_lookup_key_v<key_t, K>>>
+	const page_t& get_temp_page(const K& key) const
+		{ return lookup(key); }
+	template <class K, class = std::enable_if_t<is_lookup_key_v<key_t, K>>>
+	bool is_cached(const K& key) const
+		{ return find_slot(key, hash(key)) != NIL; }
+
+	/*  Аналогично LRUCache::save_snapshot(). Ячеек (max_pages) должно
+	 * хватать на все страницы снимка */
+	void save_snapshot(const std::string& path) const;
+	void load_snapshot(const std::string& path);
+
+private:
+	using index_t = uint32_t;
+	static constexpr index_t NIL = UINT32_MAX;
+
+	struct Entry {
+		key_t key;
+		page_t page;
+		index_t prev, next; // соседи в LRU списке
+		index_t slot; // ячейка хэш-таблицы, указывающая на эту страницу
+		uint64_t load_ns; // для возраста при вытеснении, 0 - ключ не в выборке
+	};
+
+	/* Управляющие байты хэш-таблицы */
+	enum : int8_t { CTRL_EMPTY = -128, CTRL_DELETED = -2 };
+	static constexpr size_t GROUP_SZ = 16;
+
+	mutable std::vector<Entry> m_entries;
+	mutable index_t m_nentries; // использованная часть m_entries
+	mutable index_t m_nlive; // из них страниц в кэше
+	mutable index_t m_free; // список вытесненных страниц (через next)
+	mutable index_t m_head; // самая свежая страница
+	mutable index_t m_tail; // самая старая страница
+	mutable page_t m_rejected_page; // страница, не допущенная в кэш из-за веса
+	Weigher m_weigher;
+	size_t m_max_page_weight;
+
+	mutable std::vector<int8_t> m_ctrl;
+	mutable std::vector<index_t> m_slots; // номера страниц в m_entries
+	size_t m_ngroups;
+	mutable size_t m_ndeleted;
+
+	const page_t& lookup(key_view_t<key_t> key) const;
+	/*  Кладет страницу в свободный элемент, место уже освобождено */
+	const page_t& place(key_t key, page_t page, size_t weight, uint64_t h,
+		uint64_t load_ns) const;
+
+	static uint64_t hash(key_view_t<key_t> key);
+	static uint32_t match_byte(const int8_t *group, int8_t value);
+	static uint32_t match_free(const int8_t *group);
+
+	index_t find_slot(key_view_t<key_t> key, uint64_t h) const;
+	void insert_slot(index_t entry, uint64_t h) const;
+	void erase_slot(index_t slot) const;
+	void rebuild_index() const;
+
+	void unlink(index_t entry) const;
+	void push_front(index_t entry) const;
+	void evict_lru() const;
+};
+
+/*  Полный 2Q (Johnson, Shasha). Страницы хранятся в двух очередях:
+ * A1in - FIFO для впервые запрошенных страниц, Am - LRU для страниц,
+ * запрошенных повторно. Вытесненные из A1in страницы оставляют свои ключи
+ * в A1out (только ключи, без страниц). Страница попадает в Am, только если
+ * ее ключ найден в A1out, поэтому однократно запрашиваемые страницы
+ * (например, при последовательном сканировании) не вытесняют Am
+ *  kin_ratio - размер A1in в долях от cache_sz,
+ *  kout_ratio - размер A1out в долях от cache_sz
+ *  Weigher и max_page_fraction - как в LRUCache. Размеры очередей тоже
+ * считаются в весе: ключ в A1out помнит вес своей страницы */
+template <class DataBase, class Weigher = UnitWeigher>
 class TWOQCache : public AbstractCache<DataBase> {
 public:
 	using key_t = typename DataBase::key_t;
 	using page_t = typename DataBase::page_t;
 
-	TWOQCache(const DataBase& db, size_t cache_sz) :
-		AbstractCache<DataBase>(db, cache_sz)
-	{
-		assert(cache_sz > 1);
-		m_hashtbl.reserve(cache_sz);
-		m_fifo_sz = 0.2 * cache_sz + 1;
-		m_lru_sz = cache_sz - m_fifo_sz;
-		assert(m_fifo_sz > 0);
-		assert(m_lru_sz > 0);
-		assert(m_fifo_sz + m_lru_sz == cache_sz);
-	}
+	TWOQCache(const DataBase& db, size_t cache_sz,
+		double kin_ratio = 0.25, double kout_ratio = 0.5,
+		double max_page_fraction = 1.0, const Weigher& weigher = Weigher());
 
 	const page_t& get_temp_page(const key_t& key) const override;
 	bool is_cached(const key_t& key) const override
 		{ return m_hashtbl.count(key); }
 
+	/* Аналогично LRUCache::victim() */
+	const key_t *victim() const;
+
+	size_t kin() const { return m_kin; }
+	size_t kout() const { return m_kout; }
+
+	/*  Аналогично LRUCache::save_snapshot(), сохраняются все три очереди.
+	 * kin и kout тоже должны совпадать */
+	void save_snapshot(const std::string& path) const;
+	void load_snapshot(const std::string& path);
+	template <class Out>
+	void write_snapshot(Out& out) const;
+	void read_snapshot(BufferReader& in);
+
 private:
 	struct ListEntry {
 		key_t key;
 		page_t page;
 	};
 	struct HashtblEntry {
-		enum { FIFO_QUEUE, LRU_QUEUE } location; // в какой из очередей
+		enum { A1IN_QUEUE, AM_QUEUE } location; // в какой из очередей
 		typename std::list<ListEntry>::iterator it;
 	};
+	struct Ghost {
+		key_t key;
+		size_t weight;
+	};
+	using GhostList = std::list<Ghost>;
+
+	mutable std::list<ListEntry> m_am;
+	mutable std::list<ListEntry> m_a1in;
+	mutable GhostList m_a1out; // только ключи
+	mutable std::unordered_map<key_t, HashtblEntry> m_hashtbl;
+	mutable std::unordered_map<key_t, typename GhostList::iterator> m_a1out_hashtbl;
+	mutable size_t m_a1in_weight, m_a1out_weight;
+	mutable page_t m_rejected_page; // страница, не допущенная в кэш из-за веса
+
+	size_t m_kin;
+	size_t m_kout;
+	Weigher m_weigher;
+	size_t m_max_page_weight;
+
+	void reclaim(size_t weight) const;
+	void remember(const key_t& key, size_t weight) const;
+};
+
+/*  Adaptive Replacement Cache (Megiddo, Modha)
+ *  Страницы хранятся в двух LRU списках: T1 - запрошенные один раз,
+ * T2 - запрошенные хотя бы дважды. Для вытесненных из них страниц хранятся
+ * только ключи (списки-призраки B1 и B2)
+ *  Промах, найденный в B1, означает, что T1 был слишком мал, найденный в B2 -
+ * что мал T2. По ним целевой размер T1 (target_t1_sz) подстраивается на ходу,
+ * поэтому кэш сам приспосабливается и к сканированию, и к повторным запросам
+ *  Weigher и max_page_fraction - как в LRUCache. Размеры списков, в том
+ * числе списков-призраков, и target_t1_sz считаются в весе */
+template <class DataBase, class Weigher = UnitWeigher>
+class ARCCache : public AbstractCache<DataBase> {
+public:
+	using key_t = typename DataBase::key_t;
+	using page_t = typename DataBase::page_t;
+
+	ARCCache(const DataBase& db, size_t cache_sz,
+		double max_page_fraction = 1.0, const Weigher& weigher = Weigher());
+
+	const page_t& get_temp_page(const key_t& key) const override;
+	bool is_cached(const key_t& key) const override;
+
+	size_t target_t1_sz() const { return m_target_t1_sz; }
+
+	/*  Аналогично LRUCache::save_snapshot(), сохраняются T1, T2,
+	 * списки-призраки и target_t1_sz */
+	void save_snapshot(const std::string& path) const;
+	void load_snapshot(const std::string& path);
+	template <class Out>
+	void write_snapshot(Out& out) const;
+	void read_snapshot(BufferReader& in);
+
+private:
+	struct ListEntry {
+		key_t key;
+		page_t page;
+	};
+	using PageList = std::list<ListEntry>;
+	struct Ghost {
+		key_t key;
+		size_t weight;
+	};
+	using GhostList = std::list<Ghost>;
+
+	struct HashtblEntry {
+		enum { T1, T2, B1, B2 } location; // в каком из списков
+		typename PageList::iterator it; // для T1, T2
+		typename GhostList::iterator ghost_it; // для B1, B2
+	};
+
+	mutable PageList m_t1, m_t2;
+	mutable GhostList m_b1, m_b2;
+	mutable size_t m_t1_weight, m_t2_weight, m_b1_weight, m_b2_weight;
+	mutable std::unordered_map<key_t, HashtblEntry> m_hashtbl;
+	mutable size_t m_target_t1_sz;
+	mutable page_t m_rejected_page; // страница, не допущенная в кэш из-за веса
+	Weigher m_weigher;
+	size_t m_max_page_weight;
+
+	void replace(bool found_in_b2) const;
+	void pop_ghost(GhostList& ghosts, size_t& ghosts_weight) const;
+	void trim_ghosts(size_t weight) const;
+};
+
+/*  Segmented LRU. Новые страницы попадают в испытательный (probation) LRU
+ * сегмент, а при повторном запросе переходят в защищенный (protected).
+ * Переполнение защищенного сегмента возвращает его LRU страницу в начало
+ * испытательного. Вытесняются страницы из испытательного сегмента
+ *  protected_fraction - доля кэша под защищенный сегмент
+ *  Weigher и max_page_fraction - как в LRUCache, размер защищенного
+ * сегмента тоже считается в весе */
+template <class DataBase, class Weigher = UnitWeigher>
+class SLRUCache : public AbstractCache<DataBase> {
+public:
+	using key_t = typename DataBase::key_t;
+	using page_t = typename DataBase::page_t;
+
+	SLRUCache(const DataBase& db, size_t cache_sz, double protected_fraction = 0.8,
+		double max_page_fraction = 1.0, const Weigher& weigher = Weigher());
+
+	const page_t& get_temp_page(const key_t& key) const override;
+	bool is_cached(const key_t& key) const override
+		{ return m_hashtbl.count(key); }
+
+	/* Аналогично LRUCache::victim() */
+	const key_t *victim() const;
+
+	/*  Аналогично LRUCache::save_snapshot(), сохраняются оба сегмента.
+	 * protected_fraction тоже должна совпадать */
+	void save_snapshot(const std::string& path) const;
+	void load_snapshot(const std::string& path);
+	template <class Out>
+	void write_snapshot(Out& out) const;
+	void read_snapshot(BufferReader& in);
+
+	/*  Аналогично LRUCache. Запись уже закэшированной страницы считается
+	 * повторным обращением и переносит ее в защищенный сегмент */
+	std::optional<page_t> put_page(const key_t& key, page_t page, bool dirty) const;
+	bool is_dirty(const key_t& key) const;
+	size_t ndirty() const { return m_ndirty; }
+	std::vector<std::pair<key_t, page_t>> dirty_pages() const;
+	void mark_clean() const;
+
+private:
+	struct ListEntry {
+		key_t key;
+		page_t page;
+		bool dirty = false;
+	};
+	using List = std::list<ListEntry>;
+	struct HashtblEntry {
+		bool is_protected;
+		typename List::iterator it;
+	};
 
-	mutable std::list<ListEntry> m_lru_queue;
-	mutable std::list<ListEntry> m_fifo_queue;
+	mutable List m_probation;
+	mutable List m_protected;
 	mutable std::unordered_map<key_t, HashtblEntry> m_hashtbl;
+	mutable size_t m_protected_weight;
+	mutable page_t m_rejected_page; // страница, не допущенная в кэш из-за веса
+	mutable size_t m_ndirty;
+
+	size_t m_protected_sz;
+	Weigher m_weigher;
+	size_t m_max_page_weight;
+
+	void promote(HashtblEntry& found) const;
+	void evict_one() const;
+};
+
+/*  W-TinyLFU (Einziger, Friedman, Manes). Перед основным кэшем стоит
+ * маленькое LRU окно (window_fraction от cache_sz; 1% из статьи слишком мал
+ * для тестовых размеров кэша и хождения по графу, поэтому 10%). Новые страницы попадают
+ * в окно, а вытесненная из окна страница-кандидат попадает в основной кэш,
+ * только если ее оценка частоты больше, чем у страницы, которую основной кэш
+ * вытеснил бы (victim()). Частоты всех запрошенных ключей приблизительно
+ * считает FrequencySketch
+ *  MainCache - политика основного кэша, должна иметь метод victim():
+ * LRUCache, TWOQCache, SLRUCache */
+template <class DataBase, template <class...> class MainCache = SLRUCache>
+class WTinyLFUCache : public AbstractCache<DataBase> {
+public:
+	using key_t = typename DataBase::key_t;
+	using page_t = typename DataBase::page_t;
+
+	WTinyLFUCache(const DataBase& db, size_t cache_sz, double window_fraction = 0.1);
+
+	const page_t& get_temp_page(const key_t& key) const override;
+	bool is_cached(const key_t& key) const override
+		{ return m_window_hashtbl.count(key) || m_main.is_cached(key); }
+
+	size_t window_sz() const { return m_window_sz; }
+
+	/*  Аналогично LRUCache::save_snapshot(), сохраняются окно, основной
+	 * кэш (его write_snapshot()) и FrequencySketch. window_fraction тоже
+	 * должна совпадать */
+	void save_snapshot(const std::string& path) const;
+	void load_snapshot(const std::string& path);
+
+private:
+	/*  База данных для основного кэша: отдает страницу, переданную из
+	 * окна, не обращаясь к настоящей базе данных */
+	class HandoffDB : public DB::AbstractIDB<key_t, page_t> {
+	public:
+		explicit HandoffDB(const DataBase& db) :
+			m_db(db), m_key(nullptr), m_page(nullptr) {}
+
+		bool contains(const key_t& key) const override { return m_db.contains(key); }
+		page_t get_page(const key_t& key) const override
+		{
+			if (m_page && key == *m_key)
+				return std::move(*m_page);
+			return m_db.get_page(key);
+		}
+		void handoff(const key_t *key, page_t *page) const
+			{ m_key = key, m_page = page; }
+
+	private:
+		const DataBase& m_db;
+		mutable const key_t *m_key;
+		mutable page_t *m_page;
+	};
+
+	struct ListEntry {
+		key_t key;
+		page_t page;
+	};
+	using List = std::list<ListEntry>;
+
+	size_t m_window_sz;
+	mutable List m_window;
+	mutable std::unordered_map<key_t, typename List::iterator> m_window_hashtbl;
+
+	HandoffDB m_handoff_db;
+	MainCache<HandoffDB> m_main;
+	mutable FrequencySketch<key_t> m_sketch;
+
+	void evict_from_window() const;
+};
+
+/*  Least Frequently Used. Вытесняется страница с наименьшим числом
+ * запросов, среди равных - та, к которой дольше всего не обращались
+ *  Страницы сгруппированы в корзины по частоте, корзины образуют
+ * список по возрастанию частоты, поэтому и попадание, и вытеснение - O(1)
+ *  Без старения страница, набравшая много запросов однажды, остается в кэше
+ * навсегда. Если aging_period != 0, то каждые aging_period обращений все
+ * частоты делятся пополам (O(cache_sz), т.е. O(1) в среднем при
+ * aging_period >= cache_sz)
+ *  Weigher и max_page_fraction - как в LRUCache */
+template <class DataBase, class Weigher = UnitWeigher>
+class LFUCache : public AbstractCache<DataBase> {
+public:
+	using key_t = typename DataBase::key_t;
+	using page_t = typename DataBase::page_t;
+
+	LFUCache(const DataBase& db, size_t cache_sz, size_t aging_period = 0,
+		double max_page_fraction = 1.0, const Weigher& weigher = Weigher());
+
+	const page_t& get_temp_page(const key_t& key) const override;
+	bool is_cached(const key_t& key) const override
+		{ return m_hashtbl.count(key); }
+
+	size_t aging_period() const { return m_aging_period; }
+
+	/*  Аналогично LRUCache::save_snapshot(), сохраняются корзины с
+	 * частотами и счетчик до старения. aging_period тоже должен совпадать */
+	void save_snapshot(const std::string& path) const;
+	void load_snapshot(const std::string& path);
+
+private:
+	struct ListEntry {
+		key_t key;
+		page_t page;
+	};
+	using EntryList = std::list<ListEntry>;
+
+	struct FreqBucket {
+		size_t freq;
+		EntryList entries; // в начале - самые свежие
+	};
+	using BucketList = std::list<FreqBucket>;
+
+	struct HashtblEntry {
+		typename BucketList::iterator bucket;
+		typename EntryList::iterator it;
+	};
+
+	mutable BucketList m_buckets; // по возрастанию freq
+	mutable std::unordered_map<key_t, HashtblEntry> m_hashtbl;
+	mutable page_t m_rejected_page; // страница, не допущенная в кэш из-за веса
+
+	size_t m_aging_period;
+	mutable size_t m_nrequests_since_aging;
+	Weigher m_weigher;
+	size_t m_max_page_weight;
 
-	size_t m_lru_sz;
-	size_t m_fifo_sz;
+	void evict() const;
+	void age() const;
+};
+
+/*  Потокобезопасный LRU кэш. Ключи распределяются по nshards
+ * шардам по хэшу, каждый шард - отдельный LRUCache со своим мьютексом,
+ * поэтому потоки, обращающиеся к разным шардам, не ждут друг друга
+ *  LRU порядок поддерживается внутри каждого шарда, а не глобально
+ *  Warning: ссылка из get_temp_page() указывает на буфер текущего потока
+ * и становится недействительной при следующем обращении этого потока к
+ * get_page() или get_temp_page(). Из нескольких потоков безопаснее
+ * пользоваться get_page() */
+template <class DataBase>
+class ShardedLRUCache : public AbstractCache<DataBase> {
+public:
+	using key_t = typename DataBase::key_t;
+	using page_t = typename DataBase::page_t;
+
+	ShardedLRUCache(const DataBase& db, size_t cache_sz, size_t nshards = 16,
+		size_t nasync_workers = 8);
+	~ShardedLRUCache();
+
+	/*  При промахе страница загружается из базы данных без блокировки шарда.
+	 * Одновременные промахи по одному ключу объединяются: к базе данных
+	 * обращается только первый поток, остальные ждут его результата
+	 * (или его исключения) */
+	page_t get_page(const key_t& key) const override;
+	/*  Копия страницы в буфере потока (см. ThreadPageBuffers): ссылка
+	 * действительна до следующего get_temp_page() этого потока к этому кэшу */
+	const page_t& get_temp_page(const key_t& key) const override;
+	bool is_cached(const key_t& key) const override;
+
+	/*  Асинхронный get_page(). При попадании возвращает уже готовый future,
+	 * при промахе ключ ставится в очередь пула из nasync_workers потоков
+	 * (запускается при первом промахе). Запросы одного ключа, ждущие в
+	 * очереди, объединяются и занимают один поток
+	 *  Деструктор дожидается всех поставленных в очередь загрузок */
+	std::future<page_t> get_page_async(const key_t& key) const;
+
+	/*  Аналогично AbstractCache::get_pages(), но страницы загружаются без
+	 * блокировки шардов */
+	using AbstractCache<DataBase>::get_pages;
+	std::vector<page_t> get_pages(const std::vector<key_t>& keys) const override;
+
+	size_t nshards() const { return m_shards.size(); }
+
+	/*  Статистика собирается в каждом шарде отдельно (увеличивается под его
+	 * мьютексом, читается без него), поэтому счетчики CacheAnalitics
+	 * перекрываются суммой по шардам
+	 *  Запрос, дождавшийся загрузки страницы другим потоком, считается
+	 * промахом, но не обращается к базе данных. Число таких запросов -
+	 * ncoalesced() */
+	uint64_t nhits() const override;
+	uint64_t nlookups() const override;
+	uint64_t ncoalesced() const;
+	/*  Сумма metrics() шардов и время обращений к базе данных */
+	CacheMetrics metrics() const override;
+
+	/*  Аналогично LRUCache::save_snapshot(), каждый шард - снимок своего
+	 * LRUCache. nshards тоже должно совпадать, ncoalesced() не сохраняется
+	 *  save_snapshot() можно вызывать одновременно с запросами: шарды
+	 * сохраняются по очереди, каждый под своим мьютексом. load_snapshot() -
+	 * только когда других обращений к кэшу нет */
+	void save_snapshot(const std::string& path) const;
+	void load_snapshot(const std::string& path);
+
+private:
+	struct Shard {
+		Shard(const DataBase& db, size_t cache_sz) :
+			cache(db, cache_sz) {}
+
+		mutable std::mutex mutex;
+		LRUCache<DataBase> cache;
+		std::unordered_map<key_t, std::shared_future<page_t>> inflight; // загружаемые сейчас страницы
+		RelaxedCounter ncoalesced; // изменяется под mutex
+	};
+	std::vector<std::unique_ptr<Shard>> m_shards;
+
+	/* Пул get_page_async(), под m_async_mutex */
+	size_t m_nasync_workers;
+	mutable std::mutex m_async_mutex;
+	mutable std::condition_variable m_async_cv;
+	mutable std::deque<key_t> m_async_queue;
+	mutable std::unordered_map<key_t, std::vector<std::promise<page_t>>> m_async_waiting;
+	mutable std::vector<std::thread> m_async_workers;
+	bool m_async_stop;
+	ThreadPageBuffers<page_t> m_page_bufs;
+
+	Shard& shard_for(const key_t& key) const;
+	void async_worker() const;
+};
+
+/*  Потокобезопасный кэш с алгоритмом CLOCK ("второй шанс"). Страницы
+ * лежат в кольцевом массиве, у каждой есть бит обращения. Попадание только
+ * выставляет этот бит (атомарно) и не меняет структуру кэша. При промахе
+ * стрелка идет по кругу, сбрасывая биты, до первой страницы со сброшенным
+ * битом - она и вытесняется. Промахи берут мьютекс шарда, страница из базы
+ * данных загружается до этого
+ *  Попадания не берут блокировок. Индекс - таблица с открытой адресацией
+ * из атомарных указателей на неизменяемые записи (ключ, страница): промах
+ * публикует новую запись, а вытесненную только убирает из таблицы.
+ * Освобождается она позже, когда завершатся все попадания, которые могли
+ * ее увидеть (RCU с двумя счетчиками читателей на шард). Попадание стоит
+ * нескольких атомарных операций над счетчиками шарда и не ждет ни промахов,
+ * ни других попаданий
+ *  Как и в ShardedLRUCache, ключи распределены по nshards шардам
+ *  Weigher, max_page_fraction и max_pages - как в FlatLRUCache, бюджет и
+ * число ячеек делятся между шардами поровну */
+template <class DataBase, class Weigher = UnitWeigher>
+class ClockCache : public AbstractCache<DataBase> {
+public:
+	using key_t = typename DataBase::key_t;
+	using page_t = typename DataBase::page_t;
+
+	ClockCache(const DataBase& db, size_t cache_sz, size_t nshards = 16,
+		double max_page_fraction = 1.0, const Weigher& weigher = Weigher(),
+		size_t max_pages = 0);
+
+	page_t get_page(const key_t& key) const override;
+	/* Аналогично ShardedLRUCache::get_temp_page() */
+	const page_t& get_temp_page(const key_t& key) const override;
+	bool is_cached(const key_t& key) const override;
 
-	void pop_page(std::list<ListEntry>& queue) const;
+	/* Аналогично ShardedLRUCache::get_pages() */
+	using AbstractCache<DataBase>::get_pages;
+	std::vector<page_t> get_pages(const std::vector<key_t>& keys) const override;
+
+	size_t nshards() const { return m_shards.size(); }
+
+	/* Аналогично ShardedLRUCache */
+	uint64_t nhits() const override;
+	uint64_t nlookups() const override;
+	CacheMetrics metrics() const override;
+
+	/*  Аналогично ShardedLRUCache::save_snapshot(): для каждого шарда
+	 * сохраняются страницы с их ячейками и битами обращения, стрелка и
+	 * порядок свободных ячеек, поэтому загруженный кэш вытесняет в том же
+	 * порядке. nshards, max_pages и размер кэша тоже должны совпадать */
+	void save_snapshot(const std::string& path) const;
+	void load_snapshot(const std::string& path);
+
+private:
+	struct Entry {
+		key_t key;
+		page_t page;
+		size_t slot; // ячейка кольцевого массива
+	};
+
+	/*  Линейное пробирование. Удаленная запись заменяется на tombstone(),
+	 * поэтому записи не перемещаются и читатель не может пропустить
+	 * ключ, который есть в кэше. Когда пустых ячеек остается меньше
+	 * половины, промах строит новую таблицу без tombstone() */
+	struct Index {
+		explicit Index(size_t nbuckets) :
+			buckets(new std::atomic<Entry *>[nbuckets]()), mask(nbuckets - 1) {}
+
+		std::unique_ptr<std::atomic<Entry *>[]> buckets;
+		size_t mask;
+	};
+
+	/*  Убранные из индекса записи и таблицы, которые еще могут читать */
+	struct Garbage {
+		std::vector<std::unique_ptr<Entry>> entries;
+		std::vector<std::unique_ptr<Index>> indexes;
+
+		bool empty() const { return entries.empty() && indexes.empty(); }
+		void clear() { entries.clear(), indexes.clear(); }
+	};
+
+	struct Shard {
+		Shard(size_t budget, size_t capacity);
+
+		/* Под mutex - только промахи */
+		std::mutex mutex;
+		size_t budget; // бюджет шарда в единицах веса
+		size_t weight; // вес страниц шарда
+		size_t capacity;
+		size_t hand; // стрелка часов
+		std::vector<std::unique_ptr<Entry>> slots; // пустые ячейки - nullptr
+		std::vector<size_t> free_slots;
+		std::unique_ptr<Index> index_owner;
+		size_t nused_buckets; // записи и tombstone() в index
+		Garbage retired_before; // убраны до начала текущей эпохи
+		Garbage retired_now; // убраны в текущей эпохе
+
+		/* Читаются без блокировок */
+		std::unique_ptr<std::atomic<bool>[]> referenced;
+		std::atomic<Index *> index;
+		std::atomic<uint64_t> epoch;
+		std::atomic<uint64_t> nreaders[2]; // попадания, начавшиеся в четной и нечетной эпохе
+
+		std::atomic<uint64_t> nhits, nlookups;
+	};
+	std::vector<std::unique_ptr<Shard>> m_shards;
+	Weigher m_weigher;
+	size_t m_max_page_weight;
+	ThreadPageBuffers<page_t> m_page_bufs;
+
+	/*  Читатель на время поиска в индексе и копирования страницы */
+	class ReadGuard {
+	public:
+		explicit ReadGuard(Shard& shard);
+		~ReadGuard() { m_nreaders->fetch_sub(1, std::memory_order_release); }
+
+		ReadGuard(const ReadGuard& other) = delete;
+		ReadGuard& operator =(const ReadGuard& other) = delete;
+
+	private:
+		std::atomic<uint64_t> *m_nreaders;
+	};
+
+	static uint64_t key_hash(const key_t& key)
+		{ return mix_hash(std::hash<key_t>()(key)); }
+	Shard& shard_for(uint64_t hash) const
+		{ return *m_shards[hash % m_shards.size()]; }
+	/*  Номер первой ячейки индекса - старшие биты хэша: младшие у ключей
+	 * одного шарда совпадают */
+	static size_t bucket_for(const Index& index, uint64_t hash)
+		{ return (hash >> 32) & index.mask; }
+	static Entry *tombstone()
+	{
+		alignas(Entry) static char tag;
+		return reinterpret_cast<Entry *>(&tag);
+	}
+
+	static Entry *find(const Index& index, const key_t& key, uint64_t hash);
+	page_t insert(Shard& shard, const key_t& key, uint64_t hash, page_t page) const;
+	void evict_one(Shard& shard) const;
+	void index_insert(Shard& shard, Entry *entry, uint64_t hash) const;
+	void index_erase(Shard& shard, Entry *entry) const;
+	void rebuild_index(Shard& shard) const;
+	void reclaim(Shard& shard) const;
+};
+
+/*  Декоратор, заранее загружающий страницы, которые вероятно будут
+ * запрошены следующими. Для каждого ключа запоминаются ключи, запрошенные
+ * сразу после него, с числом таких переходов (марковская цепь первого
+ * порядка). После каждого запроса фоновый поток загружает top_k самых
+ * частых преемников. Переходы помнятся только для 2 * cache_sz недавно
+ * запрошенных ключей, остальные забываются. Для целочисленных ключей
+ * дополнительно распознаются запросы с постоянным шагом (key, key + d,
+ * key + 2d, ...), если следующий ключ представим в key_t
+ *  Загруженные страницы ждут своего запроса в буфере и при запросе
+ * передаются в Cache через preload_page(). Если запрошенная страница уже
+ * загружается фоновым потоком, запрос дожидается ее, а не обращается к
+ * базе данных сам
+ *  База данных должна допускать одновременные вызовы get_page()
+ *  Cache - любой однопоточный кэш с конструктором (db, cache_sz) */
+template <class Cache>
+class PrefetchingCache : public AbstractCache<typename Cache::database_t> {
+public:
+	using database_t = typename Cache::database_t;
+	using key_t = typename database_t::key_t;
+	using page_t = typename database_t::page_t;
+
+	PrefetchingCache(const database_t& db, size_t cache_sz,
+		size_t top_k = 1, bool detect_stride = true);
+	~PrefetchingCache();
+
+	/*  Попаданием считается и страница, уже загруженная заранее. Страница,
+	 * которую пришлось дождаться, считается промахом */
+	const page_t& get_temp_page(const key_t& key) const override;
+	bool is_cached(const key_t& key) const override
+		{ return m_cache.is_cached(key); }
+
+	/* Число заранее загружаемых страниц и число запрошенных из них */
+	uint64_t nprefetched() const { return m_nprefetched; }
+	uint64_t nprefetch_hits() const { return m_nprefetch_hits; }
+	/* Доля запрошенных среди загруженных заранее */
+	double prefetch_accuracy() const
+		{ return (m_nprefetched) ? static_cast<double>(m_nprefetch_hits) / m_nprefetched : 0.0; }
+	/* Доля промахов Cache, которые закрыла предзагрузка */
+	double prefetch_coverage() const
+	{
+		uint64_t nmisses = m_nprefetch_hits + m_ndemand_misses;
+		return (nmisses) ? static_cast<double>(m_nprefetch_hits) / nmisses : 0.0;
+	}
+	/* Среднее время получения страницы, которой не было в Cache, мкс */
+	double avg_miss_latency_us() const
+	{
+		uint64_t nmisses = m_nprefetch_hits + m_ndemand_misses;
+		return (nmisses) ? static_cast<double>(m_miss_latency_us) / nmisses : 0.0;
+	}
+
+private:
+	static constexpr size_t MAX_SUCCESSORS = 4; // преемников на один ключ
+	/*  Ключи с шагом: bool для __builtin_*_overflow() не годится */
+	static constexpr bool STRIDE_KEYS =
+		std::is_integral<key_t>::value && !std::is_same<key_t, bool>::value;
+
+	struct Successor {
+		key_t key;
+		unsigned count;
+	};
+	using LearnOrder = std::list<key_t>;
+	struct Successors {
+		std::vector<Successor> top; // отсортированы по count
+		typename LearnOrder::iterator order;
+	};
+
+	Cache m_cache;
+	size_t m_top_k;
+	bool m_detect_stride;
+
+	/* Используются только потоком, вызывающим get_temp_page() */
+	mutable std::unordered_map<key_t, Successors> m_successors;
+	mutable LearnOrder m_learn_order; // от давно к недавно запрошенным
+	size_t m_max_learned; // ключей в m_successors
+	mutable std::optional<key_t> m_prev_key;
+	mutable long long m_prev_stride; // шаг между двумя последними ключами
+	mutable bool m_stride_repeated; // и он совпал с предыдущим шагом
+	mutable uint64_t m_nprefetched, m_nprefetch_hits, m_ndemand_misses;
+	mutable uint64_t m_miss_latency_us;
+
+	/* Общее с фоновым потоком, под m_mutex */
+	using BufferOrder = std::list<key_t>;
+	struct BufferEntry {
+		page_t page;
+		typename BufferOrder::iterator order;
+	};
+	mutable std::mutex m_mutex;
+	mutable std::condition_variable m_queue_cv; // появился ключ для загрузки
+	mutable std::condition_variable m_loaded_cv; // страница загружена
+	mutable std::deque<key_t> m_queue;
+	mutable std::unordered_set<key_t> m_pending; // в очереди или загружаются
+	mutable std::unordered_map<key_t, BufferEntry> m_buffer;
+	mutable BufferOrder m_buffer_order; // от старых к новым
+	size_t m_max_queue_sz;
+	size_t m_max_buffer_sz;
+	bool m_stop;
+
+	std::thread m_worker;
+
+	void learn(const key_t& key) const;
+	void predict(const key_t& key, std::vector<key_t>& predictions) const;
+	void prefetch(const std::vector<key_t>& predictions) const;
+	void worker();
+};
+
+/*  Декоратор, добавляющий кэшу Cache запись страниц через put_page()
+ *  WRITE_THROUGH - страница сразу записывается в базу данных
+ *  WRITE_BACK - страница только помечается грязной, повторные записи того же
+ * ключа объединяются. Вытесненные грязные страницы копятся и записываются в
+ * базу данных одним insert_pages(), когда их набирается flush_batch_sz.
+ * Все грязные страницы записываются при flush(), в деструкторе и когда их
+ * суммарный вес (см. weigher.h) превышает max_dirty_weight (0 - без порога)
+ *  Отметка "грязная" хранится в записи страницы в Cache, отдельно
+ * хранятся только вытесненные и еще не записанные страницы. flush() не
+ * меняет порядок вытеснения и статистику Cache
+ *  Cache - однопоточный кэш с конструктором (db, cache_sz) и записью
+ * страниц (put_page(), is_dirty(), dirty_pages(), mark_clean()): LRUCache
+ * или SLRUCache. База данных должна поддерживать запись (AbstractIODB) */
+template <class Cache, class Weigher = UnitWeigher>
+class WriteBackCache : public AbstractCache<typename Cache::database_t> {
+public:
+	using database_t = typename Cache::database_t;
+	using key_t = typename database_t::key_t;
+	using page_t = typename database_t::page_t;
+
+	enum WriteMode { WRITE_BACK, WRITE_THROUGH };
+
+	WriteBackCache(database_t& db, size_t cache_sz, WriteMode mode = WRITE_BACK,
+		size_t flush_batch_sz = 16, size_t max_dirty_weight = 0,
+		const Weigher& weigher = Weigher());
+	/*  Записывает грязные страницы. Если база данных при этом бросит
+	 * исключение, они будут потеряны, поэтому лучше вызывать flush() явно */
+	~WriteBackCache();
+
+	const page_t& get_temp_page(const key_t& key) const override;
+	bool is_cached(const key_t& key) const override
+		{ return m_cache.is_cached(key); }
+
+	void put_page(const key_t& key, const page_t& page);
+	/* Записывает в базу данных все грязные страницы */
+	void flush();
+
+	size_t ndirty() const { return m_cache.ndirty() + m_evicted_dirty.size(); }
+	size_t dirty_weight() const { return m_dirty_weight; }
+
+private:
+	Cache m_cache;
+	database_t& m_writable_db;
+	WriteMode m_mode;
+	size_t m_flush_batch_sz;
+	size_t m_max_dirty_weight;
+	Weigher m_weigher;
+
+	using PageTable = std::unordered_map<key_t, page_t>;
+	mutable PageTable m_evicted_dirty; // вытесненные, но еще не записанные
+	mutable size_t m_dirty_weight; // грязных страниц в m_cache и вытесненных
+
+	void store(const key_t& key, page_t page, bool dirty) const;
+	void keep_evicted(const key_t& key, const page_t& page) const;
+	void write_evicted() const;
+};
+
+/*  Двухуровневый кэш. L1 - кэш Cache в памяти размера cache_sz, L2 -
+ * DiskStore в файле l2_path размером до l2_capacity байт. Вытесненная из L1
+ * страница записывается в L2, а при попадании в L2 страница переносится
+ * обратно в L1 (уровни не пересекаются). Промах в обоих уровнях загружает
+ * страницу из базы данных в L1
+ *  Попаданием считается попадание в любой уровень. Eviction listener
+ * вызывается для страниц, вытесненных из L1, даже если они попали в L2
+ *  Cache - однопоточный кэш с конструктором (db, cache_sz), key_t и
+ * page_t должны поддерживаться Serializer (см. snapshot.h) */
+template <class Cache>
+class TieredCache : public AbstractCache<typename Cache::database_t> {
+public:
+	using database_t = typename Cache::database_t;
+	using key_t = typename database_t::key_t;
+	using page_t = typename database_t::page_t;
+
+	TieredCache(const database_t& db, size_t cache_sz,
+		const std::string& l2_path, size_t l2_capacity);
+
+	const page_t& get_temp_page(const key_t& key) const override;
+	bool is_cached(const key_t& key) const override
+		{ return m_l1.is_cached(key) || m_l2.contains(key); }
+
+	uint64_t nl1_hits() const { return m_nl1_hits; }
+	uint64_t nl2_hits() const { return m_nl2_hits; }
+	/* Среднее время запроса с попаданием в L1, в L2 и с промахом, мкс */
+	double avg_l1_latency_us() const { return avg_us(m_l1_latency_ns, m_nl1_hits); }
+	double avg_l2_latency_us() const { return avg_us(m_l2_latency_ns, m_nl2_hits); }
+	double avg_miss_latency_us() const
+		{ return avg_us(m_miss_latency_ns, this->nlookups() - this->nhits()); }
+
+	const Cache& l1() const { return m_l1; }
+	const DiskStore<key_t, page_t>& l2() const { return m_l2; }
+
+private:
+	Cache m_l1;
+	mutable DiskStore<key_t, page_t> m_l2;
+
+	mutable uint64_t m_nl1_hits, m_nl2_hits;
+	mutable uint64_t m_l1_latency_ns, m_l2_latency_ns, m_miss_latency_ns;
+
+	static double avg_us(uint64_t total_ns, uint64_t n)
+		{ return (n) ? total_ns / 1000.0 / n : 0.0; }
+};
+
+/*  Политики вытеснения для BasicCache. BasicCache хранит страницы в
+ * массиве из cache_sz ячеек (slot), политика упорядочивает только номера
+ * ячеек:
+ *	Policy(capacity, hash, alloc) - capacity ячеек, изначально пустых
+ *	on_hit(slot) - попадание в занятую ячейку
+ *	on_insert(slot, key) - в ячейку slot загружена страница key
+ *	evict(key_of) - выбирает ячейку для вытеснения, когда все заняты, и
+ *		забывает ее. key_of(slot) - ключ страницы в ячейке
+ *	name(), save(out), load(in, nslots) - только для снимков BasicCache:
+ *		имя политики, запись состояния и его чтение в новую политику, когда
+ *		заняты ячейки [0, nslots). load() возвращает false, если состояние
+ *		не соответствует этим ячейкам
+ *  Key, Hash, Allocator - как у BasicCache (нужны политикам, которые
+ * помнят ключи вытесненных страниц) */
+
+/*  Двусвязные списки ячеек на общих массивах prev/next: каждая ячейка
+ * находится не больше чем в одном списке */
+class SlotLists {
+public:
+	using slot_t = uint32_t;
+	static constexpr slot_t NIL = UINT32_MAX;
+
+	struct List {
+		slot_t head = NIL, tail = NIL;
+		size_t size = 0;
+	};
+
+	explicit SlotLists(size_t capacity) :
+		m_prev(capacity, NIL), m_next(capacity, NIL) {}
+
+	void push_front(List& lst, slot_t slot);
+	void unlink(List& lst, slot_t slot);
+	void move_to_front(List& lst, slot_t slot)
+		{ if (lst.head != slot) unlink(lst, slot), push_front(lst, slot); }
+
+	/*  Для снимков: ячейки списка от начала к концу. fill() строит из них
+	 * пустой список lst, если все они меньше seen.size() и не отмечены в
+	 * seen, и отмечает их */
+	std::vector<slot_t> slots(const List& lst) const;
+	bool fill(List& lst, const std::vector<slot_t>& slots, std::vector<bool>& seen);
+
+private:
+	std::vector<slot_t> m_prev, m_next;
+};
+
+template <class Key, class Hash = std::hash<Key>, class Allocator = std::allocator<Key>>
+class LRUPolicy {
+public:
+	explicit LRUPolicy(size_t capacity, const Hash& = Hash(), const Allocator& = Allocator()) :
+		m_lists(capacity) {}
+
+	void on_hit(size_t slot) { m_lists.move_to_front(m_lru, slot); }
+	void on_insert(size_t slot, const Key&) { m_lists.push_front(m_lru, slot); }
+	template <class KeyOf>
+	size_t evict(KeyOf)
+	{
+		size_t slot = m_lru.tail;
+		m_lists.unlink(m_lru, slot);
+		return slot;
+	}
+
+	static const char *name() { return "LRUPolicy"; }
+	template <class Out>
+	void save(Out& out) const { out.write(m_lists.slots(m_lru)); }
+	template <class In>
+	bool load(In& in, size_t nslots);
+
+private:
+	SlotLists m_lists;
+	SlotLists::List m_lru;
+};
+
+/*  2Q как в TWOQCache: A1in (FIFO) размера kin = capacity / 4, Am (LRU) и
+ * ключи вытесненных из A1in страниц в A1out размера kout = capacity / 2.
+ * Между evict() и on_insert() в A1out может быть kout + 1 ключ */
+template <class Key, class Hash = std::hash<Key>, class Allocator = std::allocator<Key>>
+class TWOQPolicy {
+public:
+	explicit TWOQPolicy(size_t capacity, const Hash& hash = Hash(),
+		const Allocator& alloc = Allocator());
+
+	void on_hit(size_t slot)
+		{ if (m_in_am[slot]) m_lists.move_to_front(m_am, slot); }
+	void on_insert(size_t slot, const Key& key);
+	template <class KeyOf>
+	size_t evict(KeyOf key_of);
+
+	static const char *name() { return "TWOQPolicy"; }
+	template <class Out>
+	void save(Out& out) const;
+	template <class In>
+	bool load(In& in, size_t nslots);
+
+private:
+	SlotLists m_lists;
+	SlotLists::List m_a1in, m_am;
+	std::vector<bool> m_in_am;
+	size_t m_kin, m_kout;
+	using Ghosts = std::list<Key, Allocator>;
+	using GhostIndex = std::unordered_map<Key, typename Ghosts::iterator, Hash, std::equal_to<Key>,
+		typename std::allocator_traits<Allocator>::template rebind_alloc<
+			std::pair<const Key, typename Ghosts::iterator>>>;
+
+	Ghosts m_a1out; // от новых к старым
+	GhostIndex m_a1out_index;
+};
+
+/*  CLOCK как в ClockCache, но без атомарных бит: BasicCache однопоточный */
+template <class Key, class Hash = std::hash<Key>, class Allocator = std::allocator<Key>>
+class ClockPolicy {
+public:
+	explicit ClockPolicy(size_t capacity, const Hash& = Hash(), const Allocator& = Allocator()) :
+		m_referenced(capacity, 0), m_hand(0) {}
+
+	void on_hit(size_t slot) { m_referenced[slot] = 1; }
+	void on_insert(size_t slot, const Key&) { m_referenced[slot] = 0; }
+	template <class KeyOf>
+	size_t evict(KeyOf);
+
+	static const char *name() { return "ClockPolicy"; }
+	template <class Out>
+	void save(Out& out) const { out.write(m_referenced), out.template write<uint64_t>(m_hand); }
+	template <class In>
+	bool load(In& in, size_t nslots);
+
+private:
+	std::vector<unsigned char> m_referenced;
+	size_t m_hand; // стрелка часов
+};
+
+/*  Случайная ячейка (xorshift64*, как в RandomCache). Последовательность
+ * ячеек задается seed (см. BasicCache с готовой политикой) */
+template <class Key, class Hash = std::hash<Key>, class Allocator = std::allocator<Key>>
+class RandomPolicy {
+public:
+	explicit RandomPolicy(size_t capacity, const Hash& = Hash(), const Allocator& = Allocator(),
+		uint64_t seed = 0) :
+		m_capacity(capacity), m_state(mix_hash(seed) | 1) {}
+
+	void on_hit(size_t) {}
+	void on_insert(size_t, const Key&) {}
+	template <class KeyOf>
+	size_t evict(KeyOf);
+
+	static const char *name() { return "RandomPolicy"; }
+	template <class Out>
+	void save(Out& out) const
+		{ out.template write<uint64_t>(m_capacity), out.template write<uint64_t>(m_state); }
+	template <class In>
+	bool load(In& in, size_t nslots);
+
+private:
+	size_t m_capacity;
+	uint64_t m_state; // не должно быть 0
+};
+
+/*  Кэш со статическим выбором политики вытеснения: путь попадания (поиск
+ * в хэш-таблице, on_hit() политики, счетчик) не содержит виртуальных
+ * вызовов и встраивается в вызывающий код
+ *  EvictionPolicy - LRUPolicy, TWOQPolicy, ClockPolicy, RandomPolicy или
+ * своя политика с тем же интерфейсом. Hash - хэш ключей, принимающий и
+ * key_t, и key_view_t<key_t> (см. TransparentHash), Allocator - аллокатор
+ * для страниц, индекса и структур политики
+ *  Как и BeladyCache, не наследуется от AbstractCache. Для выбора
+ * политики во время выполнения есть PolicyCache */
+template <class DataBase,
+	template <class...> class EvictionPolicy = LRUPolicy,
+	class Hash = TransparentHash<typename DataBase::key_t>,
+	class Allocator = std::allocator<typename DataBase::page_t>>
+class BasicCache : public CacheAnalitics {
+public:
+	using key_t = typename DataBase::key_t;
+	using page_t = typename DataBase::page_t;
+	using database_t = DataBase;
+	using policy_t = EvictionPolicy<key_t, Hash,
+		typename std::allocator_traits<Allocator>::template rebind_alloc<key_t>>;
+
+	BasicCache(const DataBase& db, size_t cache_sz,
+		const Hash& hash = Hash(), const Allocator& alloc = Allocator());
+	/*  С заранее созданной политикой (например, RandomPolicy с seed),
+	 * policy должна быть создана для capacity = cache_sz */
+	BasicCache(const DataBase& db, size_t cache_sz, policy_t policy,
+		const Hash& hash = Hash(), const Allocator& alloc = Allocator());
+
+	BasicCache(const BasicCache& other) = delete;
+	BasicCache& operator =(const BasicCache& other) = delete;
+
+	/*  Ссылка действительна до следующего запроса, как у AbstractCache
+	 *  Для строковых ключей key может быть std::string_view или
+	 * const char *: попадание не создает временный key_t */
+	const page_t& get_temp_page(key_view_t<key_t> key) const;
+	page_t get_page(key_view_t<key_t> key) const { return get_temp_page(key); }
+	bool contains(const key_t& key) const { return m_db.contains(key); }
+	bool is_cached(key_view_t<key_t> key) const { return m_index.count(key); }
+
+	size_t cache_sz() const { return m_cache_sz; }
+	const DataBase& db() const { return m_db; }
+
+	/*  Аналогично AbstractCache::set_eviction_listener() */
+	using eviction_listener_t = std::function<void(const key_t&, const page_t&)>;
+	void set_eviction_listener(eviction_listener_t listener)
+		{ m_eviction_listener = std::move(listener); }
+
+	/*  Аналогично LRUCache::save_snapshot(): страницы по ячейкам и
+	 * состояние политики (EvictionPolicy::save() и load()). Политика и
+	 * размер кэша тоже должны совпадать */
+	void save_snapshot(const std::string& path) const;
+	void load_snapshot(const std::string& path);
+
+private:
+	template <class T>
+	using Rebind = typename std::allocator_traits<Allocator>::template rebind_alloc<T>;
+	/*  Ключи индекса - представления ключей из m_keys: m_keys не
+	 * перераспределяется (емкость cache_sz выделена в конструкторе) */
+	using Index = std::unordered_map<key_view_t<key_t>, uint32_t, Hash, TransparentEqual<key_t>,
+		Rebind<std::pair<const key_view_t<key_t>, uint32_t>>>;
+
+	const DataBase& m_db;
+	size_t m_cache_sz;
+	mutable std::vector<key_t, Rebind<key_t>> m_keys; // ячейка -> ключ
+	mutable std::vector<page_t, Rebind<page_t>> m_pages; // ячейка -> страница
+	mutable Index m_index; // ключ -> ячейка
+	mutable policy_t m_policy;
+	eviction_listener_t m_eviction_listener;
+
+	const page_t& miss_page(key_view_t<key_t> key) const;
+	page_t timed_fetch(const key_t& key) const;
+};
+
+/*  Адаптер BasicCache к AbstractCache для выбора политики во время
+ * выполнения (через указатель на AbstractCache). Промахи загружают
+ * страницы через AbstractCache::load_page(), поэтому preload_page(),
+ * get_pages(), eviction_listener и metrics() работают как у остальных
+ * кэшей. Цена - виртуальный вызов на запрос */
+template <class DataBase,
+	template <class...> class EvictionPolicy = LRUPolicy,
+	class Hash = TransparentHash<typename DataBase::key_t>,
+	class Allocator = std::allocator<typename DataBase::page_t>>
+class PolicyCache : public AbstractCache<DataBase> {
+public:
+	using key_t = typename DataBase::key_t;
+	using page_t = typename DataBase::page_t;
+
+	PolicyCache(const DataBase& db, size_t cache_sz,
+		const Hash& hash = Hash(), const Allocator& alloc = Allocator());
+
+	const page_t& get_temp_page(const key_t& key) const override
+		{ return lookup(key); }
+	bool is_cached(const key_t& key) const override { return m_cache.is_cached(key); }
+
+	/* Аналогично LRUCache */
+	template <class K, class = std::enable_if_t<is_lookup_key_v<key_t, K>>>
+	const page_t& get_temp_page(const K& key) const
+		{ return lookup(key); }
+	template <class K, class = std::enable_if_t<is_lookup_key_v<key_t, K>>>
+	bool is_cached(const K& key) const
+		{ return m_cache.is_cached(key); }
+
+private:
+	/*  База данных для BasicCache: отдает страницы через load_page() */
+	class LoaderDB : public DB::AbstractIDB<key_t, page_t> {
+	public:
+		explicit LoaderDB(const PolicyCache& owner) : m_owner(owner) {}
+
+		bool contains(const key_t& key) const override { return m_owner.m_db.contains(key); }
+		page_t get_page(const key_t& key) const override { return m_owner.load_page(key); }
+
+	private:
+		const PolicyCache& m_owner;
+	};
+
+	LoaderDB m_loader;
+	BasicCache<LoaderDB, EvictionPolicy, Hash, Allocator> m_cache;
+
+	const page_t& lookup(key_view_t<key_t> key) const;
 };
 
 /* BeladyCache не наследуется от AbstractCache,
@@ -242,6 +1768,74 @@ protected:
 	mutable std::unordered_map<key_t, page_t> m_hashtbl;
 };
 
+/*  Оффлайн вариант BeladyCache. Вся последовательность запросов передается
+ * в конструктор, и для каждого запроса заранее (одним проходом с конца)
+ * вычисляется номер следующего запроса того же ключа
+ *  При промахе вытесняется страница с самым поздним следующим использованием,
+ * она берется из max-кучи, поэтому запрос стоит O(log cache_sz), а не
+ * O(cache_sz * log) как в BeladyCache
+ *  get_temp_page() и get_page() должны вызываться с ключами ровно в том
+ * порядке, в котором они были переданы в конструктор */
+template <class DataBase>
+class BeladySimulator :
+	public CacheAnalitics
+{
+public:
+	using key_t = typename DataBase::key_t;
+	using page_t = typename DataBase::page_t;
+	using database_t = DataBase;
+
+	template <class BidirIt>
+	BeladySimulator(const DataBase& db, size_t cache_sz,
+		BidirIt queries_from, BidirIt queries_to);
+
+	BeladySimulator(const BeladySimulator& other) = delete;
+	BeladySimulator& operator =(const BeladySimulator& other) = delete;
+
+	bool contains(const key_t& key) const { return m_db.contains(key); }
+	page_t get_page(const key_t& key) const { return get_temp_page(key); }
+
+	/*  Warning: Ссылка становится недействительной при
+	 * следующем обращении к get_page() или get_temp_page() ! */
+	const page_t& get_temp_page(const key_t& key) const;
+
+	bool is_cached(const key_t& key) const { return m_hashtbl.count(key); }
+
+	size_t cache_sz() const { return m_cache_sz; }
+	const DataBase& db() const { return m_db; }
+
+private:
+	const DataBase& m_db;
+	size_t m_cache_sz;
+
+	/*  m_next_use[i] - номер следующего запроса с тем же ключом, что и i-й,
+	 * или m_next_use.size(), если ключ больше не запрашивается */
+	std::vector<size_t> m_next_use;
+	mutable size_t m_pos; // номер текущего запроса
+
+	struct HashtblEntry {
+		page_t page;
+		size_t next_use;
+	};
+	mutable std::unordered_map<key_t, HashtblEntry> m_hashtbl;
+
+	/*  Куча по next_use. При попадании next_use страницы меняется, и в кучу
+	 * добавляется новая запись, а старая остается устаревшей. Устаревшие
+	 * записи пропускаются при вытеснении, а когда их становится больше, чем
+	 * актуальных, куча перестраивается */
+	struct HeapEntry {
+		size_t next_use;
+		key_t key;
+
+		bool operator <(const HeapEntry& other) const
+			{ return next_use < other.next_use; }
+	};
+	mutable std::vector<HeapEntry> m_heap;
+
+	void push_heap(const key_t& key, size_t next_use) const;
+	void evict() const;
+};
+
 } // Cache namespace end
 
 #include "cache_realization.h"
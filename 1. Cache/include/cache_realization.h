@@ -3,6 +3,12 @@
 
 #include <cassert>
 #include <set>
+#include <algorithm>
+#include <utility>
+#include <type_traits>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 
 /*  Чтобы не захламлять функции #define-ами и #endif-ами, печать вынесена
  * в отдельные макросы */
@@ -28,133 +34,2926 @@
 
 namespace Cache {
 
+inline CacheMetrics CacheMetrics::operator -(const CacheMetrics& earlier) const
+{
+	CacheMetrics delta = *this;
+	delta.nhits -= earlier.nhits;
+	delta.nmisses -= earlier.nmisses;
+	delta.nevictions -= earlier.nevictions;
+	delta.ninserted_bytes -= earlier.ninserted_bytes;
+	delta.nfetches -= earlier.nfetches;
+	delta.nfetch_samples -= earlier.nfetch_samples;
+	delta.fetch_ns -= earlier.fetch_ns;
+	delta.nage_samples -= earlier.nage_samples;
+	delta.eviction_age_ns -= earlier.eviction_age_ns;
+	return delta;
+}
+
+inline CacheMetrics& CacheMetrics::operator +=(const CacheMetrics& other)
+{
+	nhits += other.nhits;
+	nmisses += other.nmisses;
+	nevictions += other.nevictions;
+	ninserted_bytes += other.ninserted_bytes;
+	nfetches += other.nfetches;
+	nfetch_samples += other.nfetch_samples;
+	fetch_ns += other.fetch_ns;
+	nage_samples += other.nage_samples;
+	eviction_age_ns += other.eviction_age_ns;
+	return *this;
+}
+
+constexpr unsigned CacheAnalitics::FETCH_SAMPLING;
+
+inline CacheMetrics CacheAnalitics::metrics() const
+{
+	CacheMetrics res;
+	res.nhits = m_nhits.get();
+	res.nmisses = m_nmisses.get();
+	res.nevictions = m_nevictions.load(std::memory_order_relaxed);
+	res.ninserted_bytes = m_ninserted_bytes.load(std::memory_order_relaxed);
+	res.nfetches = m_nfetches.load(std::memory_order_relaxed);
+	res.nfetch_samples = m_nfetch_samples.load(std::memory_order_relaxed);
+	res.fetch_ns = m_fetch_ns.load(std::memory_order_relaxed);
+	res.nage_samples = m_nage_samples.load(std::memory_order_relaxed);
+	res.eviction_age_ns = m_eviction_age_ns.load(std::memory_order_relaxed);
+	return res;
+}
+
+template <class DataBase>
+template <class InputIt, class OutputIt>
+OutputIt AbstractCache<DataBase>::get_pages(InputIt first, InputIt last, OutputIt out) const
+{
+	for (auto& page : get_pages(std::vector<key_t>(first, last)))
+		*out++ = std::move(page);
+	return out;
+}
+
+template <class DataBase>
+std::vector<typename AbstractCache<DataBase>::page_t>
+AbstractCache<DataBase>::get_pages(const std::vector<key_t>& keys) const
+{
+	std::vector<key_t> uncached = uncached_keys(keys);
+	BatchPages batch(*this, keys, uncached,
+		(uncached.empty()) ? std::vector<page_t>() : fetch_pages(uncached));
+
+	std::vector<page_t> pages;
+	pages.reserve(keys.size());
+	for (auto& key : keys) {
+		if (std::optional<page_t> page = batch.take(key, !is_cached(key))) {
+			preload_page(key, std::move(*page));
+			pages.push_back(get_temp_page(key));
+			/*  Кэш-обертка загружает страницы через вложенный кэш и не
+			 * забирает свою */
+			discard_preloaded(key);
+		} else
+			pages.push_back(get_temp_page(key));
+	}
+	return pages;
+}
+
+template <class DataBase>
+AbstractCache<DataBase>::BatchPages::BatchPages(const AbstractCache& cache,
+	const std::vector<key_t>& keys, const std::vector<key_t>& loaded_keys,
+	std::vector<page_t> pages) :
+	m_cache(cache)
+{
+	assert(loaded_keys.size() == pages.size());
+	for (auto& key : keys)
+		++m_pages[key].nrequests_left;
+	for (size_t i = 0; i < loaded_keys.size(); ++i)
+		m_pages[loaded_keys[i]].page = std::move(pages[i]);
+
+	std::thread::id nobody;
+	m_registered = m_cache.m_batch_owner.compare_exchange_strong(nobody,
+		std::this_thread::get_id(), std::memory_order_acquire);
+	if (m_registered)
+		m_cache.m_batch = this;
+}
+
+template <class DataBase>
+AbstractCache<DataBase>::BatchPages::~BatchPages()
+{
+	if (m_registered) {
+		m_cache.m_batch = nullptr;
+		m_cache.m_batch_owner.store(std::thread::id(), std::memory_order_release);
+	}
+}
+
+template <class DataBase>
+std::optional<typename AbstractCache<DataBase>::page_t>
+AbstractCache<DataBase>::BatchPages::take(const key_t& key, bool needed)
+{
+	auto search = m_pages.find(key);
+	assert(search != m_pages.end() && search->second.nrequests_left > 0);
+
+	std::optional<page_t> page;
+	if (--search->second.nrequests_left == 0) {
+		if (needed)
+			page = std::move(search->second.page);
+		m_pages.erase(search);
+	} else if (needed)
+		page = search->second.page;
+	return page;
+}
+
+template <class DataBase>
+void AbstractCache<DataBase>::BatchPages::evicted(const key_t& key, const page_t& page)
+{
+	auto search = m_pages.find(key);
+	if (search != m_pages.end() && !search->second.page)
+		search->second.page = page;
+}
+
+template <class DataBase>
+constexpr size_t AbstractCache<DataBase>::MAX_PRELOADED;
+
+template <class DataBase>
+void AbstractCache<DataBase>::preload_page(const key_t& key, page_t page) const
+{
+	if (is_cached(key))
+		return;
+	auto search = m_preloaded.find(key);
+	if (search != m_preloaded.end()) {
+		search->second.page = std::move(page);
+		return;
+	}
+	if (m_preloaded.size() == MAX_PRELOADED) {
+		m_preloaded.erase(m_preload_order.front());
+		m_preload_order.pop_front();
+	}
+	m_preload_order.push_back(key);
+	m_preloaded.emplace(key, Preloaded{std::move(page), std::prev(m_preload_order.end())});
+}
+
+template <class DataBase>
+typename AbstractCache<DataBase>::page_t
+AbstractCache<DataBase>::load_page(const key_t& key) const
+{
+	if (!m_preloaded.empty()) {
+		auto search = m_preloaded.find(key);
+		if (search != m_preloaded.end()) {
+			page_t page = std::move(search->second.page);
+			m_preload_order.erase(search->second.order);
+			m_preloaded.erase(search);
+			inserted(key, page);
+			return page;
+		}
+	}
+	page_t page = fetch_page(key);
+	inserted(key, page);
+	return page;
+}
+
+template <class DataBase>
+void AbstractCache<DataBase>::discard_preloaded(const key_t& key) const
+{
+	if (m_preloaded.empty())
+		return;
+	auto search = m_preloaded.find(key);
+	if (search != m_preloaded.end()) {
+		m_preload_order.erase(search->second.order);
+		m_preloaded.erase(search);
+	}
+}
+
+template <class DataBase>
+typename AbstractCache<DataBase>::page_t
+AbstractCache<DataBase>::fetch_page(const key_t& key) const
+{
+	if (!this->count_fetch())
+		return m_db.get_page(key);
+	uint64_t start = now_ns();
+	page_t page = m_db.get_page(key);
+	this->count_fetch_time(now_ns() - start);
+	return page;
+}
+
+template <class DataBase>
+std::vector<typename AbstractCache<DataBase>::page_t>
+AbstractCache<DataBase>::fetch_pages(const std::vector<key_t>& keys) const
+{
+	if (!this->count_fetch())
+		return m_db.get_pages(keys);
+	uint64_t start = now_ns();
+	std::vector<page_t> pages = m_db.get_pages(keys);
+	this->count_fetch_time(now_ns() - start);
+	return pages;
+}
+
+template <class DataBase>
+void AbstractCache<DataBase>::inserted(const key_t& key, const page_t& page) const
+{
+	this->count_inserted_bytes(page_bytes(page));
+	if (m_own_load_ns || !age_sampled(key))
+		return;
+
+	std::lock_guard<std::mutex> lock(m_age_mutex);
+	/*  Ключи, удаленные из кэша не вытеснением (например, не допущенные в
+	 * него), остаются в m_load_ns. Чтобы он не рос бесконечно, при
+	 * переполнении он очищается - теряются лишь несколько замеров */
+	if (m_load_ns.size() >= m_cache_sz / (AGE_SAMPLING / 4) + 1024)
+		m_load_ns.clear();
+	m_load_ns[key] = now_ns();
+}
+
+template <class DataBase>
+void AbstractCache<DataBase>::evicted(const key_t& key, const page_t& page) const
+{
+	this->count_eviction();
+	if (age_sampled(key)) {
+		std::unique_lock<std::mutex> lock(m_age_mutex);
+		auto search = m_load_ns.find(key);
+		if (search != m_load_ns.end()) {
+			uint64_t load_ns = search->second;
+			m_load_ns.erase(search);
+			lock.unlock();
+			this->count_eviction_age(now_ns() - load_ns);
+		}
+	}
+	notify_evicted(key, page);
+}
+
+template <class DataBase>
+void AbstractCache<DataBase>::evicted(const key_t& key, const page_t& page, uint64_t load_ns) const
+{
+	assert(m_own_load_ns);
+	this->count_eviction();
+	if (load_ns)
+		this->count_eviction_age(now_ns() - load_ns);
+	notify_evicted(key, page);
+}
+
+template <class DataBase>
+template <class Out>
+void AbstractCache<DataBase>::write_snapshot_header(Out& out, const char *policy) const
+{
+	out.write(std::string(policy));
+	out.template write<uint64_t>(m_cache_sz);
+	out.template write<uint64_t>(this->nhits());
+	out.template write<uint64_t>(this->nlookups());
+}
+
+template <class DataBase>
+std::pair<uint64_t, uint64_t>
+AbstractCache<DataBase>::read_snapshot_header(BufferReader& in, const char *policy) const
+{
+	std::string snapshot_policy = in.read<std::string>();
+	if (snapshot_policy != policy)
+		throw SnapshotError(in.path(), std::string(policy) + ": '" + in.path()
+			+ "' is a snapshot of " + snapshot_policy);
+	uint64_t cache_sz = in.read<uint64_t>();
+	if (cache_sz != m_cache_sz)
+		throw SnapshotError(in.path(), std::string(policy) + ": '" + in.path()
+			+ "' is a snapshot of a cache of size " + std::to_string(cache_sz));
+	uint64_t nhits = in.read<uint64_t>();
+	uint64_t nlookups = in.read<uint64_t>();
+	if (nhits > nlookups)
+		throw SnapshotError(in.path(), std::string(policy) + ": '" + in.path() + "' is corrupted");
+	return {nhits, nlookups};
+}
+
+
+template <class DataBase, class Weigher>
+RandomCache<DataBase, Weigher>::RandomCache(const DataBase& db, size_t cache_sz,
+	double max_page_fraction, const Weigher& weigher, uint64_t seed) :
+	AbstractCache<DataBase>(db, cache_sz),
+	m_weigher(weigher),
+	m_max_page_weight(std::max<size_t>(max_page_fraction * cache_sz, 1)),
+	m_random_state(mix_hash(seed) | 1)
+{
+	assert(cache_sz > 0);
+	assert(max_page_fraction > 0 && max_page_fraction <= 1);
+	if (std::is_same<Weigher, UnitWeigher>::value) {
+		m_entries.reserve(cache_sz);
+		m_hashtbl.reserve(cache_sz);
+	}
+}
+
+template <class DataBase, class Weigher>
+const typename RandomCache<DataBase, Weigher>::page_t&
+RandomCache<DataBase, Weigher>::get_temp_page(const key_t& key) const
+{
+	assert(m_entries.size() == m_hashtbl.size());
+	assert(this->bytes_cached() <= this->m_cache_sz);
+
+	_CACHE_PRINTMSG_REQUESTED_PAGE(RandomCache, key);
+
+	auto it = m_hashtbl.find(key);
+	if (it != m_hashtbl.end()) {
+		_CACHE_PRINTMSG_FOUND_IN_CACHE(RandomCache, key);
+
+		this->hit();
+		return m_entries[it->second].page;
+	}
+
+	this->miss();
+	page_t page = this->load_page(key);
+	size_t weight = m_weigher(key, page);
+	if (weight > m_max_page_weight)
+		return m_rejected_page = std::move(page);
+
+	if (this->bytes_cached() + weight > this->m_cache_sz) {
+		while (this->bytes_cached() + weight > this->m_cache_sz)
+			evict_random();
+	} else {
+		_CACHE_PRINTMSG_VACANT_SPACE(RandomCache);
+	}
+
+	m_entries.push_back({key, std::move(page)});
+	m_hashtbl[key] = m_entries.size() - 1;
+	this->add_bytes(weight);
+	return m_entries.back().page;
+}
+
+/*  Удаляет случайную страницу, перемещая на ее место последнюю,
+ * чтобы массив оставался плотным */
+template <class DataBase, class Weigher>
+void RandomCache<DataBase, Weigher>::evict_random() const
+{
+	assert(!m_entries.empty());
+
+	size_t victim = random_index(m_entries.size());
+	_CACHE_PRINTMSG_DELETING_PAGE(RandomCache, m_entries[victim].key);
+	this->evicted(m_entries[victim].key, m_entries[victim].page);
+
+	this->remove_bytes(m_weigher(m_entries[victim].key, m_entries[victim].page));
+	m_hashtbl.erase(m_entries[victim].key);
+	if (victim != m_entries.size() - 1) {
+		m_entries[victim] = std::move(m_entries.back());
+		m_hashtbl.find(m_entries[victim].key)->second = victim;
+	}
+	m_entries.pop_back();
+}
+
+/*  Случайное число от 0 до n - 1. Генератор xorshift64* со своим
+ * состоянием в каждом кэше (rand() медленный, общий для всех потоков и
+ * не зависит от seed кэша). Кэш, как и его остальное mutable состояние,
+ * используется одним потоком за раз, поэтому у каждого потока,
+ * работающего со своим кэшем, своя последовательность */
+template <class DataBase, class Weigher>
+size_t RandomCache<DataBase, Weigher>::random_index(size_t n) const
+{
+	assert(n > 0 && n <= UINT32_MAX);
+	assert(m_random_state != 0);
+
+	m_random_state ^= m_random_state >> 12;
+	m_random_state ^= m_random_state << 25;
+	m_random_state ^= m_random_state >> 27;
+	uint64_t rnd = (m_random_state * 0x2545F4914F6CDD1DULL) >> 32;
+	return (rnd * n) >> 32; // отображение [0, 2^32) -> [0, n) без деления
+}
+
+
+template <class DataBase, class Weigher>
+LRUCache<DataBase, Weigher>::LRUCache(const DataBase& db, size_t cache_sz,
+	double max_page_fraction, const Weigher& weigher) :
+	AbstractCache<DataBase>(db, cache_sz),
+	m_ndirty(0),
+	m_weigher(weigher),
+	m_max_page_weight(std::max<size_t>(max_page_fraction * cache_sz, 1))
+{
+	assert(cache_sz > 0);
+	assert(max_page_fraction > 0 && max_page_fraction <= 1);
+	if (std::is_same<Weigher, UnitWeigher>::value)
+		m_hashtbl.reserve(cache_sz);
+}
+
+template <class DataBase, class Weigher>
+const typename LRUCache<DataBase, Weigher>::page_t&
+LRUCache<DataBase, Weigher>::lookup(key_view_t<key_t> key) const
+{
+	assert(m_lst.size() == m_hashtbl.size());
+	assert(this->bytes_cached() <= this->m_cache_sz);
+
+	_CACHE_PRINTMSG_REQUESTED_PAGE(LRUCache, key);
+
+	auto search = m_hashtbl.find(key);
+	if (search != m_hashtbl.end()) { // страница найдена в кэше
+		_CACHE_PRINTMSG_FOUND_IN_CACHE(LRUCache, key);
+		this->hit();
+
+		auto listit = search->second;
+		if (listit != m_lst.begin())
+			m_lst.splice(m_lst.cbegin(), m_lst, listit);
+		return listit->page;
+	}
+
+	this->miss();
+	key_t owned_key(key);
+	page_t page = this->load_page(owned_key);
+	size_t weight = m_weigher(owned_key, page);
+	if (weight > m_max_page_weight) // слишком тяжелая страница, не кэшируем
+		return m_rejected_page = std::move(page);
+
+	if (this->bytes_cached() + weight > this->m_cache_sz) {
+		while (this->bytes_cached() + weight > this->m_cache_sz) // вытеснение LRU страниц
+			evict_lru();
+	} else {
+		_CACHE_PRINTMSG_VACANT_SPACE(LRUCache);
+	}
+
+	m_lst.push_front({std::move(owned_key), std::move(page)});
+	m_hashtbl[m_lst.front().key] = m_lst.begin();
+	this->add_bytes(weight);
+	return m_lst.front().page;
+}
+
+template <class DataBase, class Weigher>
+void LRUCache<DataBase, Weigher>::evict_lru() const
+{
+	assert(!m_lst.empty());
+	_CACHE_PRINTMSG_DELETING_PAGE(LRUCache, m_lst.back().key);
+	this->evicted(m_lst.back().key, m_lst.back().page);
+
+	if (m_lst.back().dirty)
+		--m_ndirty;
+	this->remove_bytes(m_weigher(m_lst.back().key, m_lst.back().page));
+	m_hashtbl.erase(m_lst.back().key);
+	m_lst.pop_back();
+}
+
+/*  Заменяемая страница на время вытеснения убирается из m_lst, чтобы не
+ * вытеснить ее саму */
+template <class DataBase, class Weigher>
+std::optional<typename LRUCache<DataBase, Weigher>::page_t>
+LRUCache<DataBase, Weigher>::put_page(const key_t& key, page_t page, bool dirty) const
+{
+	size_t weight = m_weigher(key, page);
+	auto search = m_hashtbl.find(key);
+	if (search == m_hashtbl.end()) {
+		if (weight > m_max_page_weight)
+			return std::nullopt;
+		this->inserted(key, page);
+		while (this->bytes_cached() + weight > this->m_cache_sz)
+			evict_lru();
+		m_lst.push_front({key, std::move(page), dirty});
+		m_hashtbl[m_lst.front().key] = m_lst.begin();
+		m_ndirty += dirty;
+		this->add_bytes(weight);
+		return std::nullopt;
+	}
+
+	auto listit = search->second;
+	if (weight > m_max_page_weight) { // слишком тяжелая страница, вытесняем старую
+		m_lst.splice(m_lst.cend(), m_lst, listit);
+		evict_lru();
+		return std::nullopt;
+	}
+
+	List held;
+	held.splice(held.cbegin(), m_lst, listit);
+	this->remove_bytes(m_weigher(listit->key, listit->page));
+	m_ndirty -= listit->dirty;
+	while (this->bytes_cached() + weight > this->m_cache_sz)
+		evict_lru();
+
+	std::optional<page_t> old(std::move(listit->page));
+	listit->page = std::move(page);
+	listit->dirty = dirty;
+	m_ndirty += dirty;
+	m_lst.splice(m_lst.cbegin(), held, listit);
+	this->add_bytes(weight);
+	return old;
+}
+
+template <class DataBase, class Weigher>
+bool LRUCache<DataBase, Weigher>::is_dirty(const key_t& key) const
+{
+	auto search = m_hashtbl.find(key);
+	return search != m_hashtbl.end() && search->second->dirty;
+}
+
+template <class DataBase, class Weigher>
+std::vector<std::pair<typename LRUCache<DataBase, Weigher>::key_t,
+	typename LRUCache<DataBase, Weigher>::page_t>>
+LRUCache<DataBase, Weigher>::dirty_pages() const
+{
+	std::vector<KeyAndPage> pages;
+	pages.reserve(m_ndirty);
+	for (auto& entry : m_lst)
+		if (entry.dirty)
+			pages.emplace_back(entry.key, entry.page);
+	return pages;
+}
+
+template <class DataBase, class Weigher>
+void LRUCache<DataBase, Weigher>::mark_clean() const
+{
+	for (auto& entry : m_lst)
+		entry.dirty = false;
+	m_ndirty = 0;
+}
+
+template <class DataBase, class Weigher>
+void LRUCache<DataBase, Weigher>::save_snapshot(const std::string& path) const
+{
+	SnapshotWriter out(path);
+	write_snapshot(out);
+	out.commit();
+}
+
+template <class DataBase, class Weigher>
+void LRUCache<DataBase, Weigher>::load_snapshot(const std::string& path)
+{
+	SnapshotReader in(path);
+	read_snapshot(in);
+}
+
+template <class DataBase, class Weigher>
+template <class Out>
+void LRUCache<DataBase, Weigher>::write_snapshot(Out& out) const
+{
+	this->write_snapshot_header(out, "LRUCache");
+	write_pages(out, m_lst);
+}
+
+template <class DataBase, class Weigher>
+void LRUCache<DataBase, Weigher>::read_snapshot(BufferReader& in)
+{
+	const std::string& path = in.path();
+	std::pair<uint64_t, uint64_t> counters = this->read_snapshot_header(in, "LRUCache");
+
+	/*  Снимок читается в новые список и хэш-таблицу, чтобы при ошибке
+	 * кэш остался прежним */
+	List lst;
+	Hashtable hashtbl;
+	if (std::is_same<Weigher, UnitWeigher>::value)
+		hashtbl.reserve(this->m_cache_sz);
+	size_t weight = 0;
+	read_pages<key_t, page_t>(in, [&](key_t key, page_t page) {
+		weight += m_weigher(key, page);
+		lst.push_back({std::move(key), std::move(page)});
+		hashtbl[lst.back().key] = std::prev(lst.end());
+	});
+	if (weight > this->m_cache_sz || hashtbl.size() != lst.size() || !in.at_end())
+		throw SnapshotError(path, "LRUCache: snapshot '" + path + "' is corrupted");
+
+	m_lst.swap(lst);
+	m_hashtbl.swap(hashtbl);
+	m_ndirty = 0;
+	this->remove_bytes(this->bytes_cached());
+	this->add_bytes(weight);
+	this->restore_counters(counters.first, counters.second);
+}
+
+
+template <class DataBase, class Weigher>
+constexpr typename FlatLRUCache<DataBase, Weigher>::index_t FlatLRUCache<DataBase, Weigher>::NIL;
+
+template <class DataBase, class Weigher>
+constexpr size_t FlatLRUCache<DataBase, Weigher>::GROUP_SZ;
+
+template <class DataBase, class Weigher>
+FlatLRUCache<DataBase, Weigher>::FlatLRUCache(const DataBase& db, size_t cache_sz,
+	double max_page_fraction, const Weigher& weigher, size_t max_pages) :
+	AbstractCache<DataBase>(db, cache_sz),
+	m_entries((max_pages) ? std::min(max_pages, cache_sz) : cache_sz),
+	m_nentries(0), m_nlive(0), m_free(NIL), m_head(NIL), m_tail(NIL),
+	m_weigher(weigher),
+	m_max_page_weight(std::max<size_t>(max_page_fraction * cache_sz, 1)),
+	m_ndeleted(0)
+{
+	assert(cache_sz > 0);
+	assert(m_entries.size() < NIL);
+	assert(max_page_fraction > 0 && max_page_fraction <= 1);
+	this->keep_load_ns();
+
+	/*  Заполненность таблицы не больше 1/2, поэтому цепочки проб
+	 * почти всегда заканчиваются в первой же группе */
+	size_t capacity = GROUP_SZ;
+	while (capacity < 2 * m_entries.size())
+		capacity <<= 1;
+	m_ngroups = capacity / GROUP_SZ;
+	m_ctrl.assign(capacity, CTRL_EMPTY);
+	m_slots.assign(capacity, NIL);
+}
+
+template <class DataBase, class Weigher>
+const typename FlatLRUCache<DataBase, Weigher>::page_t&
+FlatLRUCache<DataBase, Weigher>::lookup(key_view_t<key_t> key) const
+{
+	_CACHE_PRINTMSG_REQUESTED_PAGE(FlatLRUCache, key);
+
+	uint64_t h = hash(key);
+	index_t slot = find_slot(key, h);
+	if (slot != NIL) { // страница найдена в кэше
+		_CACHE_PRINTMSG_FOUND_IN_CACHE(FlatLRUCache, key);
+		this->hit();
+
+		index_t entry = m_slots[slot];
+		if (entry != m_head) {
+			unlink(entry);
+			push_front(entry);
+		}
+		return m_entries[entry].page;
+	}
+
+	this->miss();
+	/*  Сначала загружаем страницу, чтобы исключение из базы данных
+	 * не оставило кэш в несогласованном состоянии */
+	key_t owned_key(key);
+	page_t page = this->load_page(owned_key);
+	size_t weight = m_weigher(owned_key, page);
+	if (weight > m_max_page_weight) // слишком тяжелая страница, не кэшируем
+		return m_rejected_page = std::move(page);
+
+	if (m_nlive == m_entries.size() || this->bytes_cached() + weight > this->m_cache_sz) {
+		while (m_nlive == m_entries.size() || this->bytes_cached() + weight > this->m_cache_sz)
+			evict_lru();
+	} else {
+		_CACHE_PRINTMSG_VACANT_SPACE(FlatLRUCache);
+	}
+	return place(std::move(owned_key), std::move(page), weight, h,
+		this->sampled_load_ns(owned_key));
+}
+
+template <class DataBase, class Weigher>
+const typename FlatLRUCache<DataBase, Weigher>::page_t&
+FlatLRUCache<DataBase, Weigher>::place(key_t key, page_t page, size_t weight, uint64_t h,
+	uint64_t load_ns) const
+{
+	index_t entry;
+	if (m_free != NIL) {
+		entry = m_free;
+		m_free = m_entries[entry].next;
+	} else {
+		entry = m_nentries++;
+	}
+	++m_nlive;
+
+	Entry& e = m_entries[entry];
+	e.key = std::move(key);
+	e.page = std::move(page);
+	e.load_ns = load_ns;
+	push_front(entry);
+	insert_slot(entry, h);
+	this->add_bytes(weight);
+
+	/*  Удаленные ячейки удлиняют цепочки проб. Когда их становится
+	 * слишком много, перестраиваем индекс на месте */
+	if (m_nlive + m_ndeleted > m_ctrl.size() / 8 * 7)
+		rebuild_index();
+	return e.page;
+}
+
+/*  Вытесняет LRU страницу. Ее элемент массива попадает в список
+ * свободных, страница в нем освобождается сразу */
+template <class DataBase, class Weigher>
+void FlatLRUCache<DataBase, Weigher>::evict_lru() const
+{
+	assert(m_tail != NIL);
+	index_t entry = m_tail;
+	Entry& e = m_entries[entry];
+	_CACHE_PRINTMSG_DELETING_PAGE(FlatLRUCache, e.key);
+	this->evicted(e.key, e.page, e.load_ns);
+
+	this->remove_bytes(m_weigher(e.key, e.page));
+	erase_slot(e.slot);
+	unlink(entry);
+	e.page = page_t();
+	e.slot = NIL;
+	e.next = m_free;
+	m_free = entry;
+	--m_nlive;
+}
+
+template <class DataBase, class Weigher>
+void FlatLRUCache<DataBase, Weigher>::save_snapshot(const std::string& path) const
+{
+	SnapshotWriter out(path);
+	this->write_snapshot_header(out, "FlatLRUCache");
+	out.write<uint64_t>(m_nlive);
+	for (index_t entry = m_head; entry != NIL; entry = m_entries[entry].next) {
+		out.write(m_entries[entry].key);
+		out.write(m_entries[entry].page);
+	}
+	out.commit();
+}
+
+/*  Страницы сначала читаются целиком и проверяются, чтобы при ошибке
+ * кэш остался прежним, затем добавляются от LRU к MRU */
+template <class DataBase, class Weigher>
+void FlatLRUCache<DataBase, Weigher>::load_snapshot(const std::string& path)
+{
+	SnapshotReader in(path);
+	std::pair<uint64_t, uint64_t> counters = this->read_snapshot_header(in, "FlatLRUCache");
+
+	std::vector<std::pair<key_t, page_t>> pages;
+	size_t weight = 0;
+	read_pages<key_t, page_t>(in, [&](key_t key, page_t page) {
+		weight += m_weigher(key, page);
+		pages.emplace_back(std::move(key), std::move(page));
+	});
+	std::unordered_set<key_view_t<key_t>, TransparentHash<key_t>, TransparentEqual<key_t>> keys;
+	for (auto& key_and_page : pages)
+		keys.insert(key_and_page.first);
+	if (pages.size() > m_entries.size() || keys.size() != pages.size()
+		|| weight > this->m_cache_sz || !in.at_end())
+		throw SnapshotError(path, "FlatLRUCache: snapshot '" + path + "' is corrupted");
+
+	std::fill(m_entries.begin(), m_entries.end(), Entry());
+	m_nentries = m_nlive = 0;
+	m_free = m_head = m_tail = NIL;
+	std::fill(m_ctrl.begin(), m_ctrl.end(), CTRL_EMPTY);
+	std::fill(m_slots.begin(), m_slots.end(), NIL);
+	m_ndeleted = 0;
+	this->remove_bytes(this->bytes_cached());
+	for (auto it = pages.rbegin(); it != pages.rend(); ++it) {
+		size_t page_weight = m_weigher(it->first, it->second);
+		uint64_t h = hash(it->first);
+		place(std::move(it->first), std::move(it->second), page_weight, h, 0); // возраст неизвестен
+	}
+	this->restore_counters(counters.first, counters.second);
+}
+
+template <class DataBase, class Weigher>
+uint64_t FlatLRUCache<DataBase, Weigher>::hash(key_view_t<key_t> key)
+	{ return mix_hash(TransparentHash<key_t>()(key)); }
+
+/* Битовая маска байтов группы, равных value */
+template <class DataBase, class Weigher>
+uint32_t FlatLRUCache<DataBase, Weigher>::match_byte(const int8_t *group, int8_t value)
+{
+#ifdef __SSE2__
+	__m128i ctrl = _mm_loadu_si128(reinterpret_cast<const __m128i *>(group));
+	return _mm_movemask_epi8(_mm_cmpeq_epi8(_mm_set1_epi8(value), ctrl));
+#else
+	uint32_t mask = 0;
+	for (size_t i = 0; i < GROUP_SZ; ++i)
+		mask |= static_cast<uint32_t>(group[i] == value) << i;
+	return mask;
+#endif
+}
+
+/* Битовая маска пустых и удаленных байтов группы */
+template <class DataBase, class Weigher>
+uint32_t FlatLRUCache<DataBase, Weigher>::match_free(const int8_t *group)
+{
+#ifdef __SSE2__
+	__m128i ctrl = _mm_loadu_si128(reinterpret_cast<const __m128i *>(group));
+	return _mm_movemask_epi8(_mm_cmpgt_epi8(_mm_set1_epi8(-1), ctrl));
+#else
+	uint32_t mask = 0;
+	for (size_t i = 0; i < GROUP_SZ; ++i)
+		mask |= static_cast<uint32_t>(group[i] < -1) << i;
+	return mask;
+#endif
+}
+
+/*  Возвращает ячейку хэш-таблицы с ключом key или NIL
+ *  Группы перебираются с треугольным шагом, что при числе групп,
+ * равном степени двойки, обходит их все */
+template <class DataBase, class Weigher>
+typename FlatLRUCache<DataBase, Weigher>::index_t
+FlatLRUCache<DataBase, Weigher>::find_slot(key_view_t<key_t> key, uint64_t h) const
+{
+	size_t group_mask = m_ngroups - 1;
+	size_t group = (h >> 7) & group_mask;
+	int8_t h2 = h & 0x7F;
+
+	for (size_t step = 1; ; ++step) {
+		const int8_t *ctrl = &m_ctrl[group * GROUP_SZ];
+		for (uint32_t match = match_byte(ctrl, h2); match; match &= match - 1) {
+			index_t slot = group * GROUP_SZ + __builtin_ctz(match);
+			if (m_entries[m_slots[slot]].key == key)
+				return slot;
+		}
+		if (match_byte(ctrl, CTRL_EMPTY))
+			return NIL;
+		group = (group + step) & group_mask;
+	}
+}
+
+template <class DataBase, class Weigher>
+void FlatLRUCache<DataBase, Weigher>::insert_slot(index_t entry, uint64_t h) const
+{
+	size_t group_mask = m_ngroups - 1;
+	size_t group = (h >> 7) & group_mask;
+
+	for (size_t step = 1; ; ++step) {
+		if (uint32_t free = match_free(&m_ctrl[group * GROUP_SZ])) {
+			index_t slot = group * GROUP_SZ + __builtin_ctz(free);
+			if (m_ctrl[slot] == CTRL_DELETED)
+				--m_ndeleted;
+			m_ctrl[slot] = h & 0x7F;
+			m_slots[slot] = entry;
+			m_entries[entry].slot = slot;
+			return;
+		}
+		group = (group + step) & group_mask;
+	}
+}
+
+/*  Если в группе есть пустая ячейка, то группа ни разу не заполнялась
+ * целиком, и ни одна цепочка проб не проходит дальше нее. Тогда ячейку
+ * можно сразу пометить пустой, иначе нужна пометка "удалено" */
+template <class DataBase, class Weigher>
+void FlatLRUCache<DataBase, Weigher>::erase_slot(index_t slot) const
+{
+	if (match_byte(&m_ctrl[slot / GROUP_SZ * GROUP_SZ], CTRL_EMPTY))
+		m_ctrl[slot] = CTRL_EMPTY;
+	else {
+		m_ctrl[slot] = CTRL_DELETED;
+		++m_ndeleted;
+	}
+}
+
+template <class DataBase, class Weigher>
+void FlatLRUCache<DataBase, Weigher>::rebuild_index() const
+{
+	std::fill(m_ctrl.begin(), m_ctrl.end(), CTRL_EMPTY);
+	m_ndeleted = 0;
+	for (index_t entry = 0; entry < m_nentries; ++entry)
+		if (m_entries[entry].slot != NIL)
+			insert_slot(entry, hash(m_entries[entry].key));
+}
+
+template <class DataBase, class Weigher>
+void FlatLRUCache<DataBase, Weigher>::unlink(index_t entry) const
+{
+	Entry& e = m_entries[entry];
+	if (e.prev != NIL)
+		m_entries[e.prev].next = e.next;
+	else
+		m_head = e.next;
+	if (e.next != NIL)
+		m_entries[e.next].prev = e.prev;
+	else
+		m_tail = e.prev;
+}
+
+template <class DataBase, class Weigher>
+void FlatLRUCache<DataBase, Weigher>::push_front(index_t entry) const
+{
+	Entry& e = m_entries[entry];
+	e.prev = NIL;
+	e.next = m_head;
+	if (m_head != NIL)
+		m_entries[m_head].prev = entry;
+	else
+		m_tail = entry;
+	m_head = entry;
+}
+
+
+template <class DataBase, class Weigher>
+TWOQCache<DataBase, Weigher>::TWOQCache(const DataBase& db, size_t cache_sz,
+	double kin_ratio, double kout_ratio, double max_page_fraction, const Weigher& weigher) :
+	AbstractCache<DataBase>(db, cache_sz),
+	m_a1in_weight(0), m_a1out_weight(0),
+	m_kin(std::max<size_t>(kin_ratio * cache_sz, 1)),
+	m_kout(std::max<size_t>(kout_ratio * cache_sz, 1)),
+	m_weigher(weigher),
+	m_max_page_weight(std::max<size_t>(max_page_fraction * cache_sz, 1))
+{
+	assert(cache_sz > 1);
+	assert(kin_ratio >= 0 && kout_ratio >= 0);
+	assert(max_page_fraction > 0 && max_page_fraction <= 1);
+	m_kin = std::min(m_kin, cache_sz - 1);
+	if (std::is_same<Weigher, UnitWeigher>::value) {
+		m_hashtbl.reserve(cache_sz);
+		m_a1out_hashtbl.reserve(m_kout);
+	}
+}
+
+template <class DataBase, class Weigher>
+const typename TWOQCache<DataBase, Weigher>::page_t&
+TWOQCache<DataBase, Weigher>::get_temp_page(const key_t& key) const
+{
+	assert(m_hashtbl.size() == m_am.size() + m_a1in.size());
+	assert(this->bytes_cached() <= this->m_cache_sz);
+	assert(m_a1out.size() == m_a1out_hashtbl.size());
+	assert(m_a1out_weight <= m_kout);
+
+	_CACHE_PRINTMSG_REQUESTED_PAGE(TWOQCache, key);
+
+	auto search = m_hashtbl.find(key);
+	if (search != m_hashtbl.end()) {
+		_CACHE_PRINTMSG_FOUND_IN_CACHE(TWOQCache, key);
+		this->hit();
+
+		/*  Попадание в A1in ничего не меняет: повторные запросы через
+		 * короткое время считаются одним обращением */
+		auto& found_page = search->second;
+		if (found_page.location == HashtblEntry::AM_QUEUE && found_page.it != m_am.begin())
+			m_am.splice(m_am.begin(), m_am, found_page.it);
+		return found_page.it->page;
+	}
+
+	this->miss();
+	page_t page = this->load_page(key);
+	size_t weight = m_weigher(key, page);
+	if (weight > m_max_page_weight) // слишком тяжелая страница, не кэшируем
+		return m_rejected_page = std::move(page);
+
+	/*  Призрак ищется и забывается до reclaim(): вытесняя страницы из
+	 * A1in, она запоминает их ключи в A1out и может забыть самый старый
+	 * призрак - ключ этого же запроса */
+	bool found_ghost = false;
+	auto ghost = m_a1out_hashtbl.find(key);
+	if (ghost != m_a1out_hashtbl.end()) {
+		m_a1out_weight -= ghost->second->weight;
+		m_a1out.erase(ghost->second);
+		m_a1out_hashtbl.erase(ghost);
+		found_ghost = true;
+	}
+	reclaim(weight);
+	this->add_bytes(weight);
+
+	if (found_ghost) {
+		/*  Страница недавно была вытеснена из A1in и снова запрошена,
+		 * значит она действительно часто используется */
+		m_am.push_front({key, std::move(page)});
+		m_hashtbl[key] = { HashtblEntry::AM_QUEUE, m_am.begin() };
+		return m_am.front().page;
+	}
+	m_a1in.push_front({key, std::move(page)});
+	m_hashtbl[key] = { HashtblEntry::A1IN_QUEUE, m_a1in.begin() };
+	m_a1in_weight += weight;
+	return m_a1in.front().page;
+}
+
+template <class DataBase, class Weigher>
+void TWOQCache<DataBase, Weigher>::save_snapshot(const std::string& path) const
+{
+	SnapshotWriter out(path);
+	write_snapshot(out);
+	out.commit();
+}
+
+template <class DataBase, class Weigher>
+void TWOQCache<DataBase, Weigher>::load_snapshot(const std::string& path)
+{
+	SnapshotReader in(path);
+	read_snapshot(in);
+}
+
+template <class DataBase, class Weigher>
+template <class Out>
+void TWOQCache<DataBase, Weigher>::write_snapshot(Out& out) const
+{
+	this->write_snapshot_header(out, "TWOQCache");
+	out.template write<uint64_t>(m_kin);
+	out.template write<uint64_t>(m_kout);
+	write_pages(out, m_a1in);
+	write_pages(out, m_am);
+	write_ghosts(out, m_a1out);
+}
+
+template <class DataBase, class Weigher>
+void TWOQCache<DataBase, Weigher>::read_snapshot(BufferReader& in)
+{
+	const std::string& path = in.path();
+	std::pair<uint64_t, uint64_t> counters = this->read_snapshot_header(in, "TWOQCache");
+	uint64_t kin = in.read<uint64_t>();
+	uint64_t kout = in.read<uint64_t>();
+	if (kin != m_kin || kout != m_kout)
+		throw SnapshotError(path, "TWOQCache: '" + path + "' is a snapshot of a cache"
+			" with different kin or kout");
+
+	std::list<ListEntry> a1in, am;
+	GhostList a1out;
+	std::unordered_map<key_t, HashtblEntry> hashtbl;
+	std::unordered_map<key_t, typename GhostList::iterator> a1out_hashtbl;
+	if (std::is_same<Weigher, UnitWeigher>::value) {
+		hashtbl.reserve(this->m_cache_sz);
+		a1out_hashtbl.reserve(m_kout);
+	}
+	size_t a1in_weight = 0, am_weight = 0, a1out_weight = 0;
+
+	read_pages<key_t, page_t>(in, [&](key_t key, page_t page) {
+		a1in_weight += m_weigher(key, page);
+		a1in.push_back({std::move(key), std::move(page)});
+		hashtbl[a1in.back().key] = { HashtblEntry::A1IN_QUEUE, std::prev(a1in.end()) };
+	});
+	read_pages<key_t, page_t>(in, [&](key_t key, page_t page) {
+		am_weight += m_weigher(key, page);
+		am.push_back({std::move(key), std::move(page)});
+		hashtbl[am.back().key] = { HashtblEntry::AM_QUEUE, std::prev(am.end()) };
+	});
+	read_ghosts<key_t>(in, [&](key_t key, size_t weight) {
+		a1out_weight += weight;
+		a1out.push_back({std::move(key), weight});
+		a1out_hashtbl[a1out.back().key] = std::prev(a1out.end());
+	});
+	if (hashtbl.size() != a1in.size() + am.size() || a1in_weight + am_weight > this->m_cache_sz
+		|| a1out_hashtbl.size() != a1out.size() || a1out_weight > m_kout || !in.at_end())
+		throw SnapshotError(path, "TWOQCache: snapshot '" + path + "' is corrupted");
+
+	m_a1in.swap(a1in);
+	m_am.swap(am);
+	m_a1out.swap(a1out);
+	m_hashtbl.swap(hashtbl);
+	m_a1out_hashtbl.swap(a1out_hashtbl);
+	m_a1in_weight = a1in_weight;
+	m_a1out_weight = a1out_weight;
+	this->remove_bytes(this->bytes_cached());
+	this->add_bytes(a1in_weight + am_weight);
+	this->restore_counters(counters.first, counters.second);
+}
+
+template <class DataBase, class Weigher>
+const typename TWOQCache<DataBase, Weigher>::key_t *TWOQCache<DataBase, Weigher>::victim() const
+{
+	if (this->bytes_cached() < this->m_cache_sz)
+		return nullptr;
+	return (m_a1in_weight > m_kin || m_am.empty()) ? &m_a1in.back().key : &m_am.back().key;
+}
+
+/*  Освобождает место для новой страницы веса weight. Пока A1in
+ * переполнена, ее старейшие страницы выбрасываются, а ключи запоминаются в
+ * A1out, иначе выбрасываются LRU страницы из Am */
+template <class DataBase, class Weigher>
+void TWOQCache<DataBase, Weigher>::reclaim(size_t weight) const
+{
+	if (this->bytes_cached() + weight <= this->m_cache_sz) {
+		_CACHE_PRINTMSG_VACANT_SPACE(TWOQCache);
+		return;
+	}
+	while (this->bytes_cached() + weight > this->m_cache_sz) {
+		if (m_a1in_weight > m_kin || m_am.empty()) {
+			assert(!m_a1in.empty());
+			const key_t& key = m_a1in.back().key;
+			_CACHE_PRINTMSG_DELETING_PAGE(TWOQCache, key);
+			this->evicted(key, m_a1in.back().page);
+			size_t evicted_weight = m_weigher(key, m_a1in.back().page);
+			m_a1in_weight -= evicted_weight;
+			this->remove_bytes(evicted_weight);
+			remember(key, evicted_weight);
+			m_hashtbl.erase(key);
+			m_a1in.pop_back();
+		} else {
+			_CACHE_PRINTMSG_DELETING_PAGE(TWOQCache, m_am.back().key);
+			this->evicted(m_am.back().key, m_am.back().page);
+			this->remove_bytes(m_weigher(m_am.back().key, m_am.back().page));
+			m_hashtbl.erase(m_am.back().key);
+			m_am.pop_back();
+		}
+	}
+}
+
+/*  Запоминает ключ вытесненной из A1in страницы в A1out, забывая самые
+ * старые ключи, пока их суммарный вес больше kout */
+template <class DataBase, class Weigher>
+void TWOQCache<DataBase, Weigher>::remember(const key_t& key, size_t weight) const
+{
+	if (weight > m_kout)
+		return;
+	while (m_a1out_weight + weight > m_kout) {
+		m_a1out_weight -= m_a1out.back().weight;
+		m_a1out_hashtbl.erase(m_a1out.back().key);
+		m_a1out.pop_back();
+	}
+	m_a1out.push_front({key, weight});
+	m_a1out_hashtbl[key] = m_a1out.begin();
+	m_a1out_weight += weight;
+}
+
+
+template <class DataBase, class Weigher>
+ARCCache<DataBase, Weigher>::ARCCache(const DataBase& db, size_t cache_sz,
+	double max_page_fraction, const Weigher& weigher) :
+	AbstractCache<DataBase>(db, cache_sz),
+	m_t1_weight(0), m_t2_weight(0), m_b1_weight(0), m_b2_weight(0),
+	m_target_t1_sz(0),
+	m_weigher(weigher),
+	m_max_page_weight(std::max<size_t>(max_page_fraction * cache_sz, 1))
+{
+	assert(cache_sz > 0);
+	assert(max_page_fraction > 0 && max_page_fraction <= 1);
+	if (std::is_same<Weigher, UnitWeigher>::value)
+		m_hashtbl.reserve(2 * cache_sz);
+}
+
+template <class DataBase, class Weigher>
+bool ARCCache<DataBase, Weigher>::is_cached(const key_t& key) const
+{
+	auto search = m_hashtbl.find(key);
+	return search != m_hashtbl.end()
+		&& (search->second.location == HashtblEntry::T1
+			|| search->second.location == HashtblEntry::T2);
+}
+
+/*  Размеры списков - их вес (для UnitWeigher - число страниц и ключей),
+ * поэтому при единичных весах это в точности ARC из статьи */
+template <class DataBase, class Weigher>
+const typename ARCCache<DataBase, Weigher>::page_t&
+ARCCache<DataBase, Weigher>::get_temp_page(const key_t& key) const
+{
+	assert(m_t1_weight + m_t2_weight == this->bytes_cached());
+	assert(m_t1_weight + m_t2_weight <= this->m_cache_sz);
+	assert(m_t1_weight + m_b1_weight <= this->m_cache_sz);
+	assert(m_t1_weight + m_t2_weight + m_b1_weight + m_b2_weight <= 2 * this->m_cache_sz);
+
+	_CACHE_PRINTMSG_REQUESTED_PAGE(ARCCache, key);
+
+	size_t cache_sz = this->m_cache_sz;
+	auto search = m_hashtbl.find(key);
+
+	if (search != m_hashtbl.end()) {
+		auto& found = search->second;
+		if (found.location == HashtblEntry::T1 || found.location == HashtblEntry::T2) {
+			/* Страница в кэше, переносим в начало T2 */
+			_CACHE_PRINTMSG_FOUND_IN_CACHE(ARCCache, key);
+			this->hit();
+
+			if (found.location == HashtblEntry::T1) {
+				size_t weight = m_weigher(found.it->key, found.it->page);
+				m_t1_weight -= weight;
+				m_t2_weight += weight;
+			}
+			m_t2.splice(m_t2.begin(),
+				(found.location == HashtblEntry::T1) ? m_t1 : m_t2, found.it);
+			found.location = HashtblEntry::T2;
+			return found.it->page;
+		}
+
+		/*  Ключ найден в одном из списков-призраков: страница была
+		 * запрошена повторно вскоре после вытеснения */
+		this->miss();
+		page_t page = this->load_page(key);
+		size_t weight = m_weigher(key, page);
+		if (weight > m_max_page_weight) // слишком тяжелая страница, не кэшируем
+			return m_rejected_page = std::move(page);
+		bool found_in_b2 = (found.location == HashtblEntry::B2);
+
+		size_t ghost_weight = found.ghost_it->weight;
+		if (!found_in_b2) { // T1 стоит увеличить
+			size_t delta = std::max<size_t>(m_b2_weight / std::max<size_t>(m_b1_weight, 1), 1) * weight;
+			m_target_t1_sz = std::min(cache_sz, m_target_t1_sz + delta);
+			m_b1.erase(found.ghost_it);
+			m_b1_weight -= ghost_weight;
+		} else { // T2 стоит увеличить
+			size_t delta = std::max<size_t>(m_b1_weight / std::max<size_t>(m_b2_weight, 1), 1) * weight;
+			m_target_t1_sz = (m_target_t1_sz > delta) ? m_target_t1_sz - delta : 0;
+			m_b2.erase(found.ghost_it);
+			m_b2_weight -= ghost_weight;
+		}
+		while (this->bytes_cached() + weight > cache_sz)
+			replace(found_in_b2);
+		trim_ghosts(weight);
+
+		m_t2.push_front({key, std::move(page)});
+		found.location = HashtblEntry::T2;
+		found.it = m_t2.begin();
+		m_t2_weight += weight;
+		this->add_bytes(weight);
+		return m_t2.front().page;
+	}
+
+	/* Ключ встречается впервые (или давно забыт) */
+	this->miss();
+	page_t page = this->load_page(key);
+	size_t weight = m_weigher(key, page);
+	if (weight > m_max_page_weight) // слишком тяжелая страница, не кэшируем
+		return m_rejected_page = std::move(page);
+	if (m_t1_weight + m_b1_weight + weight > cache_sz) {
+		/*  L1 = T1 + B1 переполнится: забываем старые ключи B1, а если их не
+		 * хватило (B1 пуст), выбрасываем страницы из T1 целиком */
+		while (m_t1_weight + m_b1_weight + weight > cache_sz && !m_b1.empty())
+			pop_ghost(m_b1, m_b1_weight);
+		while (m_t1_weight + m_b1_weight + weight > cache_sz) {
+			_CACHE_PRINTMSG_DELETING_PAGE(ARCCache, m_t1.back().key);
+			this->evicted(m_t1.back().key, m_t1.back().page);
+			size_t evicted_weight = m_weigher(m_t1.back().key, m_t1.back().page);
+			m_t1_weight -= evicted_weight;
+			this->remove_bytes(evicted_weight);
+			m_hashtbl.erase(m_t1.back().key);
+			m_t1.pop_back();
+		}
+		while (this->bytes_cached() + weight > cache_sz)
+			replace(false);
+	} else if (this->bytes_cached() + weight > cache_sz) {
+		while (this->bytes_cached() + weight > cache_sz)
+			replace(false);
+	} else {
+		_CACHE_PRINTMSG_VACANT_SPACE(ARCCache);
+	}
+	trim_ghosts(weight);
+
+	m_t1.push_front({key, std::move(page)});
+	auto& entry = m_hashtbl[key];
+	entry.location = HashtblEntry::T1;
+	entry.it = m_t1.begin();
+	m_t1_weight += weight;
+	this->add_bytes(weight);
+	return m_t1.front().page;
+}
+
+/*  Освобождает место для одной страницы: вытесняет LRU страницу из T1 в B1,
+ * если T1 больше целевого размера, иначе из T2 в B2 */
+template <class DataBase, class Weigher>
+void ARCCache<DataBase, Weigher>::replace(bool found_in_b2) const
+{
+	bool from_t1 = !m_t1.empty()
+		&& (m_t1_weight > m_target_t1_sz || m_t2.empty()
+			|| (found_in_b2 && m_t1_weight == m_target_t1_sz));
+	PageList& pages = (from_t1) ? m_t1 : m_t2;
+	GhostList& ghosts = (from_t1) ? m_b1 : m_b2;
+	assert(!pages.empty());
+
+	_CACHE_PRINTMSG_DELETING_PAGE(ARCCache, pages.back().key);
+	this->evicted(pages.back().key, pages.back().page);
+	size_t weight = m_weigher(pages.back().key, pages.back().page);
+	ghosts.push_front({pages.back().key, weight});
+	(from_t1 ? m_t1_weight : m_t2_weight) -= weight;
+	(from_t1 ? m_b1_weight : m_b2_weight) += weight;
+	this->remove_bytes(weight);
+	auto& entry = m_hashtbl.find(pages.back().key)->second;
+	entry.location = (from_t1) ? HashtblEntry::B1 : HashtblEntry::B2;
+	entry.ghost_it = ghosts.begin();
+	pages.pop_back();
+}
+
+/*  Забывает старые ключи B2, а если их не хватило, B1, пока страница
+ * веса weight не поместится в 2 * cache_sz вместе со всеми списками */
+template <class DataBase, class Weigher>
+void ARCCache<DataBase, Weigher>::trim_ghosts(size_t weight) const
+{
+	size_t max_weight = 2 * this->m_cache_sz;
+	while (m_t1_weight + m_t2_weight + m_b1_weight + m_b2_weight + weight > max_weight
+		&& !m_b2.empty())
+		pop_ghost(m_b2, m_b2_weight);
+	while (m_t1_weight + m_t2_weight + m_b1_weight + m_b2_weight + weight > max_weight
+		&& !m_b1.empty())
+		pop_ghost(m_b1, m_b1_weight);
+}
+
+/* Забывает самый старый ключ из списка-призрака */
+template <class DataBase, class Weigher>
+void ARCCache<DataBase, Weigher>::pop_ghost(GhostList& ghosts, size_t& ghosts_weight) const
+{
+	assert(!ghosts.empty());
+	ghosts_weight -= ghosts.back().weight;
+	m_hashtbl.erase(ghosts.back().key);
+	ghosts.pop_back();
+}
+
+template <class DataBase, class Weigher>
+void ARCCache<DataBase, Weigher>::save_snapshot(const std::string& path) const
+{
+	SnapshotWriter out(path);
+	write_snapshot(out);
+	out.commit();
+}
+
+template <class DataBase, class Weigher>
+void ARCCache<DataBase, Weigher>::load_snapshot(const std::string& path)
+{
+	SnapshotReader in(path);
+	read_snapshot(in);
+}
+
+template <class DataBase, class Weigher>
+template <class Out>
+void ARCCache<DataBase, Weigher>::write_snapshot(Out& out) const
+{
+	this->write_snapshot_header(out, "ARCCache");
+	out.template write<uint64_t>(m_target_t1_sz);
+	write_pages(out, m_t1);
+	write_pages(out, m_t2);
+	write_ghosts(out, m_b1);
+	write_ghosts(out, m_b2);
+}
+
+template <class DataBase, class Weigher>
+void ARCCache<DataBase, Weigher>::read_snapshot(BufferReader& in)
+{
+	const std::string& path = in.path();
+	std::pair<uint64_t, uint64_t> counters = this->read_snapshot_header(in, "ARCCache");
+	size_t target_t1_sz = in.read<uint64_t>();
+
+	PageList t1, t2;
+	GhostList b1, b2;
+	size_t t1_weight = 0, t2_weight = 0, b1_weight = 0, b2_weight = 0;
+	std::unordered_map<key_t, HashtblEntry> hashtbl;
+	if (std::is_same<Weigher, UnitWeigher>::value)
+		hashtbl.reserve(2 * this->m_cache_sz);
+
+	auto read_page_list = [&](PageList& pages, size_t& weight,
+		decltype(HashtblEntry::location) location)
+	{
+		read_pages<key_t, page_t>(in, [&](key_t key, page_t page) {
+			weight += m_weigher(key, page);
+			pages.push_back({std::move(key), std::move(page)});
+			auto& entry = hashtbl[pages.back().key];
+			entry.location = location;
+			entry.it = std::prev(pages.end());
+		});
+	};
+	auto read_ghost_list = [&](GhostList& ghosts, size_t& weight,
+		decltype(HashtblEntry::location) location)
+	{
+		read_ghosts<key_t>(in, [&](key_t key, size_t ghost_weight) {
+			weight += ghost_weight;
+			ghosts.push_back({std::move(key), ghost_weight});
+			auto& entry = hashtbl[ghosts.back().key];
+			entry.location = location;
+			entry.ghost_it = std::prev(ghosts.end());
+		});
+	};
+	read_page_list(t1, t1_weight, HashtblEntry::T1);
+	read_page_list(t2, t2_weight, HashtblEntry::T2);
+	read_ghost_list(b1, b1_weight, HashtblEntry::B1);
+	read_ghost_list(b2, b2_weight, HashtblEntry::B2);
+
+	size_t cache_sz = this->m_cache_sz;
+	if (hashtbl.size() != t1.size() + t2.size() + b1.size() + b2.size()
+		|| t1_weight + t2_weight > cache_sz || t1_weight + b1_weight > cache_sz
+		|| t1_weight + t2_weight + b1_weight + b2_weight > 2 * cache_sz
+		|| target_t1_sz > cache_sz || !in.at_end())
+		throw SnapshotError(path, "ARCCache: snapshot '" + path + "' is corrupted");
+
+	m_t1.swap(t1);
+	m_t2.swap(t2);
+	m_b1.swap(b1);
+	m_b2.swap(b2);
+	m_hashtbl.swap(hashtbl);
+	m_t1_weight = t1_weight, m_t2_weight = t2_weight;
+	m_b1_weight = b1_weight, m_b2_weight = b2_weight;
+	m_target_t1_sz = target_t1_sz;
+	this->remove_bytes(this->bytes_cached());
+	this->add_bytes(t1_weight + t2_weight);
+	this->restore_counters(counters.first, counters.second);
+}
+
+
+template <class DataBase, class Weigher>
+SLRUCache<DataBase, Weigher>::SLRUCache(const DataBase& db, size_t cache_sz,
+	double protected_fraction, double max_page_fraction, const Weigher& weigher) :
+	AbstractCache<DataBase>(db, cache_sz),
+	m_protected_weight(0),
+	m_ndirty(0),
+	m_protected_sz(protected_fraction * cache_sz),
+	m_weigher(weigher),
+	m_max_page_weight(std::max<size_t>(max_page_fraction * cache_sz, 1))
+{
+	assert(cache_sz > 0);
+	assert(protected_fraction >= 0.0 && protected_fraction < 1.0);
+	assert(max_page_fraction > 0 && max_page_fraction <= 1);
+	if (std::is_same<Weigher, UnitWeigher>::value)
+		m_hashtbl.reserve(cache_sz);
+}
+
+template <class DataBase, class Weigher>
+const typename SLRUCache<DataBase, Weigher>::page_t&
+SLRUCache<DataBase, Weigher>::get_temp_page(const key_t& key) const
+{
+	assert(m_probation.size() + m_protected.size() == m_hashtbl.size());
+	assert(m_protected_weight <= m_protected_sz);
+	assert(this->bytes_cached() <= this->m_cache_sz);
+
+	_CACHE_PRINTMSG_REQUESTED_PAGE(SLRUCache, key);
+
+	auto search = m_hashtbl.find(key);
+	if (search != m_hashtbl.end()) {
+		_CACHE_PRINTMSG_FOUND_IN_CACHE(SLRUCache, key);
+		this->hit();
+
+		auto& found = search->second;
+		if (found.is_protected) {
+			m_protected.splice(m_protected.begin(), m_protected, found.it);
+			return found.it->page;
+		}
+
+		promote(found);
+		return found.it->page;
+	}
+
+	this->miss();
+	page_t page = this->load_page(key);
+	size_t weight = m_weigher(key, page);
+	if (weight > m_max_page_weight) // слишком тяжелая страница, не кэшируем
+		return m_rejected_page = std::move(page);
+
+	if (this->bytes_cached() + weight > this->m_cache_sz) {
+		while (this->bytes_cached() + weight > this->m_cache_sz)
+			evict_one();
+	} else {
+		_CACHE_PRINTMSG_VACANT_SPACE(SLRUCache);
+	}
+
+	m_probation.push_front({key, std::move(page)});
+	m_hashtbl[key] = {false, m_probation.begin()};
+	this->add_bytes(weight);
+	return m_probation.front().page;
+}
+
+/*  Повторное обращение к странице из испытательного сегмента переносит
+ * ее в защищенный, а если он переполнился, его LRU страницы возвращаются
+ * в испытательный. Страница тяжелее всего защищенного сегмента остается
+ * в испытательном */
+template <class DataBase, class Weigher>
+void SLRUCache<DataBase, Weigher>::promote(HashtblEntry& found) const
+{
+	assert(!found.is_protected);
+	size_t weight = m_weigher(found.it->key, found.it->page);
+	if (weight > m_protected_sz) {
+		m_probation.splice(m_probation.begin(), m_probation, found.it);
+		return;
+	}
+	m_protected.splice(m_protected.begin(), m_probation, found.it);
+	found.is_protected = true;
+	m_protected_weight += weight;
+	while (m_protected_weight > m_protected_sz) {
+		auto demoted = std::prev(m_protected.end());
+		m_protected_weight -= m_weigher(demoted->key, demoted->page);
+		m_probation.splice(m_probation.begin(), m_protected, demoted);
+		m_hashtbl.find(demoted->key)->second.is_protected = false;
+	}
+}
+
+/*  Вытесняет LRU страницу испытательного сегмента, а если он пуст -
+ * защищенного */
+template <class DataBase, class Weigher>
+void SLRUCache<DataBase, Weigher>::evict_one() const
+{
+	bool from_protected = m_probation.empty();
+	List& lst = (from_protected) ? m_protected : m_probation;
+	assert(!lst.empty());
+	_CACHE_PRINTMSG_DELETING_PAGE(SLRUCache, lst.back().key);
+	this->evicted(lst.back().key, lst.back().page);
+
+	size_t evicted_weight = m_weigher(lst.back().key, lst.back().page);
+	if (from_protected)
+		m_protected_weight -= evicted_weight;
+	if (lst.back().dirty)
+		--m_ndirty;
+	this->remove_bytes(evicted_weight);
+	m_hashtbl.erase(lst.back().key);
+	lst.pop_back();
+}
+
+/*  Как в LRUCache, заменяемая страница на время вытеснения убирается из
+ * сегментов */
+template <class DataBase, class Weigher>
+std::optional<typename SLRUCache<DataBase, Weigher>::page_t>
+SLRUCache<DataBase, Weigher>::put_page(const key_t& key, page_t page, bool dirty) const
+{
+	size_t weight = m_weigher(key, page);
+	auto search = m_hashtbl.find(key);
+	if (search == m_hashtbl.end()) {
+		if (weight > m_max_page_weight)
+			return std::nullopt;
+		this->inserted(key, page);
+		while (this->bytes_cached() + weight > this->m_cache_sz)
+			evict_one();
+		m_probation.push_front({key, std::move(page), dirty});
+		m_hashtbl[key] = {false, m_probation.begin()};
+		m_ndirty += dirty;
+		this->add_bytes(weight);
+		return std::nullopt;
+	}
+
+	auto& found = search->second;
+	List& lst = (found.is_protected) ? m_protected : m_probation;
+	size_t old_weight = m_weigher(found.it->key, found.it->page);
+	if (found.is_protected) {
+		m_protected_weight -= old_weight;
+		found.is_protected = false;
+	}
+	if (weight > m_max_page_weight) { // слишком тяжелая страница, вытесняем старую
+		m_probation.splice(m_probation.end(), lst, found.it);
+		evict_one();
+		return std::nullopt;
+	}
+
+	List held;
+	held.splice(held.begin(), lst, found.it);
+	this->remove_bytes(old_weight);
+	m_ndirty -= found.it->dirty;
+	while (this->bytes_cached() + weight > this->m_cache_sz)
+		evict_one();
+
+	std::optional<page_t> old(std::move(found.it->page));
+	found.it->page = std::move(page);
+	found.it->dirty = dirty;
+	m_ndirty += dirty;
+	m_probation.splice(m_probation.begin(), held, found.it);
+	this->add_bytes(weight);
+	promote(found);
+	return old;
+}
+
+template <class DataBase, class Weigher>
+bool SLRUCache<DataBase, Weigher>::is_dirty(const key_t& key) const
+{
+	auto search = m_hashtbl.find(key);
+	return search != m_hashtbl.end() && search->second.it->dirty;
+}
+
+template <class DataBase, class Weigher>
+std::vector<std::pair<typename SLRUCache<DataBase, Weigher>::key_t,
+	typename SLRUCache<DataBase, Weigher>::page_t>>
+SLRUCache<DataBase, Weigher>::dirty_pages() const
+{
+	std::vector<std::pair<key_t, page_t>> pages;
+	pages.reserve(m_ndirty);
+	for (const List *lst : {&m_probation, &m_protected})
+		for (auto& entry : *lst)
+			if (entry.dirty)
+				pages.emplace_back(entry.key, entry.page);
+	return pages;
+}
+
+template <class DataBase, class Weigher>
+void SLRUCache<DataBase, Weigher>::mark_clean() const
+{
+	for (List *lst : {&m_probation, &m_protected})
+		for (auto& entry : *lst)
+			entry.dirty = false;
+	m_ndirty = 0;
+}
+
+template <class DataBase, class Weigher>
+const typename SLRUCache<DataBase, Weigher>::key_t *
+SLRUCache<DataBase, Weigher>::victim() const
+{
+	if (this->bytes_cached() < this->m_cache_sz)
+		return nullptr;
+	return (m_probation.empty()) ? &m_protected.back().key : &m_probation.back().key;
+}
+
+template <class DataBase, class Weigher>
+void SLRUCache<DataBase, Weigher>::save_snapshot(const std::string& path) const
+{
+	SnapshotWriter out(path);
+	write_snapshot(out);
+	out.commit();
+}
+
+template <class DataBase, class Weigher>
+void SLRUCache<DataBase, Weigher>::load_snapshot(const std::string& path)
+{
+	SnapshotReader in(path);
+	read_snapshot(in);
+}
+
+template <class DataBase, class Weigher>
+template <class Out>
+void SLRUCache<DataBase, Weigher>::write_snapshot(Out& out) const
+{
+	this->write_snapshot_header(out, "SLRUCache");
+	out.template write<uint64_t>(m_protected_sz);
+	write_pages(out, m_probation);
+	write_pages(out, m_protected);
+}
+
+template <class DataBase, class Weigher>
+void SLRUCache<DataBase, Weigher>::read_snapshot(BufferReader& in)
+{
+	const std::string& path = in.path();
+	std::pair<uint64_t, uint64_t> counters = this->read_snapshot_header(in, "SLRUCache");
+	if (in.read<uint64_t>() != m_protected_sz)
+		throw SnapshotError(path, "SLRUCache: '" + path + "' is a snapshot of a cache"
+			" with different protected_fraction");
+
+	List probation, protected_;
+	size_t probation_weight = 0, protected_weight = 0;
+	std::unordered_map<key_t, HashtblEntry> hashtbl;
+	if (std::is_same<Weigher, UnitWeigher>::value)
+		hashtbl.reserve(this->m_cache_sz);
+	read_pages<key_t, page_t>(in, [&](key_t key, page_t page) {
+		probation_weight += m_weigher(key, page);
+		probation.push_back({std::move(key), std::move(page)});
+		hashtbl[probation.back().key] = {false, std::prev(probation.end())};
+	});
+	read_pages<key_t, page_t>(in, [&](key_t key, page_t page) {
+		protected_weight += m_weigher(key, page);
+		protected_.push_back({std::move(key), std::move(page)});
+		hashtbl[protected_.back().key] = {true, std::prev(protected_.end())};
+	});
+	if (hashtbl.size() != probation.size() + protected_.size()
+		|| probation_weight + protected_weight > this->m_cache_sz
+		|| protected_weight > m_protected_sz || !in.at_end())
+		throw SnapshotError(path, "SLRUCache: snapshot '" + path + "' is corrupted");
+
+	m_probation.swap(probation);
+	m_protected.swap(protected_);
+	m_hashtbl.swap(hashtbl);
+	m_protected_weight = protected_weight;
+	m_ndirty = 0;
+	this->remove_bytes(this->bytes_cached());
+	this->add_bytes(probation_weight + protected_weight);
+	this->restore_counters(counters.first, counters.second);
+}
+
+
+template <class DataBase, template <class...> class MainCache>
+WTinyLFUCache<DataBase, MainCache>::WTinyLFUCache(const DataBase& db,
+	size_t cache_sz, double window_fraction) :
+	AbstractCache<DataBase>(db, cache_sz),
+	m_window_sz(std::max<size_t>(window_fraction * cache_sz, 1)),
+	m_handoff_db(db),
+	m_main(m_handoff_db, (assert(cache_sz > m_window_sz), cache_sz - m_window_sz)),
+	m_sketch(cache_sz)
+{
+	m_window_hashtbl.reserve(m_window_sz);
+	m_main.set_eviction_listener([this](const key_t& key, const page_t& page) {
+		this->evicted(key, page);
+	});
+}
+
+template <class DataBase, template <class...> class MainCache>
+const typename WTinyLFUCache<DataBase, MainCache>::page_t&
+WTinyLFUCache<DataBase, MainCache>::get_temp_page(const key_t& key) const
+{
+	assert(m_window.size() == m_window_hashtbl.size());
+	assert(m_window.size() <= m_window_sz);
+
+	_CACHE_PRINTMSG_REQUESTED_PAGE(WTinyLFUCache, key);
+
+	m_sketch.increment(key);
+
+	auto search = m_window_hashtbl.find(key);
+	if (search != m_window_hashtbl.end()) {
+		_CACHE_PRINTMSG_FOUND_IN_CACHE(WTinyLFUCache, key);
+		this->hit();
+
+		m_window.splice(m_window.begin(), m_window, search->second);
+		return search->second->page;
+	}
+	if (m_main.is_cached(key)) {
+		_CACHE_PRINTMSG_FOUND_IN_CACHE(WTinyLFUCache, key);
+		this->hit();
+		return m_main.get_temp_page(key);
+	}
+
+	this->miss();
+	page_t page = this->load_page(key);
+	if (m_window.size() >= m_window_sz)
+		evict_from_window();
+	else {
+		_CACHE_PRINTMSG_VACANT_SPACE(WTinyLFUCache);
+	}
+
+	m_window.push_front({key, std::move(page)});
+	m_window_hashtbl[key] = m_window.begin();
+	return m_window.front().page;
+}
+
+/*  LRU страница окна становится кандидатом в основной кэш. Она вытесняет
+ * жертву основного кэша, только если запрашивалась чаще нее, иначе
+ * выбрасывается сама */
+template <class DataBase, template <class...> class MainCache>
+void WTinyLFUCache<DataBase, MainCache>::evict_from_window() const
+{
+	ListEntry& candidate = m_window.back();
+	const key_t *victim = m_main.victim();
+
+	if (!victim || m_sketch.estimate(candidate.key) > m_sketch.estimate(*victim)) {
+		m_handoff_db.handoff(&candidate.key, &candidate.page);
+		m_main.get_temp_page(candidate.key);
+		m_handoff_db.handoff(nullptr, nullptr);
+	} else {
+		_CACHE_PRINTMSG_DELETING_PAGE(WTinyLFUCache, candidate.key);
+		this->evicted(candidate.key, candidate.page);
+	}
+
+	m_window_hashtbl.erase(candidate.key);
+	m_window.pop_back();
+}
+
+
+template <class DataBase, template <class...> class MainCache>
+void WTinyLFUCache<DataBase, MainCache>::save_snapshot(const std::string& path) const
+{
+	SnapshotWriter out(path);
+	this->write_snapshot_header(out, "WTinyLFUCache");
+	out.write<uint64_t>(m_window_sz);
+	write_pages(out, m_window);
+	m_sketch.save(out);
+	write_nested(out, m_main);
+	out.commit();
+}
+
+/*  Основной кэш читается последним: его read_snapshot() либо читает
+ * снимок целиком, либо ничего не меняет */
+template <class DataBase, template <class...> class MainCache>
+void WTinyLFUCache<DataBase, MainCache>::load_snapshot(const std::string& path)
+{
+	SnapshotReader in(path);
+	std::pair<uint64_t, uint64_t> counters = this->read_snapshot_header(in, "WTinyLFUCache");
+	if (in.read<uint64_t>() != m_window_sz)
+		throw SnapshotError(path, "WTinyLFUCache: '" + path + "' is a snapshot of a cache"
+			" with different window_fraction");
+
+	List window;
+	std::unordered_map<key_t, typename List::iterator> window_hashtbl;
+	window_hashtbl.reserve(m_window_sz);
+	read_pages<key_t, page_t>(in, [&](key_t key, page_t page) {
+		window.push_back({std::move(key), std::move(page)});
+		window_hashtbl[window.back().key] = std::prev(window.end());
+	});
+	FrequencySketch<key_t> sketch(this->m_cache_sz);
+	bool sketch_ok = sketch.load(in);
+	BufferReader main = read_nested(in);
+	if (window_hashtbl.size() != window.size() || window.size() > m_window_sz
+		|| !sketch_ok || !in.at_end())
+		throw SnapshotError(path, "WTinyLFUCache: snapshot '" + path + "' is corrupted");
+
+	m_main.read_snapshot(main);
+	m_window.swap(window);
+	m_window_hashtbl.swap(window_hashtbl);
+	m_sketch = std::move(sketch);
+	this->restore_counters(counters.first, counters.second);
+}
+
+
+template <class DataBase, class Weigher>
+LFUCache<DataBase, Weigher>::LFUCache(const DataBase& db, size_t cache_sz,
+	size_t aging_period, double max_page_fraction, const Weigher& weigher) :
+	AbstractCache<DataBase>(db, cache_sz),
+	m_aging_period(aging_period),
+	m_nrequests_since_aging(0),
+	m_weigher(weigher),
+	m_max_page_weight(std::max<size_t>(max_page_fraction * cache_sz, 1))
+{
+	assert(cache_sz > 0);
+	assert(max_page_fraction > 0 && max_page_fraction <= 1);
+	if (std::is_same<Weigher, UnitWeigher>::value)
+		m_hashtbl.reserve(cache_sz);
+}
+
+template <class DataBase, class Weigher>
+const typename LFUCache<DataBase, Weigher>::page_t&
+LFUCache<DataBase, Weigher>::get_temp_page(const key_t& key) const
+{
+	assert(this->bytes_cached() <= this->m_cache_sz);
+
+	_CACHE_PRINTMSG_REQUESTED_PAGE(LFUCache, key);
+
+	if (m_aging_period && ++m_nrequests_since_aging == m_aging_period) {
+		m_nrequests_since_aging = 0;
+		age();
+	}
+
+	auto search = m_hashtbl.find(key);
+	if (search != m_hashtbl.end()) {
+		_CACHE_PRINTMSG_FOUND_IN_CACHE(LFUCache, key);
+		this->hit();
+
+		/* Переносим страницу в корзину с частотой на 1 больше */
+		auto& found = search->second;
+		auto bucket = found.bucket;
+		auto next_bucket = std::next(bucket);
+		if (next_bucket == m_buckets.end() || next_bucket->freq != bucket->freq + 1)
+			next_bucket = m_buckets.insert(next_bucket, {bucket->freq + 1, EntryList()});
+
+		next_bucket->entries.splice(next_bucket->entries.begin(), bucket->entries, found.it);
+		found.bucket = next_bucket;
+		if (bucket->entries.empty())
+			m_buckets.erase(bucket);
+		return found.it->page;
+	}
+
+	this->miss();
+	page_t page = this->load_page(key);
+	size_t weight = m_weigher(key, page);
+	if (weight > m_max_page_weight) // слишком тяжелая страница, не кэшируем
+		return m_rejected_page = std::move(page);
+
+	if (this->bytes_cached() + weight > this->m_cache_sz) {
+		while (this->bytes_cached() + weight > this->m_cache_sz)
+			evict();
+	} else {
+		_CACHE_PRINTMSG_VACANT_SPACE(LFUCache);
+	}
+
+	auto bucket = m_buckets.begin();
+	if (bucket == m_buckets.end() || bucket->freq != 1)
+		bucket = m_buckets.insert(bucket, {1, EntryList()});
+	bucket->entries.push_front({key, std::move(page)});
+	m_hashtbl[key] = {bucket, bucket->entries.begin()};
+	this->add_bytes(weight);
+	return bucket->entries.front().page;
+}
+
+/* Вытесняет самую старую страницу из корзины с наименьшей частотой */
+template <class DataBase, class Weigher>
+void LFUCache<DataBase, Weigher>::evict() const
+{
+	assert(!m_buckets.empty());
+	auto bucket = m_buckets.begin();
+	assert(!bucket->entries.empty());
+
+	_CACHE_PRINTMSG_DELETING_PAGE(LFUCache, bucket->entries.back().key);
+	this->evicted(bucket->entries.back().key, bucket->entries.back().page);
+	this->remove_bytes(m_weigher(bucket->entries.back().key, bucket->entries.back().page));
+	m_hashtbl.erase(bucket->entries.back().key);
+	bucket->entries.pop_back();
+	if (bucket->entries.empty())
+		m_buckets.erase(bucket);
+}
+
+/*  Делит все частоты пополам. Корзины, частоты которых совпали,
+ * сливаются, причем страницы из корзины с меньшей старой частотой
+ * оказываются ближе к концу, т.е. вытесняются раньше */
+template <class DataBase, class Weigher>
+void LFUCache<DataBase, Weigher>::age() const
+{
+	for (auto bucket = m_buckets.begin(); bucket != m_buckets.end(); ) {
+		bucket->freq = std::max<size_t>(bucket->freq / 2, 1);
+		if (bucket == m_buckets.begin() || std::prev(bucket)->freq != bucket->freq) {
+			++bucket;
+			continue;
+		}
+
+		auto prev_bucket = std::prev(bucket);
+		for (auto& entry : bucket->entries)
+			m_hashtbl.find(entry.key)->second.bucket = prev_bucket;
+		prev_bucket->entries.splice(prev_bucket->entries.begin(), bucket->entries);
+		bucket = m_buckets.erase(bucket);
+	}
+}
+
+
+template <class DataBase, class Weigher>
+void LFUCache<DataBase, Weigher>::save_snapshot(const std::string& path) const
+{
+	SnapshotWriter out(path);
+	this->write_snapshot_header(out, "LFUCache");
+	out.write<uint64_t>(m_aging_period);
+	out.write<uint64_t>(m_nrequests_since_aging);
+	out.write<uint64_t>(m_buckets.size());
+	for (auto& bucket : m_buckets) {
+		out.write<uint64_t>(bucket.freq);
+		write_pages(out, bucket.entries);
+	}
+	out.commit();
+}
+
+template <class DataBase, class Weigher>
+void LFUCache<DataBase, Weigher>::load_snapshot(const std::string& path)
+{
+	SnapshotReader in(path);
+	std::pair<uint64_t, uint64_t> counters = this->read_snapshot_header(in, "LFUCache");
+	if (in.read<uint64_t>() != m_aging_period)
+		throw SnapshotError(path, "LFUCache: '" + path + "' is a snapshot of a cache"
+			" with different aging_period");
+	uint64_t nrequests_since_aging = in.read<uint64_t>();
+
+	BucketList buckets;
+	std::unordered_map<key_t, HashtblEntry> hashtbl;
+	if (std::is_same<Weigher, UnitWeigher>::value)
+		hashtbl.reserve(this->m_cache_sz);
+	size_t weight = 0, npages = 0;
+	bool ordered = true; // частоты корзин положительны и возрастают
+	uint64_t nbuckets = in.read<uint64_t>();
+	for (uint64_t i = 0; i < nbuckets; ++i) {
+		uint64_t freq = in.read<uint64_t>();
+		ordered = ordered && freq > 0 && (buckets.empty() || freq > buckets.back().freq);
+		auto bucket = buckets.insert(buckets.end(), {freq, EntryList()});
+		read_pages<key_t, page_t>(in, [&](key_t key, page_t page) {
+			weight += m_weigher(key, page);
+			++npages;
+			bucket->entries.push_back({std::move(key), std::move(page)});
+			hashtbl[bucket->entries.back().key] = {bucket, std::prev(bucket->entries.end())};
+		});
+		ordered = ordered && !bucket->entries.empty();
+	}
+	if (!ordered || hashtbl.size() != npages || weight > this->m_cache_sz
+		|| (m_aging_period && nrequests_since_aging >= m_aging_period) || !in.at_end())
+		throw SnapshotError(path, "LFUCache: snapshot '" + path + "' is corrupted");
+
+	m_buckets.swap(buckets);
+	m_hashtbl.swap(hashtbl);
+	m_nrequests_since_aging = nrequests_since_aging;
+	this->remove_bytes(this->bytes_cached());
+	this->add_bytes(weight);
+	this->restore_counters(counters.first, counters.second);
+}
+
+
+template <class DataBase>
+ShardedLRUCache<DataBase>::ShardedLRUCache(const DataBase& db,
+	size_t cache_sz, size_t nshards, size_t nasync_workers) :
+	AbstractCache<DataBase>(db, cache_sz),
+	m_nasync_workers(nasync_workers),
+	m_async_stop(false)
+{
+	assert(cache_sz > 0);
+	assert(nshards > 0);
+	assert(nasync_workers > 0);
+	if (nshards > cache_sz)
+		nshards = cache_sz; // в каждом шарде должна быть хотя бы одна страница
+
+	/* Распределяем cache_sz по шардам так, чтобы суммарный размер совпадал */
+	m_shards.reserve(nshards);
+	for (size_t i = 0; i < nshards; ++i) {
+		size_t shard_sz = cache_sz / nshards + (i < cache_sz % nshards);
+		m_shards.emplace_back(new Shard(db, shard_sz));
+		m_shards.back()->cache.set_eviction_listener(
+			[this](const key_t& key, const page_t& page) { this->notify_evicted(key, page); });
+	}
+}
+
+template <class DataBase>
+ShardedLRUCache<DataBase>::~ShardedLRUCache()
+{
+	{
+		std::lock_guard<std::mutex> lock(m_async_mutex);
+		m_async_stop = true;
+	}
+	m_async_cv.notify_all();
+	for (auto& worker : m_async_workers)
+		worker.join();
+}
+
+template <class DataBase>
+typename ShardedLRUCache<DataBase>::Shard&
+ShardedLRUCache<DataBase>::shard_for(const key_t& key) const
+{
+	return *m_shards[mix_hash(std::hash<key_t>()(key)) % m_shards.size()];
+}
+
+template <class DataBase>
+typename ShardedLRUCache<DataBase>::page_t
+ShardedLRUCache<DataBase>::get_page(const key_t& key) const
+{
+	Shard& shard = shard_for(key);
+	std::promise<page_t> promise;
+	{
+		std::unique_lock<std::mutex> lock(shard.mutex);
+		if (shard.cache.is_cached(key))
+			return shard.cache.get_temp_page(key); // копируем, пока держим мьютекс
+
+		auto search = shard.inflight.find(key);
+		if (search != shard.inflight.end()) {
+			/* Страницу уже загружает другой поток, ждем его */
+			shard.ncoalesced.add(1);
+			std::shared_future<page_t> loading = search->second;
+			lock.unlock();
+			return loading.get();
+		}
+		shard.inflight.emplace(key, promise.get_future().share());
+	}
+
+	/*  Этот поток загружает страницу. Остальные потоки, запросившие ее,
+	 * получат тот же результат через promise */
+	auto fetch = [&]() {
+		try {
+			return this->fetch_page(key);
+		} catch (...) {
+			std::lock_guard<std::mutex> lock(shard.mutex);
+			shard.inflight.erase(key);
+			promise.set_exception(std::current_exception());
+			throw;
+		}
+	};
+	page_t page = fetch();
+
+	std::lock_guard<std::mutex> lock(shard.mutex);
+	shard.cache.preload_page(key, std::move(page));
+	const page_t& cached = shard.cache.get_temp_page(key);
+	shard.inflight.erase(key);
+	promise.set_value(cached);
+	return cached;
+}
+
+template <class DataBase>
+std::future<typename ShardedLRUCache<DataBase>::page_t>
+ShardedLRUCache<DataBase>::get_page_async(const key_t& key) const
+{
+	{
+		Shard& shard = shard_for(key);
+		std::lock_guard<std::mutex> lock(shard.mutex);
+		if (shard.cache.is_cached(key)) {
+			std::promise<page_t> ready;
+			ready.set_value(shard.cache.get_temp_page(key));
+			return ready.get_future();
+		}
+	}
+
+	std::promise<page_t> promise;
+	std::future<page_t> page = promise.get_future();
+	std::lock_guard<std::mutex> lock(m_async_mutex);
+	auto& waiting = m_async_waiting[key];
+	if (waiting.empty())
+		m_async_queue.push_back(key);
+	waiting.push_back(std::move(promise));
+	if (m_async_workers.size() < m_nasync_workers
+		&& m_async_workers.size() < m_async_queue.size())
+		m_async_workers.emplace_back(&ShardedLRUCache::async_worker, this);
+	m_async_cv.notify_one();
+	return page;
+}
+
+/*  Загружает ключи из очереди get_page_async(), пока кэш не разрушается.
+ * Оставшиеся в очереди ключи загружаются и при разрушении */
+template <class DataBase>
+void ShardedLRUCache<DataBase>::async_worker() const
+{
+	std::unique_lock<std::mutex> lock(m_async_mutex);
+	for (;;) {
+		m_async_cv.wait(lock, [this]() { return m_async_stop || !m_async_queue.empty(); });
+		if (m_async_queue.empty())
+			return;
+
+		key_t key = std::move(m_async_queue.front());
+		m_async_queue.pop_front();
+		auto search = m_async_waiting.find(key);
+		std::vector<std::promise<page_t>> waiting = std::move(search->second);
+		m_async_waiting.erase(search);
+		lock.unlock();
+
+		try {
+			page_t page = get_page(key);
+			for (auto& promise : waiting)
+				promise.set_value(page);
+		} catch (...) {
+			for (auto& promise : waiting)
+				promise.set_exception(std::current_exception());
+		}
+		lock.lock();
+	}
+}
+
+template <class DataBase>
+std::vector<typename ShardedLRUCache<DataBase>::page_t>
+ShardedLRUCache<DataBase>::get_pages(const std::vector<key_t>& keys) const
+{
+	std::vector<key_t> uncached = this->uncached_keys(keys);
+	typename AbstractCache<DataBase>::BatchPages batch(*this, keys, uncached,
+		(uncached.empty()) ? std::vector<page_t>() : this->fetch_pages(uncached));
+
+	std::vector<page_t> pages;
+	pages.reserve(keys.size());
+	for (auto& key : keys) {
+		Shard& shard = shard_for(key);
+		std::unique_lock<std::mutex> lock(shard.mutex);
+		std::optional<page_t> page = batch.take(key, !shard.cache.is_cached(key));
+		if (!page) {
+			lock.unlock();
+			pages.push_back(get_page(key));
+			continue;
+		}
+		shard.cache.preload_page(key, std::move(*page));
+		pages.push_back(shard.cache.get_temp_page(key));
+	}
+	return pages;
+}
+
+template <class DataBase>
+const typename ShardedLRUCache<DataBase>::page_t&
+ShardedLRUCache<DataBase>::get_temp_page(const key_t& key) const
+{
+	/*  Страница внутри шарда может быть вытеснена другим потоком сразу
+	 * после освобождения мьютекса, поэтому ссылку на нее отдавать нельзя */
+	return m_page_bufs.get() = get_page(key);
+}
+
+template <class DataBase>
+bool ShardedLRUCache<DataBase>::is_cached(const key_t& key) const
+{
+	Shard& shard = shard_for(key);
+	std::lock_guard<std::mutex> lock(shard.mutex);
+	return shard.cache.is_cached(key);
+}
+
+/*  Счетчики шардов (RelaxedCounter) читаются без их мьютексов, поэтому
+ * опрос не мешает запросам. Сумма по шардам не атомарна: между чтениями
+ * шардов могут пройти новые запросы */
+template <class DataBase>
+uint64_t ShardedLRUCache<DataBase>::nhits() const
+{
+	uint64_t nhits = 0;
+	for (auto& shard : m_shards)
+		nhits += shard->cache.nhits();
+	return nhits;
+}
+
+template <class DataBase>
+uint64_t ShardedLRUCache<DataBase>::nlookups() const
+{
+	uint64_t nlookups = 0;
+	for (auto& shard : m_shards)
+		nlookups += shard->cache.nlookups() + shard->ncoalesced.get();
+	return nlookups;
+}
+
+template <class DataBase>
+uint64_t ShardedLRUCache<DataBase>::ncoalesced() const
+{
+	uint64_t ncoalesced = 0;
+	for (auto& shard : m_shards)
+		ncoalesced += shard->ncoalesced.get();
+	return ncoalesced;
+}
+
+/*  Аналогично nhits(). Объединенный промах (ncoalesced) - промах без обращения к базе */
+template <class DataBase>
+CacheMetrics ShardedLRUCache<DataBase>::metrics() const
+{
+	CacheMetrics res = AbstractCache<DataBase>::metrics();
+	for (auto& shard : m_shards) {
+		res += shard->cache.metrics();
+		res.nmisses += shard->ncoalesced.get();
+	}
+	return res;
+}
+
+template <class DataBase>
+void ShardedLRUCache<DataBase>::save_snapshot(const std::string& path) const
+{
+	SnapshotWriter out(path);
+	this->write_snapshot_header(out, "ShardedLRUCache");
+	out.write<uint64_t>(m_shards.size());
+	for (auto& shard : m_shards) {
+		std::lock_guard<std::mutex> lock(shard->mutex);
+		write_nested(out, shard->cache);
+	}
+	out.commit();
+}
+
+/*  Шарды читаются в новые объекты, поэтому при ошибке в любом из них кэш
+ * остается прежним. Счетчики из заголовка - сумма счетчиков шардов, они
+ * восстанавливаются в самих шардах */
 template <class DataBase>
-const typename RandomCache<DataBase>::page_t&
-RandomCache<DataBase>::get_temp_page(const key_t& key) const
+void ShardedLRUCache<DataBase>::load_snapshot(const std::string& path)
+{
+	SnapshotReader in(path);
+	this->read_snapshot_header(in, "ShardedLRUCache");
+	if (in.read<uint64_t>() != m_shards.size())
+		throw SnapshotError(path, "ShardedLRUCache: '" + path + "' is a snapshot of a cache"
+			" with different nshards");
+
+	std::vector<std::unique_ptr<Shard>> shards;
+	shards.reserve(m_shards.size());
+	for (auto& shard : m_shards) {
+		shards.emplace_back(new Shard(this->m_db, shard->cache.cache_sz()));
+		BufferReader nested = read_nested(in);
+		shards.back()->cache.read_snapshot(nested);
+		shards.back()->cache.set_eviction_listener(
+			[this](const key_t& key, const page_t& page) { this->notify_evicted(key, page); });
+	}
+	if (!in.at_end())
+		throw SnapshotError(path, "ShardedLRUCache: snapshot '" + path + "' is corrupted");
+	m_shards.swap(shards);
+}
+
+
+/*  Бюджет и число ячеек делятся между шардами поровну. Без max_pages
+ * ячеек столько же, сколько единиц веса: при UnitWeigher их хватает ровно */
+template <class DataBase, class Weigher>
+ClockCache<DataBase, Weigher>::ClockCache(const DataBase& db,
+	size_t cache_sz, size_t nshards, double max_page_fraction,
+	const Weigher& weigher, size_t max_pages) :
+	AbstractCache<DataBase>(db, cache_sz),
+	m_weigher(weigher),
+	m_max_page_weight(std::max<size_t>(max_page_fraction * cache_sz, 1))
+{
+	assert(cache_sz > 0);
+	assert(nshards > 0);
+	assert(max_page_fraction > 0 && max_page_fraction <= 1);
+	size_t capacity = (max_pages) ? std::min(max_pages, cache_sz) : cache_sz;
+	if (nshards > capacity)
+		nshards = capacity;
+
+	m_shards.reserve(nshards);
+	for (size_t i = 0; i < nshards; ++i)
+		m_shards.emplace_back(new Shard(cache_sz / nshards + (i < cache_sz % nshards),
+			capacity / nshards + (i < capacity % nshards)));
+}
+
+/*  В индексе не меньше 4 ячеек на страницу: tombstone() и записи вместе
+ * занимают не больше половины ячеек, значит между перестроениями индекса
+ * проходит не меньше capacity промахов */
+template <class DataBase, class Weigher>
+ClockCache<DataBase, Weigher>::Shard::Shard(size_t budget, size_t capacity) :
+	budget(budget), weight(0), capacity(capacity), hand(0),
+	slots(capacity), free_slots(capacity), nused_buckets(0),
+	referenced(new std::atomic<bool>[capacity]()),
+	epoch(0), nhits(0), nlookups(0)
+{
+	size_t nbuckets = 8;
+	while (nbuckets < 4 * capacity)
+		nbuckets <<= 1;
+	index_owner.reset(new Index(nbuckets));
+	index.store(index_owner.get(), std::memory_order_relaxed);
+	nreaders[0].store(0, std::memory_order_relaxed);
+	nreaders[1].store(0, std::memory_order_relaxed);
+	/* Ячейки занимаются с начала */
+	for (size_t i = 0; i < capacity; ++i)
+		free_slots[i] = capacity - 1 - i;
+}
+
+/*  Читатель учитывается в счетчике своей эпохи. Если эпоха сменилась между
+ * ее чтением и увеличением счетчика, промах мог уже проверить этот счетчик,
+ * поэтому читатель перерегистрируется в новой эпохе */
+template <class DataBase, class Weigher>
+ClockCache<DataBase, Weigher>::ReadGuard::ReadGuard(Shard& shard)
+{
+	for (;;) {
+		uint64_t epoch = shard.epoch.load();
+		m_nreaders = &shard.nreaders[epoch & 1];
+		m_nreaders->fetch_add(1);
+		if (shard.epoch.load() == epoch)
+			return;
+		m_nreaders->fetch_sub(1, std::memory_order_release);
+	}
+}
+
+template <class DataBase, class Weigher>
+typename ClockCache<DataBase, Weigher>::Entry *
+ClockCache<DataBase, Weigher>::find(const Index& index, const key_t& key, uint64_t hash)
+{
+	for (size_t i = bucket_for(index, hash); ; i = (i + 1) & index.mask) {
+		Entry *entry = index.buckets[i].load(std::memory_order_acquire);
+		if (!entry)
+			return nullptr;
+		if (entry != tombstone() && entry->key == key)
+			return entry;
+	}
+}
+
+template <class DataBase, class Weigher>
+typename ClockCache<DataBase, Weigher>::page_t
+ClockCache<DataBase, Weigher>::get_page(const key_t& key) const
+{
+	_CACHE_PRINTMSG_REQUESTED_PAGE(ClockCache, key);
+	uint64_t hash = key_hash(key);
+	Shard& shard = shard_for(hash);
+
+	{
+		ReadGuard guard(shard);
+		Entry *entry = find(*shard.index.load(std::memory_order_acquire), key, hash);
+		if (entry) {
+			_CACHE_PRINTMSG_FOUND_IN_CACHE(ClockCache, key);
+			shard.nhits.fetch_add(1, std::memory_order_relaxed);
+			shard.nlookups.fetch_add(1, std::memory_order_relaxed);
+			shard.referenced[entry->slot].store(true, std::memory_order_relaxed);
+			return entry->page;
+		}
+	}
+
+	return insert(shard, key, hash, this->fetch_page(key));
+}
+
+template <class DataBase, class Weigher>
+std::vector<typename ClockCache<DataBase, Weigher>::page_t>
+ClockCache<DataBase, Weigher>::get_pages(const std::vector<key_t>& keys) const
+{
+	std::vector<key_t> uncached = this->uncached_keys(keys);
+	typename AbstractCache<DataBase>::BatchPages batch(*this, keys, uncached,
+		(uncached.empty()) ? std::vector<page_t>() : this->fetch_pages(uncached));
+
+	std::vector<page_t> pages;
+	pages.reserve(keys.size());
+	for (auto& key : keys) {
+		std::optional<page_t> page = batch.take(key, !is_cached(key));
+		if (!page) {
+			pages.push_back(get_page(key));
+			continue;
+		}
+		uint64_t hash = key_hash(key);
+		pages.push_back(insert(shard_for(hash), key, hash, std::move(*page)));
+	}
+	return pages;
+}
+
+/*  Добавляет загруженную страницу в шард (промах) */
+template <class DataBase, class Weigher>
+typename ClockCache<DataBase, Weigher>::page_t
+ClockCache<DataBase, Weigher>::insert(Shard& shard, const key_t& key, uint64_t hash, page_t page) const
+{
+	std::lock_guard<std::mutex> lock(shard.mutex);
+	shard.nlookups.fetch_add(1, std::memory_order_relaxed);
+
+	/* Пока страница загружалась, ее мог добавить другой поток */
+	Entry *found = find(*shard.index_owner, key, hash);
+	if (found) {
+		shard.referenced[found->slot].store(true, std::memory_order_relaxed);
+		return found->page;
+	}
+
+	this->inserted(key, page);
+	size_t weight = m_weigher(key, page);
+	if (weight > std::min(m_max_page_weight, shard.budget)) // не кэшируем
+		return page;
+
+	if (shard.weight + weight > shard.budget || shard.free_slots.empty()) {
+		while (shard.weight + weight > shard.budget || shard.free_slots.empty())
+			evict_one(shard);
+	} else {
+		_CACHE_PRINTMSG_VACANT_SPACE(ClockCache);
+	}
+	size_t slot = shard.free_slots.back();
+	shard.free_slots.pop_back();
+	shard.weight += weight;
+	if (2 * (shard.nused_buckets + 1) > shard.index_owner->mask + 1)
+		rebuild_index(shard);
+	shard.referenced[slot].store(false, std::memory_order_relaxed);
+	shard.slots[slot].reset(new Entry{key, page, slot});
+	index_insert(shard, shard.slots[slot].get(), hash);
+	reclaim(shard);
+	return page;
+}
+
+/*  Вытесняет страницу под стрелкой, давая второй шанс страницам с
+ * выставленным битом обращения. Ячейка освобождается */
+template <class DataBase, class Weigher>
+void ClockCache<DataBase, Weigher>::evict_one(Shard& shard) const
+{
+	assert(shard.free_slots.size() < shard.capacity);
+	while (!shard.slots[shard.hand]
+		|| shard.referenced[shard.hand].exchange(false, std::memory_order_relaxed))
+		shard.hand = (shard.hand + 1) % shard.capacity;
+	size_t slot = shard.hand;
+	shard.hand = (shard.hand + 1) % shard.capacity;
+
+	Entry *victim = shard.slots[slot].get();
+	_CACHE_PRINTMSG_DELETING_PAGE(ClockCache, victim->key);
+	this->evicted(victim->key, victim->page);
+	shard.weight -= m_weigher(victim->key, victim->page);
+	index_erase(shard, victim);
+	shard.retired_now.entries.push_back(std::move(shard.slots[slot]));
+	shard.free_slots.push_back(slot);
+}
+
+/*  Запись публикуется в первой ячейке цепочки с tombstone() или пустой.
+ * Ключа в индексе нет (проверено под мьютексом), поэтому читатель увидит
+ * либо пустую ячейку (промах), либо готовую запись */
+template <class DataBase, class Weigher>
+void ClockCache<DataBase, Weigher>::index_insert(Shard& shard, Entry *entry, uint64_t hash) const
+{
+	Index& index = *shard.index_owner;
+	size_t i = bucket_for(index, hash);
+	for (;;) {
+		Entry *current = index.buckets[i].load(std::memory_order_relaxed);
+		if (!current || current == tombstone()) {
+			if (!current)
+				++shard.nused_buckets;
+			index.buckets[i].store(entry, std::memory_order_release);
+			return;
+		}
+		i = (i + 1) & index.mask;
+	}
+}
+
+template <class DataBase, class Weigher>
+void ClockCache<DataBase, Weigher>::index_erase(Shard& shard, Entry *entry) const
+{
+	Index& index = *shard.index_owner;
+	for (size_t i = bucket_for(index, key_hash(entry->key)); ; i = (i + 1) & index.mask) {
+		Entry *current = index.buckets[i].load(std::memory_order_relaxed);
+		assert(current);
+		if (current == entry) {
+			index.buckets[i].store(tombstone(), std::memory_order_release);
+			return;
+		}
+	}
+}
+
+/*  Новая таблица без tombstone(). Старую еще могут читать попадания,
+ * поэтому она освобождается как вытесненные записи */
+template <class DataBase, class Weigher>
+void ClockCache<DataBase, Weigher>::rebuild_index(Shard& shard) const
+{
+	std::unique_ptr<Index> index(new Index(shard.index_owner->mask + 1));
+	shard.nused_buckets = 0;
+	for (auto& entry : shard.slots) {
+		if (!entry)
+			continue;
+		size_t i = bucket_for(*index, key_hash(entry->key));
+		while (index->buckets[i].load(std::memory_order_relaxed))
+			i = (i + 1) & index->mask;
+		index->buckets[i].store(entry.get(), std::memory_order_relaxed);
+		++shard.nused_buckets;
+	}
+
+	shard.index.store(index.get(), std::memory_order_release);
+	shard.retired_now.indexes.push_back(std::move(shard.index_owner));
+	shard.index_owner = std::move(index);
+}
+
+/*  Освобождает записи, убранные из индекса в прошлой эпохе, если все
+ * попадания, начавшиеся до текущей эпохи, завершились, и начинает новую
+ * эпоху. Попадания прошлой эпохи могли видеть записи, убранные в
+ * текущей, поэтому те освобождаются только при следующей смене эпохи.
+ * Промах никогда не ждет попаданий: если они еще идут, мусор просто
+ * копится до следующего промаха */
+template <class DataBase, class Weigher>
+void ClockCache<DataBase, Weigher>::reclaim(Shard& shard) const
+{
+	if (shard.retired_before.empty() && shard.retired_now.empty())
+		return;
+	uint64_t epoch = shard.epoch.load(std::memory_order_relaxed);
+	if (shard.nreaders[(epoch + 1) & 1].load() != 0)
+		return;
+
+	shard.retired_before.clear();
+	std::swap(shard.retired_before, shard.retired_now);
+	shard.epoch.store(epoch + 1);
+}
+
+template <class DataBase, class Weigher>
+const typename ClockCache<DataBase, Weigher>::page_t&
+ClockCache<DataBase, Weigher>::get_temp_page(const key_t& key) const
+{
+	return m_page_bufs.get() = get_page(key);
+}
+
+template <class DataBase, class Weigher>
+bool ClockCache<DataBase, Weigher>::is_cached(const key_t& key) const
+{
+	uint64_t hash = key_hash(key);
+	Shard& shard = shard_for(hash);
+	ReadGuard guard(shard);
+	return find(*shard.index.load(std::memory_order_acquire), key, hash);
+}
+
+template <class DataBase, class Weigher>
+uint64_t ClockCache<DataBase, Weigher>::nhits() const
 {
-	auto it = m_hashtbl.find(key);
+	uint64_t nhits = 0;
+	for (auto& shard : m_shards)
+		nhits += shard->nhits.load(std::memory_order_relaxed);
+	return nhits;
+}
 
-	_CACHE_PRINTMSG_REQUESTED_PAGE(RandomCache, key);
+template <class DataBase, class Weigher>
+uint64_t ClockCache<DataBase, Weigher>::nlookups() const
+{
+	uint64_t nlookups = 0;
+	for (auto& shard : m_shards)
+		nlookups += shard->nlookups.load(std::memory_order_relaxed);
+	return nlookups;
+}
 
-	if (it != m_hashtbl.end()) {
-		_CACHE_PRINTMSG_FOUND_IN_CACHE(RandomCache, key);
+template <class DataBase, class Weigher>
+CacheMetrics ClockCache<DataBase, Weigher>::metrics() const
+{
+	CacheMetrics res = AbstractCache<DataBase>::metrics();
+	res.nhits = nhits();
+	res.nmisses = nlookups() - res.nhits;
+	return res;
+}
 
-		this->hit();
-		return it->second;
+template <class DataBase, class Weigher>
+void ClockCache<DataBase, Weigher>::save_snapshot(const std::string& path) const
+{
+	SnapshotWriter out(path);
+	this->write_snapshot_header(out, "ClockCache");
+	out.write<uint64_t>(m_shards.size());
+	for (auto& shard : m_shards) {
+		std::lock_guard<std::mutex> lock(shard->mutex);
+		out.write<uint64_t>(shard->budget);
+		out.write<uint64_t>(shard->capacity);
+		out.write<uint64_t>(shard->hand);
+		out.write<uint64_t>(shard->nhits.load(std::memory_order_relaxed));
+		out.write<uint64_t>(shard->nlookups.load(std::memory_order_relaxed));
+		out.write<uint64_t>(shard->capacity - shard->free_slots.size());
+		for (auto& entry : shard->slots) {
+			if (!entry)
+				continue;
+			out.write<uint64_t>(entry->slot);
+			out.write<uint8_t>(shard->referenced[entry->slot].load(std::memory_order_relaxed));
+			out.write(entry->key);
+			out.write(entry->page);
+		}
+		out.write(shard->free_slots);
 	}
-	
-	this->miss();
-	if (m_hashtbl.size() < this->m_cache_sz) { // есть свободное место в кэше
-		_CACHE_PRINTMSG_VACANT_SPACE(RandomCache);
+	out.commit();
+}
+
+/*  Как и в ShardedLRUCache::load_snapshot(), шарды читаются в новые
+ * объекты. Ключ должен принадлежать своему шарду, каждая ячейка - быть
+ * либо занятой одной страницей, либо свободной */
+template <class DataBase, class Weigher>
+void ClockCache<DataBase, Weigher>::load_snapshot(const std::string& path)
+{
+	SnapshotReader in(path);
+	this->read_snapshot_header(in, "ClockCache");
+	if (in.read<uint64_t>() != m_shards.size())
+		throw SnapshotError(path, "ClockCache: '" + path + "' is a snapshot of a cache"
+			" with different nshards");
+
+	auto corrupted = [&path]()
+		{ return SnapshotError(path, "ClockCache: snapshot '" + path + "' is corrupted"); };
+	std::vector<std::unique_ptr<Shard>> shards;
+	shards.reserve(m_shards.size());
+	for (size_t i = 0; i < m_shards.size(); ++i) {
+		uint64_t budget = in.read<uint64_t>();
+		uint64_t capacity = in.read<uint64_t>();
+		if (budget != m_shards[i]->budget || capacity != m_shards[i]->capacity)
+			throw SnapshotError(path, "ClockCache: '" + path + "' is a snapshot of a cache"
+				" with different size or max_pages");
+		shards.emplace_back(new Shard(budget, capacity));
+		Shard& shard = *shards.back();
+		shard.hand = in.read<uint64_t>();
+		uint64_t nhits = in.read<uint64_t>();
+		uint64_t nlookups = in.read<uint64_t>();
+		if (shard.hand >= capacity || nhits > nlookups)
+			throw corrupted();
+		shard.nhits.store(nhits, std::memory_order_relaxed);
+		shard.nlookups.store(nlookups, std::memory_order_relaxed);
 
-		return m_hashtbl[key] = this->m_db.get_page(key);
+		uint64_t npages = in.read<uint64_t>();
+		for (uint64_t n = 0; n < npages; ++n) {
+			uint64_t slot = in.read<uint64_t>();
+			bool referenced = in.read<uint8_t>();
+			key_t key = in.read<key_t>();
+			page_t page = in.read<page_t>();
+			uint64_t hash = key_hash(key);
+			if (slot >= capacity || shard.slots[slot] || hash % m_shards.size() != i
+				|| find(*shard.index_owner, key, hash))
+				throw corrupted();
+			shard.weight += m_weigher(key, page);
+			shard.referenced[slot].store(referenced, std::memory_order_relaxed);
+			shard.slots[slot].reset(new Entry{std::move(key), std::move(page), slot});
+			index_insert(shard, shard.slots[slot].get(), hash);
+		}
+		/*  Порядок свободных ячеек определяет, куда попадут следующие
+		 * страницы, поэтому он тоже сохраняется */
+		std::vector<size_t> free_slots = in.read<std::vector<size_t>>();
+		std::vector<bool> seen(capacity);
+		for (size_t slot : free_slots) {
+			if (slot >= capacity || shard.slots[slot] || seen[slot])
+				throw corrupted();
+			seen[slot] = true;
+		}
+		if (shard.weight > budget || free_slots.size() + npages != capacity)
+			throw corrupted();
+		shard.free_slots.swap(free_slots);
 	}
-	
-	it = get_random_it(m_hashtbl);
-	assert(it != m_hashtbl.end());
-	_CACHE_PRINTMSG_DELETING_PAGE(RandomCache, it->first);
-	m_hashtbl.erase(it);
-	return m_hashtbl[key] = this->m_db.get_page(key);
+	if (!in.at_end())
+		throw corrupted();
+	m_shards.swap(shards);
 }
 
-template <class DataBase>
-typename RandomCache<DataBase>::Hashtable::iterator
-RandomCache<DataBase>::get_random_it(Hashtable& hashtbl) const
+
+constexpr SlotLists::slot_t SlotLists::NIL;
+
+inline void SlotLists::push_front(List& lst, slot_t slot)
 {
-	auto it = hashtbl.begin();
-	std::advance(it, rand() % hashtbl.size()); // O(n) !
-	return it;
+	m_prev[slot] = NIL;
+	m_next[slot] = lst.head;
+	if (lst.head != NIL)
+		m_prev[lst.head] = slot;
+	else
+		lst.tail = slot;
+	lst.head = slot;
+	++lst.size;
 }
 
+inline void SlotLists::unlink(List& lst, slot_t slot)
+{
+	assert(lst.size > 0);
+	if (m_prev[slot] != NIL)
+		m_next[m_prev[slot]] = m_next[slot];
+	else
+		lst.head = m_next[slot];
+	if (m_next[slot] != NIL)
+		m_prev[m_next[slot]] = m_prev[slot];
+	else
+		lst.tail = m_prev[slot];
+	--lst.size;
+}
 
-template <class DataBase>
-const typename LRUCache<DataBase>::page_t&
-LRUCache<DataBase>::get_temp_page(const key_t& key) const
+inline std::vector<SlotLists::slot_t> SlotLists::slots(const List& lst) const
 {
-	assert(m_lst.size() == m_hashtbl.size());
+	std::vector<slot_t> res;
+	res.reserve(lst.size);
+	for (slot_t slot = lst.head; slot != NIL; slot = m_next[slot])
+		res.push_back(slot);
+	return res;
+}
 
-	_CACHE_PRINTMSG_REQUESTED_PAGE(LRUCache, key);
+inline bool SlotLists::fill(List& lst, const std::vector<slot_t>& slots, std::vector<bool>& seen)
+{
+	assert(lst.size == 0);
+	for (slot_t slot : slots) {
+		if (slot >= seen.size() || seen[slot])
+			return false;
+		seen[slot] = true;
+	}
+	for (auto it = slots.rbegin(); it != slots.rend(); ++it)
+		push_front(lst, *it);
+	return true;
+}
 
-	auto search = m_hashtbl.find(key);
-	if (search != m_hashtbl.end()) { // страница найдена в кэше
-		_CACHE_PRINTMSG_FOUND_IN_CACHE(LRUCache, key);
-		this->hit();
 
-		auto listit = search->second;
-		if (listit != m_lst.begin())
-			m_lst.splice(m_lst.cbegin(), m_lst, listit);
-		return listit->page;
-	}
+template <class Key, class Hash, class Allocator>
+template <class In>
+bool LRUPolicy<Key, Hash, Allocator>::load(In& in, size_t nslots)
+{
+	std::vector<bool> seen(nslots);
+	return m_lists.fill(m_lru, in.template read<std::vector<SlotLists::slot_t>>(), seen)
+		&& m_lru.size == nslots;
+}
 
-	this->miss();
-	if (m_lst.size() >= this->m_cache_sz) { // вытеснение LRU страницы
-		_CACHE_PRINTMSG_DELETING_PAGE(LRUCache, m_lst.back().key);
 
-		m_hashtbl.erase(m_lst.back().key);
-		m_lst.pop_back();		
+template <class Key, class Hash, class Allocator>
+TWOQPolicy<Key, Hash, Allocator>::TWOQPolicy(size_t capacity, const Hash& hash,
+	const Allocator& alloc) :
+	m_lists(capacity),
+	m_in_am(capacity, false),
+	m_kin(std::min(std::max<size_t>(capacity / 4, 1), capacity - 1)),
+	m_kout(std::max<size_t>(capacity / 2, 1)),
+	m_a1out(alloc),
+	m_a1out_index(m_kout, hash, std::equal_to<Key>(), alloc)
+{
+	assert(capacity > 1);
+}
+
+template <class Key, class Hash, class Allocator>
+void TWOQPolicy<Key, Hash, Allocator>::on_insert(size_t slot, const Key& key)
+{
+	auto ghost = m_a1out_index.find(key);
+	if (ghost != m_a1out_index.end()) {
+		/* Недавно вытеснена из A1in и снова запрошена - в Am */
+		m_a1out.erase(ghost->second);
+		m_a1out_index.erase(ghost);
+		m_in_am[slot] = true;
+		m_lists.push_front(m_am, slot);
 	} else {
-		_CACHE_PRINTMSG_VACANT_SPACE(LRUCache);
+		m_in_am[slot] = false;
+		m_lists.push_front(m_a1in, slot);
+	}
+	/*  evict() только что запомнила вытесненный ключ, не забывая самый
+	 * старый: им мог оказаться key, который тогда попал бы в A1in */
+	if (m_a1out.size() > m_kout) {
+		m_a1out_index.erase(m_a1out.back());
+		m_a1out.pop_back();
 	}
-
-	m_lst.push_front({key, this->m_db.get_page(key)});
-	m_hashtbl[key] = m_lst.begin();
-	return m_lst.front().page;
 }
 
-template <class DataBase>
-const typename TWOQCache<DataBase>::page_t&
-TWOQCache<DataBase>::get_temp_page(const key_t& key) const
+template <class Key, class Hash, class Allocator>
+template <class KeyOf>
+size_t TWOQPolicy<Key, Hash, Allocator>::evict(KeyOf key_of)
 {
-	assert(m_lru_queue.size() <= m_lru_sz);
-	assert(m_fifo_queue.size() <= m_fifo_sz);
-	assert(m_hashtbl.size() == m_lru_queue.size() + m_fifo_queue.size());
+	if (m_a1in.size > m_kin || m_am.size == 0) {
+		size_t slot = m_a1in.tail;
+		m_lists.unlink(m_a1in, slot);
+		/*  Лишний самый старый ключ забывает on_insert() */
+		m_a1out.push_front(key_of(slot));
+		m_a1out_index[m_a1out.front()] = m_a1out.begin();
+		return slot;
+	}
+	size_t slot = m_am.tail;
+	m_lists.unlink(m_am, slot);
+	return slot;
+}
 
-	_CACHE_PRINTMSG_REQUESTED_PAGE(TWOQCache, key);
+template <class Key, class Hash, class Allocator>
+template <class Out>
+void TWOQPolicy<Key, Hash, Allocator>::save(Out& out) const
+{
+	out.write(m_lists.slots(m_a1in));
+	out.write(m_lists.slots(m_am));
+	write_keys(out, m_a1out);
+}
 
-	auto search = m_hashtbl.find(key);
-	if (search != m_hashtbl.end()) {
-		_CACHE_PRINTMSG_FOUND_IN_CACHE(TWOQCache, key);
-		this->hit();
+template <class Key, class Hash, class Allocator>
+template <class In>
+bool TWOQPolicy<Key, Hash, Allocator>::load(In& in, size_t nslots)
+{
+	std::vector<bool> seen(nslots);
+	if (!m_lists.fill(m_a1in, in.template read<std::vector<SlotLists::slot_t>>(), seen)
+		|| !m_lists.fill(m_am, in.template read<std::vector<SlotLists::slot_t>>(), seen)
+		|| m_a1in.size + m_am.size != nslots)
+		return false;
+	for (SlotLists::slot_t slot : m_lists.slots(m_am))
+		m_in_am[slot] = true;
 
-		auto& found_page = search->second;
-		if (found_page.location == HashtblEntry::FIFO_QUEUE) {
-			/*  Страница найдена в FIFO очереди, переносим в более приоритетную
-			 * LRU очередь */
-			if (m_lru_queue.size() == m_lru_sz) {
-				_CACHE_PRINTMSG_DELETING_PAGE(TWOQCache, m_lru_queue.back().key);
-				pop_page(m_lru_queue);
-			}
-			m_lru_queue.splice(m_lru_queue.begin(), m_fifo_queue, found_page.it); // Переносим в LRU
-			found_page.location = HashtblEntry::LRU_QUEUE; // Меняем флажок нахождения
-		} else if (found_page.it != m_lru_queue.begin()) {
-			/*  Страница найдена в LRU очереди. Если она не первая, то
-			 * перемещаем в начало этой же очереди */
-			m_lru_queue.splice(m_lru_queue.begin(), m_lru_queue, found_page.it);
+	bool consistent = true;
+	read_keys<Key>(in, [&](Key key) {
+		if (m_a1out.size() == m_kout || m_a1out_index.count(key)) {
+			consistent = false;
+			return;
 		}
-		return found_page.it->page;
+		m_a1out.push_back(std::move(key));
+		m_a1out_index[m_a1out.back()] = std::prev(m_a1out.end());
+	});
+	return consistent;
+}
+
+template <class Key, class Hash, class Allocator>
+template <class KeyOf>
+size_t ClockPolicy<Key, Hash, Allocator>::evict(KeyOf)
+{
+	/* Даем второй шанс ячейкам с выставленным битом обращения */
+	while (m_referenced[m_hand]) {
+		m_referenced[m_hand] = 0;
+		m_hand = (m_hand + 1) % m_referenced.size();
+	}
+	size_t slot = m_hand;
+	m_hand = (m_hand + 1) % m_referenced.size();
+	return slot;
+}
+
+template <class Key, class Hash, class Allocator>
+template <class In>
+bool ClockPolicy<Key, Hash, Allocator>::load(In& in, size_t)
+{
+	std::vector<unsigned char> referenced = in.template read<std::vector<unsigned char>>();
+	uint64_t hand = in.template read<uint64_t>();
+	if (referenced.size() != m_referenced.size() || hand >= referenced.size())
+		return false;
+	m_referenced.swap(referenced);
+	m_hand = hand;
+	return true;
+}
+
+template <class Key, class Hash, class Allocator>
+template <class KeyOf>
+size_t RandomPolicy<Key, Hash, Allocator>::evict(KeyOf)
+{
+	assert(m_capacity <= UINT32_MAX);
+	m_state ^= m_state >> 12;
+	m_state ^= m_state << 25;
+	m_state ^= m_state >> 27;
+	uint64_t rnd = (m_state * 0x2545F4914F6CDD1DULL) >> 32;
+	return (rnd * m_capacity) >> 32;
+}
+
+template <class Key, class Hash, class Allocator>
+template <class In>
+bool RandomPolicy<Key, Hash, Allocator>::load(In& in, size_t)
+{
+	uint64_t capacity = in.template read<uint64_t>();
+	uint64_t state = in.template read<uint64_t>();
+	if (capacity != m_capacity || state == 0)
+		return false;
+	m_state = state;
+	return true;
+}
+
+
+template <class DataBase, template <class...> class EvictionPolicy, class Hash, class Allocator>
+BasicCache<DataBase, EvictionPolicy, Hash, Allocator>::BasicCache(const DataBase& db,
+	size_t cache_sz, const Hash& hash, const Allocator& alloc) :
+	m_db(db), m_cache_sz(cache_sz),
+	m_keys(alloc), m_pages(alloc),
+	m_index(cache_sz, hash, TransparentEqual<key_t>(), alloc),
+	m_policy(cache_sz, hash, alloc)
+{
+	assert(cache_sz > 0 && cache_sz < UINT32_MAX);
+	m_keys.reserve(cache_sz);
+	m_pages.reserve(cache_sz);
+}
+
+template <class DataBase, template <class...> class EvictionPolicy, class Hash, class Allocator>
+BasicCache<DataBase, EvictionPolicy, Hash, Allocator>::BasicCache(const DataBase& db,
+	size_t cache_sz, policy_t policy, const Hash& hash, const Allocator& alloc) :
+	m_db(db), m_cache_sz(cache_sz),
+	m_keys(alloc), m_pages(alloc),
+	m_index(cache_sz, hash, TransparentEqual<key_t>(), alloc),
+	m_policy(std::move(policy))
+{
+	assert(cache_sz > 0 && cache_sz < UINT32_MAX);
+	m_keys.reserve(cache_sz);
+	m_pages.reserve(cache_sz);
+}
+
+template <class DataBase, template <class...> class EvictionPolicy, class Hash, class Allocator>
+inline const typename BasicCache<DataBase, EvictionPolicy, Hash, Allocator>::page_t&
+BasicCache<DataBase, EvictionPolicy, Hash, Allocator>::get_temp_page(key_view_t<key_t> key) const
+{
+	_CACHE_PRINTMSG_REQUESTED_PAGE(BasicCache, key);
+
+	auto search = m_index.find(key);
+	if (search != m_index.end()) {
+		_CACHE_PRINTMSG_FOUND_IN_CACHE(BasicCache, key);
+		this->hit();
+		m_policy.on_hit(search->second);
+		return m_pages[search->second];
 	}
+	return miss_page(key);
+}
 
+/*  Промах вынесен в отдельную функцию, чтобы встраиваемый путь попадания
+ * оставался коротким */
+template <class DataBase, template <class...> class EvictionPolicy, class Hash, class Allocator>
+const typename BasicCache<DataBase, EvictionPolicy, Hash, Allocator>::page_t&
+BasicCache<DataBase, EvictionPolicy, Hash, Allocator>::miss_page(key_view_t<key_t> key) const
+{
 	this->miss();
-	/* Если страница не была найдена */
-	if (m_fifo_queue.size() == m_fifo_sz) {
-		_CACHE_PRINTMSG_DELETING_PAGE(TWOQCache, m_fifo_queue.back().key);
-		pop_page(m_fifo_queue);
+	key_t owned_key(key);
+	page_t page = (this->count_fetch()) ? timed_fetch(owned_key) : m_db.get_page(owned_key);
+	this->count_inserted_bytes(page_bytes(page));
+
+	size_t slot = m_pages.size();
+	if (slot < m_cache_sz) {
+		_CACHE_PRINTMSG_VACANT_SPACE(BasicCache);
+		m_keys.push_back(std::move(owned_key));
+		m_pages.push_back(std::move(page));
 	} else {
-		_CACHE_PRINTMSG_VACANT_SPACE(TWOQCache);
+		slot = m_policy.evict([this](size_t victim) -> const key_t& { return m_keys[victim]; });
+		assert(slot < m_cache_sz);
+		_CACHE_PRINTMSG_DELETING_PAGE(BasicCache, m_keys[slot]);
+		this->count_eviction();
+		if (m_eviction_listener)
+			m_eviction_listener(m_keys[slot], m_pages[slot]);
+		m_index.erase(m_keys[slot]);
+		m_keys[slot] = std::move(owned_key);
+		m_pages[slot] = std::move(page);
 	}
-	m_fifo_queue.push_front({key, this->m_db.get_page(key)});
-	m_hashtbl[key] = { HashtblEntry::FIFO_QUEUE, m_fifo_queue.begin() };
-	return m_fifo_queue.front().page;
+	m_index.emplace(m_keys[slot], slot);
+	m_policy.on_insert(slot, m_keys[slot]);
+	return m_pages[slot];
 }
 
-template <class DataBase>
-void TWOQCache<DataBase>::pop_page(std::list<ListEntry>& queue) const
+
+template <class DataBase, template <class...> class EvictionPolicy, class Hash, class Allocator>
+void BasicCache<DataBase, EvictionPolicy, Hash, Allocator>::save_snapshot(const std::string& path) const
+{
+	SnapshotWriter out(path);
+	out.write(std::string("BasicCache"));
+	out.write(std::string(policy_t::name()));
+	out.write<uint64_t>(m_cache_sz);
+	out.write<uint64_t>(this->nhits());
+	out.write<uint64_t>(this->nlookups());
+	out.write<uint64_t>(m_pages.size());
+	for (size_t slot = 0; slot < m_pages.size(); ++slot) {
+		out.write(m_keys[slot]);
+		out.write(m_pages[slot]);
+	}
+	m_policy.save(out);
+	out.commit();
+}
+
+/*  Аналогично AbstractCache::read_snapshot_header(), но BasicCache не
+ * наследуется от AbstractCache. Снимок читается в новые массивы, индекс и
+ * политику, поэтому при ошибке кэш остается прежним */
+template <class DataBase, template <class...> class EvictionPolicy, class Hash, class Allocator>
+void BasicCache<DataBase, EvictionPolicy, Hash, Allocator>::load_snapshot(const std::string& path)
+{
+	SnapshotReader in(path);
+	std::string cache = in.read<std::string>();
+	std::string policy_name = in.read<std::string>();
+	if (cache != "BasicCache" || policy_name != policy_t::name())
+		throw SnapshotError(path, "BasicCache: '" + path + "' is a snapshot of "
+			+ cache + " with " + policy_name);
+	if (in.read<uint64_t>() != m_cache_sz)
+		throw SnapshotError(path, "BasicCache: '" + path + "' is a snapshot of a cache"
+			" of different size");
+	uint64_t nhits = in.read<uint64_t>();
+	uint64_t nlookups = in.read<uint64_t>();
+
+	auto corrupted = [&path]()
+		{ return SnapshotError(path, "BasicCache: snapshot '" + path + "' is corrupted"); };
+	uint64_t npages = in.read<uint64_t>();
+	if (npages > m_cache_sz || nhits > nlookups)
+		throw corrupted();
+	std::vector<key_t, Rebind<key_t>> keys(m_keys.get_allocator());
+	std::vector<page_t, Rebind<page_t>> pages(m_pages.get_allocator());
+	keys.reserve(m_cache_sz);
+	pages.reserve(m_cache_sz);
+	Index index(m_cache_sz, m_index.hash_function(), m_index.key_eq(), m_index.get_allocator());
+	for (uint64_t slot = 0; slot < npages; ++slot) {
+		keys.push_back(in.read<key_t>());
+		pages.push_back(in.read<page_t>());
+		if (!index.emplace(keys.back(), slot).second)
+			throw corrupted();
+	}
+	policy_t policy(m_cache_sz, m_index.hash_function(), m_keys.get_allocator());
+	if (!policy.load(in, npages) || !in.at_end())
+		throw corrupted();
+
+	m_keys.swap(keys);
+	m_pages.swap(pages);
+	m_index.swap(index);
+	m_policy = std::move(policy);
+	this->restore_counters(nhits, nlookups);
+}
+
+template <class DataBase, template <class...> class EvictionPolicy, class Hash, class Allocator>
+typename BasicCache<DataBase, EvictionPolicy, Hash, Allocator>::page_t
+BasicCache<DataBase, EvictionPolicy, Hash, Allocator>::timed_fetch(const key_t& key) const
+{
+	auto start = std::chrono::steady_clock::now();
+	page_t page = m_db.get_page(key);
+	this->count_fetch_time(std::chrono::duration_cast<std::chrono::nanoseconds>(
+		std::chrono::steady_clock::now() - start).count());
+	return page;
+}
+
+
+template <class DataBase, template <class...> class EvictionPolicy, class Hash, class Allocator>
+PolicyCache<DataBase, EvictionPolicy, Hash, Allocator>::PolicyCache(const DataBase& db,
+	size_t cache_sz, const Hash& hash, const Allocator& alloc) :
+	AbstractCache<DataBase>(db, cache_sz),
+	m_loader(*this),
+	m_cache(m_loader, cache_sz, hash, alloc)
 {
-	assert(queue.size() != 0);
-	assert(m_hashtbl.size() != 0);
+	m_cache.set_eviction_listener(
+		[this](const key_t& key, const page_t& page) { this->evicted(key, page); });
+}
 
-	m_hashtbl.erase(queue.back().key);
-	queue.pop_back();
+template <class DataBase, template <class...> class EvictionPolicy, class Hash, class Allocator>
+const typename PolicyCache<DataBase, EvictionPolicy, Hash, Allocator>::page_t&
+PolicyCache<DataBase, EvictionPolicy, Hash, Allocator>::lookup(key_view_t<key_t> key) const
+{
+	uint64_t nhits = m_cache.nhits();
+	const page_t& page = m_cache.get_temp_page(key);
+	if (m_cache.nhits() != nhits)
+		this->hit();
+	else
+		this->miss();
+	return page;
 }
 
 
@@ -200,6 +2999,514 @@ BeladyCache<DataBase>::get_temp_page(const key_t& key,
 }
 
 
+template <class DataBase>
+template <class BidirIt>
+BeladySimulator<DataBase>::BeladySimulator(const DataBase& db, size_t cache_sz,
+	BidirIt queries_from, BidirIt queries_to) :
+	m_db(db), m_cache_sz(cache_sz),
+	m_next_use(std::distance(queries_from, queries_to)),
+	m_pos(0)
+{
+	assert(cache_sz > 0);
+	m_hashtbl.reserve(cache_sz);
+	m_heap.reserve(2 * cache_sz + 1);
+
+	/* Проход с конца: last_use[key] - ближайший уже просмотренный запрос key */
+	std::unordered_map<key_t, size_t> last_use;
+	size_t pos = m_next_use.size();
+	while (queries_to != queries_from) {
+		--queries_to, --pos;
+		auto ins = last_use.insert({*queries_to, pos});
+		m_next_use[pos] = (ins.second) ? m_next_use.size() : ins.first->second;
+		ins.first->second = pos;
+	}
+}
+
+template <class DataBase>
+const typename BeladySimulator<DataBase>::page_t&
+BeladySimulator<DataBase>::get_temp_page(const key_t& key) const
+{
+	assert(m_pos < m_next_use.size() && "BeladySimulator: too many queries");
+	assert(m_hashtbl.size() <= m_cache_sz);
+	_CACHE_PRINTMSG_REQUESTED_PAGE(BeladySimulator, key);
+
+	size_t next_use = m_next_use[m_pos++];
+
+	auto search = m_hashtbl.find(key);
+	if (search != m_hashtbl.end()) {
+		_CACHE_PRINTMSG_FOUND_IN_CACHE(BeladySimulator, key);
+		this->hit();
+		search->second.next_use = next_use;
+		push_heap(key, next_use);
+		return search->second.page;
+	}
+
+	this->miss();
+	page_t page = m_db.get_page(key);
+	if (m_hashtbl.size() >= m_cache_sz)
+		evict();
+	else {
+		_CACHE_PRINTMSG_VACANT_SPACE(BeladySimulator);
+	}
+	push_heap(key, next_use);
+	auto ins = m_hashtbl.insert({key, {std::move(page), next_use}});
+	return ins.first->second.page;
+}
+
+template <class DataBase>
+void BeladySimulator<DataBase>::push_heap(const key_t& key, size_t next_use) const
+{
+	if (m_heap.size() > 2 * m_cache_sz) { // слишком много устаревших записей
+		m_heap.clear();
+		for (auto& entry : m_hashtbl)
+			m_heap.push_back({entry.second.next_use, entry.first});
+		std::make_heap(m_heap.begin(), m_heap.end());
+	}
+	m_heap.push_back({next_use, key});
+	std::push_heap(m_heap.begin(), m_heap.end());
+}
+
+/* Удаляет страницу, которая будет запрошена позже всех */
+template <class DataBase>
+void BeladySimulator<DataBase>::evict() const
+{
+	for (;;) {
+		assert(!m_heap.empty());
+		std::pop_heap(m_heap.begin(), m_heap.end());
+		HeapEntry top = std::move(m_heap.back());
+		m_heap.pop_back();
+
+		auto search = m_hashtbl.find(top.key);
+		if (search != m_hashtbl.end() && search->second.next_use == top.next_use) {
+			_CACHE_PRINTMSG_DELETING_PAGE(BeladySimulator, top.key);
+			m_hashtbl.erase(search);
+			return;
+		}
+	}
+}
+
+
+template <class Cache>
+constexpr size_t PrefetchingCache<Cache>::MAX_SUCCESSORS;
+
+template <class Cache>
+PrefetchingCache<Cache>::PrefetchingCache(const database_t& db, size_t cache_sz,
+	size_t top_k, bool detect_stride) :
+	AbstractCache<database_t>(db, cache_sz),
+	m_cache(db, cache_sz),
+	m_top_k(std::min(top_k, MAX_SUCCESSORS)),
+	m_detect_stride(detect_stride),
+	m_max_learned(2 * cache_sz),
+	m_prev_stride(0),
+	m_stride_repeated(false),
+	m_nprefetched(0), m_nprefetch_hits(0), m_ndemand_misses(0),
+	m_miss_latency_us(0),
+	m_max_queue_sz(4 * (m_top_k + 1)),
+	m_max_buffer_sz(std::max<size_t>(cache_sz / 4, 4 * (m_top_k + 1))),
+	m_stop(false)
+{
+	m_cache.set_eviction_listener([this](const key_t& key, const page_t& page) {
+		this->evicted(key, page);
+	});
+	m_worker = std::thread(&PrefetchingCache::worker, this);
+}
+
+template <class Cache>
+PrefetchingCache<Cache>::~PrefetchingCache()
+{
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		m_stop = true;
+	}
+	m_queue_cv.notify_all();
+	m_worker.join();
+}
+
+template <class Cache>
+const typename PrefetchingCache<Cache>::page_t&
+PrefetchingCache<Cache>::get_temp_page(const key_t& key) const
+{
+	_CACHE_PRINTMSG_REQUESTED_PAGE(PrefetchingCache, key);
+
+	std::vector<key_t> predictions;
+	learn(key);
+	predict(key, predictions);
+
+	if (m_cache.is_cached(key)) {
+		_CACHE_PRINTMSG_FOUND_IN_CACHE(PrefetchingCache, key);
+		this->hit();
+		prefetch(predictions);
+		return m_cache.get_temp_page(key);
+	}
+
+	auto start = std::chrono::steady_clock::now();
+	std::unique_lock<std::mutex> lock(m_mutex);
+	bool late = m_pending.count(key);
+	if (late) {
+		auto queued = std::find(m_queue.begin(), m_queue.end(), key);
+		if (queued != m_queue.end()) {
+			/* Загрузка еще не началась, быстрее загрузить самим */
+			m_queue.erase(queued);
+			m_pending.erase(key);
+		} else
+			m_loaded_cv.wait(lock, [this, &key]() { return !m_pending.count(key); });
+	}
+
+	auto search = m_buffer.find(key);
+	if (search != m_buffer.end()) {
+		_CACHE_PRINTMSG_FOUND_IN_CACHE(PrefetchingCache, key);
+		page_t page = std::move(search->second.page);
+		m_buffer_order.erase(search->second.order);
+		m_buffer.erase(search);
+		lock.unlock();
+
+		++m_nprefetch_hits;
+		if (late)
+			this->miss();
+		else
+			this->hit();
+		m_cache.preload_page(key, std::move(page));
+	} else {
+		lock.unlock();
+		++m_ndemand_misses;
+		this->miss();
+	}
+	const page_t& page = m_cache.get_temp_page(key);
+	m_miss_latency_us += std::chrono::duration_cast<std::chrono::microseconds>(
+		std::chrono::steady_clock::now() - start).count();
+
+	prefetch(predictions);
+	return page;
+}
+
+/*  Запоминает переход от предыдущего запрошенного ключа к key */
+template <class Cache>
+void PrefetchingCache<Cache>::learn(const key_t& key) const
+{
+	if (m_prev_key) {
+		auto learned = m_successors.find(*m_prev_key);
+		if (learned == m_successors.end()) {
+			/*  Забываем переходы давно не запрошенного ключа */
+			if (m_successors.size() == m_max_learned) {
+				m_successors.erase(m_learn_order.front());
+				m_learn_order.pop_front();
+			}
+			m_learn_order.push_back(*m_prev_key);
+			learned = m_successors.emplace(*m_prev_key,
+				Successors{{}, std::prev(m_learn_order.end())}).first;
+		} else {
+			m_learn_order.splice(m_learn_order.end(), m_learn_order, learned->second.order);
+		}
+
+		auto& successors = learned->second.top;
+		auto it = std::find_if(successors.begin(), successors.end(),
+			[&key](const Successor& successor) { return successor.key == key; });
+		if (it != successors.end())
+			++it->count;
+		else if (successors.size() < MAX_SUCCESSORS)
+			it = successors.insert(successors.end(), {key, 1});
+		else {
+			/* Вытесняем самого редкого преемника */
+			it = std::prev(successors.end());
+			*it = {key, 1};
+		}
+		/* Поддерживаем порядок по убыванию count */
+		for (; it != successors.begin() && std::prev(it)->count < it->count; --it)
+			std::iter_swap(it, std::prev(it));
+
+		if constexpr (STRIDE_KEYS) {
+			/*  Шаг, не представимый в long long, не распознается */
+			long long stride;
+			if (__builtin_sub_overflow(key, *m_prev_key, &stride))
+				stride = 0;
+			m_stride_repeated = (stride != 0 && stride == m_prev_stride);
+			m_prev_stride = stride;
+		}
+	}
+	m_prev_key = key;
+}
+
+/*  Ключи, которые вероятно будут запрошены после key */
+template <class Cache>
+void PrefetchingCache<Cache>::predict(const key_t& key, std::vector<key_t>& predictions) const
+{
+	auto search = m_successors.find(key);
+	if (search != m_successors.end())
+		for (size_t i = 0; i < m_top_k && i < search->second.top.size(); ++i)
+			predictions.push_back(search->second.top[i].key);
+
+	if constexpr (STRIDE_KEYS) {
+		/*  key + шаг вне диапазона key_t - переполнение, не предсказываем */
+		key_t next;
+		if (m_detect_stride && m_stride_repeated
+			&& !__builtin_add_overflow(key, m_prev_stride, &next))
+			predictions.push_back(next);
+	}
+}
+
+/*  Ставит в очередь фонового потока ключи, которых нет ни в кэше,
+ * ни в буфере. Если очередь переполнена, самые старые предсказания
+ * отбрасываются - они уже устарели */
+template <class Cache>
+void PrefetchingCache<Cache>::prefetch(const std::vector<key_t>& predictions) const
+{
+	if (predictions.empty())
+		return;
+
+	std::vector<key_t> uncached;
+	for (auto& key : predictions)
+		if (!m_cache.is_cached(key))
+			uncached.push_back(key);
+	if (uncached.empty())
+		return;
+
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		for (auto& key : uncached) {
+			if (m_pending.count(key) || m_buffer.count(key))
+				continue;
+			if (m_queue.size() == m_max_queue_sz) {
+				m_pending.erase(m_queue.front());
+				m_queue.pop_front();
+				m_loaded_cv.notify_all();
+			}
+			m_queue.push_back(key);
+			m_pending.insert(key);
+			++m_nprefetched;
+		}
+	}
+	m_queue_cv.notify_one();
+}
+
+template <class Cache>
+void PrefetchingCache<Cache>::worker()
+{
+	std::unique_lock<std::mutex> lock(m_mutex);
+	for (;;) {
+		m_queue_cv.wait(lock, [this]() { return m_stop || !m_queue.empty(); });
+		if (m_stop)
+			return;
+
+		key_t key = std::move(m_queue.front());
+		m_queue.pop_front();
+		lock.unlock();
+
+		std::unique_ptr<page_t> page;
+		try {
+			page.reset(new page_t(this->fetch_page(key)));
+		} catch (...) {
+			/* Неудачное предсказание, например несуществующий ключ */
+		}
+
+		lock.lock();
+		m_pending.erase(key);
+		if (page) {
+			if (m_buffer.size() == m_max_buffer_sz) {
+				/* Самая старая незапрошенная страница - бесполезная загрузка */
+				m_buffer.erase(m_buffer_order.front());
+				m_buffer_order.pop_front();
+			}
+			m_buffer_order.push_back(key);
+			m_buffer.emplace(key, BufferEntry{std::move(*page), std::prev(m_buffer_order.end())});
+		}
+		m_loaded_cv.notify_all();
+	}
+}
+
+
+template <class Cache, class Weigher>
+WriteBackCache<Cache, Weigher>::WriteBackCache(database_t& db, size_t cache_sz,
+	WriteMode mode, size_t flush_batch_sz, size_t max_dirty_weight, const Weigher& weigher) :
+	AbstractCache<database_t>(db, cache_sz),
+	m_cache(db, cache_sz),
+	m_writable_db(db),
+	m_mode(mode),
+	m_flush_batch_sz(flush_batch_sz),
+	m_max_dirty_weight(max_dirty_weight),
+	m_weigher(weigher),
+	m_dirty_weight(0)
+{
+	assert(flush_batch_sz > 0);
+	m_cache.set_eviction_listener([this](const key_t& key, const page_t& page) {
+		if (m_cache.is_dirty(key))
+			keep_evicted(key, page);
+		this->evicted(key, page);
+	});
+}
+
+template <class Cache, class Weigher>
+WriteBackCache<Cache, Weigher>::~WriteBackCache()
+{
+	try {
+		flush();
+	} catch (...) {}
+}
+
+template <class Cache, class Weigher>
+const typename WriteBackCache<Cache, Weigher>::page_t&
+WriteBackCache<Cache, Weigher>::get_temp_page(const key_t& key) const
+{
+	_CACHE_PRINTMSG_REQUESTED_PAGE(WriteBackCache, key);
+
+	if (m_cache.is_cached(key)) {
+		_CACHE_PRINTMSG_FOUND_IN_CACHE(WriteBackCache, key);
+		this->hit();
+		return m_cache.get_temp_page(key);
+	}
+
+	this->miss();
+	/* В базе данных старая версия вытесненной, но еще не записанной страницы */
+	auto search = m_evicted_dirty.find(key);
+	if (search == m_evicted_dirty.end())
+		return m_cache.get_temp_page(key);
+
+	page_t page = std::move(search->second);
+	m_dirty_weight -= m_weigher(key, page);
+	m_evicted_dirty.erase(search);
+	store(key, std::move(page), true);
+	auto kept = m_evicted_dirty.find(key); // не поместилась в m_cache
+	if (m_cache.is_cached(key) || kept == m_evicted_dirty.end())
+		return m_cache.get_temp_page(key);
+	return kept->second;
+}
+
+template <class Cache, class Weigher>
+void WriteBackCache<Cache, Weigher>::put_page(const key_t& key, const page_t& page)
+{
+	_CACHE_PRINTMSG_REQUESTED_PAGE(WriteBackCache, key);
+
+	if (m_mode == WRITE_THROUGH) {
+		m_writable_db.insert_page(key, page);
+		store(key, page, false);
+		return;
+	}
+
+	auto old = m_evicted_dirty.find(key);
+	if (old != m_evicted_dirty.end()) {
+		m_dirty_weight -= m_weigher(old->first, old->second);
+		m_evicted_dirty.erase(old);
+	}
+	store(key, page, true); // повторная запись заменяет грязную страницу
+
+	if (m_max_dirty_weight && m_dirty_weight > m_max_dirty_weight)
+		flush();
+}
+
+template <class Cache, class Weigher>
+void WriteBackCache<Cache, Weigher>::flush()
+{
+	write_evicted();
+	std::vector<std::pair<key_t, page_t>> batch = m_cache.dirty_pages();
+	if (batch.empty())
+		return;
+	m_writable_db.insert_pages(batch);
+	m_cache.mark_clean();
+	for (auto& key_and_page : batch)
+		m_dirty_weight -= m_weigher(key_and_page.first, key_and_page.second);
+}
+
+/*  Кладет страницу в m_cache, не обращаясь к базе данных. Грязная
+ * страница, которую m_cache не принял из-за веса, ждет записи вместе с
+ * вытесненными */
+template <class Cache, class Weigher>
+void WriteBackCache<Cache, Weigher>::store(const key_t& key, page_t page, bool dirty) const
+{
+	size_t weight = m_weigher(key, page);
+	bool was_dirty = m_cache.is_dirty(key);
+	std::optional<page_t> old = m_cache.put_page(key, dirty ? page : std::move(page), dirty);
+	if (was_dirty && old)
+		m_dirty_weight -= m_weigher(key, *old);
+	if (!dirty)
+		return;
+
+	m_dirty_weight += weight;
+	if (!m_cache.is_cached(key))
+		keep_evicted(key, page);
+}
+
+/*  Запоминает вытесненную грязную страницу, ее вес уже учтен в
+ * m_dirty_weight. Прежняя версия той же страницы заменяется */
+template <class Cache, class Weigher>
+void WriteBackCache<Cache, Weigher>::keep_evicted(const key_t& key, const page_t& page) const
+{
+	auto search = m_evicted_dirty.find(key);
+	if (search != m_evicted_dirty.end()) {
+		m_dirty_weight -= m_weigher(search->first, search->second);
+		search->second = page;
+	} else
+		m_evicted_dirty.emplace(key, page);
+	if (m_evicted_dirty.size() >= m_flush_batch_sz)
+		write_evicted();
+}
+
+/*  Записывает вытесненные грязные страницы в базу данных одним вызовом */
+template <class Cache, class Weigher>
+void WriteBackCache<Cache, Weigher>::write_evicted() const
+{
+	if (m_evicted_dirty.empty())
+		return;
+
+	std::vector<std::pair<key_t, page_t>> batch(m_evicted_dirty.begin(), m_evicted_dirty.end());
+	m_writable_db.insert_pages(batch);
+	for (auto& key_and_page : batch)
+		m_dirty_weight -= m_weigher(key_and_page.first, key_and_page.second);
+	m_evicted_dirty.clear();
+}
+
+
+template <class Cache>
+TieredCache<Cache>::TieredCache(const database_t& db, size_t cache_sz,
+	const std::string& l2_path, size_t l2_capacity) :
+	AbstractCache<database_t>(db, cache_sz),
+	m_l1(db, cache_sz),
+	m_l2(l2_path, l2_capacity),
+	m_nl1_hits(0), m_nl2_hits(0),
+	m_l1_latency_ns(0), m_l2_latency_ns(0), m_miss_latency_ns(0)
+{
+	m_l1.set_eviction_listener([this](const key_t& key, const page_t& page) {
+		this->evicted(key, page);
+		m_l2.put(key, page);
+	});
+}
+
+template <class Cache>
+const typename TieredCache<Cache>::page_t&
+TieredCache<Cache>::get_temp_page(const key_t& key) const
+{
+	using clock = std::chrono::steady_clock;
+	auto start = clock::now();
+	auto elapsed_ns = [&start]() {
+		return std::chrono::duration_cast<std::chrono::nanoseconds>(clock::now() - start).count();
+	};
+
+	_CACHE_PRINTMSG_REQUESTED_PAGE(TieredCache, key);
+
+	if (m_l1.is_cached(key)) {
+		_CACHE_PRINTMSG_FOUND_IN_CACHE(TieredCache, key);
+		this->hit();
+		++m_nl1_hits;
+		const page_t& page = m_l1.get_temp_page(key);
+		m_l1_latency_ns += elapsed_ns();
+		return page;
+	}
+
+	if (std::optional<page_t> l2_page = m_l2.take(key)) {
+		/*  Перенос в L1 может вытеснить из L1 другую страницу в L2 */
+		_CACHE_PRINTMSG_FOUND_IN_CACHE(TieredCache, key);
+		this->hit();
+		++m_nl2_hits;
+		m_l1.preload_page(key, std::move(*l2_page));
+		const page_t& page = m_l1.get_temp_page(key);
+		m_l2_latency_ns += elapsed_ns();
+		return page;
+	}
+
+	this->miss();
+	const page_t& page = m_l1.get_temp_page(key);
+	m_miss_latency_ns += elapsed_ns();
+	return page;
+}
+
 #undef _CACHE_PRINTMSG_REQUESTED_PAGE
 #undef _CACHE_PRINTMSG_FOUND_IN_CACHE
 #undef _CACHE_PRINTMSG_VACANT_SPACE
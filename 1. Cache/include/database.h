@@ -7,13 +7,18 @@
  * QuickEndlessDB - содержит бесконечно много страниц типа int, все страницы
  				одинаковы и равны 0. Key - int, Page - int. Имеет самый быстрый
  				доступ к странице, благодаря чему лучше все подходит для тестирования кэшей
+ 				(BasicQuickEndlessDB - то же с любым типом ключа)
  * FileSystemDB - Key - имя файла (std::string), Page - его содержимое в виде std::string
+ * MmapFileSystemDB - Key - имя файла (std::string), Page - отображенный в память
+ 				файл (MappedFile), содержимое не копируется
+ * NegativeCacheDB - обертка над любой базой данных, запоминающая отсутствующие
+ 				ключи, с необязательным фильтром Блума по файлам каталога
  */
 
 #ifndef _DATA_BASE_H_
 #define _DATA_BASE_H_
 
-/* ENDLESS_DB_TIMEOUT_US sets timeout for
+/* ENDLESS_DB_TIMEOUT_US sets default timeout for
  * each call to EndlessDB::get_page() */
 #ifndef ENDLESS_DB_TIMEOUT_US
 #define ENDLESS_DB_TIMEOUT_US 0
@@ -25,11 +30,26 @@
 
 #include <string>
 #include <vector>
+#include <utility>
 #include <iostream>
 #include <unistd.h> // for usleep()
 #include <sys/stat.h> // for stat()
 #include <unordered_map>
+#include <memory>
+#include <string_view>
 #include <cstring> // for strerror()
+#include <fcntl.h> // for open()
+#include <sys/mman.h> // for mmap()
+#include <dirent.h> // for opendir()
+#include <mutex>
+#include <atomic>
+#include <deque>
+#include <list>
+#include <chrono>
+#include <optional>
+#include <type_traits>
+#include "hashing.h" // for key_view_t
+#include "bloom_filter.h"
 
 namespace DB {
 
@@ -56,6 +76,19 @@ public:
 	class PageNotFound;
 
 	virtual page_t get_page(const key_t& key) const = 0;
+
+	/*  Загружает сразу несколько страниц, i-я страница результата
+	 * соответствует keys[i]. Базы данных, у которых одно обращение
+	 * дороже загрузки одной страницы, должны загружать их за один раз,
+	 * по умолчанию - просто get_page() для каждого ключа */
+	virtual std::vector<page_t> get_pages(const std::vector<key_t>& keys) const
+	{
+		std::vector<page_t> pages;
+		pages.reserve(keys.size());
+		for (auto& key : keys)
+			pages.push_back(get_page(key));
+		return pages;
+	}
 };
 
 template <class Key, class Page>
@@ -78,6 +111,15 @@ public:
 	using page_t = Page;
 
 	virtual void insert_page(const key_t& key, const page_t& page) = 0;
+
+	/*  Записывает сразу несколько страниц. Базы данных, у которых одно
+	 * обращение дороже записи одной страницы, должны записывать их за один
+	 * раз, по умолчанию - просто insert_page() для каждой страницы */
+	virtual void insert_pages(const std::vector<std::pair<key_t, page_t>>& pages)
+	{
+		for (auto& key_and_page : pages)
+			insert_page(key_and_page.first, key_and_page.second);
+	}
 };
 
 template <class Key, class Page>
@@ -94,20 +136,39 @@ class EndlessDB :
 	public AbstractIDB<int, std::string>
 {
 public:
+	/*  timeout_us - задержка каждого обращения к базе данных,
+	 * page_cost_us - дополнительная задержка на каждую загружаемую страницу */
+	explicit EndlessDB(useconds_t timeout_us = ENDLESS_DB_TIMEOUT_US,
+		useconds_t page_cost_us = 0) :
+		m_timeout_us(timeout_us), m_page_cost_us(page_cost_us) {}
+
 	page_t get_page(const key_t& key) const override;
+	/* Все страницы загружаются за одно обращение */
+	std::vector<page_t> get_pages(const std::vector<key_t>& keys) const override;
 	bool contains(const key_t& key) const override
 		{ return true; }
+
+private:
+	useconds_t m_timeout_us;
+	useconds_t m_page_cost_us;
 };
 
-class QuickEndlessDB :
-	public AbstractIDB<int, int>
+/*  Key - тип ключа, например uint64_t для ключей из файлов трасс */
+template <class Key>
+class BasicQuickEndlessDB :
+	public AbstractIDB<Key, int>
 {
 public:
+	using key_t = Key;
+	using page_t = int;
+
 	page_t get_page(const key_t& key) const override { return 0; }
 	bool contains(const key_t& key) const override
 		{ return true; }
 };
 
+using QuickEndlessDB = BasicQuickEndlessDB<int>;
+
 
 class FileSystemDB :
 	public AbstractIDB<std::string, std::string>
@@ -118,6 +179,117 @@ public:
 	bool contains(const std::string& filename) const override;
 };
 
+/*  Файл, отображенный в память только для чтения. Копии разделяют одно
+ * отображение (копирование не копирует содержимое файла), оно удаляется
+ * вместе с последней копией. Поэтому страница, лежащая в кэше, остается
+ * действительной, даже если файл удален */
+class MappedFile {
+public:
+	using value_type = char;
+
+	MappedFile() = default;
+
+	std::string_view view() const
+		{ return (m_mapping) ? std::string_view(m_mapping->data, m_mapping->size) : std::string_view(); }
+	const char *data() const { return (m_mapping) ? m_mapping->data : nullptr; }
+	size_t size() const { return (m_mapping) ? m_mapping->size : 0; }
+
+private:
+	struct Mapping {
+		const char *data;
+		size_t size;
+
+		Mapping(const char *mapped_data, size_t mapped_size) :
+			data(mapped_data), size(mapped_size) {}
+		~Mapping() { munmap(const_cast<char *>(data), size); }
+		Mapping(const Mapping& other) = delete;
+		Mapping& operator =(const Mapping& other) = delete;
+	};
+	std::shared_ptr<const Mapping> m_mapping; // nullptr для пустого файла
+
+	friend class MmapFileSystemDB;
+};
+
+class MmapFileSystemDB :
+	public AbstractIDB<std::string, MappedFile>
+{
+public:
+	/* Отображает файл в память */
+	MappedFile get_page(const std::string& filename) const override;
+	bool contains(const std::string& filename) const override;
+};
+
+/*  Обертка над базой данных db, запоминающая отсутствующие ключи на время
+ * ttl (но не больше max_entries ключей). Повторные запросы к ним не доходят
+ * до db: для FileSystemDB это значит без системных вызовов, а через
+ * try_get_page() и known_absent() - еще и без исключений
+ *  build_filter() строит фильтр Блума по всем файлам каталога (для баз
+ * данных, где ключ - путь к файлу). Путь к файлу этого каталога, которого
+ * нет в фильтре, точно отсутствует. Файлы, созданные после build_filter(),
+ * будут считаться отсутствующими до следующего build_filter()
+ *  Потокобезопасна, если потокобезопасна db. build_filter() можно вызывать
+ * одновременно с запросами: новый фильтр строится в стороне и подменяет
+ * старый атомарно, запросы видят либо старый, либо новый фильтр целиком */
+template <class DataBase>
+class NegativeCacheDB :
+	public AbstractIDB<typename DataBase::key_t, typename DataBase::page_t>
+{
+public:
+	using key_t = typename DataBase::key_t;
+	using page_t = typename DataBase::page_t;
+	using PageNotFound = typename AbstractIDB<key_t, page_t>::PageNotFound;
+
+	explicit NegativeCacheDB(const DataBase& db,
+		std::chrono::milliseconds ttl = std::chrono::seconds(1), size_t max_entries = 4096) :
+		m_db(db), m_ttl(ttl), m_max_entries(max_entries), m_nabsent_answers(0) {}
+
+	page_t get_page(const key_t& key) const override;
+	bool contains(const key_t& key) const override;
+
+	/* Как get_page(), но вместо исключения возвращает пустой optional */
+	std::optional<page_t> try_get_page(const key_t& key) const;
+
+	/* true, если ключа точно нет. Не обращается к db */
+	bool known_absent(const key_t& key) const;
+
+	void build_filter(const std::string& dirname);
+
+	/* Число запросов, на которые ответили "нет", не обращаясь к db */
+	size_t nabsent_answers() const { return m_nabsent_answers; }
+
+private:
+	using clock = std::chrono::steady_clock;
+
+	const DataBase& m_db;
+	std::chrono::milliseconds m_ttl;
+	size_t m_max_entries;
+
+	struct Absent {
+		clock::time_point forget_at;
+		typename std::list<key_t>::iterator order_pos;
+	};
+
+	/*  Все ключи запоминаются на одно и то же время ttl, поэтому в
+	 * m_absent_order они упорядочены и по времени, когда их нужно забыть */
+	mutable std::mutex m_mutex;
+	mutable std::unordered_map<key_t, Absent> m_absent;
+	mutable std::list<key_t> m_absent_order; // от старых к новым
+
+	struct DirFilter {
+		Common::BloomFilter<key_t> files;
+		std::string dirname;
+	};
+	std::shared_ptr<const DirFilter> m_filter; // только через atomic_load/atomic_store
+
+	mutable std::atomic<size_t> m_nabsent_answers;
+
+	bool filtered_out(const key_t& key) const;
+	void remember_absent(const key_t& key) const;
+};
+
+/*  Пути ко всем обычным файлам в каталоге dirname (без подкаталогов) */
+std::vector<std::string> list_files(const std::string& dirname);
+
 
 template <class Key, class Page>
 class SimpleDB :
@@ -128,13 +300,39 @@ public:
 	using page_t = Page;
 	using PageNotFound = typename AbstractIDB<Key, Page>::PageNotFound;
 
-	page_t get_page(const key_t& key) const override;
+	SimpleDB() = default;
+	/*  Копия строит свою хэш-таблицу по представлениям своих ключей.
+	 * Перемещение не перемещает сами ключи, поэтому представления остаются верными */
+	SimpleDB(const SimpleDB& other);
+	SimpleDB& operator =(const SimpleDB& other);
+	SimpleDB(SimpleDB&& other) = default;
+	SimpleDB& operator =(SimpleDB&& other) = default;
+
+	page_t get_page(const key_t& key) const override
+		{ return find_page(key); }
 	bool contains(const key_t& key) const override
 		{ return m_hashtbl.count(key); }
-	void insert_page(const key_t& key, const page_t& page) override
-		{ m_hashtbl[key] = page; }
+	void insert_page(const key_t& key, const page_t& page) override;
+
+	/*  Для строковых ключей - поиск по std::string_view или const char *
+	 * без создания временного key_t (см. Cache::key_view_t) */
+	template <class K, class = std::enable_if_t<Cache::is_lookup_key_v<Key, K>>>
+	page_t get_page(const K& key) const
+		{ return find_page(key); }
+	template <class K, class = std::enable_if_t<Cache::is_lookup_key_v<Key, K>>>
+	bool contains(const K& key) const
+		{ return m_hashtbl.count(Cache::key_view_t<Key>(key)); }
+
 private:
-	std::unordered_map<key_t, page_t> m_hashtbl;
+	using key_view_t = Cache::key_view_t<Key>;
+
+	/*  Ключи хранятся в m_keys (deque не перемещает элементы при
+	 * добавлении), хэш-таблица - по их представлениям */
+	std::deque<key_t> m_keys;
+	std::unordered_map<key_view_t, page_t,
+		Cache::TransparentHash<Key>, Cache::TransparentEqual<Key>> m_hashtbl;
+
+	page_t find_page(key_view_t key) const;
 };
 
 
@@ -142,14 +340,14 @@ private:
 
 /******* realization *******/
 
-EndlessDB::page_t EndlessDB::get_page(const key_t& key) const
+inline EndlessDB::page_t EndlessDB::get_page(const key_t& key) const
 {
 #ifdef SIMPLE_DB_VERBOSE
 	std::cout << "> db: loading page " << key;
 	std::cout.flush();
 #endif // SIMPLE_DB_VERBOSE
 
-	usleep(ENDLESS_DB_TIMEOUT_US);
+	usleep(m_timeout_us + m_page_cost_us);
 
 #ifdef SIMPLE_DB_VERBOSE
 	std::cout << "\t\t[ OK ]\n";
@@ -158,7 +356,27 @@ EndlessDB::page_t EndlessDB::get_page(const key_t& key) const
 	return "This is page " + std::to_string(key);
 }
 
-std::string FileSystemDB::get_page
+inline std::vector<EndlessDB::page_t> EndlessDB::get_pages(const std::vector<key_t>& keys) const
+{
+#ifdef SIMPLE_DB_VERBOSE
+	std::cout << "> db: loading " << keys.size() << " pages";
+	std::cout.flush();
+#endif // SIMPLE_DB_VERBOSE
+
+	usleep(m_timeout_us + m_page_cost_us * keys.size());
+
+#ifdef SIMPLE_DB_VERBOSE
+	std::cout << "\t\t[ OK ]\n";
+#endif // SIMPLE_DB_VERBOSE
+
+	std::vector<page_t> pages;
+	pages.reserve(keys.size());
+	for (auto& key : keys)
+		pages.push_back("This is page " + std::to_string(key));
+	return pages;
+}
+
+inline std::string FileSystemDB::get_page
 	(const std::string& filename) const
 {
 	std::string v;
@@ -175,22 +393,217 @@ std::string FileSystemDB::get_page
 	return v;
 }
 
-bool FileSystemDB::contains(const std::string& filename) const
+inline bool FileSystemDB::contains(const std::string& filename) const
 {
 	struct stat statbuf;
 	return (stat(filename.c_str(), &statbuf) == 0);
 }
 
+inline MappedFile MmapFileSystemDB::get_page(const std::string& filename) const
+{
+	int fd = open(filename.c_str(), O_RDONLY);
+	if (fd == -1)
+		throw PageNotFound(filename, "MmapFileSystemDB: cannot"
+			" open file '" + filename + "': " + strerror(errno));
+
+	struct stat statbuf;
+	if (fstat(fd, &statbuf) == -1) {
+		int err = errno;
+		close(fd);
+		throw PageNotFound(filename, "MmapFileSystemDB: cannot"
+			" stat file '" + filename + "': " + strerror(err));
+	}
+
+	MappedFile page;
+	size_t size = statbuf.st_size;
+	if (size != 0) { // пустой файл отобразить нельзя
+		void *data = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+		if (data == MAP_FAILED) {
+			int err = errno;
+			close(fd);
+			throw PageNotFound(filename, "MmapFileSystemDB: cannot"
+				" map file '" + filename + "': " + strerror(err));
+		}
+		page.m_mapping = std::make_shared<const MappedFile::Mapping>(static_cast<const char *>(data), size);
+	}
+	close(fd); // отображение остается действительным и после закрытия файла
+	return page;
+}
+
+inline bool MmapFileSystemDB::contains(const std::string& filename) const
+{
+	struct stat statbuf;
+	return (stat(filename.c_str(), &statbuf) == 0);
+}
+
+inline std::vector<std::string> list_files(const std::string& dirname)
+{
+	std::vector<std::string> files;
+	if (DIR *dir = opendir(dirname.c_str())) {
+		while (struct dirent *entry = readdir(dir)) {
+			std::string path = dirname + "/" + entry->d_name;
+			struct stat statbuf;
+			if (stat(path.c_str(), &statbuf) == 0 && S_ISREG(statbuf.st_mode))
+				files.push_back(path);
+		}
+		closedir(dir);
+	}
+	return files;
+}
+
+template <class DataBase>
+typename NegativeCacheDB<DataBase>::page_t
+NegativeCacheDB<DataBase>::get_page(const key_t& key) const
+{
+	if (known_absent(key))
+		throw PageNotFound(key, "NegativeCacheDB: page is known to be absent");
+	try {
+		return m_db.get_page(key);
+	} catch (PageNotFound&) {
+		remember_absent(key);
+		throw;
+	}
+}
+
+template <class DataBase>
+bool NegativeCacheDB<DataBase>::contains(const key_t& key) const
+{
+	if (known_absent(key))
+		return false;
+	bool found = m_db.contains(key);
+	if (!found)
+		remember_absent(key);
+	return found;
+}
+
+template <class DataBase>
+std::optional<typename NegativeCacheDB<DataBase>::page_t>
+NegativeCacheDB<DataBase>::try_get_page(const key_t& key) const
+{
+	if (known_absent(key))
+		return std::nullopt;
+	try {
+		return m_db.get_page(key);
+	} catch (PageNotFound&) {
+		remember_absent(key);
+		return std::nullopt;
+	}
+}
+
+template <class DataBase>
+bool NegativeCacheDB<DataBase>::known_absent(const key_t& key) const
+{
+	if (filtered_out(key)) {
+		++m_nabsent_answers;
+		return true;
+	}
+
+	std::lock_guard<std::mutex> lock(m_mutex);
+	auto search = m_absent.find(key);
+	if (search == m_absent.end() || search->second.forget_at < clock::now())
+		return false;
+	++m_nabsent_answers;
+	return true;
+}
+
+template <class DataBase>
+void NegativeCacheDB<DataBase>::build_filter(const std::string& dirname)
+{
+	static_assert(std::is_same<key_t, std::string>::value,
+		"NegativeCacheDB::build_filter() requires file path keys");
+
+	std::vector<std::string> files = list_files(dirname);
+	auto filter = std::make_shared<DirFilter>(DirFilter{Common::BloomFilter<key_t>(files.size()), dirname});
+	for (auto& file : files)
+		filter->files.insert(file);
+	std::atomic_store(&m_filter, std::shared_ptr<const DirFilter>(std::move(filter)));
+}
+
+/*  true, если key - путь к файлу из каталога фильтра, которого нет в фильтре */
+template <class DataBase>
+bool NegativeCacheDB<DataBase>::filtered_out(const key_t& key) const
+{
+	if constexpr (std::is_same<key_t, std::string>::value) {
+		std::shared_ptr<const DirFilter> filter = std::atomic_load(&m_filter);
+		if (!filter)
+			return false;
+		size_t dir_len = filter->dirname.size();
+		bool in_dir = key.size() > dir_len + 1
+			&& key.compare(0, dir_len, filter->dirname) == 0
+			&& key[dir_len] == '/'
+			&& key.find('/', dir_len + 1) == std::string::npos;
+		return in_dir && !filter->files.contains(key);
+	} else
+		return false;
+}
+
+template <class DataBase>
+void NegativeCacheDB<DataBase>::remember_absent(const key_t& key) const
+{
+	if (m_max_entries == 0)
+		return;
+	std::lock_guard<std::mutex> lock(m_mutex);
+	clock::time_point now = clock::now();
+	auto search = m_absent.find(key);
+	if (search != m_absent.end()) { // ключ уже был (устаревший) - теперь он самый новый
+		search->second.forget_at = now + m_ttl;
+		m_absent_order.splice(m_absent_order.end(), m_absent_order, search->second.order_pos);
+		return;
+	}
+
+	/*  Сначала забываем устаревшие ключи (они в начале очереди),
+	 * и только если их нет - самый старый из действующих */
+	while (!m_absent_order.empty() && m_absent.at(m_absent_order.front()).forget_at < now) {
+		m_absent.erase(m_absent_order.front());
+		m_absent_order.pop_front();
+	}
+	if (m_absent_order.size() == m_max_entries) {
+		m_absent.erase(m_absent_order.front());
+		m_absent_order.pop_front();
+	}
+	m_absent_order.push_back(key);
+	m_absent.emplace(key, Absent{now + m_ttl, std::prev(m_absent_order.end())});
+}
+
+template <class Key, class Page>
+SimpleDB<Key, Page>::SimpleDB(const SimpleDB& other) :
+	m_keys(other.m_keys)
+{
+	m_hashtbl.reserve(other.m_hashtbl.size());
+	for (auto& key : m_keys)
+		m_hashtbl.emplace(key, other.m_hashtbl.find(key)->second);
+}
+
+template <class Key, class Page>
+SimpleDB<Key, Page>& SimpleDB<Key, Page>::operator =(const SimpleDB& other)
+{
+	if (this != &other)
+		*this = SimpleDB(other);
+	return *this;
+}
+
 template <class Key, class Page>
 typename SimpleDB<Key, Page>::page_t
-SimpleDB<Key, Page>::get_page(const key_t& key) const
+SimpleDB<Key, Page>::find_page(key_view_t key) const
 {
 	try {
 		return m_hashtbl.at(key);
 	}
 	catch (std::out_of_range&) {
-		throw PageNotFound(key, "");
+		throw PageNotFound(key_t(key), "");
+	}
+}
+
+template <class Key, class Page>
+void SimpleDB<Key, Page>::insert_page(const key_t& key, const page_t& page)
+{
+	auto search = m_hashtbl.find(key);
+	if (search != m_hashtbl.end()) {
+		search->second = page;
+		return;
 	}
+	m_keys.push_back(key);
+	m_hashtbl.emplace(m_keys.back(), page);
 }
 
 } // DB namespace end
@@ -0,0 +1,277 @@
+/* DiskStore - хранилище страниц на локальном диске: журнал (append-only log)
+ * в файле и индекс ключ -> место записи в памяти. Используется как второй
+ * уровень TieredCache
+ */
+
+#ifndef _DISK_STORE_H_
+#define _DISK_STORE_H_
+
+#include "snapshot.h"
+#include <string>
+#include <vector>
+#include <list>
+#include <unordered_map>
+#include <optional>
+#include <cstring> // for strerror()
+#include <cstdint>
+#include <cerrno>
+#include <cassert>
+#include <unistd.h> // for pread(), pwrite()
+#include <fcntl.h> // for open()
+
+namespace Cache {
+
+class DiskStoreError {
+public:
+	std::string path;
+	std::string error_description;
+
+	DiskStoreError(const std::string& store_path, const std::string& description = "") :
+		path(store_path),
+		error_description(description) {}
+};
+
+/*  Запись (ключ и страница, см. Serializer в snapshot.h) всегда дописывается
+ * в конец файла path. Перезапись и удаление только помечают старую запись
+ * мертвой. Когда доля мертвых байт в файле превышает max_garbage_ratio,
+ * живые записи переписываются в новый файл (compact())
+ *  capacity - предел суммарного размера живых записей в байтах, при его
+ * превышении вытесняются самые старые записи (FIFO)
+ *  Файл создается заново в конструкторе и удаляется в деструкторе: это
+ * кэш, а не постоянное хранилище. Ошибки ввода-вывода - DiskStoreError */
+template <class Key, class Page>
+class DiskStore {
+public:
+	using key_t = Key;
+	using page_t = Page;
+
+	DiskStore(const std::string& path, size_t capacity, double max_garbage_ratio = 0.5);
+	~DiskStore();
+
+	DiskStore(const DiskStore& other) = delete;
+	DiskStore& operator =(const DiskStore& other) = delete;
+
+	/*  Запись тяжелее capacity не сохраняется */
+	void put(const key_t& key, const page_t& page);
+
+	/*  Читает страницу и удаляет ее из хранилища */
+	std::optional<page_t> take(const key_t& key);
+
+	bool contains(const key_t& key) const { return m_index.count(key); }
+	void erase(const key_t& key);
+
+	void compact();
+
+	size_t size() const { return m_index.size(); }
+	size_t capacity() const { return m_capacity; }
+	size_t live_bytes() const { return m_live_bytes; }
+	size_t file_bytes() const { return m_file_sz; }
+	size_t nevicted() const { return m_nevicted; }
+	size_t ncompactions() const { return m_ncompactions; }
+
+private:
+	using Order = std::list<key_t>;
+	struct Record {
+		uint64_t offset;
+		uint64_t size;
+		typename Order::iterator order;
+	};
+
+	std::string m_path;
+	int m_fd;
+	size_t m_capacity;
+	double m_max_garbage_ratio;
+
+	std::unordered_map<key_t, Record> m_index;
+	Order m_order; // от старых к новым
+	uint64_t m_file_sz;
+	uint64_t m_live_bytes;
+	size_t m_nevicted;
+	size_t m_ncompactions;
+
+	BufferWriter m_write_buf;
+	std::vector<char> m_read_buf;
+
+	static constexpr uint64_t MIN_COMPACTION_FILE_SZ = 1 << 16;
+
+	void drop(typename std::unordered_map<key_t, Record>::iterator record);
+	void read_record(int fd, const Record& record);
+	void write_at(int fd, const char *data, size_t nbytes, uint64_t offset);
+	int open_file(const std::string& path);
+};
+
+
+template <class Key, class Page>
+constexpr uint64_t DiskStore<Key, Page>::MIN_COMPACTION_FILE_SZ;
+
+template <class Key, class Page>
+DiskStore<Key, Page>::DiskStore(const std::string& path, size_t capacity,
+	double max_garbage_ratio) :
+	m_path(path),
+	m_fd(open_file(path)),
+	m_capacity(capacity),
+	m_max_garbage_ratio(max_garbage_ratio),
+	m_file_sz(0), m_live_bytes(0),
+	m_nevicted(0), m_ncompactions(0)
+{
+	assert(capacity > 0);
+	assert(max_garbage_ratio > 0.0 && max_garbage_ratio < 1.0);
+}
+
+template <class Key, class Page>
+DiskStore<Key, Page>::~DiskStore()
+{
+	close(m_fd);
+	unlink(m_path.c_str());
+}
+
+template <class Key, class Page>
+void DiskStore<Key, Page>::put(const key_t& key, const page_t& page)
+{
+	auto old = m_index.find(key);
+	if (old != m_index.end())
+		drop(old);
+
+	m_write_buf.clear();
+	m_write_buf.write(key);
+	m_write_buf.write(page);
+	uint64_t record_sz = m_write_buf.size();
+	if (record_sz > m_capacity)
+		return;
+
+	while (m_live_bytes + record_sz > m_capacity) {
+		++m_nevicted;
+		drop(m_index.find(m_order.front()));
+	}
+
+	write_at(m_fd, m_write_buf.data(), record_sz, m_file_sz);
+	m_order.push_back(key);
+	m_index[key] = { m_file_sz, record_sz, std::prev(m_order.end()) };
+	m_file_sz += record_sz;
+	m_live_bytes += record_sz;
+
+	uint64_t garbage_sz = m_file_sz - m_live_bytes;
+	if (m_file_sz >= MIN_COMPACTION_FILE_SZ && garbage_sz > m_max_garbage_ratio * m_file_sz)
+		compact();
+}
+
+template <class Key, class Page>
+std::optional<typename DiskStore<Key, Page>::page_t>
+DiskStore<Key, Page>::take(const key_t& key)
+{
+	auto search = m_index.find(key);
+	if (search == m_index.end())
+		return std::nullopt;
+
+	read_record(m_fd, search->second);
+	BufferReader in(m_read_buf.data(), m_read_buf.size(), m_path);
+	if (in.read<key_t>() != key)
+		throw DiskStoreError(m_path, "DiskStore: '" + m_path + "' is corrupted");
+	page_t page = in.read<page_t>();
+	drop(search);
+	return page;
+}
+
+template <class Key, class Page>
+void DiskStore<Key, Page>::erase(const key_t& key)
+{
+	auto search = m_index.find(key);
+	if (search != m_index.end())
+		drop(search);
+}
+
+/*  Переписывает живые записи (в прежнем порядке) в новый файл и подменяет
+ * им старый. Каждый байт переписывается не чаще, чем раз на
+ * 1 / max_garbage_ratio - 1 байт записанного мусора */
+template <class Key, class Page>
+void DiskStore<Key, Page>::compact()
+{
+	std::string tmp_path = m_path + ".compact";
+	int tmp_fd = open_file(tmp_path);
+	uint64_t offset = 0;
+	try {
+		for (auto& key : m_order) {
+			Record& record = m_index.find(key)->second;
+			read_record(m_fd, record);
+			write_at(tmp_fd, m_read_buf.data(), record.size, offset);
+			offset += record.size;
+		}
+		if (rename(tmp_path.c_str(), m_path.c_str()) != 0)
+			throw DiskStoreError(m_path, "DiskStore: cannot replace '" + m_path
+				+ "': " + strerror(errno));
+	} catch (DiskStoreError&) {
+		close(tmp_fd);
+		unlink(tmp_path.c_str());
+		throw;
+	}
+
+	/* Файл переписан целиком, теперь можно обновить индекс */
+	offset = 0;
+	for (auto& key : m_order) {
+		Record& record = m_index.find(key)->second;
+		record.offset = offset;
+		offset += record.size;
+	}
+	close(m_fd);
+	m_fd = tmp_fd;
+	m_file_sz = offset;
+	assert(m_file_sz == m_live_bytes);
+	++m_ncompactions;
+}
+
+template <class Key, class Page>
+void DiskStore<Key, Page>::drop(typename std::unordered_map<key_t, Record>::iterator record)
+{
+	assert(record != m_index.end());
+	m_live_bytes -= record->second.size;
+	m_order.erase(record->second.order);
+	m_index.erase(record);
+}
+
+template <class Key, class Page>
+void DiskStore<Key, Page>::read_record(int fd, const Record& record)
+{
+	m_read_buf.resize(record.size);
+	size_t nread = 0;
+	while (nread < record.size) {
+		ssize_t len = pread(fd, m_read_buf.data() + nread, record.size - nread,
+			record.offset + nread);
+		if (len <= 0) {
+			if (len < 0 && errno == EINTR)
+				continue;
+			throw DiskStoreError(m_path, "DiskStore: cannot read '" + m_path + "': "
+				+ ((len < 0) ? strerror(errno) : "unexpected end of file"));
+		}
+		nread += len;
+	}
+}
+
+template <class Key, class Page>
+void DiskStore<Key, Page>::write_at(int fd, const char *data, size_t nbytes, uint64_t offset)
+{
+	size_t nwritten = 0;
+	while (nwritten < nbytes) {
+		ssize_t len = pwrite(fd, data + nwritten, nbytes - nwritten, offset + nwritten);
+		if (len < 0) {
+			if (errno == EINTR)
+				continue;
+			throw DiskStoreError(m_path, "DiskStore: cannot write '" + m_path + "': "
+				+ strerror(errno));
+		}
+		nwritten += len;
+	}
+}
+
+template <class Key, class Page>
+int DiskStore<Key, Page>::open_file(const std::string& path)
+{
+	int fd = open(path.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0600);
+	if (fd == -1)
+		throw DiskStoreError(path, "DiskStore: cannot create file '" + path + "': "
+			+ strerror(errno));
+	return fd;
+}
+
+} // Cache namespace end
+
+#endif // _DISK_STORE_H_
@@ -0,0 +1,185 @@
+/* FrequencySketch - приблизительный счетчик частот запросов ключей для
+ * политик допуска (TinyLFU) */
+
+#ifndef _FREQUENCY_SKETCH_H_
+#define _FREQUENCY_SKETCH_H_
+
+#include "hashing.h"
+#include "bloom_filter.h"
+#include <vector>
+#include <functional>
+#include <algorithm>
+#include <cstddef>
+
+namespace Cache {
+
+/*  Count-Min sketch из 4 строк 4-битных счетчиков (16 счетчиков в
+ * одном uint64_t), перед ним - "привратник" (doorkeeper): фильтр Блума,
+ * который пропускает в счетчики только ключи, встреченные хотя бы второй раз.
+ * Так ключи, запрошенные однажды, не занимают счетчиков
+ *  Оценка частоты - минимум из 4 счетчиков плюс 1, если ключ есть в фильтре,
+ * т.е. от 0 до 16
+ *  Чтобы частоты отражали недавнее прошлое, после каждых sample_sz()
+ * добавлений все счетчики делятся пополам, а фильтр очищается
+ *  Фильтр рассчитан на 4 * nkeys ключей, а за sample_sz() добавлений в
+ * него попадает до 10 * nkeys разных ключей: заполнившись, он пропускал бы
+ * в счетчики и ключи, встреченные впервые. Поэтому он очищается и сам,
+ * когда в него попало столько новых ключей, на сколько он рассчитан.
+ * Ключ должен повториться раньше, чем придут 4 * nkeys новых ключей,
+ * иначе он снова будет считаться встреченным впервые
+ *  nkeys - число ключей, частоты которых нужно различать (обычно размер кэша).
+ * Память: около 6 байт на ключ, из них 4 - фильтр */
+template <class Key, class Hash = std::hash<Key>>
+class FrequencySketch {
+public:
+	explicit FrequencySketch(size_t nkeys);
+
+	void increment(const Key& key);
+	unsigned estimate(const Key& key) const;
+
+	size_t sample_sz() const { return m_sample_sz; }
+
+	/*  Аналогично BloomFilter::save() и load(): счетчики, фильтр, число
+	 * добавлений до старения и новых ключей до очистки фильтра */
+	template <class Out>
+	void save(Out& out) const;
+	template <class In>
+	bool load(In& in);
+
+private:
+	static constexpr int DEPTH = 4;
+	static constexpr int COUNTERS_PER_WORD = 16;
+	static constexpr unsigned MAX_COUNT = 15;
+
+	static constexpr size_t SAMPLE_PER_COUNTER = 10; // sample_sz() / m_width
+	static constexpr size_t DOORKEEPER_PER_COUNTER = 4; // m_doorkeeper_sz / m_width
+
+	std::vector<uint64_t> m_table; // DEPTH строк по m_width счетчиков
+	size_t m_width; // степень двойки
+	size_t m_sample_sz;
+	size_t m_doorkeeper_sz; // ключей до очистки фильтра
+	Common::BloomFilter<Key, Hash> m_doorkeeper;
+	Hash m_hash;
+
+	size_t m_nadditions;
+	size_t m_nnew_keys; // попало в фильтр с последней очистки
+
+	static size_t table_width(size_t nkeys)
+	{
+		size_t width = COUNTERS_PER_WORD;
+		while (width < nkeys)
+			width <<= 1;
+		return width;
+	}
+
+	size_t counter_index(uint64_t h, int row) const
+		{ return row * m_width + (((h & 0xFFFFFFFF) + row * ((h >> 32) | 1)) & (m_width - 1)); }
+	unsigned counter(size_t index) const
+		{ return (m_table[index / COUNTERS_PER_WORD] >> (index % COUNTERS_PER_WORD * 4)) & 0xF; }
+	unsigned min_counter(uint64_t h) const;
+	void halve();
+};
+
+template <class Key, class Hash>
+constexpr int FrequencySketch<Key, Hash>::DEPTH;
+template <class Key, class Hash>
+constexpr int FrequencySketch<Key, Hash>::COUNTERS_PER_WORD;
+template <class Key, class Hash>
+constexpr unsigned FrequencySketch<Key, Hash>::MAX_COUNT;
+template <class Key, class Hash>
+constexpr size_t FrequencySketch<Key, Hash>::SAMPLE_PER_COUNTER;
+template <class Key, class Hash>
+constexpr size_t FrequencySketch<Key, Hash>::DOORKEEPER_PER_COUNTER;
+
+template <class Key, class Hash>
+FrequencySketch<Key, Hash>::FrequencySketch(size_t nkeys) :
+	m_width(table_width(nkeys)),
+	m_sample_sz(SAMPLE_PER_COUNTER * m_width),
+	m_doorkeeper_sz(DOORKEEPER_PER_COUNTER * m_width),
+	m_doorkeeper(m_doorkeeper_sz),
+	m_nadditions(0), m_nnew_keys(0)
+{
+	m_table.assign(DEPTH * m_width / COUNTERS_PER_WORD, 0);
+}
+
+template <class Key, class Hash>
+unsigned FrequencySketch<Key, Hash>::min_counter(uint64_t h) const
+{
+	unsigned count = MAX_COUNT;
+	for (int row = 0; row < DEPTH; ++row)
+		count = std::min(count, counter(counter_index(h, row)));
+	return count;
+}
+
+template <class Key, class Hash>
+void FrequencySketch<Key, Hash>::increment(const Key& key)
+{
+	if (++m_nadditions == m_sample_sz)
+		halve();
+	if (!m_doorkeeper.insert(key)) {
+		/*  Первое появление ключа запоминает только фильтр */
+		if (++m_nnew_keys == m_doorkeeper_sz) {
+			m_doorkeeper.clear();
+			m_nnew_keys = 0;
+		}
+		return;
+	}
+
+	uint64_t h = mix_hash(m_hash(key));
+	for (int row = 0; row < DEPTH; ++row) {
+		size_t index = counter_index(h, row);
+		if (counter(index) < MAX_COUNT)
+			m_table[index / COUNTERS_PER_WORD] += 1ULL << (index % COUNTERS_PER_WORD * 4);
+	}
+}
+
+template <class Key, class Hash>
+unsigned FrequencySketch<Key, Hash>::estimate(const Key& key) const
+{
+	return min_counter(mix_hash(m_hash(key))) + m_doorkeeper.contains(key);
+}
+
+template <class Key, class Hash>
+template <class Out>
+void FrequencySketch<Key, Hash>::save(Out& out) const
+{
+	out.write(m_table);
+	out.template write<uint64_t>(m_nadditions);
+	out.template write<uint64_t>(m_nnew_keys);
+	m_doorkeeper.save(out);
+}
+
+/*  Сначала читается все, затем проверяется, поэтому при false скетч не
+ * меняется */
+template <class Key, class Hash>
+template <class In>
+bool FrequencySketch<Key, Hash>::load(In& in)
+{
+	std::vector<uint64_t> table = in.template read<std::vector<uint64_t>>();
+	uint64_t nadditions = in.template read<uint64_t>();
+	uint64_t nnew_keys = in.template read<uint64_t>();
+	Common::BloomFilter<Key, Hash> doorkeeper(m_doorkeeper_sz);
+	if (table.size() != m_table.size() || nadditions >= m_sample_sz || nnew_keys >= m_doorkeeper_sz
+		|| !doorkeeper.load(in))
+		return false;
+	m_table.swap(table);
+	m_nadditions = nadditions;
+	m_nnew_keys = nnew_keys;
+	m_doorkeeper = std::move(doorkeeper);
+	return true;
+}
+
+/* Старение: все счетчики делятся пополам, фильтр забывает все ключи */
+template <class Key, class Hash>
+void FrequencySketch<Key, Hash>::halve()
+{
+	for (auto& word : m_table)
+		word = (word >> 1) & 0x7777777777777777ULL;
+	m_doorkeeper.clear();
+	m_nnew_keys = 0;
+	m_nadditions /= 2;
+}
+
+} // Cache namespace end
+
+#endif // _FREQUENCY_SKETCH_H_
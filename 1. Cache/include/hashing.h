@@ -0,0 +1,62 @@
+#ifndef _HASHING_H_
+#define _HASHING_H_
+
+#include <string>
+#include <string_view>
+#include <functional>
+#include <type_traits>
+#include <cstdint>
+#include <cstddef>
+#include "mix_hash.h"
+
+namespace Cache {
+
+using Common::mix_hash;
+
+/*  Представление ключа для поиска без копирования: для std::basic_string -
+ * basic_string_view (указывает на ключ, который хранит кэш), для остальных
+ * ключей - сам ключ. Хэш std::string и string_view с теми же символами
+ * совпадает, поэтому индекс по представлениям ищет и по тем, и по другим */
+template <class Key>
+struct KeyView {
+	using type = Key;
+};
+
+template <class Char, class Traits, class Alloc>
+struct KeyView<std::basic_string<Char, Traits, Alloc>> {
+	using type = std::basic_string_view<Char, Traits>;
+};
+
+template <class Key>
+using key_view_t = typename KeyView<Key>::type;
+
+/*  true, если поиск ключа Key по значению типа T не создает временный Key:
+ * для строковых ключей T - string_view, const char * или строковый литерал */
+template <class Key, class T>
+constexpr bool is_lookup_key_v = !std::is_same<key_view_t<Key>, Key>::value
+	&& !std::is_same<std::decay_t<T>, Key>::value
+	&& std::is_convertible<const T&, key_view_t<Key>>::value;
+
+/*  Прозрачный хэш: принимает и Key, и key_view_t<Key> с одинаковым
+ * результатом. is_transparent включает гетерогенный поиск в контейнерах,
+ * которые его поддерживают */
+template <class Key>
+struct TransparentHash {
+	using is_transparent = void;
+
+	size_t operator ()(const key_view_t<Key>& key) const
+		{ return std::hash<key_view_t<Key>>()(key); }
+};
+
+/*  Прозрачное сравнение, пара к TransparentHash */
+template <class Key>
+struct TransparentEqual {
+	using is_transparent = void;
+
+	bool operator ()(const key_view_t<Key>& lhs, const key_view_t<Key>& rhs) const
+		{ return lhs == rhs; }
+};
+
+} // Cache namespace end
+
+#endif // _HASHING_H_
@@ -0,0 +1,208 @@
+/* MissRatioCurve - доля попаданий LRU кэша сразу для всех размеров кэша
+ * за один проход по последовательности запросов (стековые расстояния
+ * Маттсона), с необязательной пространственной выборкой SHARDS
+ */
+
+#ifndef _MISS_RATIO_CURVE_H_
+#define _MISS_RATIO_CURVE_H_
+
+#include "hashing.h"
+#include <vector>
+#include <unordered_map>
+#include <functional>
+#include <algorithm>
+#include <utility>
+#include <cstdint>
+#include <cstddef>
+#include <cassert>
+
+namespace Cache {
+
+/*  Стековое расстояние запроса - число различных ключей, запрошенных после
+ * предыдущего запроса того же ключа. LRU кэш размера cache_sz попадает
+ * ровно тогда, когда расстояние меньше cache_sz, поэтому гистограмма
+ * расстояний дает долю попаданий для любого размера
+ *  Расстояние считается деревом Фенвика по времени последнего запроса
+ * каждого ключа, O(log ndistinct) на запрос. Когда время доходит до конца
+ * дерева, живые отметки перенумеровываются подряд
+ *  sampling_rate < 1 включает SHARDS (Waldspurger et al.): учитываются
+ * только ключи с hash(key) mod P < sampling_rate * P, расстояния
+ * масштабируются на 1 / sampling_rate. Память и время - пропорционально
+ * sampling_rate, ошибка для длинных трасс - доли процента */
+template <class Key, class Hash = std::hash<Key>>
+class MissRatioCurve {
+public:
+	using key_t = Key;
+
+	explicit MissRatioCurve(double sampling_rate = 1.0, const Hash& hash = Hash());
+
+	void access(const key_t& key);
+	template <class InputIt>
+	void access(InputIt first, InputIt last)
+		{ for (; first != last; ++first) access(*first); }
+
+	/* Доля попаданий LRU кэша размера cache_sz */
+	double hit_ratio(size_t cache_sz) const;
+	/* hit_ratio() для всех размеров от 0 до max_cache_sz, O(max_cache_sz) */
+	std::vector<double> hit_ratios(size_t max_cache_sz) const;
+
+	uint64_t nrequests() const { return m_nrequests; }
+	uint64_t nsampled() const { return m_nsampled; }
+	double sampling_rate() const { return m_sampling_rate; }
+
+private:
+	static constexpr uint64_t SAMPLING_MODULUS = 1 << 24;
+	static constexpr size_t MIN_TREE_SZ = 1 << 10;
+
+	double m_sampling_rate;
+	uint64_t m_sampling_threshold;
+	Hash m_hash;
+
+	std::unordered_map<key_t, uint32_t> m_last_access; // ключ -> время
+	std::vector<uint32_t> m_tree; // дерево Фенвика, 1 - последний запрос ключа
+	uint32_t m_time;
+
+	std::vector<uint64_t> m_distances; // гистограмма расстояний выборки
+	uint64_t m_nrequests;
+	uint64_t m_nsampled;
+
+	bool sampled(const key_t& key) const
+		{ return (mix_hash(m_hash(key)) % SAMPLING_MODULUS) < m_sampling_threshold; }
+	void tree_add(uint32_t pos, int delta);
+	uint32_t tree_prefix(uint32_t pos) const; // сумма [0, pos)
+	void renumber();
+	double sampled_hits(const std::vector<uint64_t>& prefix, size_t cache_sz) const;
+};
+
+
+template <class Key, class Hash>
+constexpr uint64_t MissRatioCurve<Key, Hash>::SAMPLING_MODULUS;
+
+template <class Key, class Hash>
+constexpr size_t MissRatioCurve<Key, Hash>::MIN_TREE_SZ;
+
+template <class Key, class Hash>
+MissRatioCurve<Key, Hash>::MissRatioCurve(double sampling_rate, const Hash& hash) :
+	m_sampling_rate(sampling_rate),
+	m_sampling_threshold(std::max<uint64_t>(sampling_rate * SAMPLING_MODULUS, 1)),
+	m_hash(hash),
+	m_tree(MIN_TREE_SZ + 1, 0),
+	m_time(0),
+	m_nrequests(0),
+	m_nsampled(0)
+{
+	assert(sampling_rate > 0.0 && sampling_rate <= 1.0);
+}
+
+template <class Key, class Hash>
+void MissRatioCurve<Key, Hash>::access(const key_t& key)
+{
+	++m_nrequests;
+	if (m_sampling_rate < 1.0 && !sampled(key))
+		return;
+	++m_nsampled;
+
+	if (m_time + 1 == m_tree.size())
+		renumber();
+
+	auto inserted = m_last_access.emplace(key, m_time);
+	if (!inserted.second) {
+		uint32_t& last_time = inserted.first->second;
+		uint32_t distance = tree_prefix(m_time) - tree_prefix(last_time + 1);
+		if (distance >= m_distances.size())
+			m_distances.resize(distance + 1, 0);
+		++m_distances[distance];
+		tree_add(last_time, -1);
+		last_time = m_time;
+	}
+	tree_add(m_time, 1);
+	++m_time;
+}
+
+template <class Key, class Hash>
+double MissRatioCurve<Key, Hash>::hit_ratio(size_t cache_sz) const
+{
+	std::vector<uint64_t> prefix(m_distances.size() + 1, 0);
+	for (size_t d = 0; d < m_distances.size(); ++d)
+		prefix[d + 1] = prefix[d] + m_distances[d];
+	return sampled_hits(prefix, cache_sz);
+}
+
+template <class Key, class Hash>
+std::vector<double> MissRatioCurve<Key, Hash>::hit_ratios(size_t max_cache_sz) const
+{
+	std::vector<uint64_t> prefix(m_distances.size() + 1, 0);
+	for (size_t d = 0; d < m_distances.size(); ++d)
+		prefix[d + 1] = prefix[d] + m_distances[d];
+
+	std::vector<double> ratios(max_cache_sz + 1);
+	for (size_t cache_sz = 0; cache_sz <= max_cache_sz; ++cache_sz)
+		ratios[cache_sz] = sampled_hits(prefix, cache_sz);
+	return ratios;
+}
+
+/*  Кэш размера cache_sz соответствует кэшу размера cache_sz * sampling_rate
+ * на выборке. Поправка SHARDS-adj: число запросов в выборке отличается от
+ * ожидаемого nrequests * sampling_rate, и разница почти целиком приходится
+ * на самые частые ключи, т.е. на попадания при любом размере кэша */
+template <class Key, class Hash>
+double MissRatioCurve<Key, Hash>::sampled_hits(const std::vector<uint64_t>& prefix,
+	size_t cache_sz) const
+{
+	if (!m_nsampled || !cache_sz)
+		return 0.0;
+	if (m_sampling_rate == 1.0)
+		return static_cast<double>(prefix[std::min(cache_sz, prefix.size() - 1)]) / m_nsampled;
+
+	size_t sampled_sz = static_cast<size_t>(cache_sz * m_sampling_rate + 0.5);
+	double expected = m_nrequests * m_sampling_rate;
+	double hits = prefix[std::min(sampled_sz, prefix.size() - 1)] + (expected - m_nsampled);
+	return std::min(std::max(hits / expected, 0.0), 1.0);
+}
+
+template <class Key, class Hash>
+void MissRatioCurve<Key, Hash>::tree_add(uint32_t pos, int delta)
+{
+	for (size_t i = pos + 1; i < m_tree.size(); i += i & (~i + 1))
+		m_tree[i] += delta;
+}
+
+template <class Key, class Hash>
+uint32_t MissRatioCurve<Key, Hash>::tree_prefix(uint32_t pos) const
+{
+	uint32_t sum = 0;
+	for (size_t i = pos; i > 0; i -= i & (~i + 1))
+		sum += m_tree[i];
+	return sum;
+}
+
+/*  Времена последних запросов заменяются на 0, 1, ... в прежнем порядке,
+ * дерево строится заново с запасом вдвое. Амортизированно O(log ndistinct)
+ * на запрос */
+template <class Key, class Hash>
+void MissRatioCurve<Key, Hash>::renumber()
+{
+	std::vector<std::pair<uint32_t, uint32_t *>> times;
+	times.reserve(m_last_access.size());
+	for (auto& key_and_time : m_last_access)
+		times.emplace_back(key_and_time.second, &key_and_time.second);
+	std::sort(times.begin(), times.end());
+
+	size_t nkeys = times.size();
+	for (size_t i = 0; i < nkeys; ++i)
+		*times[i].second = i;
+	m_time = nkeys;
+
+	/*  Дерево из единиц в [0, nkeys) строится за линейное время: каждая
+	 * ячейка i хранит сумму по (i - lowbit(i), i] */
+	size_t tree_sz = std::max(2 * nkeys, MIN_TREE_SZ);
+	m_tree.assign(tree_sz + 1, 0);
+	for (size_t i = 1; i <= tree_sz; ++i) {
+		size_t low = i - (i & (~i + 1));
+		m_tree[i] = (std::min(i, nkeys) > low) ? std::min(i, nkeys) - low : 0;
+	}
+}
+
+} // Cache namespace end
+
+#endif // _MISS_RATIO_CURVE_H_
@@ -0,0 +1,24 @@
+/* mix_hash() - перемешивание битов хэша. Общий для кэшей и баз данных */
+
+#ifndef _MIX_HASH_H_
+#define _MIX_HASH_H_
+
+#include <cstdint>
+
+namespace Common {
+
+/*  std::hash для целых чисел часто тождественный, поэтому там, где важны
+ * все биты хэша, их дополнительно перемешиваем (финализатор MurmurHash3) */
+inline uint64_t mix_hash(uint64_t h)
+{
+	h ^= h >> 33;
+	h *= 0xff51afd7ed558ccdULL;
+	h ^= h >> 33;
+	h *= 0xc4ceb9fe1a85ec53ULL;
+	h ^= h >> 33;
+	return h;
+}
+
+} // Common namespace end
+
+#endif // _MIX_HASH_H_
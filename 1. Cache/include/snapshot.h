@@ -0,0 +1,409 @@
+/* Снимки (snapshot) кэша на диске, чтобы после перезапуска процесса кэш
+ * начинал не с нуля, а с тем же содержимым и порядком вытеснения
+ * SnapshotWriter - пишет двоичный снимок во временный файл и атомарно
+ 				переименовывает его по commit()
+ * SnapshotReader - отображает снимок в память (mmap) и читает его без разбора
+ 				текста: ключи и страницы фиксированного размера копируются memcpy
+ * BufferReader, BufferWriter - то же для буфера в памяти
+ * write_nested(), read_nested() - снимок кэша внутри снимка другого кэша
+ * Serializer<T> - как записать и прочитать значение типа T. Определен для
+ 				тривиально копируемых типов, std::basic_string, std::vector
+ 				и std::pair, для остальных типов его нужно специализировать
+ */
+
+#ifndef _SNAPSHOT_H_
+#define _SNAPSHOT_H_
+
+#include <string>
+#include <vector>
+#include <utility>
+#include <type_traits>
+#include <cstdio>
+#include <cstring> // for strerror()
+#include <cstdint>
+#include <cerrno>
+#include <unistd.h> // for fsync()
+#include <fcntl.h> // for open()
+#include <sys/stat.h> // for fstat()
+#include <sys/mman.h> // for mmap()
+
+namespace Cache {
+
+class SnapshotError {
+public:
+	std::string path;
+	std::string error_description;
+
+	SnapshotError(const std::string& snapshot_path, const std::string& description = "") :
+		path(snapshot_path),
+		error_description(description) {}
+};
+
+template <class T, class Enable = void>
+struct Serializer;
+
+/*  Снимок пишется в path.tmp, который по commit() переименовывается в path,
+ * поэтому прерванная запись не портит предыдущий снимок. Если commit() не
+ * был вызван, деструктор удаляет временный файл */
+class SnapshotWriter {
+public:
+	explicit SnapshotWriter(const std::string& path);
+	~SnapshotWriter();
+
+	SnapshotWriter(const SnapshotWriter& other) = delete;
+	SnapshotWriter& operator =(const SnapshotWriter& other) = delete;
+
+	void write_bytes(const void *data, size_t nbytes);
+
+	template <class T>
+	void write(const T& value) { Serializer<T>::write(*this, value); }
+
+	void commit();
+
+private:
+	std::string m_path;
+	std::string m_tmp_path;
+	FILE *m_fp;
+};
+
+/*  Чтение из непрерывного буфера в памяти. Выход за конец буфера -
+ * SnapshotError с именем path */
+class BufferReader {
+public:
+	BufferReader(const char *data, size_t size, const std::string& path = "") :
+		m_path(path), m_data(data), m_size(size), m_pos(0) {}
+
+	/*  Указатель на следующие nbytes байт буфера */
+	const char *take(size_t nbytes);
+	void read_bytes(void *data, size_t nbytes)
+		{ if (nbytes) memcpy(data, take(nbytes), nbytes); }
+
+	template <class T>
+	T read() { return Serializer<T>::read(*this); }
+
+	bool at_end() const { return m_pos == m_size; }
+	const std::string& path() const { return m_path; }
+
+protected:
+	std::string m_path;
+	const char *m_data;
+	size_t m_size;
+	size_t m_pos;
+};
+
+/*  Запись в буфер в памяти, например, чтобы узнать размер записи до
+ * того, как она попадет в файл */
+class BufferWriter {
+public:
+	void write_bytes(const void *data, size_t nbytes)
+		{ m_buf.append(static_cast<const char *>(data), nbytes); }
+
+	template <class T>
+	void write(const T& value) { Serializer<T>::write(*this, value); }
+
+	const char *data() const { return m_buf.data(); }
+	size_t size() const { return m_buf.size(); }
+	void clear() { m_buf.clear(); }
+
+private:
+	std::string m_buf;
+};
+
+/*  Файл снимка целиком отображается в память, чтение - сдвиг указателя
+ * и копирование, поэтому время загрузки определяется скоростью диска.
+ * Обрезанный или чужой файл - SnapshotError. Указатели из take()
+ * действительны до уничтожения SnapshotReader */
+class SnapshotReader : public BufferReader {
+public:
+	explicit SnapshotReader(const std::string& path);
+	~SnapshotReader();
+
+	SnapshotReader(const SnapshotReader& other) = delete;
+	SnapshotReader& operator =(const SnapshotReader& other) = delete;
+
+private:
+	void unmap();
+};
+
+
+/*  Serializer<T>::write(out, value) и Serializer<T>::read(in) работают с
+ * любыми out и in с интерфейсом SnapshotWriter/BufferWriter и BufferReader
+ *  Тривиально копируемые типы (числа, POD структуры) пишутся как есть.
+ * Снимок переносим только между машинами с одинаковым порядком байт */
+template <class T, class Enable>
+struct Serializer {
+	static_assert(std::is_trivially_copyable<T>::value,
+		"Serializer<T> must be specialized for this type");
+
+	template <class Out>
+	static void write(Out& out, const T& value)
+		{ out.write_bytes(&value, sizeof(T)); }
+	template <class In>
+	static T read(In& in)
+	{
+		T value;
+		in.read_bytes(&value, sizeof(T));
+		return value;
+	}
+};
+
+template <class Char, class Traits, class Alloc>
+struct Serializer<std::basic_string<Char, Traits, Alloc>> {
+	using string_t = std::basic_string<Char, Traits, Alloc>;
+
+	template <class Out>
+	static void write(Out& out, const string_t& str)
+	{
+		out.template write<uint64_t>(str.size());
+		out.write_bytes(str.data(), str.size() * sizeof(Char));
+	}
+	template <class In>
+	static string_t read(In& in)
+	{
+		uint64_t len = in.template read<uint64_t>();
+		const Char *data = reinterpret_cast<const Char *>(in.take(len * sizeof(Char)));
+		return string_t(data, data + len);
+	}
+};
+
+template <class T, class Alloc>
+struct Serializer<std::vector<T, Alloc>> {
+	template <class Out>
+	static void write(Out& out, const std::vector<T, Alloc>& vec)
+	{
+		out.template write<uint64_t>(vec.size());
+		if constexpr (std::is_trivially_copyable<T>::value)
+			out.write_bytes(vec.data(), vec.size() * sizeof(T));
+		else
+			for (auto& value : vec)
+				out.write(value);
+	}
+	template <class In>
+	static std::vector<T, Alloc> read(In& in)
+	{
+		uint64_t len = in.template read<uint64_t>();
+		std::vector<T, Alloc> vec;
+		if constexpr (std::is_trivially_copyable<T>::value) {
+			const char *data = in.take(len * sizeof(T));
+			vec.resize(len);
+			if (len)
+				memcpy(vec.data(), data, len * sizeof(T));
+		} else {
+			vec.reserve(len);
+			for (uint64_t i = 0; i < len; ++i)
+				vec.push_back(in.template read<T>());
+		}
+		return vec;
+	}
+};
+
+template <class First, class Second>
+struct Serializer<std::pair<First, Second>,
+	std::enable_if_t<!std::is_trivially_copyable<std::pair<First, Second>>::value>>
+{
+	template <class Out>
+	static void write(Out& out, const std::pair<First, Second>& value)
+		{ out.write(value.first), out.write(value.second); }
+	template <class In>
+	static std::pair<First, Second> read(In& in)
+	{
+		First first = in.template read<First>();
+		return {std::move(first), in.template read<Second>()};
+	}
+};
+
+
+/*  Записывает список страниц (элементов с полями key и page) от начала
+ * к концу, а read_pages() передает их в том же порядке в emplace(key, page) */
+template <class Out, class List>
+void write_pages(Out& out, const List& lst)
+{
+	out.template write<uint64_t>(lst.size());
+	for (auto& entry : lst) {
+		out.write(entry.key);
+		out.write(entry.page);
+	}
+}
+
+template <class Key, class Page, class Emplace>
+void read_pages(BufferReader& in, Emplace emplace)
+{
+	uint64_t npages = in.read<uint64_t>();
+	for (uint64_t i = 0; i < npages; ++i) {
+		Key key = in.read<Key>();
+		emplace(std::move(key), in.read<Page>());
+	}
+}
+
+/* Аналогично для списков ключей без страниц */
+template <class Out, class List>
+void write_keys(Out& out, const List& lst)
+{
+	out.template write<uint64_t>(lst.size());
+	for (auto& key : lst)
+		out.write(key);
+}
+
+template <class Key, class Emplace>
+void read_keys(BufferReader& in, Emplace emplace)
+{
+	uint64_t nkeys = in.read<uint64_t>();
+	for (uint64_t i = 0; i < nkeys; ++i)
+		emplace(in.read<Key>());
+}
+
+/*  Аналогично для списков-призраков (элементов с полями key и weight -
+ * вес вытесненной страницы), read_ghosts() вызывает emplace(key, weight) */
+template <class Out, class List>
+void write_ghosts(Out& out, const List& lst)
+{
+	out.template write<uint64_t>(lst.size());
+	for (auto& ghost : lst) {
+		out.write(ghost.key);
+		out.template write<uint64_t>(ghost.weight);
+	}
+}
+
+template <class Key, class Emplace>
+void read_ghosts(BufferReader& in, Emplace emplace)
+{
+	uint64_t nghosts = in.read<uint64_t>();
+	for (uint64_t i = 0; i < nghosts; ++i) {
+		Key key = in.read<Key>();
+		emplace(std::move(key), in.read<uint64_t>());
+	}
+}
+
+/*  Снимок вложенного кэша (его write_snapshot()) записывается блоком с
+ * длиной. read_nested() возвращает этот блок, не разбирая его, поэтому
+ * владелец может прочитать все остальное раньше, чем менять вложенный кэш */
+template <class Out, class Cache>
+void write_nested(Out& out, const Cache& cache)
+{
+	BufferWriter nested;
+	cache.write_snapshot(nested);
+	out.template write<uint64_t>(nested.size());
+	out.write_bytes(nested.data(), nested.size());
+}
+
+inline BufferReader read_nested(BufferReader& in)
+{
+	uint64_t nbytes = in.read<uint64_t>();
+	return BufferReader(in.take(nbytes), nbytes, in.path());
+}
+
+
+namespace snapshot_detail {
+
+const char MAGIC[8] = {'C', 'A', 'C', 'H', 'E', 'S', 'N', 'P'};
+const uint32_t VERSION = 3; // 2 - 64-битные счетчики попаданий, 3 - веса в списках-призраках
+
+} // snapshot_detail namespace end
+
+inline SnapshotWriter::SnapshotWriter(const std::string& path) :
+	m_path(path),
+	m_tmp_path(path + ".tmp"),
+	m_fp(fopen(m_tmp_path.c_str(), "wb"))
+{
+	if (!m_fp)
+		throw SnapshotError(path, "SnapshotWriter: cannot create file '"
+			+ m_tmp_path + "': " + strerror(errno));
+	write_bytes(snapshot_detail::MAGIC, sizeof(snapshot_detail::MAGIC));
+	write(snapshot_detail::VERSION);
+}
+
+inline SnapshotWriter::~SnapshotWriter()
+{
+	if (m_fp) {
+		fclose(m_fp);
+		unlink(m_tmp_path.c_str());
+	}
+}
+
+inline void SnapshotWriter::write_bytes(const void *data, size_t nbytes)
+{
+	if (nbytes && fwrite(data, 1, nbytes, m_fp) != nbytes)
+		throw SnapshotError(m_path, "SnapshotWriter: cannot write to '"
+			+ m_tmp_path + "': " + strerror(errno));
+}
+
+inline void SnapshotWriter::commit()
+{
+	bool ok = (fflush(m_fp) == 0 && fsync(fileno(m_fp)) == 0);
+	ok = (fclose(m_fp) == 0) && ok;
+	m_fp = nullptr;
+	if (!ok || rename(m_tmp_path.c_str(), m_path.c_str()) != 0) {
+		int err = errno;
+		unlink(m_tmp_path.c_str());
+		throw SnapshotError(m_path, "SnapshotWriter: cannot save '"
+			+ m_path + "': " + strerror(err));
+	}
+}
+
+inline SnapshotReader::SnapshotReader(const std::string& path) :
+	BufferReader(nullptr, 0, path)
+{
+	int fd = open(path.c_str(), O_RDONLY);
+	if (fd == -1)
+		throw SnapshotError(path, "SnapshotReader: cannot open file '"
+			+ path + "': " + strerror(errno));
+
+	struct stat statbuf;
+	if (fstat(fd, &statbuf) == -1) {
+		int err = errno;
+		close(fd);
+		throw SnapshotError(path, "SnapshotReader: cannot stat file '"
+			+ path + "': " + strerror(err));
+	}
+	m_size = statbuf.st_size;
+	if (m_size) {
+		void *addr = mmap(nullptr, m_size, PROT_READ, MAP_PRIVATE, fd, 0);
+		if (addr == MAP_FAILED) {
+			int err = errno;
+			close(fd);
+			throw SnapshotError(path, "SnapshotReader: cannot mmap file '"
+				+ path + "': " + strerror(err));
+		}
+		madvise(addr, m_size, MADV_SEQUENTIAL);
+		m_data = static_cast<const char *>(addr);
+	}
+	close(fd); // отображение остается действительным
+
+	try {
+		if (m_size < sizeof(snapshot_detail::MAGIC)
+			|| memcmp(take(sizeof(snapshot_detail::MAGIC)), snapshot_detail::MAGIC,
+				sizeof(snapshot_detail::MAGIC)) != 0)
+			throw SnapshotError(path, "SnapshotReader: '" + path + "' is not a cache snapshot");
+		if (read<uint32_t>() != snapshot_detail::VERSION)
+			throw SnapshotError(path, "SnapshotReader: unsupported snapshot version in '"
+				+ path + "'");
+	} catch (SnapshotError&) {
+		unmap();
+		throw;
+	}
+}
+
+inline SnapshotReader::~SnapshotReader()
+{
+	unmap();
+}
+
+inline void SnapshotReader::unmap()
+{
+	if (m_data)
+		munmap(const_cast<char *>(m_data), m_size);
+	m_data = nullptr;
+}
+
+inline const char *BufferReader::take(size_t nbytes)
+{
+	if (nbytes > m_size - m_pos)
+		throw SnapshotError(m_path, "BufferReader: '" + m_path + "' is truncated");
+	const char *data = m_data + m_pos;
+	m_pos += nbytes;
+	return data;
+}
+
+} // Cache namespace end
+
+#endif // _SNAPSHOT_H_
@@ -0,0 +1,50 @@
+#ifndef _WEIGHER_H_
+#define _WEIGHER_H_
+
+#include <cstddef>
+#include <type_traits>
+#include <utility>
+
+namespace Cache {
+
+/*  Weigher - функтор size_t(const key_t&, const page_t&), задающий "вес"
+ * страницы. Кэши с параметром Weigher ограничивают не число страниц, а их
+ * суммарный вес: cache_sz - бюджет в единицах веса */
+
+/*  Каждая страница весит 1, т.е. cache_sz - число страниц */
+struct UnitWeigher {
+	template <class Key, class Page>
+	size_t operator ()(const Key&, const Page&) const { return 1; }
+};
+
+/*  Вес - размер страницы в байтах. Подходит для страниц-контейнеров
+ * (std::string, std::vector), например для FileSystemDB
+ *  Пустая страница весит 1, иначе их в кэше может оказаться сколько угодно */
+struct PageSizeWeigher {
+	template <class Key, class Page>
+	size_t operator ()(const Key&, const Page& page) const
+	{
+		size_t sz = page.size() * sizeof(typename Page::value_type);
+		return (sz) ? sz : 1;
+	}
+};
+
+/*  Размер страницы в байтах для статистики кэша: для контейнеров - размер
+ * содержимого, как у PageSizeWeigher, для остальных типов - sizeof */
+template <class Page, class = void>
+struct PageBytes {
+	size_t operator ()(const Page&) const { return sizeof(Page); }
+};
+
+template <class Page>
+struct PageBytes<Page, std::void_t<typename Page::value_type, decltype(std::declval<Page>().size())>> {
+	size_t operator ()(const Page& page) const
+		{ return page.size() * sizeof(typename Page::value_type); }
+};
+
+template <class Page>
+size_t page_bytes(const Page& page) { return PageBytes<Page>()(page); }
+
+} // Cache namespace end
+
+#endif // _WEIGHER_H_
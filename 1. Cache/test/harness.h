@@ -0,0 +1,205 @@
+/* Harness - параллельный прогон матрицы "кэш x набор запросов x размер кэша"
+ * на пуле потоков с выборочным замером времени каждого запроса
+ */
+
+#ifndef _HARNESS_H_
+#define _HARNESS_H_
+
+#include "testing_facilities.h"
+#include "histogram.h"
+#include <string>
+#include <vector>
+#include <functional>
+#include <thread>
+#include <atomic>
+#include <mutex>
+#include <algorithm>
+#include <exception>
+#include <chrono>
+#include <ostream>
+#include <cstdio>
+#include <cassert>
+
+namespace Cache {
+
+struct HarnessResult {
+	std::string policy;
+	std::string workload;
+	size_t cache_sz;
+	TestResult result; // usec - процессорное время потока, выполнявшего прогон
+	uint64_t wall_usec;
+	LatencyHistogram latency; // нс на запрос, каждый sample_period-й запрос
+
+	HarnessResult(const std::string& policy_name, const std::string& workload_name, size_t sz) :
+		policy(policy_name), workload(workload_name), cache_sz(sz),
+		result(0, 0, 0), wall_usec(0) {}
+};
+
+/*  Каждый прогон (job) создает свой кэш и проходит по своим запросам в
+ * одном потоке, прогоны выполняются параллельно на nworkers потоках.
+ * Время прогона - процессорное время потока (CLOCK_THREAD_CPUTIME_ID),
+ * поэтому соседние прогоны его не искажают, в отличие от
+ * CLOCK_PROCESS_CPUTIME_ID. Реальное время тоже сохраняется
+ *  Задержка отдельного запроса меряется steady_clock у каждого
+ * sample_period-го запроса: замер каждого стоит ~20-40 нс, что сравнимо
+ * со временем самого запроса. В задержку входит и время замера
+ *  Прогоны делят кэш процессора и память, поэтому при nworkers больше
+ * числа свободных ядер время запросов растет - для точных абсолютных
+ * значений nworkers = 1, для сравнения политик хватает любого */
+class Harness {
+public:
+	explicit Harness(int nworkers, unsigned sample_period = 16) :
+		m_nworkers(nworkers), m_sample_period(sample_period)
+	{
+		assert(nworkers > 0);
+		assert(sample_period > 0);
+	}
+
+	/*  make_cache() возвращает указатель (например, std::unique_ptr) на
+	 * новый кэш с методами get_temp_page(), nhits(), nlookups(). Он
+	 * вызывается в потоке прогона, его время входит во время прогона.
+	 * [queries_from, queries_to) и все, что захватил make_cache, должны
+	 * существовать до конца run() */
+	template <class MakeCache, class InputIt>
+	void add(const std::string& policy, const std::string& workload, size_t cache_sz,
+		MakeCache make_cache, InputIt queries_from, InputIt queries_to);
+
+	/*  Выполняет все добавленные прогоны и возвращает их результаты в порядке
+	 * добавления. Исключение из прогона пробрасывается после остановки
+	 * всех потоков */
+	std::vector<HarnessResult> run();
+
+	size_t size() const { return m_jobs.size(); }
+
+private:
+	int m_nworkers;
+	unsigned m_sample_period;
+	std::vector<HarnessResult> m_results;
+	std::vector<std::function<void(HarnessResult&)>> m_jobs;
+};
+
+/*  Записывает результаты как JSON массив объектов, по одному на прогон.
+ * Время - в микросекундах, процентили задержки - в наносекундах */
+void write_json(std::ostream& os, const std::vector<HarnessResult>& results);
+
+/* Строка в кавычках с экранированием по правилам JSON */
+std::string json_string(const std::string& str);
+
+
+template <class MakeCache, class InputIt>
+void Harness::add(const std::string& policy, const std::string& workload, size_t cache_sz,
+	MakeCache make_cache, InputIt queries_from, InputIt queries_to)
+{
+	unsigned sample_period = m_sample_period;
+	m_results.emplace_back(policy, workload, cache_sz);
+	m_jobs.push_back([=](HarnessResult& res) {
+		mytime::Timer cpu_timer(CLOCK_THREAD_CPUTIME_ID);
+		mytime::Timer wall_timer(CLOCK_MONOTONIC);
+		auto cache = make_cache();
+
+		unsigned countdown = sample_period;
+		for (InputIt it = queries_from; it != queries_to; ++it) {
+			if (--countdown) {
+				cache->get_temp_page(*it);
+				continue;
+			}
+			countdown = sample_period;
+			auto start = std::chrono::steady_clock::now();
+			cache->get_temp_page(*it);
+			res.latency.record(std::chrono::duration_cast<std::chrono::nanoseconds>(
+				std::chrono::steady_clock::now() - start).count());
+		}
+
+		res.result = TestResult(cache->nhits(), cache->nlookups(), cpu_timer.elapsed_us());
+		res.wall_usec = wall_timer.elapsed_us();
+	});
+}
+
+inline std::vector<HarnessResult> Harness::run()
+{
+	std::atomic<size_t> next_job(0);
+	std::atomic<bool> failed(false);
+	std::exception_ptr error;
+	std::mutex error_mutex;
+
+	auto worker = [&]() {
+		while (!failed) {
+			size_t i = next_job++;
+			if (i >= m_jobs.size())
+				break;
+			try {
+				m_jobs[i](m_results[i]);
+			} catch (...) {
+				std::lock_guard<std::mutex> lock(error_mutex);
+				if (!error)
+					error = std::current_exception();
+				failed = true;
+			}
+		}
+	};
+
+	size_t nthreads = std::min<size_t>(m_nworkers, m_jobs.size());
+	std::vector<std::thread> threads;
+	for (size_t i = 0; i < nthreads; ++i)
+		threads.emplace_back(worker);
+	for (auto& thread : threads)
+		thread.join();
+
+	std::vector<HarnessResult> results;
+	results.swap(m_results);
+	m_jobs.clear();
+	if (error)
+		std::rethrow_exception(error);
+	return results;
+}
+
+inline std::string json_string(const std::string& str)
+{
+	std::string quoted = "\"";
+	for (char c : str) {
+		switch (c) {
+		case '"': quoted += "\\\""; break;
+		case '\\': quoted += "\\\\"; break;
+		case '\n': quoted += "\\n"; break;
+		case '\t': quoted += "\\t"; break;
+		default:
+			if (static_cast<unsigned char>(c) < 0x20) {
+				char buf[8];
+				snprintf(buf, sizeof(buf), "\\u%04x", c);
+				quoted += buf;
+			} else {
+				quoted += c;
+			}
+		}
+	}
+	return quoted + "\"";
+}
+
+inline void write_json(std::ostream& os, const std::vector<HarnessResult>& results)
+{
+	os << "[";
+	for (size_t i = 0; i < results.size(); ++i) {
+		const HarnessResult& res = results[i];
+		os << ((i) ? ",\n" : "\n")
+			<< "  {\"policy\": " << json_string(res.policy)
+			<< ", \"workload\": " << json_string(res.workload)
+			<< ", \"cache_sz\": " << res.cache_sz
+			<< ", \"hits\": " << res.result.nhits
+			<< ", \"lookups\": " << res.result.nlookups
+			<< ", \"hit_ratio\": " << ((res.result.nlookups)
+				? static_cast<double>(res.result.nhits) / res.result.nlookups : 0.0)
+			<< ", \"cpu_us\": " << res.result.usec
+			<< ", \"wall_us\": " << res.wall_usec
+			<< ", \"latency_ns\": {\"samples\": " << res.latency.count()
+			<< ", \"mean\": " << res.latency.mean()
+			<< ", \"p50\": " << res.latency.percentile(0.5)
+			<< ", \"p99\": " << res.latency.percentile(0.99)
+			<< ", \"p999\": " << res.latency.percentile(0.999)
+			<< ", \"max\": " << res.latency.max() << "}}";
+	}
+	os << "\n]";
+}
+
+} // Cache namespace end
+
+#endif // _HARNESS_H_
@@ -0,0 +1,95 @@
+/* LatencyHistogram - гистограмма задержек для процентилей (p50, p99, ...)
+ */
+
+#ifndef _HISTOGRAM_H_
+#define _HISTOGRAM_H_
+
+#include <vector>
+#include <algorithm>
+#include <cstdint>
+#include <cstddef>
+
+namespace Cache {
+
+/*  Гистограмма задержек в духе HDR Histogram: значения до 2^SUB_BUCKET_BITS
+ * хранятся точно, большие - в логарифмических корзинах, каждая степень
+ * двойки делится на 2^(SUB_BUCKET_BITS - 1) равных частей. Относительная
+ * ошибка процентилей - не больше 2^-(SUB_BUCKET_BITS - 1) (~1.6%), память
+ * постоянна, запись - O(1) без выделений памяти */
+class LatencyHistogram {
+public:
+	LatencyHistogram() :
+		m_counts(bucket_index(UINT64_MAX) + 1, 0),
+		m_count(0), m_sum(0), m_max(0) {}
+
+	void record(uint64_t value)
+	{
+		++m_counts[bucket_index(value)];
+		++m_count;
+		m_sum += value;
+		m_max = std::max(m_max, value);
+	}
+
+	void merge(const LatencyHistogram& other)
+	{
+		for (size_t i = 0; i < m_counts.size(); ++i)
+			m_counts[i] += other.m_counts[i];
+		m_count += other.m_count;
+		m_sum += other.m_sum;
+		m_max = std::max(m_max, other.m_max);
+	}
+
+	/*  Значение, не меньше которого q-я доля записанных значений
+	 * (q от 0 до 1), с точностью до ширины корзины */
+	uint64_t percentile(double q) const
+	{
+		if (!m_count)
+			return 0;
+		uint64_t rank = std::max<uint64_t>(static_cast<uint64_t>(q * m_count + 0.5), 1);
+		uint64_t seen = 0;
+		for (size_t i = 0; i < m_counts.size(); ++i) {
+			seen += m_counts[i];
+			if (seen >= rank)
+				return std::min(bucket_upper(i), m_max);
+		}
+		return m_max;
+	}
+
+	uint64_t count() const { return m_count; }
+	uint64_t max() const { return m_max; }
+	double mean() const { return (m_count) ? static_cast<double>(m_sum) / m_count : 0.0; }
+
+private:
+	static constexpr unsigned SUB_BUCKET_BITS = 7;
+	static constexpr uint64_t SUB_BUCKET_COUNT = 1 << SUB_BUCKET_BITS;
+	static constexpr uint64_t HALF_COUNT = SUB_BUCKET_COUNT / 2;
+
+	std::vector<uint64_t> m_counts;
+	uint64_t m_count;
+	uint64_t m_sum;
+	uint64_t m_max;
+
+	/*  Для value >= SUB_BUCKET_COUNT: shift - на сколько сдвинуть value,
+	 * чтобы остались SUB_BUCKET_BITS старших бит */
+	static size_t bucket_index(uint64_t value)
+	{
+		if (value < SUB_BUCKET_COUNT)
+			return value;
+		unsigned shift = 64 - __builtin_clzll(value) - SUB_BUCKET_BITS;
+		return SUB_BUCKET_COUNT + (shift - 1) * HALF_COUNT + ((value >> shift) - HALF_COUNT);
+	}
+
+	/* Наибольшее значение, попадающее в корзину index */
+	static uint64_t bucket_upper(size_t index)
+	{
+		if (index < SUB_BUCKET_COUNT)
+			return index;
+		unsigned shift = (index - SUB_BUCKET_COUNT) / HALF_COUNT + 1;
+		uint64_t mantissa = (index - SUB_BUCKET_COUNT) % HALF_COUNT + HALF_COUNT;
+		return ((mantissa + 1) << shift) - 1;
+	}
+};
+
+} // Cache namespace end
+
+#endif // _HISTOGRAM_H_
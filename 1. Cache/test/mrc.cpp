@@ -0,0 +1,120 @@
+/* ./mrc [OPTIONS] <nlookups> <ndifferent_queries>
+ * Печатает в stdout CSV "cache_sz,hit_ratio" - долю попаданий LRU кэша для
+ * всех размеров кэша, посчитанную за один проход по запросам
+ * OPTIONS: -r, -g, -s <scan_len> (random, graph, scan-mixed queries),
+ *  -R <rate> (SHARDS sampling rate), -m <max_cache_sz>, -k <step>,
+ *  -v (add column with hit ratio of real LRUCache for comparison) */
+#define NDEBUG
+
+#include <iostream>
+#include <cstdlib>
+#include <cstdio>
+#include <unistd.h>
+#include "../include/cache.h"
+#include "../include/miss_ratio_curve.h"
+#include "testing_facilities.h"
+
+namespace {
+
+void usage_error(const char *progname, const char *err_info)
+{
+	fprintf(stderr, "%s: %s\n", progname,
+		(err_info) ? err_info : "incorrect usage");
+	fprintf(stderr, "Usage:\n");
+	fprintf(stderr, "\t%s [OPTIONS] <nlookups> <ndifferent_queries>\n", progname);
+	fprintf(stderr, "\tOPTIONS:\t-r\t--\trandom queries (default)\n");
+	fprintf(stderr, "\t        \t-g\t--\tgraph-like queries\n");
+	fprintf(stderr, "\t        \t-s <scan_len>\t--\trandom queries mixed with scans of scan_len unique keys\n");
+	fprintf(stderr, "\t        \t-R <rate>\t--\tSHARDS sampling rate, 0 < rate <= 1 (default 1 - no sampling)\n");
+	fprintf(stderr, "\t        \t-m <max_cache_sz>\t--\tlargest cache size in output (default ndifferent_queries)\n");
+	fprintf(stderr, "\t        \t-k <step>\t--\tcache size step in output (default max_cache_sz / 100)\n");
+	fprintf(stderr, "\t        \t-v\t--\tadd column with hit ratio of LRUCache run for each size\n");
+	exit(EXIT_FAILURE);
+}
+
+} // anonymous namespace end
+
+int main(int argc, char *argv[])
+{
+	const char * const progname = argv[0];
+	int opt_graph_queries = 0;
+	int opt_scan_len = 0;
+	double opt_rate = 1.0;
+	int opt_max_cache_sz = 0;
+	int opt_step = 0;
+	int opt_verify = 0;
+	int opt = 0;
+
+	while ((opt = getopt(argc, argv, "rgvs:R:m:k:")) != -1) {
+		switch (opt) {
+		case 'r': opt_graph_queries = 0, opt_scan_len = 0; break;
+		case 'g': opt_graph_queries = 1; break;
+		case 'v': opt_verify = 1; break;
+		case 's':
+			if (sscanf(optarg, "%d", &opt_scan_len) != 1 || opt_scan_len <= 0)
+				usage_error(progname, "scan length must be a positive number");
+			break;
+		case 'R':
+			if (sscanf(optarg, "%lf", &opt_rate) != 1 || opt_rate <= 0.0 || opt_rate > 1.0)
+				usage_error(progname, "sampling rate must be in (0, 1]");
+			break;
+		case 'm':
+			if (sscanf(optarg, "%d", &opt_max_cache_sz) != 1 || opt_max_cache_sz <= 0)
+				usage_error(progname, "max cache size must be a positive number");
+			break;
+		case 'k':
+			if (sscanf(optarg, "%d", &opt_step) != 1 || opt_step <= 0)
+				usage_error(progname, "step must be a positive number");
+			break;
+		default: exit(EXIT_FAILURE);
+		}
+	}
+	argc -= optind;
+	argv += optind;
+
+	if (argc != 2)
+		usage_error(progname, (argc < 2) ? "not enough args" : "too many args");
+
+	int nlookups = 0;
+	int ndifferent_queries = 0;
+	if (sscanf(argv[0], "%d", &nlookups) != 1
+		|| sscanf(argv[1], "%d", &ndifferent_queries) != 1
+		|| nlookups <= 0
+		|| ndifferent_queries <= 0)
+		usage_error(progname, "last 2 arguments must be positive numbers");
+
+	int max_cache_sz = (opt_max_cache_sz) ? opt_max_cache_sz : ndifferent_queries;
+	int step = (opt_step) ? opt_step : std::max(max_cache_sz / 100, 1);
+
+	srand(time(0));
+	std::vector<int> queries;
+	if (opt_scan_len)
+		queries = Cache::generate_scan_mixed_queries(nlookups, ndifferent_queries, opt_scan_len);
+	else if (opt_graph_queries)
+		queries = Cache::generate_graph_queries(nlookups, ndifferent_queries, 1);
+	else
+		queries = Cache::generate_random_queries(nlookups, ndifferent_queries);
+
+	mytime::Timer timer;
+	Cache::MissRatioCurve<int> mrc(opt_rate);
+	mrc.access(queries.begin(), queries.end());
+	std::vector<double> hit_ratios = mrc.hit_ratios(max_cache_sz);
+	uint64_t usec = timer.elapsed_us();
+	fprintf(stderr, "%d lookups (%llu sampled) in %.3f sec, %.1f Mlookups/sec\n",
+		nlookups, static_cast<unsigned long long>(mrc.nsampled()), usec / 1e6,
+		static_cast<double>(nlookups) / std::max<uint64_t>(usec, 1));
+
+	DB::QuickEndlessDB db;
+	printf((opt_verify) ? "cache_sz,hit_ratio,lru_hit_ratio\n" : "cache_sz,hit_ratio\n");
+	for (int cache_sz = step; cache_sz <= max_cache_sz; cache_sz += step) {
+		printf("%d,%.6f", cache_sz, hit_ratios[cache_sz]);
+		if (opt_verify) {
+			auto res = Cache::test_cache<Cache::LRUCache<DB::QuickEndlessDB>>(db, cache_sz,
+				queries.begin(), queries.end());
+			printf(",%.6f", static_cast<double>(res.nhits) / res.nlookups);
+		}
+		printf("\n");
+	}
+
+	return 0;
+}
@@ -0,0 +1,235 @@
+/* ./string_keys [OPTIONS] <nlookups> <ndifferent_queries> <cache_sz>
+ * Сравнивает запросы по строковым ключам из кода, у которого есть только
+ * std::string_view: с созданием временной std::string и прямо по
+ * string_view - число выделений памяти на попадание и промах и время запроса
+ * OPTIONS: -r, -g (random, graph queries), -e <seed> (reproducible queries)
+ *  Заодно проверяет, что FlatLRUCache с ключами int не выделяет память
+ * ни при попадании, ни при промахе (иначе код возврата - ошибка)
+ *  Отдельная программа, потому что для подсчета выделений памяти заменены
+ * глобальные operator new/delete: в test_efficiency они бы искажали время */
+#define NDEBUG
+
+#include <iostream>
+#include <iomanip>
+#include <cstdlib>
+#include <cstdio>
+#include <ctime>
+#include <algorithm>
+#include <new>
+#include <string_view>
+#include <unordered_map>
+#include <unistd.h>
+#include "../include/cache.h"
+#include "testing_facilities.h"
+
+/*  Все выделения памяти считаются, чтобы показать их число на запрос */
+static std::atomic<uint64_t> g_nallocations(0);
+
+/*  noinline: иначе после встраивания GCC видит free() от указателя,
+ * полученного через new, и предупреждает (-Wmismatched-new-delete) */
+__attribute__((noinline)) void *operator new(size_t sz)
+{
+	g_nallocations.fetch_add(1, std::memory_order_relaxed);
+	if (void *ptr = malloc(sz ? sz : 1))
+		return ptr;
+	throw std::bad_alloc();
+}
+
+__attribute__((noinline)) void operator delete(void *ptr) noexcept { free(ptr); }
+__attribute__((noinline)) void operator delete(void *ptr, size_t) noexcept { free(ptr); }
+
+namespace {
+
+/*  Одна строка таблицы: выделения памяти на попадание и на промах (проход
+ * с подсчетом) и время запроса (отдельный проход без подсчета, с пустым
+ * кэшем) */
+template <class Cache_t, class DB_t, class Lookup>
+void string_key_row(const std::string& name, const DB_t& db, int cache_sz,
+	const std::vector<std::string_view>& keys, Lookup lookup)
+{
+	uint64_t hit_allocs = 0, miss_allocs = 0;
+	Cache::CacheMetrics m;
+	{
+		Cache_t cache(db, cache_sz);
+		for (std::string_view key : keys) {
+			uint64_t nallocs = g_nallocations.load(std::memory_order_relaxed);
+			uint64_t nhits = cache.nhits();
+			lookup(cache, key);
+			uint64_t delta = g_nallocations.load(std::memory_order_relaxed) - nallocs;
+			if (cache.nhits() != nhits)
+				hit_allocs += delta;
+			else
+				miss_allocs += delta;
+		}
+		m = cache.metrics();
+	}
+
+	Cache_t cache(db, cache_sz);
+	mytime::Timer timer(CLOCK_MONOTONIC);
+	for (std::string_view key : keys)
+		lookup(cache, key);
+	uint64_t usec = timer.elapsed_us();
+
+	std::cout << std::left << std::setw(36) << name << std::right << std::fixed
+		<< std::setw(10) << m.nhits
+		<< std::setw(13) << std::setprecision(2)
+			<< static_cast<double>(hit_allocs) / std::max<uint64_t>(m.nhits, 1)
+		<< std::setw(13) << static_cast<double>(miss_allocs) / std::max<uint64_t>(m.nmisses, 1)
+		<< std::setw(13) << std::setprecision(1) << 1e3 * usec / keys.size()
+		<< std::defaultfloat << std::endl;
+}
+
+/*  Запросы по строковым ключам из кода, у которого есть только
+ * std::string_view (например, путь из разобранного запроса). Раньше
+ * на каждый запрос создавалась временная std::string, теперь LRUCache,
+ * FlatLRUCache, BasicCache и SimpleDB ищут прямо по string_view и
+ * копируют ключ только при вставке. Пути длиннее буфера SSO, поэтому
+ * каждая временная строка - выделение памяти */
+void run_string_key_tests(const std::string& test_title, int cache_sz,
+	const std::vector<int>& queries)
+{
+	using DB_t = DB::SimpleDB<std::string, std::string>;
+	DB_t db;
+	std::unordered_map<int, std::string> paths;
+	for (int query : queries) {
+		std::string& path = paths[query];
+		if (path.empty()) {
+			path = "/var/cache/pages/page_" + std::to_string(query) + ".dat";
+			db.insert_page(path, "page " + std::to_string(query));
+		}
+	}
+	std::vector<std::string_view> keys;
+	keys.reserve(queries.size());
+	for (int query : queries)
+		keys.push_back(paths[query]);
+
+	auto by_string = [](auto& cache, std::string_view key) { cache.get_temp_page(std::string(key)); };
+	auto by_view = [](auto& cache, std::string_view key) { cache.get_temp_page(key); };
+
+	std::cout
+		<< std::right
+		<< std::setw(30) << "*******  " << test_title << " [string keys, std::string vs string_view lookups]  *******" << std::endl
+		<< std::setw(36) << "" << "      HITS   ALLOCS/HIT  ALLOCS/MISS  SPEED(nsec/query)\n";
+	string_key_row<Cache::LRUCache<DB_t>>("LRUCache (std::string)", db, cache_sz, keys, by_string);
+	string_key_row<Cache::LRUCache<DB_t>>("LRUCache (string_view)", db, cache_sz, keys, by_view);
+	string_key_row<Cache::FlatLRUCache<DB_t>>("FlatLRUCache (std::string)", db, cache_sz, keys, by_string);
+	string_key_row<Cache::FlatLRUCache<DB_t>>("FlatLRUCache (string_view)", db, cache_sz, keys, by_view);
+	string_key_row<Cache::BasicCache<DB_t>>("Basic<LRU> (std::string)", db, cache_sz, keys, by_string);
+	string_key_row<Cache::BasicCache<DB_t>>("Basic<LRU> (string_view)", db, cache_sz, keys, by_view);
+
+	/*  Сама база данных: contains() на каждый запрос */
+	auto db_allocs = [&](auto contains) {
+		uint64_t nallocs = g_nallocations.load(std::memory_order_relaxed);
+		for (std::string_view key : keys)
+			contains(key);
+		return static_cast<double>(g_nallocations.load(std::memory_order_relaxed) - nallocs) / keys.size();
+	};
+	std::cout << std::fixed << std::setprecision(2) << "SimpleDB::contains() allocs/query: "
+		<< db_allocs([&](std::string_view key) { return db.contains(std::string(key)); })
+		<< " (std::string), "
+		<< db_allocs([&](std::string_view key) { return db.contains(key); })
+		<< " (string_view)" << std::defaultfloat << "\n\n\n";
+}
+
+/*  FlatLRUCache обещает не выделять память после конструирования. Для
+ * ключей int это проверяется на всех промахах (включая ключи из выборки
+ * возраста вытесняемых страниц) и попаданиях. Возвращает false, если
+ * обещание нарушено */
+bool check_flat_lru_allocations(const std::string& test_title, int cache_sz,
+	const std::vector<int>& queries)
+{
+	DB::QuickEndlessDB db;
+	Cache::FlatLRUCache<DB::QuickEndlessDB> cache(db, cache_sz);
+	uint64_t hit_allocs = 0, miss_allocs = 0;
+	for (int query : queries) {
+		uint64_t nallocs = g_nallocations.load(std::memory_order_relaxed);
+		uint64_t nhits = cache.nhits();
+		cache.get_temp_page(query);
+		uint64_t delta = g_nallocations.load(std::memory_order_relaxed) - nallocs;
+		if (cache.nhits() != nhits)
+			hit_allocs += delta;
+		else
+			miss_allocs += delta;
+	}
+	Cache::CacheMetrics m = cache.metrics();
+	std::cout << test_title << ": FlatLRUCache<int> allocations: " << hit_allocs << " on "
+		<< m.nhits << " hits, " << miss_allocs << " on " << m.nmisses << " misses ("
+		<< m.nevictions << " evictions, " << m.nage_samples << " age samples)\n\n\n";
+	return hit_allocs == 0 && miss_allocs == 0;
+}
+
+void usage_error(const char *progname, const char *err_info)
+{
+	fprintf(stderr, "%s: %s\n", progname,
+		(err_info) ? err_info : "incorrect usage");
+	fprintf(stderr, "Usage:\n");
+	fprintf(stderr, "\t%s [OPTIONS] <nlookups> <ndifferent_queries> <cache_sz>\n", progname);
+	fprintf(stderr, "\tOPTIONS:\t-r\t--\trandom queries (default)\n");
+	fprintf(stderr, "\t        \t-g\t--\tgraph-like queries\n");
+	fprintf(stderr, "\t        \t-e <seed>\t--\tseed for generated queries (default: current time)\n");
+	exit(EXIT_FAILURE);
+}
+
+} // anonymous namespace end
+
+int main(int argc, char *argv[])
+{
+	const char * const progname = argv[0];
+	int opt_random_queries = 0;
+	int opt_graph_queries = 0;
+	const char *opt_seed = nullptr;
+	int opt = 0;
+
+	while ((opt = getopt(argc, argv, "rge:")) != -1) {
+		switch (opt) {
+		case 'r': opt_random_queries = 1; break;
+		case 'g': opt_graph_queries = 1; break;
+		case 'e': opt_seed = optarg; break;
+		default: exit(EXIT_FAILURE);
+		}
+	}
+	argc -= optind;
+	argv += optind;
+
+	if (argc != 3)
+		usage_error(progname, (argc < 3) ? "not enough args" : "too many args");
+
+	unsigned long long seed = time(0);
+	if (opt_seed && sscanf(opt_seed, "%llu", &seed) != 1)
+		usage_error(progname, "seed must be a non-negative number");
+
+	int nlookups = 0;
+	int ndifferent_queries = 0;
+	int cache_sz = 0;
+
+	if (sscanf(argv[0], "%d", &nlookups) != 1
+		|| sscanf(argv[1], "%d", &ndifferent_queries) != 1
+		|| sscanf(argv[2], "%d", &cache_sz) != 1
+		|| nlookups <= 0
+		|| ndifferent_queries <= 0
+		|| cache_sz <= 0)
+		usage_error(progname, "last 3 arguments must be positive numbers");
+	if (!opt_graph_queries)
+		opt_random_queries = 1;
+
+	srand(seed);
+	printf("TEST CONDITIONS: nlookups = %d, ndifferent_queries = %d, cache_sz = %d, seed = %llu\n\n",
+		nlookups, ndifferent_queries, cache_sz, seed);
+
+	bool no_allocations = true;
+	auto run = [&](const std::string& test_title, const std::vector<int>& queries) {
+		run_string_key_tests(test_title, cache_sz, queries);
+		no_allocations = check_flat_lru_allocations(test_title, cache_sz, queries) && no_allocations;
+	};
+	if (opt_random_queries)
+		run("RANDOM QUERIES", Cache::generate_random_queries(nlookups, ndifferent_queries));
+	if (opt_graph_queries)
+		run("GRAPH-LIKE QUERIES [1 link per node]",
+			Cache::generate_graph_queries(nlookups, ndifferent_queries, 1));
+
+	if (!no_allocations) {
+		fprintf(stderr, "%s: FlatLRUCache allocated memory after construction\n", progname);
+		return EXIT_FAILURE;
+	}
+	return 0;
+}
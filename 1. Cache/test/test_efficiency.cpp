@@ -1,13 +1,32 @@
 /* ./test_efficiency [OPTIONS] <nlookups> <ndifferent_queries> <cache_sz>
- * OPTIONS: -r, -g (random, graph queries) */
+ * OPTIONS: -r, -g (random, graph queries), -s <scan_len> (random queries mixed with scans),
+ *  -x <trace> (replay binary trace file), -t <nthreads> (multithreaded mode),
+ *  -a <latency_us> (slow database, concurrent misses), -b <batch_sz> (batched lookups
+ *  on slow database), -p (prefetching on slow database), -w (writes through WriteBackCache),
+ *  -o <snapshot> (restart from snapshot), -d <l2_file> (memory + disk tiers),
+ *  -f <directory> (files from directory), -c <sz,sz,...> (more cache sizes),
+ *  -n <nworkers> (parallel runs), -j <json_file> (results as JSON),
+ *  -m (metrics overhead),
+ *  -z <alpha> (Zipf queries), -S <scan_len> (Zipf queries mixed with scans),
+ *  -l <loop_len> (looping queries), -H <phase_len> (shifting hot set),
+ *  -e <seed> (reproducible queries) */
 #define NDEBUG
 
 #include <iostream>
 #include <iomanip>
+#include <sstream>
 #include <cstdlib>
+#include <fstream>
+#include <algorithm>
+#include <memory>
+#include <deque>
+#include <tuple>
 #include <unistd.h>
 #include "../include/cache.h"
 #include "testing_facilities.h"
+#include "harness.h"
+#include "trace.h"
+#include "workload.h"
 
 namespace {
 
@@ -22,53 +41,683 @@ std::ostream& operator <<(std::ostream& os, const Cache::TestResult& res)
 	return os;
 }
 
-/*  Тестирует эффективность всех реализованных кэшей на переданном
- * наборе запросов (ключей) и выводит результаты в консоль
- *  В качестве базы данных используется EndlessDB, поэтому ключом
- * может быть любое число типа int
+/*  Добавляет в harness прогоны всех реализованных кэшей размера cache_sz
+ * на наборе запросов (ключей) [queries_from, queries_to) с названием
+ * workload. Результаты печатает print_all_tests()
+ *  В качестве базы данных используется BasicQuickEndlessDB, поэтому
+ * ключом может быть любое число типа, на который указывает InputIt
+ *  Каждый кэш проходит по [queries_from, queries_to) заново, поэтому
+ * достаточно однопроходных итераторов, которые можно копировать (например,
+ * TraceFile::iterator). BeladyCache нужна вся последовательность в памяти,
+ * with_belady = false его пропускает
+ *  seed (из -e) задает вытеснения RandomCache и Basic<Random>
  */
-void run_all_tests(
-	const std::string& test_title,
+template <class InputIt>
+void add_all_tests(
+	Cache::Harness& harness,
+	const std::string& workload,
 	int cache_sz,
-	typename std::vector<int>::const_iterator queries_from,
-	typename std::vector<int>::const_iterator queries_to)
+	InputIt queries_from,
+	InputIt queries_to,
+	uint64_t seed,
+	bool with_belady = true)
+{
+	using key_t = typename std::iterator_traits<InputIt>::value_type;
+	using DB_t = DB::BasicQuickEndlessDB<key_t>;
+
+	static const DB_t db{}; // без состояния, общая для всех потоков
+
+	auto add = [&](const char *policy, auto make_cache)
+		{ harness.add(policy, workload, cache_sz, make_cache, queries_from, queries_to); };
+	auto add_cache = [&](const char *policy, auto *cache_tag) {
+		using Cache_t = std::remove_pointer_t<decltype(cache_tag)>;
+		add(policy, [cache_sz]() { return std::make_unique<Cache_t>(db, cache_sz); });
+	};
+
+	add("DummyCache", []() { return std::make_unique<Cache::DummyCache<DB_t>>(db); });
+	add("RandomCache", [cache_sz, seed]() {
+		return std::make_unique<Cache::RandomCache<DB_t>>(db, cache_sz, 1.0, Cache::UnitWeigher(), seed);
+	});
+	add_cache("LRUCache", static_cast<Cache::LRUCache<DB_t> *>(nullptr));
+	add_cache("FlatLRUCache", static_cast<Cache::FlatLRUCache<DB_t> *>(nullptr));
+	add_cache("ShardedLRUCache", static_cast<Cache::ShardedLRUCache<DB_t> *>(nullptr));
+	add_cache("ClockCache", static_cast<Cache::ClockCache<DB_t> *>(nullptr));
+	add_cache("TWOQCache", static_cast<Cache::TWOQCache<DB_t> *>(nullptr));
+	add_cache("ARCCache", static_cast<Cache::ARCCache<DB_t> *>(nullptr));
+	add_cache("SLRUCache", static_cast<Cache::SLRUCache<DB_t> *>(nullptr));
+	add_cache("W-TinyLFU(LRU)", static_cast<Cache::WTinyLFUCache<DB_t, Cache::LRUCache> *>(nullptr));
+	add_cache("W-TinyLFU(2Q)", static_cast<Cache::WTinyLFUCache<DB_t, Cache::TWOQCache> *>(nullptr));
+	add_cache("W-TinyLFU(SLRU)", static_cast<Cache::WTinyLFUCache<DB_t, Cache::SLRUCache> *>(nullptr));
+	add_cache("Basic<LRU>", static_cast<Cache::BasicCache<DB_t, Cache::LRUPolicy> *>(nullptr));
+	add_cache("Basic<2Q>", static_cast<Cache::BasicCache<DB_t, Cache::TWOQPolicy> *>(nullptr));
+	add_cache("Basic<CLOCK>", static_cast<Cache::BasicCache<DB_t, Cache::ClockPolicy> *>(nullptr));
+	add("Basic<Random>", [cache_sz, seed]() {
+		using Cache_t = Cache::BasicCache<DB_t, Cache::RandomPolicy>;
+		return std::make_unique<Cache_t>(db, cache_sz,
+			typename Cache_t::policy_t(cache_sz, {}, {}, seed));
+	});
+	add_cache("Policy<LRU>", static_cast<Cache::PolicyCache<DB_t, Cache::LRUPolicy> *>(nullptr));
+	add_cache("LFUCache", static_cast<Cache::LFUCache<DB_t> *>(nullptr));
+	add("LFUCache(aging)", [cache_sz]()
+		{ return std::make_unique<Cache::LFUCache<DB_t>>(db, cache_sz, 10 * cache_sz); });
+	if constexpr (std::is_base_of<std::bidirectional_iterator_tag,
+		typename std::iterator_traits<InputIt>::iterator_category>::value) {
+		if (with_belady)
+			add("BeladyCache", [cache_sz, queries_from, queries_to]() {
+				return std::make_unique<Cache::BeladySimulator<DB_t>>(db, cache_sz,
+					queries_from, queries_to);
+			});
+	}
+}
+
+/*  Печатает результаты Harness таблицами: по одной на каждую пару
+ * (набор запросов, размер кэша) в порядке добавления прогонов */
+void print_all_tests(const std::vector<Cache::HarnessResult>& results)
+{
+	int shift_sz = 15;
+	auto shift = std::setw(shift_sz);
+
+	for (auto first = results.begin(); first != results.end(); ) {
+		auto last = std::find_if(first, results.end(), [first](const Cache::HarnessResult& res)
+			{ return res.workload != first->workload || res.cache_sz != first->cache_sz; });
+
+		std::cout
+			<< std::right
+			<< std::setw(shift_sz * 2) << "*******  " << first->workload
+			<< " [cache_sz = " << first->cache_sz << "]  *******" << std::endl
+			<< shift << "" << " HITS      LOOKUPS     HIT RATIO    TIME(sec)    SPEED(usec/query)"
+			<< "   P50(ns)   P99(ns)  P999(ns)\n";
+		for (auto it = first; it != last; ++it)
+			std::cout << shift << std::left << it->policy << ' ' << it->result << std::right
+				<< std::setw(10) << it->latency.percentile(0.5)
+				<< std::setw(10) << it->latency.percentile(0.99)
+				<< std::setw(10) << it->latency.percentile(0.999) << std::endl;
+
+		/*  Сравнение скорости двух реализаций одной политики */
+		auto compare = [first, last](const std::string& fast, const std::string& slow) {
+			auto find = [first, last](const std::string& policy) {
+				auto it = std::find_if(first, last, [&policy](const Cache::HarnessResult& res)
+					{ return res.policy == policy; });
+				return (it != last) ? &*it : nullptr;
+			};
+			const Cache::HarnessResult *fast_res = find(fast), *slow_res = find(slow);
+			if (!fast_res || !slow_res)
+				return;
+			double slow_ns = 1e3 * slow_res->result.usec / slow_res->result.nlookups;
+			double fast_ns = 1e3 * fast_res->result.usec / fast_res->result.nlookups;
+			std::cout << std::fixed << std::setprecision(1)
+				<< fast << " vs " << slow << ": " << slow_ns - fast_ns << " ns/lookup faster ("
+				<< fast_ns << " vs " << slow_ns << " ns/lookup, x" << std::setprecision(2)
+				<< slow_ns / std::max(fast_ns, 1e-3) << ")" << std::defaultfloat << std::endl;
+		};
+		compare("FlatLRUCache", "LRUCache");
+		compare("Basic<LRU>", "LRUCache");
+		compare("Basic<LRU>", "Policy<LRU>");
+		compare("Basic<2Q>", "TWOQCache");
+		std::cout << "\n\n";
+		first = last;
+	}
+}
+
+/*  Открывает трассу из файла trace_path и добавляет в harness прогоны
+ * всех кэшей по первым nlookups ее запросам для каждого размера из
+ * cache_sizes. Ключи декодируются на лету при каждом проходе, трасса
+ * в память не загружается. Перед этим меряется скорость одного только
+ * декодирования */
+std::unique_ptr<Cache::TraceFile> add_trace_tests(Cache::Harness& harness,
+	const std::string& trace_path, uint64_t nlookups, const std::vector<int>& cache_sizes,
+	uint64_t seed)
+{
+	auto trace = std::make_unique<Cache::TraceFile>(trace_path);
+	auto trace_end = trace->end(nlookups);
+
+	mytime::Timer timer(CLOCK_MONOTONIC);
+	uint64_t checksum = 0, nkeys = 0;
+	for (auto it = trace->begin(); it != trace_end; ++it, ++nkeys)
+		checksum += *it;
+	uint64_t usec = std::max<uint64_t>(timer.elapsed_us(), 1);
+
+	std::string title = "TRACE '" + trace_path + "' ["
+		+ ((trace->encoding() == Cache::TraceEncoding::RAW) ? "raw" : "delta-varint") + ", "
+		+ std::to_string(nkeys) + " of " + std::to_string(trace->size()) + " lookups]";
+	std::cout << std::fixed << std::setprecision(1)
+		<< "decode: " << static_cast<double>(nkeys) / usec << " Mkeys/sec (checksum "
+		<< checksum << ")" << std::defaultfloat << "\n\n";
+	for (int cache_sz : cache_sizes)
+		add_all_tests(harness, title, cache_sz, trace->begin(), trace_end, seed, false);
+	return trace;
+}
+
+/*  Сравнивает TWOQCache с разными размерами очередей A1in (kin) и
+ * A1out (kout) с LRUCache и ARCCache */
+void run_twoq_tests(const std::string& test_title, int cache_sz,
+	const std::vector<int>& queries)
 {
 	using Cache::test_cache;
-	using Cache::test_dummy_cache;
-	using Cache::test_belady_cache;
 	using DB_t = DB::QuickEndlessDB;
 
 	DB_t db;
-
-	using std::left;
-
 	int shift_sz = 15;
 	auto shift = std::setw(shift_sz);
+	const std::pair<double, double> ratios[] = {
+		{0.25, 0.5}, {0.1, 0.5}, {0.5, 0.5}, {0.25, 0.1}, {0.25, 1.0}
+	};
 
 	std::cout
 		<< std::right
-		<< std::setw(shift_sz * 2) << "*******  " << test_title << "  *******" << std::endl
+		<< std::setw(shift_sz * 2) << "*******  " << test_title << " [2Q kin/kout]  *******" << std::endl
 		<< shift << "" << " HITS      LOOKUPS     HIT RATIO    TIME(sec)    SPEED(usec/query)\n";
+	std::cout << std::left
+		<< shift << "LRUCache" << ' '
+		<< test_cache<Cache::LRUCache<DB_t>>(db, cache_sz, queries.begin(), queries.end()) << std::endl
+		<< shift << "ARCCache" << ' '
+		<< test_cache<Cache::ARCCache<DB_t>>(db, cache_sz, queries.begin(), queries.end()) << std::endl;
+	for (auto& ratio : ratios) {
+		std::ostringstream title;
+		title << "2Q(" << ratio.first << '/' << ratio.second << ')';
+		std::cout << std::left << shift << title.str() << ' '
+			<< test_cache<Cache::TWOQCache<DB_t>>(db, cache_sz, queries.begin(), queries.end(),
+				ratio.first, ratio.second) << std::endl;
+	}
+	std::cout << "\n\n";
+}
+
+/*  Сравнивает пропускную способность LRUCache под общим мьютексом,
+ * ShardedLRUCache и ClockCache при числе потоков 1, 2, 4, ... до max_threads */
+void run_mt_tests(const std::string& test_title, int cache_sz, int max_threads,
+	const std::vector<int>& queries)
+{
+	using Cache::test_cache_mt;
+	using DB_t = DB::QuickEndlessDB;
+
+	DB_t db;
+	int shift_sz = 15;
+	auto mlookups_per_sec = [&queries](const Cache::TestResult& res)
+		{ return static_cast<double>(queries.size()) / std::max<uint64_t>(res.usec, 1); };
+
 	std::cout
-		<< shift << left << "DummyCache"	<< ' '
-		<< test_dummy_cache                     (db, cache_sz, queries_from, queries_to) << std::endl
-		<< shift << left << "RandomCache" << ' '
-		<< test_cache<Cache::RandomCache<DB_t>> (db, cache_sz, queries_from, queries_to) << std::endl
-		<< shift << left << "LRUCache" << ' '
-		<< test_cache<Cache::LRUCache<DB_t>>    (db, cache_sz, queries_from, queries_to) << std::endl
-		<< shift << left << "TWOQCache" << ' '
-		<< test_cache<Cache::TWOQCache<DB_t>>   (db, cache_sz, queries_from, queries_to) << std::endl
-		<< shift << left << "BeladyCache" << ' '
-		<< test_belady_cache                    (db, cache_sz, queries_from, queries_to) << std::endl
-		<< "\n\n";	
+		<< std::right
+		<< std::setw(shift_sz * 2) << "*******  " << test_title << " [multithreaded, Mlookups/s]  *******" << std::endl
+		<< " THREADS   LRUCache+mutex   ShardedLRUCache   SPEEDUP   ClockCache   SPEEDUP\n";
+
+	for (int nthreads = 1; ; nthreads = std::min(nthreads * 2, max_threads)) {
+		auto locked = test_cache_mt<Cache::LockedCache<Cache::LRUCache<DB_t>>>
+			(db, cache_sz, nthreads, queries.begin(), queries.end());
+		auto sharded = test_cache_mt<Cache::ShardedLRUCache<DB_t>>
+			(db, cache_sz, nthreads, queries.begin(), queries.end());
+		auto clock = test_cache_mt<Cache::ClockCache<DB_t>>
+			(db, cache_sz, nthreads, queries.begin(), queries.end());
+
+		std::cout << std::fixed << std::setprecision(2)
+			<< std::setw(8) << nthreads
+			<< std::setw(17) << mlookups_per_sec(locked)
+			<< std::setw(18) << mlookups_per_sec(sharded)
+			<< std::setw(10) << mlookups_per_sec(sharded) / mlookups_per_sec(locked)
+			<< std::setw(13) << mlookups_per_sec(clock)
+			<< std::setw(10) << mlookups_per_sec(clock) / mlookups_per_sec(locked)
+			<< std::defaultfloat << std::endl;
+		if (nthreads == max_threads)
+			break;
+	}
+	std::cout << "\n\n";
 }
 
-void run_all_tests(const std::string& test_title, int cache_sz,
-	const typename std::vector<int>& queries)
+
+/*  Сравнивает число обращений к медленной базе данных (EndlessDB с
+ * задержкой latency_us на вызов) у ClockCache, где одновременные промахи
+ * по одному ключу загружают страницу независимо, и ShardedLRUCache,
+ * где они объединяются в одно обращение */
+void run_single_flight_tests(const std::string& test_title, int cache_sz, int nthreads,
+	useconds_t latency_us, const std::vector<int>& queries)
+{
+	using Cache::test_cache_pool;
+	using Cache::test_cache_async;
+	using DB_t = Cache::CountingDB<DB::EndlessDB>;
+
+	DB::EndlessDB endless(latency_us);
+	DB_t db(endless);
+	size_t nqueries = std::min<size_t>(queries.size(), 20000);
+	auto queries_to = queries.begin() + nqueries;
+
+	std::cout
+		<< std::right
+		<< std::setw(30) << "*******  " << test_title << " [" << nthreads << " workers, "
+		<< latency_us << " usec/fetch, " << nqueries << " lookups]  *******" << std::endl
+		<< "                         MISSES    DB CALLS   TIME(sec)\n";
+
+	auto print_row = [&db](const char *name, const Cache::TestResult& res) {
+		std::cout << std::left << std::setw(25) << name << std::right
+			<< std::setw(6) << res.nlookups - res.nhits
+			<< std::setw(12) << db.ncalls()
+			<< std::setw(12) << std::fixed << std::setprecision(2) << res.usec / 1e6
+			<< std::defaultfloat << std::endl;
+		db.reset();
+	};
+
+	print_row("ClockCache (pool)",
+		test_cache_pool<Cache::ClockCache<DB_t>>(db, cache_sz, nthreads, queries.begin(), queries_to));
+	print_row("ShardedLRUCache (pool)",
+		test_cache_pool<Cache::ShardedLRUCache<DB_t>>(db, cache_sz, nthreads, queries.begin(), queries_to));
+	print_row("ShardedLRUCache (async)",
+		test_cache_async<Cache::ShardedLRUCache<DB_t>>(db, cache_sz, nthreads, queries.begin(), queries_to));
+	std::cout << "\n\n";
+}
+
+/*  Сравнивает выполнение запросов по одному и пачками по batch_sz через
+ * get_pages() на медленной базе данных: EndlessDB с задержкой latency_us
+ * на каждое обращение и 1 usec на каждую страницу */
+void run_batch_tests(const std::string& test_title, int cache_sz, int batch_sz,
+	useconds_t latency_us, const std::vector<int>& queries)
 {
-	run_all_tests(test_title, cache_sz, queries.begin(), queries.end());
+	using Cache::test_cache;
+	using Cache::test_cache_batched;
+	using DB_t = Cache::CountingDB<DB::EndlessDB>;
+
+	DB::EndlessDB endless(latency_us, 1);
+	DB_t db(endless);
+	size_t nqueries = std::min<size_t>(queries.size(), 20000);
+	auto queries_to = queries.begin() + nqueries;
+
+	std::cout
+		<< std::right
+		<< std::setw(30) << "*******  " << test_title << " [batch_sz = " << batch_sz << ", "
+		<< latency_us << " usec/call, " << nqueries << " lookups]  *******" << std::endl
+		<< "                         MISSES    DB CALLS   TIME(sec)\n";
+
+	auto print_row = [&db](const char *name, const Cache::TestResult& res) {
+		std::cout << std::left << std::setw(25) << name << std::right
+			<< std::setw(6) << res.nlookups - res.nhits
+			<< std::setw(12) << db.ncalls()
+			<< std::setw(12) << std::fixed << std::setprecision(2) << res.usec / 1e6
+			<< std::defaultfloat << std::endl;
+		db.reset();
+	};
+
+	/* test_cache() считает процессорное время, поэтому время задержек не
+	 * учитывается, здесь нужно реальное */
+	mytime::Timer timer(CLOCK_MONOTONIC);
+	auto res = test_cache<Cache::LRUCache<DB_t>>(db, cache_sz, queries.begin(), queries_to);
+	res.usec = timer.elapsed_us();
+	print_row("LRUCache (one by one)", res);
+	print_row("LRUCache (get_pages)",
+		test_cache_batched<Cache::LRUCache<DB_t>>(db, cache_sz, batch_sz, queries.begin(), queries_to));
+	print_row("ARCCache (get_pages)",
+		test_cache_batched<Cache::ARCCache<DB_t>>(db, cache_sz, batch_sz, queries.begin(), queries_to));
+	print_row("ShardedLRU (get_pages)",
+		test_cache_batched<Cache::ShardedLRUCache<DB_t>>(db, cache_sz, batch_sz, queries.begin(), queries_to));
+	std::cout << "\n\n";
 }
 
+/*  Сравнивает LRUCache с предзагрузкой и без нее на медленной базе данных
+ * (EndlessDB с задержкой latency_us). Между запросами пользователь "думает"
+ * latency_us мкс, за это время фоновый поток успевает загрузить страницы */
+void run_prefetch_tests(const std::string& test_title, int cache_sz,
+	useconds_t latency_us, const std::vector<int>& queries)
+{
+	using Cache_t = Cache::PrefetchingCache<Cache::LRUCache<DB::EndlessDB>>;
+
+	DB::EndlessDB db(latency_us);
+	size_t nqueries = std::min<size_t>(queries.size(), 5000);
+
+	std::cout
+		<< std::right
+		<< std::setw(30) << "*******  " << test_title << " [prefetch, " << latency_us
+		<< " usec/fetch, " << nqueries << " lookups]  *******" << std::endl
+		<< "                       HIT RATIO  MISS LATENCY(usec)  ACCURACY  COVERAGE  PREFETCHED\n";
+
+	auto run = [&](const char *name, size_t top_k, bool detect_stride) {
+		Cache_t cache(db, cache_sz, top_k, detect_stride);
+		for (size_t i = 0; i < nqueries; ++i) {
+			cache.get_temp_page(queries[i]);
+			usleep(latency_us);
+		}
+		std::cout << std::left << std::setw(23) << name << std::right << std::fixed
+			<< std::setprecision(3) << std::setw(9) << cache.hit_ratio()
+			<< std::setprecision(1) << std::setw(20) << cache.avg_miss_latency_us()
+			<< std::setprecision(3) << std::setw(10) << cache.prefetch_accuracy()
+			<< std::setw(10) << cache.prefetch_coverage()
+			<< std::setw(12) << cache.nprefetched()
+			<< std::defaultfloat << std::endl;
+	};
+
+	run("LRUCache", 0, false);
+	run("+ prefetch top-1", 1, false);
+	run("+ prefetch top-2", 2, false);
+	run("+ top-2 and stride", 2, true);
+	std::cout << "\n\n";
+}
+
+/*  Сравнивает число обращений к базе данных на запись у WriteBackCache в
+ * режимах write-through и write-back. Каждый четвертый (в среднем) запрос -
+ * запись новой версии страницы, остальные - чтение. Какие именно - задает seed */
+void run_write_tests(const std::string& test_title, int cache_sz,
+	const std::vector<int>& queries, uint64_t seed)
+{
+	using SimpleDB_t = DB::SimpleDB<int, int>;
+	using DB_t = Cache::CountingIODB<SimpleDB_t>;
+	using Cache_t = Cache::WriteBackCache<Cache::LRUCache<DB_t>>;
+
+	SimpleDB_t simple_db;
+	for (int key : queries)
+		simple_db.insert_page(key, 0);
+	DB_t db(simple_db);
+
+	Cache::WorkloadRandom rng(seed);
+	std::vector<bool> is_write;
+	for (size_t i = 0; i < queries.size(); ++i)
+		is_write.push_back(rng.below(4) == 0);
+
+	std::cout
+		<< std::right
+		<< std::setw(30) << "*******  " << test_title << " [25% writes]  *******" << std::endl
+		<< "                                WRITE CALLS   PAGES WRITTEN   READ CALLS   TIME(sec)\n";
+
+	auto run = [&](const char *name, Cache_t::WriteMode mode,
+		size_t flush_batch_sz, size_t max_dirty_weight) {
+		db.reset();
+		mytime::Timer timer;
+		{
+			Cache_t cache(db, cache_sz, mode, flush_batch_sz, max_dirty_weight);
+			for (size_t i = 0; i < queries.size(); ++i)
+				if (is_write[i])
+					cache.put_page(queries[i], i);
+				else
+					cache.get_temp_page(queries[i]);
+		} // деструктор записывает оставшиеся грязные страницы
+		std::cout << std::left << std::setw(32) << name << std::right
+			<< std::setw(12) << db.nwrites()
+			<< std::setw(16) << db.npages_written()
+			<< std::setw(13) << db.nreads()
+			<< std::setw(12) << std::fixed << std::setprecision(2) << timer.elapsed_us() / 1e6
+			<< std::defaultfloat << std::endl;
+	};
+
+	run("write-through", Cache_t::WRITE_THROUGH, 1, 0);
+	run("write-back (batch 1)", Cache_t::WRITE_BACK, 1, 0);
+	run("write-back (batch 16)", Cache_t::WRITE_BACK, 16, 0);
+	run("write-back (batch 16, max 1/2)", Cache_t::WRITE_BACK, 16, std::max(cache_sz / 2, 1));
+	std::cout << "\n\n";
+}
+
+/*  Одна строка run_snapshot_tests(): кэш прогревается первой половиной
+ * запросов и сохраняет снимок, "перезапущенный" кэш загружает его и
+ * обрабатывает вторую половину. Для сравнения вторую половину обрабатывает
+ * и пустой кэш */
+template <class Cache_t>
+void snapshot_row(const char *name, int cache_sz, const std::string& snapshot_path,
+	const std::vector<int>& queries)
+{
+	DB::EndlessDB db(0);
+	auto half = queries.begin() + queries.size() / 2;
+
+	Cache_t before_restart(db, cache_sz);
+	for (auto it = queries.begin(); it != half; ++it)
+		before_restart.get_temp_page(*it);
+	mytime::Timer save_timer(CLOCK_MONOTONIC);
+	before_restart.save_snapshot(snapshot_path);
+	uint64_t save_us = save_timer.elapsed_us();
+
+	struct stat statbuf;
+	size_t snapshot_sz = (stat(snapshot_path.c_str(), &statbuf) == 0) ? statbuf.st_size : 0;
+
+	Cache_t warm(db, cache_sz), cold(db, cache_sz);
+	mytime::Timer load_timer(CLOCK_MONOTONIC);
+	warm.load_snapshot(snapshot_path);
+	uint64_t load_us = load_timer.elapsed_us();
+	uint64_t nhits_before = warm.nhits(), nlookups_before = warm.nlookups();
+	for (auto it = half; it != queries.end(); ++it) {
+		warm.get_temp_page(*it);
+		cold.get_temp_page(*it);
+	}
+	double warm_ratio = static_cast<double>(warm.nhits() - nhits_before)
+		/ (warm.nlookups() - nlookups_before);
+
+	std::cout << std::left << std::setw(15) << name << std::right
+		<< std::setw(12) << snapshot_sz / 1024
+		<< std::setw(12) << save_us / 1000.0
+		<< std::setw(12) << load_us / 1000.0
+		<< std::setw(15) << cold.hit_ratio()
+		<< std::setw(15) << warm_ratio << std::endl;
+}
+
+/*  Сравнивает долю попаданий после перезапуска с пустым кэшем и с кэшем,
+ * загруженным из снимка snapshot_path */
+void run_snapshot_tests(const std::string& test_title, int cache_sz,
+	const std::string& snapshot_path, const std::vector<int>& queries)
+{
+	std::cout
+		<< std::right
+		<< std::setw(30) << "*******  " << test_title << " [snapshot restart]  *******" << std::endl
+		<< std::setw(15) << "" << "    SIZE(KB)    SAVE(ms)    LOAD(ms)   COLD RATIO     WARM RATIO\n";
+	snapshot_row<Cache::LRUCache<DB::EndlessDB>>("LRUCache", cache_sz, snapshot_path, queries);
+	snapshot_row<Cache::TWOQCache<DB::EndlessDB>>("TWOQCache", cache_sz, snapshot_path, queries);
+	snapshot_row<Cache::ARCCache<DB::EndlessDB>>("ARCCache", cache_sz, snapshot_path, queries);
+	snapshot_row<Cache::SLRUCache<DB::EndlessDB>>("SLRUCache", cache_sz, snapshot_path, queries);
+	snapshot_row<Cache::FlatLRUCache<DB::EndlessDB>>("FlatLRUCache", cache_sz, snapshot_path, queries);
+	snapshot_row<Cache::LFUCache<DB::EndlessDB>>("LFUCache", cache_sz, snapshot_path, queries);
+	snapshot_row<Cache::WTinyLFUCache<DB::EndlessDB>>("WTinyLFUCache", cache_sz, snapshot_path, queries);
+	snapshot_row<Cache::ClockCache<DB::EndlessDB>>("ClockCache", cache_sz, snapshot_path, queries);
+	snapshot_row<Cache::ShardedLRUCache<DB::EndlessDB>>("ShardedLRUCache", cache_sz, snapshot_path, queries);
+	snapshot_row<Cache::BasicCache<DB::EndlessDB>>("BasicCache", cache_sz, snapshot_path, queries);
+	std::cout << "\n\n";
+}
+
+/*  Сравнивает LRUCache размера cache_sz и в 10 раз больше с TieredCache,
+ * у которого L1 размера cache_sz, а L2 в файле l2_path вмещает примерно
+ * 10 * cache_sz страниц. База данных - EndlessDB с задержкой latency_us */
+void run_tiered_tests(const std::string& test_title, int cache_sz, const std::string& l2_path,
+	useconds_t latency_us, const std::vector<int>& queries)
+{
+	using LRU_t = Cache::LRUCache<DB::EndlessDB>;
+
+	DB::EndlessDB db(latency_us);
+	size_t nqueries = std::min<size_t>(queries.size(), 20000);
+
+	/* Размер записи в L2 для самого длинного ключа */
+	int max_key = *std::max_element(queries.begin(), queries.begin() + nqueries);
+	Cache::BufferWriter record;
+	record.write(max_key);
+	record.write(DB::EndlessDB(0).get_page(max_key));
+	size_t l2_capacity = 10 * cache_sz * record.size();
+
+	std::cout
+		<< std::right
+		<< std::setw(30) << "*******  " << test_title << " [L1 + disk L2, " << latency_us
+		<< " usec/fetch, " << nqueries << " lookups]  *******" << std::endl
+		<< "                          HIT RATIO   L1 HITS   L2 HITS   L1(usec)   L2(usec)  MISS(usec)\n";
+
+	auto print_row = [](const char *name, double hit_ratio, uint64_t nl1_hits, uint64_t nl2_hits,
+		double l1_us, double l2_us, double miss_us) {
+		std::cout << std::left << std::setw(26) << name << std::right << std::fixed
+			<< std::setprecision(3) << std::setw(9) << hit_ratio
+			<< std::setw(10) << nl1_hits << std::setw(10) << nl2_hits
+			<< std::setprecision(2) << std::setw(11) << l1_us
+			<< std::setw(11) << l2_us << std::setw(12) << miss_us
+			<< std::defaultfloat << std::endl;
+	};
+	auto run_lru = [&](const char *name, int sz) {
+		LRU_t cache(db, sz);
+		for (size_t i = 0; i < nqueries; ++i)
+			cache.get_temp_page(queries[i]);
+		print_row(name, cache.hit_ratio(), cache.nhits(), 0, 0.0, 0.0, 0.0);
+	};
+	auto run_tiered = [&](const char *name, auto *cache_tag) {
+		using Cache_t = std::remove_pointer_t<decltype(cache_tag)>;
+		Cache_t cache(db, cache_sz, l2_path, l2_capacity);
+		for (size_t i = 0; i < nqueries; ++i)
+			cache.get_temp_page(queries[i]);
+		print_row(name, cache.hit_ratio(), cache.nl1_hits(), cache.nl2_hits(),
+			cache.avg_l1_latency_us(), cache.avg_l2_latency_us(), cache.avg_miss_latency_us());
+	};
+
+	run_lru("LRUCache", cache_sz);
+	run_lru("LRUCache (10x memory)", 10 * cache_sz);
+	run_tiered("TieredCache<LRUCache>", static_cast<Cache::TieredCache<LRU_t> *>(nullptr));
+	run_tiered("TieredCache<ARCCache>",
+		static_cast<Cache::TieredCache<Cache::ARCCache<DB::EndlessDB>> *>(nullptr));
+	std::cout << "\n\n";
+}
+
+/*  Стоимость одной операции (нс) при n повторениях op() */
+template <class Op>
+double op_ns(size_t n, Op op)
+{
+	mytime::Timer timer(CLOCK_MONOTONIC);
+	for (size_t i = 0; i < n; ++i)
+		op();
+	return 1e3 * timer.elapsed_us() / n;
+}
+
+/*  Меряет цену статистики кэша (CacheAnalitics::metrics()): стоимость
+ * обновления счетчиков на пути попадания и промаха в сравнении со
+ * временем запроса к LRUCache, и замедление запросов, когда другой поток
+ * опрашивает metrics() через MetricsScraper каждую миллисекунду */
+void run_metrics_tests(const std::string& test_title, int cache_sz,
+	const std::vector<int>& queries)
+{
+	using Cache_t = Cache::LRUCache<DB::QuickEndlessDB>;
+	const int poll_us = 1000;
+	DB::QuickEndlessDB db;
+
+	std::cout
+		<< std::right
+		<< std::setw(30) << "*******  " << test_title << " [metrics overhead]  *******" << std::endl;
+
+	/*  Запросы без опроса и с опросом из другого потока, реальное время */
+	auto run = [&](bool scrape) {
+		Cache_t cache(db, cache_sz);
+		std::atomic<bool> done(false);
+		Cache::MetricsScraper<Cache_t> scraper(cache);
+		size_t npolls = 0;
+		std::thread poller;
+		if (scrape)
+			poller = std::thread([&]() {
+				while (!done.load()) {
+					scraper.poll();
+					++npolls;
+					usleep(poll_us);
+				}
+			});
+		mytime::Timer timer(CLOCK_MONOTONIC);
+		for (int key : queries)
+			cache.get_temp_page(key);
+		uint64_t usec = std::max<uint64_t>(timer.elapsed_us(), 1);
+		done = true;
+		if (scrape) {
+			poller.join();
+			scraper.poll();
+		}
+		return std::make_tuple(1e3 * usec / queries.size(), npolls, cache.metrics(), scraper.total());
+	};
+
+	auto quiet = run(false);
+	auto scraped = run(true);
+	double lookup_ns = std::get<0>(quiet);
+	const Cache::CacheMetrics& m = std::get<2>(quiet);
+	const Cache::CacheMetrics& total = std::get<3>(scraped);
+
+	/*  Цена отдельных операций: обычный инкремент (как у прежних счетчиков
+	 * int), RelaxedCounter (попадание и промах), атомарный fetch_add
+	 * (вытеснение, загрузка) и два вызова steady_clock (время загрузки) */
+	const size_t nops = 10000000;
+	volatile uint64_t plain = 0;
+	Cache::RelaxedCounter relaxed;
+	std::atomic<uint64_t> atomic(0);
+	double plain_ns = op_ns(nops, [&]() { plain = plain + 1; });
+	double relaxed_ns = op_ns(nops, [&]() { relaxed.add(1); });
+	double atomic_ns = op_ns(nops, [&]() { atomic.fetch_add(1, std::memory_order_relaxed); });
+	double clock_ns = op_ns(nops / 10, []() {
+		volatile auto t = std::chrono::steady_clock::now();
+		(void) t;
+	});
+
+	/*  Попадание: RelaxedCounter вместо int. Промах: то же, 2 fetch_add
+	 * (загрузка и ее размер) и у каждой FETCH_SAMPLING-й загрузки еще 2
+	 * вызова часов и 2 fetch_add. Вытеснение - 1 fetch_add. Выборка
+	 * возраста страниц (1 из 64 ключей) не учитывается */
+	const double sampling = Cache::CacheAnalitics::FETCH_SAMPLING;
+	double hit_cost = std::max(relaxed_ns - plain_ns, 0.0);
+	double miss_cost = hit_cost + 2 * atomic_ns + (2 * clock_ns + 2 * atomic_ns) / sampling;
+	double evict_cost = atomic_ns;
+	double per_lookup = (m.nhits * hit_cost + m.nmisses * miss_cost + m.nevictions * evict_cost)
+		/ std::max<uint64_t>(m.nlookups(), 1);
+
+	std::cout << std::fixed << std::setprecision(1)
+		<< "counter update (ns): int " << plain_ns << ", RelaxedCounter " << relaxed_ns
+		<< ", fetch_add " << atomic_ns << ", steady_clock::now() " << clock_ns << std::endl
+		<< "LRUCache: " << lookup_ns << " ns/lookup, metrics ~" << per_lookup << " ns/lookup ("
+		<< std::setprecision(2) << 100.0 * per_lookup / lookup_ns << "%)" << std::endl
+		<< std::setprecision(1)
+		<< "with scraper polling every " << poll_us << " usec: " << std::get<0>(scraped)
+		<< " ns/lookup (" << std::get<1>(scraped) << " polls, scraped hits "
+		<< total.nhits << " of " << std::get<2>(scraped).nhits << ")" << std::endl
+		<< "hits " << m.nhits << ", misses " << m.nmisses << ", evictions " << m.nevictions
+		<< ", inserted " << m.ninserted_bytes << " bytes, fetch " << std::setprecision(3)
+		<< m.avg_fetch_us() << " usec, eviction age " << m.avg_eviction_age_ms() << " ms ("
+		<< m.nage_samples << " samples)" << std::defaultfloat << "\n\n\n";
+}
+
+/*  Сравнивает LRUCache над FileSystemDB (файл читается и копируется в
+ * std::string) и над MmapFileSystemDB (файл отображается в память) на
+ * nlookups случайных запросах к файлам из каталога dirname. Примерно 30%
+ * запросов - к несуществующим файлам: их обрабатывают через исключения
+ * либо отсекают NegativeCacheDB (только ttl или еще и фильтр Блума) */
+void run_file_tests(const std::string& dirname, int nlookups, int cache_sz)
+{
+	using Cache::test_cache_absent;
+	using NegativeDB = DB::NegativeCacheDB<DB::FileSystemDB>;
+
+	std::vector<std::string> files = DB::list_files(dirname);
+	if (files.empty()) {
+		std::cout << "no files found in '" << dirname << "'\n\n\n";
+		return;
+	}
+	std::vector<std::string> queries;
+	for (int i = 0; i < nlookups; ++i)
+		if (rand() % 10 < 3)
+			queries.push_back(dirname + "/.missing_" + std::to_string(rand() % files.size()));
+		else
+			queries.push_back(files[rand() % files.size()]);
+
+	DB::FileSystemDB fs_db;
+	DB::MmapFileSystemDB mmap_db;
+	NegativeDB ttl_db(fs_db, std::chrono::seconds(60));
+	NegativeDB bloom_db(fs_db, std::chrono::seconds(60));
+	bloom_db.build_filter(dirname);
+
+	auto never_absent = [](const std::string&) { return false; };
+	auto ttl_absent = [&ttl_db](const std::string& key) { return ttl_db.known_absent(key); };
+	auto bloom_absent = [&bloom_db](const std::string& key) { return bloom_db.known_absent(key); };
+
+	int shift_sz = 36;
+	auto shift = std::setw(shift_sz);
+
+	std::cout
+		<< std::right
+		<< std::setw(30) << "*******  FILES FROM '" << dirname << "' [" << files.size()
+		<< " files, ~30% missing]  *******" << std::endl
+		<< shift << "" << " HITS      LOOKUPS     HIT RATIO    TIME(sec)    SPEED(usec/query)\n";
+	std::cout << std::left
+		<< shift << "LRUCache<FileSystemDB>" << ' '
+		<< test_cache_absent<Cache::LRUCache<DB::FileSystemDB>>(fs_db, cache_sz,
+			queries.begin(), queries.end(), never_absent)
+		<< std::endl
+		<< shift << "LRUCache<MmapFileSystemDB>" << ' '
+		<< test_cache_absent<Cache::LRUCache<DB::MmapFileSystemDB>>(mmap_db, cache_sz,
+			queries.begin(), queries.end(), never_absent)
+		<< std::endl
+		<< shift << "LRUCache<NegativeCacheDB> (ttl)" << ' '
+		<< test_cache_absent<Cache::LRUCache<NegativeDB>>(ttl_db, cache_sz,
+			queries.begin(), queries.end(), ttl_absent)
+		<< std::endl
+		<< shift << "LRUCache<NegativeCacheDB> (bloom)" << ' '
+		<< test_cache_absent<Cache::LRUCache<NegativeDB>>(bloom_db, cache_sz,
+			queries.begin(), queries.end(), bloom_absent)
+		<< std::endl
+		<< "answered without syscalls: " << ttl_db.nabsent_answers() << " (ttl), "
+		<< bloom_db.nabsent_answers() << " (bloom)"
+		<< std::endl << "\n\n";
+}
 
 void usage_error(const char *progname, const char *err_info)
 {
@@ -78,6 +727,34 @@ void usage_error(const char *progname, const char *err_info)
 	fprintf(stderr, "\t%s [OPTIONS] <nlookups> <ndifferent_queries> <cache_sz>\n", progname);
 	fprintf(stderr, "\tOPTIONS:\t-r\t--\trandom queries test\n");
 	fprintf(stderr, "\t        \t-g\t--\tgraph-like queries test\n");
+	fprintf(stderr, "\t        \t-s <scan_len>\t--\trandom queries mixed with scans of scan_len unique keys\n");
+	fprintf(stderr, "\t        \t-z <alpha>\t--\tZipf(alpha) queries over ndifferent_queries keys\n");
+	fprintf(stderr, "\t        \t-S <scan_len>\t--\tZipf queries (alpha from -z or 0.99) mixed with sequential scans"
+		" of scan_len cold keys (1/3 of queries)\n");
+	fprintf(stderr, "\t        \t-l <loop_len>\t--\tkeys 0, 1, ..., loop_len - 1 in a loop\n");
+	fprintf(stderr, "\t        \t-H <phase_len>\t--\tZipf queries (alpha from -z or 0.99) over ndifferent_queries keys,"
+		" the hot set shifts by half every phase_len queries\n");
+	fprintf(stderr, "\t        \t-e <seed>\t--\tseed for all generated queries and random evictions (default: current time)\n");
+	fprintf(stderr, "\t        \t-x <trace>\t--\treplay at most nlookups keys from binary trace file"
+		" (see trace.h; ndifferent_queries is ignored)\n");
+	fprintf(stderr, "\t        \t-c <sz,sz,...>\t--\talso run all caches with these sizes\n");
+	fprintf(stderr, "\t        \t-n <nworkers>\t--\trun caches x queries x sizes on nworkers threads"
+		" (default: number of CPUs)\n");
+	fprintf(stderr, "\t        \t-j <json_file>\t--\talso write results with latency percentiles as JSON\n");
+	fprintf(stderr, "\t        \t-t <nthreads>\t--\talso run multithreaded tests with up to nthreads threads\n");
+	fprintf(stderr, "\t        \t-a <latency_us>\t--\talso count database calls on concurrent misses"
+		" with given database latency (workers: nthreads from -t or 8)\n");
+	fprintf(stderr, "\t        \t-b <batch_sz>\t--\talso compare lookups one by one and in batches of batch_sz"
+		" on slow database (latency from -a or 100 usec)\n");
+	fprintf(stderr, "\t        \t-f <directory>\t--\tfiles from directory (with ~30%% missing): FileSystemDB vs MmapFileSystemDB vs NegativeCacheDB\n");
+	fprintf(stderr, "\t        \t-o <snapshot>\t--\talso compare hit ratio after restart with empty cache"
+		" and with cache loaded from snapshot file\n");
+	fprintf(stderr, "\t        \t-d <l2_file>\t--\talso compare memory-only caches with TieredCache"
+		" (L2 in l2_file) on slow database (latency from -a or 100 usec)\n");
+	fprintf(stderr, "\t        \t-w\t--\talso count database writes of write-through and write-back caches\n");
+	fprintf(stderr, "\t        \t-m\t--\talso measure overhead of cache metrics and of polling them from another thread\n");
+	fprintf(stderr, "\t        \t-p\t--\talso compare LRUCache with and without prefetching"
+		" on slow database (latency from -a or 100 usec)\n");
 	exit(EXIT_FAILURE);
 }
 
@@ -90,12 +767,87 @@ int main(int argc, char *argv[])
 	const char * const progname = argv[0];
 	int opt_random_queries = 0;
 	int opt_graph_queries = 0;
+	int opt_max_threads = 0;
+	int opt_scan_len = 0;
+	int opt_latency_us = -1;
+	int opt_batch_sz = 0;
+	int opt_prefetch = 0;
+	int opt_writes = 0;
+	int opt_metrics = 0;
+	const char *opt_directory = nullptr;
+	const char *opt_snapshot = nullptr;
+	const char *opt_l2_file = nullptr;
+	const char *opt_trace = nullptr;
+	const char *opt_json = nullptr;
+	int opt_harness_workers = 0;
+	std::vector<int> opt_cache_sizes;
+	double opt_zipf_alpha = -1.0;
+	int opt_zipf_scan_len = 0;
+	int opt_loop_len = 0;
+	int opt_phase_len = 0;
+	const char *opt_seed = nullptr;
 	int opt = 0;
 
-	while ((opt = getopt(argc, argv, "rg")) != -1) {
+	while ((opt = getopt(argc, argv, "rgpwms:t:a:b:f:o:d:x:n:c:j:z:S:l:H:e:")) != -1) {
 		switch (opt) {
 		case 'r': opt_random_queries = 1; break;
 		case 'g': opt_graph_queries = 1; break;
+		case 'p': opt_prefetch = 1; break;
+		case 'w': opt_writes = 1; break;
+		case 'm': opt_metrics = 1; break;
+		case 'f': opt_directory = optarg; break;
+		case 'o': opt_snapshot = optarg; break;
+		case 'd': opt_l2_file = optarg; break;
+		case 'x': opt_trace = optarg; break;
+		case 'j': opt_json = optarg; break;
+		case 'e': opt_seed = optarg; break;
+		case 'z':
+			if (sscanf(optarg, "%lf", &opt_zipf_alpha) != 1 || opt_zipf_alpha < 0.0)
+				usage_error(progname, "Zipf alpha must be a non-negative number");
+			break;
+		case 'S':
+			if (sscanf(optarg, "%d", &opt_zipf_scan_len) != 1 || opt_zipf_scan_len <= 0)
+				usage_error(progname, "scan length must be a positive number");
+			break;
+		case 'l':
+			if (sscanf(optarg, "%d", &opt_loop_len) != 1 || opt_loop_len <= 0)
+				usage_error(progname, "loop length must be a positive number");
+			break;
+		case 'H':
+			if (sscanf(optarg, "%d", &opt_phase_len) != 1 || opt_phase_len <= 0)
+				usage_error(progname, "phase length must be a positive number");
+			break;
+		case 'n':
+			if (sscanf(optarg, "%d", &opt_harness_workers) != 1 || opt_harness_workers <= 0)
+				usage_error(progname, "number of workers must be a positive number");
+			break;
+		case 'c': {
+			std::istringstream sizes(optarg);
+			std::string size;
+			while (std::getline(sizes, size, ',')) {
+				int sz = 0;
+				if (sscanf(size.c_str(), "%d", &sz) != 1 || sz <= 0)
+					usage_error(progname, "cache sizes must be comma-separated positive numbers");
+				opt_cache_sizes.push_back(sz);
+			}
+			break;
+		}
+		case 's':
+			if (sscanf(optarg, "%d", &opt_scan_len) != 1 || opt_scan_len <= 0)
+				usage_error(progname, "scan length must be a positive number");
+			break;
+		case 'a':
+			if (sscanf(optarg, "%d", &opt_latency_us) != 1 || opt_latency_us < 0)
+				usage_error(progname, "latency must be a non-negative number");
+			break;
+		case 'b':
+			if (sscanf(optarg, "%d", &opt_batch_sz) != 1 || opt_batch_sz <= 0)
+				usage_error(progname, "batch size must be a positive number");
+			break;
+		case 't':
+			if (sscanf(optarg, "%d", &opt_max_threads) != 1 || opt_max_threads <= 0)
+				usage_error(progname, "number of threads must be a positive number");
+			break;
 		default: exit(EXIT_FAILURE);
 		}
 	}
@@ -106,9 +858,14 @@ int main(int argc, char *argv[])
 		usage_error(progname, "not enough args");
 	if (argc > 3)
 		usage_error(progname, "too many args");
-	if (!opt_random_queries && !opt_graph_queries)
+	if (!opt_random_queries && !opt_graph_queries && !opt_scan_len && !opt_directory && !opt_trace
+		&& opt_zipf_alpha < 0.0 && !opt_zipf_scan_len && !opt_loop_len && !opt_phase_len)
 		usage_error(progname, "no test specified, see OPTIONS");
 
+	unsigned long long seed = time(0);
+	if (opt_seed && sscanf(opt_seed, "%llu", &seed) != 1)
+		usage_error(progname, "seed must be a non-negative number");
+
 	int nlookups = 0;
 	int ndifferent_queries = 0;
 	int cache_sz = 0;
@@ -121,22 +878,155 @@ int main(int argc, char *argv[])
 		|| cache_sz <= 0)
 		usage_error(progname, "last 3 arguments must be positive numbers");
 
-	srand(time(0));
-	printf("TEST CONDITIONS: nlookups = %d, ndifferent_queries = %d, cache_sz = %d\n\n",
-		nlookups, ndifferent_queries, cache_sz);
+	int nworkers = (opt_max_threads) ? opt_max_threads : 8;
+	int slow_db_latency_us = (opt_latency_us >= 0) ? opt_latency_us : 100;
+	int harness_workers = (opt_harness_workers)
+		? opt_harness_workers : std::max<int>(std::thread::hardware_concurrency(), 1);
+	std::vector<int> cache_sizes = {cache_sz};
+	cache_sizes.insert(cache_sizes.end(), opt_cache_sizes.begin(), opt_cache_sizes.end());
 
-	if (opt_random_queries) {
-		auto random_queries = Cache::generate_random_queries(nlookups, ndifferent_queries);
-		run_all_tests("RANDOM QUERIES", cache_sz, random_queries);
-	}
+	/*  Seed печатается, чтобы любой запуск можно было повторить с -e.
+	 * rand() (случайные и графовые запросы), вытеснения RandomCache и
+	 * Basic<Random> и выбор записей в -w (seed + 4) тоже от него зависят */
+	srand(seed);
+	printf("TEST CONDITIONS: nlookups = %d, ndifferent_queries = %d, cache_sz = %d, "
+		"harness workers = %d, seed = %llu\n\n", nlookups, ndifferent_queries, cache_sz,
+		harness_workers, seed);
+
+	/*  Сначала генерируются все наборы запросов и в harness добавляются
+	 * прогоны всех кэшей всех размеров на каждом из них, затем они
+	 * выполняются параллельно. Наборы должны жить до конца harness.run() */
+	Cache::Harness harness(harness_workers);
+	std::deque<std::vector<int>> workloads;
+	auto add_workload = [&](const std::string& title, std::vector<int>&& queries)
+		-> const std::vector<int>& {
+		workloads.push_back(std::move(queries));
+		for (int sz : cache_sizes)
+			add_all_tests(harness, title, sz, workloads.back().begin(), workloads.back().end(), seed);
+		return workloads.back();
+	};
+
+	const std::string graph_title = "GRAPH-LIKE QUERIES [1 link per node]";
+	const std::string scan_title = "SCAN-MIXED QUERIES [scan_len = " + std::to_string(opt_scan_len) + "]";
+	const std::vector<int> *random_queries = nullptr, *graph_queries = nullptr, *scan_queries = nullptr;
+	if (opt_random_queries)
+		random_queries = &add_workload("RANDOM QUERIES",
+			Cache::generate_random_queries(nlookups, ndifferent_queries));
 	if (opt_graph_queries) {
-		auto graph_queries = Cache::generate_graph_queries(nlookups, ndifferent_queries, 1);	
-		run_all_tests("GRAPH-LIKE QUERIES [1 link per node]", cache_sz, graph_queries);
-		graph_queries = Cache::generate_graph_queries(nlookups, ndifferent_queries, 2);	
-		run_all_tests("GRAPH-LIKE QUERIES [2 links per node]", cache_sz, graph_queries);
-		graph_queries = Cache::generate_graph_queries(nlookups, ndifferent_queries, 3);	
-		run_all_tests("GRAPH-LIKE QUERIES [3 links per node]", cache_sz, graph_queries);
+		graph_queries = &add_workload(graph_title,
+			Cache::generate_graph_queries(nlookups, ndifferent_queries, 1));
+		add_workload("GRAPH-LIKE QUERIES [2 links per node]",
+			Cache::generate_graph_queries(nlookups, ndifferent_queries, 2));
+		add_workload("GRAPH-LIKE QUERIES [3 links per node]",
+			Cache::generate_graph_queries(nlookups, ndifferent_queries, 3));
+	}
+	if (opt_scan_len)
+		scan_queries = &add_workload(scan_title,
+			Cache::generate_scan_mixed_queries(nlookups, ndifferent_queries, opt_scan_len));
+
+	/*  У каждого генератора свой seed, чтобы добавление одного набора
+	 * запросов не меняло остальные */
+	double alpha = (opt_zipf_alpha >= 0.0) ? opt_zipf_alpha : 0.99;
+	std::ostringstream alpha_str;
+	alpha_str << alpha;
+	if (opt_zipf_alpha >= 0.0) {
+		Cache::ZipfGenerator zipf(ndifferent_queries, alpha, seed + 1);
+		add_workload("ZIPF QUERIES [alpha = " + alpha_str.str() + "]",
+			Cache::generate_queries(zipf, nlookups));
+	}
+	if (opt_zipf_scan_len) {
+		Cache::ScanMixGenerator scans(ndifferent_queries, alpha, 10 * ndifferent_queries,
+			opt_zipf_scan_len, 1.0 / 3, seed + 2);
+		add_workload("ZIPF + SCANS [alpha = " + alpha_str.str() + ", scan_len = "
+			+ std::to_string(opt_zipf_scan_len) + ", 1/3 of queries]",
+			Cache::generate_queries(scans, nlookups));
+	}
+	if (opt_loop_len) {
+		Cache::LoopGenerator loop(opt_loop_len);
+		add_workload("LOOP [loop_len = " + std::to_string(opt_loop_len) + "]",
+			Cache::generate_queries(loop, nlookups));
+	}
+	if (opt_phase_len) {
+		Cache::PhaseShiftGenerator phases(ndifferent_queries, alpha, opt_phase_len,
+			std::max(ndifferent_queries / 2, 1), seed + 3);
+		add_workload("SHIFTING HOT SET [alpha = " + alpha_str.str() + ", phase_len = "
+			+ std::to_string(opt_phase_len) + "]",
+			Cache::generate_queries(phases, nlookups));
 	}
 
+	std::unique_ptr<Cache::TraceFile> trace;
+	try {
+		if (opt_trace)
+			trace = add_trace_tests(harness, opt_trace, nlookups, cache_sizes, seed);
+		auto results = harness.run();
+		print_all_tests(results);
+		if (opt_json) {
+			std::ofstream json(opt_json);
+			json << "{\"conditions\": {\"nlookups\": " << nlookups
+				<< ", \"ndifferent_queries\": " << ndifferent_queries
+				<< ", \"harness_workers\": " << harness_workers
+				<< ", \"seed\": " << seed << "},\n\"results\": ";
+			Cache::write_json(json, results);
+			json << "}\n";
+			if (!json.flush()) {
+				fprintf(stderr, "%s: cannot write '%s'\n", progname, opt_json);
+				return EXIT_FAILURE;
+			}
+		}
+	} catch (Cache::TraceError& err) {
+		fprintf(stderr, "%s: %s\n", progname, err.error_description.c_str());
+		return EXIT_FAILURE;
+	}
+
+	if (random_queries) {
+		if (opt_max_threads)
+			run_mt_tests("RANDOM QUERIES", cache_sz, opt_max_threads, *random_queries);
+		if (opt_latency_us >= 0)
+			run_single_flight_tests("RANDOM QUERIES", cache_sz, nworkers, opt_latency_us, *random_queries);
+		if (opt_batch_sz)
+			run_batch_tests("RANDOM QUERIES", cache_sz, opt_batch_sz, slow_db_latency_us, *random_queries);
+		if (opt_prefetch)
+			run_prefetch_tests("RANDOM QUERIES", cache_sz, slow_db_latency_us, *random_queries);
+		if (opt_writes)
+			run_write_tests("RANDOM QUERIES", cache_sz, *random_queries, seed + 4);
+		if (opt_metrics)
+			run_metrics_tests("RANDOM QUERIES", cache_sz, *random_queries);
+		if (opt_snapshot)
+			run_snapshot_tests("RANDOM QUERIES", cache_sz, opt_snapshot, *random_queries);
+		if (opt_l2_file)
+			run_tiered_tests("RANDOM QUERIES", cache_sz, opt_l2_file, slow_db_latency_us,
+				*random_queries);
+	}
+	if (graph_queries) {
+		if (opt_max_threads)
+			run_mt_tests(graph_title, cache_sz, opt_max_threads, *graph_queries);
+		if (opt_latency_us >= 0)
+			run_single_flight_tests(graph_title, cache_sz, nworkers, opt_latency_us, *graph_queries);
+		if (opt_batch_sz)
+			run_batch_tests(graph_title, cache_sz, opt_batch_sz, slow_db_latency_us, *graph_queries);
+		if (opt_prefetch)
+			run_prefetch_tests(graph_title, cache_sz, slow_db_latency_us, *graph_queries);
+		if (opt_writes)
+			run_write_tests(graph_title, cache_sz, *graph_queries, seed + 4);
+		if (opt_metrics)
+			run_metrics_tests(graph_title, cache_sz, *graph_queries);
+		if (opt_snapshot)
+			run_snapshot_tests(graph_title, cache_sz, opt_snapshot, *graph_queries);
+		if (opt_l2_file)
+			run_tiered_tests(graph_title, cache_sz, opt_l2_file, slow_db_latency_us, *graph_queries);
+	}
+	if (scan_queries) {
+		run_twoq_tests(scan_title, cache_sz, *scan_queries);
+		if (opt_prefetch)
+			run_prefetch_tests(scan_title, cache_sz, slow_db_latency_us, *scan_queries);
+		if (opt_snapshot)
+			run_snapshot_tests(scan_title, cache_sz, opt_snapshot, *scan_queries);
+		if (opt_l2_file)
+			run_tiered_tests(scan_title, cache_sz, opt_l2_file, slow_db_latency_us, *scan_queries);
+	}
+
+	if (opt_directory)
+		run_file_tests(opt_directory, nlookups, cache_sz);
+
 	return 0;
 }
\ No newline at end of file
@@ -5,14 +5,21 @@
 #include <cstddef>
 #include "timer.h"
 #include <cassert>
+#include <thread>
+#include <mutex>
+#include <vector>
+#include <utility>
+#include <atomic>
+#include <future>
+#include <iterator>
 
 namespace Cache {
 
 struct TestResult {
-	int nhits, nlookups;
+	uint64_t nhits, nlookups;
 	uint64_t usec; // Затраченное процессорное время
 
-	TestResult(int hits, int lookups, uint64_t usecs) :
+	TestResult(uint64_t hits, uint64_t lookups, uint64_t usecs) :
 		nhits(hits), nlookups(lookups), usec(usecs) {}
 };
 
@@ -21,12 +28,13 @@ struct TestResult {
  * к Cache::key_t
  *  База данных db, к которой обращается кэш, должна содержать страницы
  * для всех запрашиваемых ключей. Лучше всего для этого использовать
- * QuickEndlessDB. */
-template <class Cache, class InputIt>
+ * QuickEndlessDB.
+ *  cache_args - дополнительные аргументы конструктора кэша */
+template <class Cache, class InputIt, class... CacheArgs>
 TestResult test_cache(const typename Cache::database_t& db, size_t cache_sz,
-	InputIt queries_from, InputIt queries_to)
+	InputIt queries_from, InputIt queries_to, CacheArgs&&... cache_args)
 {
-	Cache cache(db, cache_sz);
+	Cache cache(db, cache_sz, std::forward<CacheArgs>(cache_args)...);
 	mytime::Timer timer;
 
 	for (; queries_from != queries_to; ++queries_from)
@@ -52,21 +60,228 @@ TestResult test_dummy_cache(const DataBase& db, size_t cache_sz,
 }
 
 /*  Функция аналогична test_cache(),
- * но BeladyCache требует предсказание следующих запросов
- * при вызовах get_page(), get_temp_page(), поэтому отдельная функция */
-template <class DataBase, class InputIt>
+ * но алгоритму Белади нужна вся последовательность запросов заранее,
+ * поэтому отдельная функция. Используется BeladySimulator, время
+ * предварительной обработки запросов включается в результат */
+template <class DataBase, class BidirIt>
 TestResult test_belady_cache(const DataBase& db, size_t cache_sz,
-	InputIt queries_from, InputIt queries_to)
+	BidirIt queries_from, BidirIt queries_to)
 {
-	Cache::BeladyCache<DataBase> cache(db, cache_sz);
 	mytime::Timer timer;
+	Cache::BeladySimulator<DataBase> cache(db, cache_sz, queries_from, queries_to);
 
 	for (; queries_from != queries_to; ++queries_from)
-		cache.get_temp_page(*queries_from, queries_from, queries_to);
+		cache.get_temp_page(*queries_from);
 	
 	return TestResult(cache.nhits(), cache.nlookups(), timer.elapsed_us());
 }
 
+/*  Однопоточный кэш Cache, защищенный одним общим мьютексом.
+ * Используется как базовая линия в многопоточных тестах */
+template <class Cache>
+class LockedCache {
+public:
+	using key_t = typename Cache::key_t;
+	using page_t = typename Cache::page_t;
+	using database_t = typename Cache::database_t;
+
+	LockedCache(const database_t& db, size_t cache_sz) :
+		m_cache(db, cache_sz) {}
+
+	page_t get_page(const key_t& key) const
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		return m_cache.get_temp_page(key);
+	}
+
+	uint64_t nhits() const { return m_cache.nhits(); }
+	uint64_t nlookups() const { return m_cache.nlookups(); }
+
+private:
+	mutable std::mutex m_mutex;
+	Cache m_cache;
+};
+
+/*  Многопоточный аналог test_cache(). Запросы из [queries_from, queries_to)
+ * распределяются между nthreads потоками через один (поток i выполняет
+ * запросы i, i + nthreads, ...), все потоки работают с одним кэшем
+ *  Cache должен быть потокобезопасным и иметь метод get_page()
+ *  Время - реальное, а не процессорное */
+template <class Cache, class RandomIt>
+TestResult test_cache_mt(const typename Cache::database_t& db, size_t cache_sz,
+	int nthreads, RandomIt queries_from, RandomIt queries_to)
+{
+	assert(nthreads > 0);
+	Cache cache(db, cache_sz);
+	std::vector<std::thread> threads;
+	auto nqueries = queries_to - queries_from;
+
+	mytime::Timer timer(CLOCK_MONOTONIC);
+	for (int i = 0; i < nthreads; ++i)
+		threads.emplace_back([&cache, queries_from, nqueries, nthreads, i]() {
+			for (auto j = i; j < nqueries; j += nthreads)
+				cache.get_page(queries_from[j]);
+		});
+	for (auto& thread : threads)
+		thread.join();
+
+	return TestResult(cache.nhits(), cache.nlookups(), timer.elapsed_us());
+}
+
+/*  Обертка над базой данных, потокобезопасно считающая обращения к ней */
+template <class DataBase>
+class CountingDB :
+	public DB::AbstractIDB<typename DataBase::key_t, typename DataBase::page_t>
+{
+public:
+	using key_t = typename DataBase::key_t;
+	using page_t = typename DataBase::page_t;
+
+	explicit CountingDB(const DataBase& db) :
+		m_db(db), m_ncalls(0) {}
+
+	page_t get_page(const key_t& key) const override
+		{ ++m_ncalls; return m_db.get_page(key); }
+	std::vector<page_t> get_pages(const std::vector<key_t>& keys) const override
+		{ ++m_ncalls; return m_db.get_pages(keys); }
+	bool contains(const key_t& key) const override
+		{ return m_db.contains(key); }
+
+	int ncalls() const { return m_ncalls; }
+	void reset() { m_ncalls = 0; }
+
+private:
+	const DataBase& m_db;
+	mutable std::atomic<int> m_ncalls;
+};
+
+/*  Обертка над базой данных с записью, считающая обращения на чтение и
+ * на запись, а также число записанных страниц */
+template <class DataBase>
+class CountingIODB :
+	public DB::AbstractIODB<typename DataBase::key_t, typename DataBase::page_t>
+{
+public:
+	using key_t = typename DataBase::key_t;
+	using page_t = typename DataBase::page_t;
+
+	explicit CountingIODB(DataBase& db) :
+		m_db(db), m_nreads(0), m_nwrites(0), m_npages_written(0) {}
+
+	page_t get_page(const key_t& key) const override
+		{ ++m_nreads; return m_db.get_page(key); }
+	std::vector<page_t> get_pages(const std::vector<key_t>& keys) const override
+		{ ++m_nreads; return m_db.get_pages(keys); }
+	bool contains(const key_t& key) const override
+		{ return m_db.contains(key); }
+	void insert_page(const key_t& key, const page_t& page) override
+		{ ++m_nwrites, ++m_npages_written; m_db.insert_page(key, page); }
+	void insert_pages(const std::vector<std::pair<key_t, page_t>>& pages) override
+		{ ++m_nwrites, m_npages_written += pages.size(); m_db.insert_pages(pages); }
+
+	int nreads() const { return m_nreads; }
+	int nwrites() const { return m_nwrites; }
+	int npages_written() const { return m_npages_written; }
+	void reset() { m_nreads = m_nwrites = m_npages_written = 0; }
+
+private:
+	DataBase& m_db;
+	mutable std::atomic<int> m_nreads;
+	int m_nwrites, m_npages_written;
+};
+
+/*  Аналог test_cache_mt(), но запросы разбирает пул из nthreads потоков:
+ * каждый поток берет следующий еще не выполненный запрос через общий
+ * атомарный счетчик, поэтому соседние запросы выполняются одновременно */
+template <class Cache, class RandomIt>
+TestResult test_cache_pool(const typename Cache::database_t& db, size_t cache_sz,
+	int nthreads, RandomIt queries_from, RandomIt queries_to)
+{
+	assert(nthreads > 0);
+	Cache cache(db, cache_sz);
+	std::vector<std::thread> threads;
+	std::atomic<long> next(0);
+	long nqueries = queries_to - queries_from;
+
+	mytime::Timer timer(CLOCK_MONOTONIC);
+	for (int i = 0; i < nthreads; ++i)
+		threads.emplace_back([&cache, &next, queries_from, nqueries]() {
+			for (long j = next++; j < nqueries; j = next++)
+				cache.get_page(queries_from[j]);
+		});
+	for (auto& thread : threads)
+		thread.join();
+
+	return TestResult(cache.nhits(), cache.nlookups(), timer.elapsed_us());
+}
+
+/*  Один поток выдает запросы пачками по window штук через
+ * get_page_async() и дожидается всей пачки перед следующей */
+template <class Cache, class RandomIt>
+TestResult test_cache_async(const typename Cache::database_t& db, size_t cache_sz,
+	int window, RandomIt queries_from, RandomIt queries_to)
+{
+	assert(window > 0);
+	Cache cache(db, cache_sz);
+	std::vector<std::future<typename Cache::page_t>> pending;
+
+	mytime::Timer timer(CLOCK_MONOTONIC);
+	while (queries_from != queries_to) {
+		for (int i = 0; i < window && queries_from != queries_to; ++i, ++queries_from)
+			pending.push_back(cache.get_page_async(*queries_from));
+		for (auto& page : pending)
+			page.get();
+		pending.clear();
+	}
+
+	return TestResult(cache.nhits(), cache.nlookups(), timer.elapsed_us());
+}
+
+/*  Аналог test_cache(), но запросы выполняются пачками по batch_sz штук
+ * через get_pages() */
+template <class Cache, class InputIt>
+TestResult test_cache_batched(const typename Cache::database_t& db, size_t cache_sz,
+	size_t batch_sz, InputIt queries_from, InputIt queries_to)
+{
+	assert(batch_sz > 0);
+	Cache cache(db, cache_sz);
+	std::vector<typename Cache::key_t> batch;
+	std::vector<typename Cache::page_t> pages;
+
+	mytime::Timer timer(CLOCK_MONOTONIC);
+	while (queries_from != queries_to) {
+		batch.clear();
+		for (; batch.size() < batch_sz && queries_from != queries_to; ++queries_from)
+			batch.push_back(*queries_from);
+		pages.clear();
+		cache.get_pages(batch.begin(), batch.end(), std::back_inserter(pages));
+	}
+
+	return TestResult(cache.nhits(), cache.nlookups(), timer.elapsed_us());
+}
+
+/*  Аналог test_cache() для запросов, часть которых отсутствует в базе
+ * данных: PageNotFound перехватывается. Ключи, для которых
+ * known_absent(key) == true, в кэш не передаются, но считаются запросами */
+template <class Cache, class InputIt, class AbsentPredicate>
+TestResult test_cache_absent(const typename Cache::database_t& db, size_t cache_sz,
+	InputIt queries_from, InputIt queries_to, AbsentPredicate known_absent)
+{
+	Cache cache(db, cache_sz);
+	int nqueries = 0;
+
+	mytime::Timer timer(CLOCK_MONOTONIC);
+	for (; queries_from != queries_to; ++queries_from, ++nqueries) {
+		if (known_absent(*queries_from))
+			continue;
+		try {
+			cache.get_temp_page(*queries_from);
+		} catch (typename Cache::database_t::PageNotFound&) {}
+	}
+
+	return TestResult(cache.nhits(), nqueries, timer.elapsed_us());
+}
+
 template <class T>
 class GraphRandomWalkIt {
 public:
@@ -126,6 +341,34 @@ std::vector<int> generate_random_queries(int nqueries, int ndifferent_queries)
 	return queries;
 }
 
+/*! \brief Создает случайные запросы, перемешанные с последовательными
+ *  сканированиями
+ *
+ *  Запросы идут блоками: 2 * scan_len случайных запросов из "горячего"
+ * множества ключей от 0 до ndifferent_queries - 1, затем scan_len
+ * запросов сканирования. Ключи сканирования начинаются с
+ * ndifferent_queries и никогда не повторяются, т.е. каждая такая
+ * страница запрашивается ровно один раз
+ *
+ * \param scan_len - длина одного сканирования, должна быть положительным
+ *  числом */
+std::vector<int> generate_scan_mixed_queries(int nqueries,
+	int ndifferent_queries, int scan_len)
+{
+	assert(ndifferent_queries > 0);
+	assert(scan_len > 0);
+	std::vector<int> queries;
+	int next_scan_key = ndifferent_queries;
+
+	while (static_cast<int>(queries.size()) < nqueries) {
+		for (int i = 0; i < 2 * scan_len && static_cast<int>(queries.size()) < nqueries; ++i)
+			queries.push_back(rand() % ndifferent_queries);
+		for (int i = 0; i < scan_len && static_cast<int>(queries.size()) < nqueries; ++i)
+			queries.push_back(next_scan_key++);
+	}
+	return queries;
+}
+
 /*! \brief Создает запросы наподобие хождения по графу
  *
  *  Создает vector из nqueries чисел от 0 до ndifferent_queries - 1,
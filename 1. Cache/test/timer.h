@@ -2,14 +2,20 @@
 #define _TIMER_H_
 
 #include <stddef.h>
+#include <stdint.h>
+#include <time.h>
 
 namespace mytime {
 
+/*  По умолчанию измеряет процессорное время процесса. Для многопоточных
+ * тестов нужно реальное время (CLOCK_MONOTONIC), т.к. процессорное время
+ * суммируется по всем потокам */
 class Timer {
 public:
-	Timer()
+	explicit Timer(clockid_t clock = CLOCK_PROCESS_CPUTIME_ID) :
+		m_clock(clock)
 	{
-		if (clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &m_time_start) != 0)
+		if (clock_gettime(m_clock, &m_time_start) != 0)
 			throw TimerError();
 	}
 	
@@ -18,13 +24,14 @@ public:
 	uint64_t elapsed_us() const
 	{
 		struct timespec time_end;
-		if (clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &time_end) != 0)
+		if (clock_gettime(m_clock, &time_end) != 0)
 			throw TimerError();	
 
 		return (time_end.tv_sec - m_time_start.tv_sec) * 1000000
 			+ (time_end.tv_nsec - m_time_start.tv_nsec) / 1000;
 	}
 private:
+	clockid_t m_clock;
 	struct timespec m_time_start;
 };
 
@@ -0,0 +1,288 @@
+/* Трассы запросов в двоичных файлах: последовательности 64-битных ключей,
+ * которые можно прогонять через кэши вместо сгенерированных запросов
+ *
+ * Формат файла: "CACHETRC", uint32_t версия, uint32_t кодировка,
+ * uint64_t число ключей, затем ключи
+ * RAW - ключи как есть, по 8 байт (little-endian)
+ * DELTA_VARINT - разность с предыдущим ключом (первый - с 0) в zigzag
+ 				кодировке, записанная как varint (LEB128): 7 бит на байт,
+ 				старший бит - "есть продолжение". Близкие ключи занимают 1-2 байта
+ */
+
+#ifndef _TRACE_H_
+#define _TRACE_H_
+
+#include <string>
+#include <iterator>
+#include <algorithm>
+#include <cstdio>
+#include <cstring> // for strerror()
+#include <cstdint>
+#include <cerrno>
+#include <unistd.h>
+#include <fcntl.h> // for open()
+#include <sys/stat.h> // for fstat()
+#include <sys/mman.h> // for mmap()
+
+namespace Cache {
+
+class TraceError {
+public:
+	std::string path;
+	std::string error_description;
+
+	TraceError(const std::string& trace_path, const std::string& description = "") :
+		path(trace_path),
+		error_description(description) {}
+};
+
+enum class TraceEncoding : uint32_t { RAW = 0, DELTA_VARINT = 1 };
+
+namespace trace_detail {
+
+const char MAGIC[8] = {'C', 'A', 'C', 'H', 'E', 'T', 'R', 'C'};
+const uint32_t VERSION = 1;
+const size_t HEADER_SZ = sizeof(MAGIC) + 2 * sizeof(uint32_t) + sizeof(uint64_t);
+
+inline uint64_t zigzag_encode(int64_t value)
+	{ return (static_cast<uint64_t>(value) << 1) ^ static_cast<uint64_t>(value >> 63); }
+inline int64_t zigzag_decode(uint64_t value)
+	{ return static_cast<int64_t>(value >> 1) ^ -static_cast<int64_t>(value & 1); }
+
+} // trace_detail namespace end
+
+/*  Файл трассы отображается в память (mmap) и декодируется на лету при
+ * проходе итератором, поэтому трасса может быть больше оперативной памяти:
+ * прочитанные страницы файла ядро может выбросить в любой момент
+ *  Итераторы - однопроходные (input iterator), но проходов по трассе
+ * может быть сколько угодно. Оборванная трасса - TraceError */
+class TraceFile {
+public:
+	class iterator;
+
+	explicit TraceFile(const std::string& path);
+	~TraceFile();
+
+	TraceFile(const TraceFile& other) = delete;
+	TraceFile& operator =(const TraceFile& other) = delete;
+
+	iterator begin() const;
+	iterator end() const;
+	/* Конец первых min(nkeys, size()) ключей */
+	iterator end(uint64_t nkeys) const;
+
+	uint64_t size() const { return m_nkeys; }
+	TraceEncoding encoding() const { return m_encoding; }
+	const std::string& path() const { return m_path; }
+
+private:
+	std::string m_path;
+	const unsigned char *m_data;
+	size_t m_file_sz;
+	TraceEncoding m_encoding;
+	uint64_t m_nkeys;
+};
+
+class TraceFile::iterator {
+public:
+	using iterator_category = std::input_iterator_tag;
+	using value_type = uint64_t;
+	using difference_type = std::ptrdiff_t;
+	using pointer = const uint64_t *;
+	using reference = const uint64_t&;
+
+	reference operator *() const { return m_key; }
+	pointer operator ->() const { return &m_key; }
+	iterator& operator ++()
+	{
+		if (++m_index < m_nkeys)
+			decode();
+		return *this;
+	}
+	iterator operator ++(int)
+	{
+		iterator old = *this;
+		++*this;
+		return old;
+	}
+
+	bool operator ==(const iterator& other) const { return m_index == other.m_index; }
+	bool operator !=(const iterator& other) const { return m_index != other.m_index; }
+
+private:
+	friend class TraceFile;
+
+	const TraceFile *m_trace;
+	const unsigned char *m_pos;
+	const unsigned char *m_end;
+	uint64_t m_index;
+	uint64_t m_nkeys;
+	uint64_t m_key;
+
+	iterator(const TraceFile *trace, const unsigned char *pos, const unsigned char *end,
+		uint64_t index, uint64_t nkeys) :
+		m_trace(trace), m_pos(pos), m_end(end), m_index(index), m_nkeys(nkeys), m_key(0)
+	{
+		if (m_index < m_nkeys)
+			decode();
+	}
+
+	void decode()
+	{
+		if (m_trace->m_encoding == TraceEncoding::RAW) {
+			if (m_end - m_pos < static_cast<std::ptrdiff_t>(sizeof(m_key)))
+				truncated();
+			memcpy(&m_key, m_pos, sizeof(m_key));
+			m_pos += sizeof(m_key);
+			return;
+		}
+		if (m_pos == m_end)
+			truncated();
+		uint64_t value = *m_pos++;
+		if (value & 0x80) // больше одного байта - редкий случай для близких ключей
+			value = decode_varint_tail(value);
+		m_key += trace_detail::zigzag_decode(value);
+	}
+
+	uint64_t decode_varint_tail(uint64_t value)
+	{
+		value &= 0x7f;
+		for (unsigned shift = 7; shift < 64; shift += 7) {
+			if (m_pos == m_end)
+				truncated();
+			uint64_t byte = *m_pos++;
+			value |= (byte & 0x7f) << shift;
+			if (!(byte & 0x80))
+				return value;
+		}
+		throw TraceError(m_trace->m_path, "TraceFile: '" + m_trace->m_path
+			+ "' contains a malformed varint");
+	}
+
+	[[noreturn]] void truncated() const
+	{
+		throw TraceError(m_trace->m_path, "TraceFile: '" + m_trace->m_path + "' is truncated");
+	}
+};
+
+/*  Записывает ключи из [first, last) в файл трассы path */
+template <class InputIt>
+void write_trace(const std::string& path, InputIt first, InputIt last,
+	TraceEncoding encoding = TraceEncoding::DELTA_VARINT);
+
+
+inline TraceFile::TraceFile(const std::string& path) :
+	m_path(path), m_data(nullptr), m_file_sz(0),
+	m_encoding(TraceEncoding::RAW), m_nkeys(0)
+{
+	int fd = open(path.c_str(), O_RDONLY);
+	if (fd == -1)
+		throw TraceError(path, "TraceFile: cannot open file '" + path + "': " + strerror(errno));
+
+	struct stat statbuf;
+	if (fstat(fd, &statbuf) == -1) {
+		int err = errno;
+		close(fd);
+		throw TraceError(path, "TraceFile: cannot stat file '" + path + "': " + strerror(err));
+	}
+	m_file_sz = statbuf.st_size;
+	if (m_file_sz < trace_detail::HEADER_SZ) {
+		close(fd);
+		throw TraceError(path, "TraceFile: '" + path + "' is not a trace");
+	}
+
+	void *addr = mmap(nullptr, m_file_sz, PROT_READ, MAP_PRIVATE, fd, 0);
+	int err = errno;
+	close(fd); // отображение остается действительным
+	if (addr == MAP_FAILED)
+		throw TraceError(path, "TraceFile: cannot mmap file '" + path + "': " + strerror(err));
+	madvise(addr, m_file_sz, MADV_SEQUENTIAL);
+	m_data = static_cast<const unsigned char *>(addr);
+
+	const unsigned char *pos = m_data;
+	uint32_t version = 0, encoding = 0;
+	bool is_trace = (memcmp(pos, trace_detail::MAGIC, sizeof(trace_detail::MAGIC)) == 0);
+	pos += sizeof(trace_detail::MAGIC);
+	memcpy(&version, pos, sizeof(version));
+	pos += sizeof(version);
+	memcpy(&encoding, pos, sizeof(encoding));
+	pos += sizeof(encoding);
+	memcpy(&m_nkeys, pos, sizeof(m_nkeys));
+
+	if (!is_trace || version != trace_detail::VERSION
+		|| encoding > static_cast<uint32_t>(TraceEncoding::DELTA_VARINT)) {
+		munmap(const_cast<unsigned char *>(m_data), m_file_sz);
+		throw TraceError(path, "TraceFile: '" + path + "' is not a trace or has unsupported version");
+	}
+	m_encoding = static_cast<TraceEncoding>(encoding);
+}
+
+inline TraceFile::~TraceFile()
+{
+	munmap(const_cast<unsigned char *>(m_data), m_file_sz);
+}
+
+inline TraceFile::iterator TraceFile::begin() const
+{
+	return iterator(this, m_data + trace_detail::HEADER_SZ, m_data + m_file_sz, 0, m_nkeys);
+}
+
+inline TraceFile::iterator TraceFile::end() const
+{
+	return iterator(this, m_data + m_file_sz, m_data + m_file_sz, m_nkeys, m_nkeys);
+}
+
+inline TraceFile::iterator TraceFile::end(uint64_t nkeys) const
+{
+	nkeys = std::min(nkeys, m_nkeys);
+	return iterator(this, m_data + m_file_sz, m_data + m_file_sz, nkeys, nkeys);
+}
+
+template <class InputIt>
+void write_trace(const std::string& path, InputIt first, InputIt last, TraceEncoding encoding)
+{
+	FILE *fp = fopen(path.c_str(), "wb");
+	if (!fp)
+		throw TraceError(path, "write_trace: cannot create file '" + path + "': " + strerror(errno));
+
+	/*  Число ключей становится известно в конце, заголовок перезаписывается */
+	uint64_t nkeys = 0;
+	auto write_header = [&]() {
+		uint32_t enc = static_cast<uint32_t>(encoding);
+		fwrite(trace_detail::MAGIC, 1, sizeof(trace_detail::MAGIC), fp);
+		fwrite(&trace_detail::VERSION, sizeof(trace_detail::VERSION), 1, fp);
+		fwrite(&enc, sizeof(enc), 1, fp);
+		fwrite(&nkeys, sizeof(nkeys), 1, fp);
+	};
+	write_header();
+
+	uint64_t prev = 0;
+	unsigned char buf[10];
+	for (; first != last; ++first, ++nkeys) {
+		uint64_t key = *first;
+		if (encoding == TraceEncoding::RAW) {
+			fwrite(&key, sizeof(key), 1, fp);
+			continue;
+		}
+		uint64_t value = trace_detail::zigzag_encode(static_cast<int64_t>(key - prev));
+		prev = key;
+		size_t len = 0;
+		do {
+			buf[len++] = (value & 0x7f) | ((value > 0x7f) ? 0x80 : 0);
+			value >>= 7;
+		} while (value);
+		fwrite(buf, 1, len, fp);
+	}
+
+	bool ok = (fseek(fp, 0, SEEK_SET) == 0);
+	if (ok)
+		write_header();
+	ok = (fflush(fp) == 0) && !ferror(fp) && ok;
+	ok = (fclose(fp) == 0) && ok;
+	if (!ok)
+		throw TraceError(path, "write_trace: cannot write to '" + path + "'");
+}
+
+} // Cache namespace end
+
+#endif // _TRACE_H_
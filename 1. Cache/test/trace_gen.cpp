@@ -0,0 +1,91 @@
+/* ./trace_gen [OPTIONS] <trace_file> <nlookups> <ndifferent_queries>
+ * Записывает сгенерированные запросы в двоичный файл трассы (см. trace.h),
+ * который можно прогнать через кэши: ./test_efficiency -x <trace_file> ...
+ * OPTIONS: -r, -g, -s <scan_len> (random, graph, scan-mixed queries),
+ *  -R (raw 64-bit keys instead of delta-varint) */
+#define NDEBUG
+
+#include <iostream>
+#include <cstdlib>
+#include <cstdio>
+#include <unistd.h>
+#include <sys/stat.h>
+#include "../include/cache.h"
+#include "testing_facilities.h"
+#include "trace.h"
+
+namespace {
+
+void usage_error(const char *progname, const char *err_info)
+{
+	fprintf(stderr, "%s: %s\n", progname,
+		(err_info) ? err_info : "incorrect usage");
+	fprintf(stderr, "Usage:\n");
+	fprintf(stderr, "\t%s [OPTIONS] <trace_file> <nlookups> <ndifferent_queries>\n", progname);
+	fprintf(stderr, "\tOPTIONS:\t-r\t--\trandom queries (default)\n");
+	fprintf(stderr, "\t        \t-g\t--\tgraph-like queries\n");
+	fprintf(stderr, "\t        \t-s <scan_len>\t--\trandom queries mixed with scans of scan_len unique keys\n");
+	fprintf(stderr, "\t        \t-R\t--\twrite raw 64-bit keys instead of delta-varint\n");
+	exit(EXIT_FAILURE);
+}
+
+} // anonymous namespace end
+
+int main(int argc, char *argv[])
+{
+	const char * const progname = argv[0];
+	int opt_graph_queries = 0;
+	int opt_scan_len = 0;
+	int opt_raw = 0;
+	int opt = 0;
+
+	while ((opt = getopt(argc, argv, "rgRs:")) != -1) {
+		switch (opt) {
+		case 'r': opt_graph_queries = 0, opt_scan_len = 0; break;
+		case 'g': opt_graph_queries = 1; break;
+		case 'R': opt_raw = 1; break;
+		case 's':
+			if (sscanf(optarg, "%d", &opt_scan_len) != 1 || opt_scan_len <= 0)
+				usage_error(progname, "scan length must be a positive number");
+			break;
+		default: exit(EXIT_FAILURE);
+		}
+	}
+	argc -= optind;
+	argv += optind;
+
+	if (argc != 3)
+		usage_error(progname, (argc < 3) ? "not enough args" : "too many args");
+
+	const char *trace_path = argv[0];
+	int nlookups = 0;
+	int ndifferent_queries = 0;
+	if (sscanf(argv[1], "%d", &nlookups) != 1
+		|| sscanf(argv[2], "%d", &ndifferent_queries) != 1
+		|| nlookups <= 0
+		|| ndifferent_queries <= 0)
+		usage_error(progname, "last 2 arguments must be positive numbers");
+
+	srand(time(0));
+	std::vector<int> queries;
+	if (opt_scan_len)
+		queries = Cache::generate_scan_mixed_queries(nlookups, ndifferent_queries, opt_scan_len);
+	else if (opt_graph_queries)
+		queries = Cache::generate_graph_queries(nlookups, ndifferent_queries, 1);
+	else
+		queries = Cache::generate_random_queries(nlookups, ndifferent_queries);
+
+	try {
+		Cache::write_trace(trace_path, queries.begin(), queries.end(),
+			(opt_raw) ? Cache::TraceEncoding::RAW : Cache::TraceEncoding::DELTA_VARINT);
+	} catch (Cache::TraceError& err) {
+		fprintf(stderr, "%s: %s\n", progname, err.error_description.c_str());
+		return EXIT_FAILURE;
+	}
+
+	struct stat statbuf;
+	if (stat(trace_path, &statbuf) == 0)
+		printf("%s: %d keys, %lld bytes (%.2f bytes/key)\n", trace_path, nlookups,
+			static_cast<long long>(statbuf.st_size), static_cast<double>(statbuf.st_size) / nlookups);
+	return 0;
+}
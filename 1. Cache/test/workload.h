@@ -0,0 +1,241 @@
+/* Генераторы запросов, похожих на реальную нагрузку. Каждый генератор
+ * выдает ключи по одному (next()), поэтому запросы можно не хранить
+ * целиком; generate_queries() собирает их в vector для test_cache()
+ * ZipfGenerator - ключи с распределением Зипфа, O(1) на ключ
+ * ScanMixGenerator - горячие запросы по Зипфу вперемешку с
+ 				последовательными сканированиями холодных ключей
+ * LoopGenerator - циклический проход по одним и тем же ключам
+ * PhaseShiftGenerator - горячее множество ключей (по Зипфу), которое
+ 				сдвигается на новые ключи каждые phase_len запросов
+ *  Ключи зависят только от параметров и seed, поэтому запуски с одним
+ * seed воспроизводимы на любой платформе
+ */
+
+#ifndef _WORKLOAD_H_
+#define _WORKLOAD_H_
+
+#include <vector>
+#include <cmath>
+#include <cstdint>
+#include <cassert>
+
+namespace Cache {
+
+/*  SplitMix64: в отличие от rand() и распределений из <random>,
+ * последовательность задана однозначно для любой платформы */
+class WorkloadRandom {
+public:
+	explicit WorkloadRandom(uint64_t seed) : m_state(seed) {}
+
+	uint64_t next()
+	{
+		uint64_t z = (m_state += 0x9e3779b97f4a7c15ULL);
+		z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+		z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+		return z ^ (z >> 31);
+	}
+
+	/* Число из [0, n), n < 2^32 */
+	uint32_t below(uint32_t n) { return ((next() >> 32) * n) >> 32; }
+
+private:
+	uint64_t m_state;
+};
+
+/*  Ключи из [0, nkeys), ключ k выпадает с вероятностью, пропорциональной
+ * 1 / (k + 1)^alpha: ключ 0 - самый частый. alpha = 0 - равномерное
+ * распределение, у реальных кэшей alpha обычно 0.6 - 1.2
+ *  Выборка - методом псевдонимов (Walker, Vose): таблица из nkeys ячеек
+ * строится за O(nkeys), каждый ключ - одно случайное число и одно
+ * сравнение */
+class ZipfGenerator {
+public:
+	ZipfGenerator(int nkeys, double alpha, uint64_t seed);
+
+	int next()
+	{
+		uint64_t r = m_random.next();
+		uint32_t column = ((r >> 32) * m_nkeys) >> 32;
+		return ((r & 0xffffffff) < m_threshold[column]) ? column : m_alias[column];
+	}
+
+	int nkeys() const { return m_nkeys; }
+	double alpha() const { return m_alpha; }
+
+private:
+	WorkloadRandom m_random;
+	uint32_t m_nkeys;
+	double m_alpha;
+	std::vector<uint64_t> m_threshold; // вероятность остаться в ячейке * 2^32
+	std::vector<uint32_t> m_alias; // ключ, если не остались
+};
+
+/*  Горячие запросы (Зипф по ключам [0, nhot)) вперемешку с
+ * последовательными сканированиями холодных ключей [nhot, nhot + ncold):
+ * после каждых scan_len * (1 - scan_fraction) / scan_fraction горячих
+ * запросов идет сканирование scan_len подряд идущих холодных ключей со
+ * случайного места (по кругу). Так выглядят, например, отчеты и
+ * резервное копирование на фоне обычной нагрузки */
+class ScanMixGenerator {
+public:
+	ScanMixGenerator(int nhot, double alpha, int ncold, int scan_len,
+		double scan_fraction, uint64_t seed);
+
+	int next();
+
+private:
+	ZipfGenerator m_hot;
+	WorkloadRandom m_random;
+	int m_ncold;
+	int m_scan_len;
+	int m_hot_run; // горячих запросов между сканированиями
+	int m_left; // осталось запросов в текущем горячем отрезке или сканировании
+	bool m_scanning;
+	int m_scan_pos;
+};
+
+/*  Ключи first_key, ..., first_key + loop_len - 1 по кругу. Если loop_len
+ * больше размера кэша, LRU не попадает ни разу, а оптимальный кэш
+ * попадает примерно в cache_sz / loop_len запросов */
+class LoopGenerator {
+public:
+	explicit LoopGenerator(int loop_len, int first_key = 0) :
+		m_loop_len(loop_len), m_first_key(first_key), m_pos(0) { assert(loop_len > 0); }
+
+	int next()
+	{
+		int key = m_first_key + m_pos;
+		if (++m_pos == m_loop_len)
+			m_pos = 0;
+		return key;
+	}
+
+private:
+	int m_loop_len;
+	int m_first_key;
+	int m_pos;
+};
+
+/*  Зипф по hot_sz ключам, начиная с base. Каждые phase_len запросов base
+ * увеличивается на shift: при shift < hot_sz соседние фазы частично
+ * пересекаются, при shift >= hot_sz горячее множество меняется целиком.
+ * Проверяет, как быстро кэш забывает бывшие горячими страницы */
+class PhaseShiftGenerator {
+public:
+	PhaseShiftGenerator(int hot_sz, double alpha, int phase_len, int shift, uint64_t seed) :
+		m_hot(hot_sz, alpha, seed),
+		m_phase_len(phase_len), m_shift(shift),
+		m_left(phase_len), m_base(0)
+	{
+		assert(phase_len > 0);
+		assert(shift > 0);
+	}
+
+	int next()
+	{
+		if (!m_left--) {
+			m_left = m_phase_len - 1;
+			m_base += m_shift;
+		}
+		return m_base + m_hot.next();
+	}
+
+private:
+	ZipfGenerator m_hot;
+	int m_phase_len;
+	int m_shift;
+	int m_left;
+	int m_base;
+};
+
+/*  Первые nqueries ключей генератора gen */
+template <class Generator>
+std::vector<int> generate_queries(Generator& gen, int nqueries)
+{
+	std::vector<int> queries;
+	queries.reserve(nqueries);
+	for (int i = 0; i < nqueries; ++i)
+		queries.push_back(gen.next());
+	return queries;
+}
+
+
+inline ZipfGenerator::ZipfGenerator(int nkeys, double alpha, uint64_t seed) :
+	m_random(seed), m_nkeys(nkeys), m_alpha(alpha),
+	m_threshold(nkeys), m_alias(nkeys)
+{
+	assert(nkeys > 0);
+	assert(alpha >= 0.0);
+
+	/*  Вероятности, умноженные на nkeys: в среднем 1. Ячейки с
+	 * недостатком (< 1) дополняются из ячеек с избытком */
+	std::vector<double> scaled(nkeys);
+	double sum = 0.0;
+	for (int k = 0; k < nkeys; ++k)
+		sum += scaled[k] = std::pow(k + 1.0, -alpha);
+	std::vector<uint32_t> small, large;
+	for (int k = 0; k < nkeys; ++k) {
+		scaled[k] *= nkeys / sum;
+		(scaled[k] < 1.0 ? small : large).push_back(k);
+	}
+
+	const double scale = 4294967296.0; // 2^32
+	while (!small.empty() && !large.empty()) {
+		uint32_t less = small.back(), more = large.back();
+		small.pop_back();
+		m_threshold[less] = static_cast<uint64_t>(scaled[less] * scale);
+		m_alias[less] = more;
+		scaled[more] -= 1.0 - scaled[less];
+		if (scaled[more] < 1.0) {
+			large.pop_back();
+			small.push_back(more);
+		}
+	}
+	/*  Оставшиеся ячейки заполнены (с точностью до округления) */
+	for (uint32_t k : large) {
+		m_threshold[k] = static_cast<uint64_t>(scale);
+		m_alias[k] = k;
+	}
+	for (uint32_t k : small) {
+		m_threshold[k] = static_cast<uint64_t>(scale);
+		m_alias[k] = k;
+	}
+}
+
+inline ScanMixGenerator::ScanMixGenerator(int nhot, double alpha, int ncold, int scan_len,
+	double scan_fraction, uint64_t seed) :
+	m_hot(nhot, alpha, seed),
+	m_random(~seed),
+	m_ncold(ncold), m_scan_len(scan_len),
+	m_hot_run(std::lround(scan_len * (1.0 - scan_fraction) / scan_fraction)),
+	m_left(m_hot_run), m_scanning(false), m_scan_pos(0)
+{
+	assert(ncold > 0);
+	assert(scan_len > 0);
+	assert(scan_fraction > 0.0 && scan_fraction < 1.0);
+}
+
+inline int ScanMixGenerator::next()
+{
+	while (!m_left) {
+		m_scanning = !m_scanning;
+		if (m_scanning) {
+			m_left = m_scan_len;
+			m_scan_pos = m_random.below(m_ncold);
+		} else {
+			m_left = m_hot_run;
+		}
+	}
+	--m_left;
+	if (!m_scanning)
+		return m_hot.next();
+
+	int key = m_hot.nkeys() + m_scan_pos;
+	if (++m_scan_pos == m_ncold)
+		m_scan_pos = 0;
+	return key;
+}
+
+} // Cache namespace end
+
+#endif // _WORKLOAD_H_